@@ -39,6 +39,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef _EVENT_HAVE_SYS_TIME_H
 #include <sys/time.h>
@@ -64,7 +65,20 @@
 #include <sys/sendfile.h>
 #endif
 
+#ifdef _EVENT_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef _EVENT_HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+
+#ifdef _EVENT_HAVE_POLL_H
+#include <poll.h>
+#endif
+
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -134,8 +148,11 @@ static int use_mmap = 1;
 #define CHAIN_PINNED(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_ANY) != 0)
 #define CHAIN_PINNED_R(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_R) != 0)
 
-static void evbuffer_chain_align(struct evbuffer_chain *chain);
+static void evbuffer_chain_align(struct evbuffer *buf,
+    struct evbuffer_chain *chain);
 static void evbuffer_deferred_callback(struct deferred_cb *cb, void *arg);
+static int evbuffer_expand_singlechain(struct evbuffer *buf, size_t datlen);
+static void evbuffer_zerocopy_free(struct evbuffer_zerocopy *zc);
 static int evbuffer_ptr_memcmp(const struct evbuffer *buf,
     const struct evbuffer_ptr *pos, const char *mem, size_t len);
 
@@ -159,6 +176,7 @@ evbuffer_chain_new(size_t size)
 	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
 
 	chain->buffer_len = to_alloc - EVBUFFER_CHAIN_SIZE;
+	chain->refcnt = 1;
 
 	/* this way we can manipulate the buffer to different addresses,
 	 * which is required for mmap for example.
@@ -168,14 +186,46 @@ evbuffer_chain_new(size_t size)
 	return (chain);
 }
 
-static inline void
+static void
 evbuffer_chain_free(struct evbuffer_chain *chain)
 {
+	EVUTIL_ASSERT(chain->refcnt > 0);
+	if (--chain->refcnt > 0) {
+		/* Some other buffer is still sharing this chain's memory. */
+		return;
+	}
 	if (CHAIN_PINNED(chain)) {
+		/* We'll free it when it's unpinned. */
+		chain->refcnt = 1;
 		chain->flags |= EVBUFFER_DANGLING;
 		return;
 	}
-	if (chain->flags & (EVBUFFER_MMAP|EVBUFFER_SENDFILE|
+	if (chain->flags & EVBUFFER_MULTICAST) {
+		struct evbuffer_multicast_parent *info =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent,
+			chain);
+		EVBUFFER_LOCK(info->source);
+		evbuffer_chain_free(info->parent);
+		_evbuffer_decref_and_unlock(info->source);
+	}
+	if (chain->flags & EVBUFFER_RING) {
+		struct evbuffer_chain_ring *ring =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_ring, chain);
+#if defined(_EVENT_HAVE_MMAP) && !defined(WIN32)
+		if (ring->mirrored) {
+			if (munmap(chain->buffer, 2 * ring->size) == -1)
+				event_warn("%s: munmap failed", __func__);
+		} else
+#endif
+			mm_free(chain->buffer);
+	} else if (chain->flags & EVBUFFER_FILESEGMENT) {
+		/* The segment owns the fd and any mapping; we just hold a
+		 * reference to it. */
+		struct evbuffer_chain_file_segment *info =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment,
+			chain);
+		evbuffer_file_segment_free(info->segment);
+	} else if (chain->flags & (EVBUFFER_MMAP|EVBUFFER_SENDFILE|
 		EVBUFFER_REFERENCE)) {
 		if (chain->flags & EVBUFFER_REFERENCE) {
 			struct evbuffer_chain_reference *info =
@@ -224,7 +274,10 @@ evbuffer_chain_insert(struct evbuffer *buf, struct evbuffer_chain *chain)
 		/* the last chain is empty so we can just drop it */
 		if (buf->last->off == 0 && !CHAIN_PINNED(buf->last)) {
 			evbuffer_chain_free(buf->last);
-			buf->previous_to_last->next = chain;
+			if (buf->first == buf->last)
+				buf->first = chain;
+			else
+				buf->previous_to_last->next = chain;
 			buf->last = chain;
 		} else {
 			buf->previous_to_last = buf->last;
@@ -286,6 +339,10 @@ int
 evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base)
 {
 	EVBUFFER_LOCK(buffer);
+	if (buffer->cb_batch) {
+		EVBUFFER_UNLOCK(buffer);
+		return -1;
+	}
 	buffer->cb_queue = event_base_get_deferred_cb_queue(base);
 	buffer->deferred_cbs = 1;
 	event_deferred_cb_init(&buffer->deferred,
@@ -338,11 +395,11 @@ evbuffer_run_callbacks(struct evbuffer *buffer, int running_deferred)
 	if (running_deferred) {
 		mask = EVBUFFER_CB_NODEFER|EVBUFFER_CB_ENABLED;
 		masked_val = EVBUFFER_CB_ENABLED;
-	} else if (buffer->deferred_cbs) {
+	} else if (buffer->deferred_cbs || buffer->cb_batch) {
 		mask = EVBUFFER_CB_NODEFER|EVBUFFER_CB_ENABLED;
 		masked_val = EVBUFFER_CB_NODEFER|EVBUFFER_CB_ENABLED;
-		/* Don't zero-out n_add/n_del, since the deferred callbacks
-		   will want to see them. */
+		/* Don't zero-out n_add/n_del, since the deferred or batched
+		   callbacks will want to see them. */
 		clear = 0;
 	} else {
 		mask = EVBUFFER_CB_ENABLED;
@@ -395,6 +452,16 @@ evbuffer_invoke_callbacks(struct evbuffer *buffer)
 			bufferevent_incref(buffer->parent);
 		EVBUFFER_UNLOCK(buffer);
 		event_deferred_cb_schedule(buffer->cb_queue, &buffer->deferred);
+	} else if (buffer->cb_batch && !buffer->batch_pending &&
+	    (buffer->n_add_for_cb || buffer->n_del_for_cb)) {
+		/* Just remember that we changed; the batch will run our
+		 * callbacks with the totals. */
+		struct evbuffer_cb_batch *batch = buffer->cb_batch;
+		if (TAILQ_EMPTY(&batch->pending) && batch->cb_queue)
+			event_deferred_cb_schedule(batch->cb_queue,
+			    &batch->deferred);
+		TAILQ_INSERT_TAIL(&batch->pending, buffer, batch_next);
+		buffer->batch_pending = 1;
 	}
 
 	evbuffer_run_callbacks(buffer, 0);
@@ -416,6 +483,115 @@ evbuffer_deferred_callback(struct deferred_cb *cb, void *arg)
 		bufferevent_free(parent);
 }
 
+static void
+evbuffer_cb_batch_deferred(struct deferred_cb *cb, void *arg)
+{
+	evbuffer_cb_batch_flush(arg);
+}
+
+struct evbuffer_cb_batch *
+evbuffer_cb_batch_new(struct event_base *base)
+{
+	struct evbuffer_cb_batch *batch;
+
+	if ((batch = mm_calloc(1, sizeof(struct evbuffer_cb_batch))) == NULL)
+		return NULL;
+	TAILQ_INIT(&batch->pending);
+	if (base) {
+		batch->cb_queue = event_base_get_deferred_cb_queue(base);
+		event_deferred_cb_init(&batch->deferred,
+		    evbuffer_cb_batch_deferred, batch);
+	}
+	return batch;
+}
+
+void
+evbuffer_cb_batch_free(struct evbuffer_cb_batch *batch)
+{
+	if (batch->n_buffers)
+		event_warnx("%s: freeing a batch that %d evbuffer(s) still "
+		    "use", __func__, batch->n_buffers);
+	if (batch->cb_queue)
+		event_deferred_cb_cancel(batch->cb_queue, &batch->deferred);
+	mm_free(batch);
+}
+
+/* Helper: run the callbacks for a buffer that was pending in its batch. */
+static void
+evbuffer_cb_batch_run(struct evbuffer *buffer)
+{
+	struct bufferevent *parent;
+
+	/* As with deferred callbacks, the callbacks might free the buffer
+	 * or its bufferevent, so hold a reference to both. */
+	_evbuffer_incref_and_lock(buffer);
+	if (buffer->batch_pending) {
+		TAILQ_REMOVE(&buffer->cb_batch->pending, buffer, batch_next);
+		buffer->batch_pending = 0;
+	}
+	if ((parent = buffer->parent))
+		bufferevent_incref(parent);
+	evbuffer_run_callbacks(buffer, 1);
+	_evbuffer_decref_and_unlock(buffer);
+	if (parent)
+		bufferevent_free(parent);
+}
+
+void
+evbuffer_cb_batch_flush(struct evbuffer_cb_batch *batch)
+{
+	struct evbuffer *buffer;
+
+	/* Callbacks can change other buffers in the batch, so keep going
+	 * until nothing is pending. */
+	while ((buffer = TAILQ_FIRST(&batch->pending)))
+		evbuffer_cb_batch_run(buffer);
+}
+
+void
+evbuffer_flush_callbacks(struct evbuffer *buffer)
+{
+	int pending;
+
+	EVBUFFER_LOCK(buffer);
+	pending = buffer->cb_batch && buffer->batch_pending;
+	EVBUFFER_UNLOCK(buffer);
+	/* Don't hold the lock across the callbacks: if they free the
+	 * bufferevent, it takes the buffer with it. */
+	if (pending)
+		evbuffer_cb_batch_run(buffer);
+}
+
+int
+evbuffer_set_cb_batch(struct evbuffer *buffer,
+    struct evbuffer_cb_batch *batch)
+{
+	/* Bring the old batch's callbacks up to date before we leave it. */
+	evbuffer_flush_callbacks(buffer);
+
+	EVBUFFER_LOCK(buffer);
+	if (buffer->deferred_cbs) {
+		EVBUFFER_UNLOCK(buffer);
+		return -1;
+	}
+	if (buffer->cb_batch) {
+		if (buffer->batch_pending) {
+			TAILQ_REMOVE(&buffer->cb_batch->pending, buffer,
+			    batch_next);
+			buffer->batch_pending = 0;
+		}
+		--buffer->cb_batch->n_buffers;
+	}
+	buffer->cb_batch = batch;
+	if (batch) {
+		++batch->n_buffers;
+		/* Anything that happened before now is up to date. */
+		buffer->n_add_for_cb = buffer->n_del_for_cb = 0;
+	}
+	EVBUFFER_UNLOCK(buffer);
+	return 0;
+}
+
 static void
 evbuffer_remove_all_callbacks(struct evbuffer *buffer)
 {
@@ -438,6 +614,9 @@ _evbuffer_decref_and_unlock(struct evbuffer *buffer)
 		return;
 	}
 
+	if (buffer->zerocopy)
+		evbuffer_zerocopy_free(buffer->zerocopy);
+
 	for (chain = buffer->first; chain != NULL; chain = next) {
 		next = chain->next;
 		evbuffer_chain_free(chain);
@@ -445,6 +624,12 @@ _evbuffer_decref_and_unlock(struct evbuffer *buffer)
 	evbuffer_remove_all_callbacks(buffer);
 	if (buffer->deferred_cbs)
 		event_deferred_cb_cancel(buffer->cb_queue, &buffer->deferred);
+	if (buffer->cb_batch) {
+		if (buffer->batch_pending)
+			TAILQ_REMOVE(&buffer->cb_batch->pending, buffer,
+			    batch_next);
+		--buffer->cb_batch->n_buffers;
+	}
 
 	EVBUFFER_UNLOCK(buffer);
         if (buffer->own_lock)
@@ -499,6 +684,349 @@ evbuffer_get_contiguous_space(const struct evbuffer *buf)
         return result;
 }
 
+int
+evbuffer_set_coalesce(struct evbuffer *buf, size_t min_chain_size,
+    size_t max_move)
+{
+        EVBUFFER_LOCK(buf);
+	buf->coalesce = 1;
+	buf->min_chain_size = min_chain_size;
+	buf->max_move = max_move;
+        EVBUFFER_UNLOCK(buf);
+	return 0;
+}
+
+size_t
+evbuffer_get_n_chains(const struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	size_t n = 0;
+
+        EVBUFFER_LOCK(buf);
+	for (chain = buf->first; chain; chain = chain->next)
+		++n;
+        EVBUFFER_UNLOCK(buf);
+
+	return n;
+}
+
+ev_uint64_t
+evbuffer_get_n_bytes_moved(const struct evbuffer *buf)
+{
+	ev_uint64_t n;
+
+        EVBUFFER_LOCK(buf);
+	n = buf->n_bytes_moved;
+        EVBUFFER_UNLOCK(buf);
+
+	return n;
+}
+
+/* The struct evbuffer_chain_ring of the only chain of a ring evbuffer. */
+#define RING_INFO(chain)						\
+	(EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_ring, (chain)))
+
+/* Helper for ring evbuffers: restore the invariants on the ring chain after
+ * its misalign or off has changed. */
+static void
+evbuffer_ring_fix(struct evbuffer_chain *chain)
+{
+	struct evbuffer_chain_ring *ring = RING_INFO(chain);
+
+	if (chain->off == 0)
+		chain->misalign = 0;
+	else if (chain->misalign >= ring->size)
+		chain->misalign -= ring->size;
+	if (ring->mirrored)
+		chain->buffer_len = chain->misalign + ring->size;
+}
+
+/* Helper for ring evbuffers: return the number of bytes we can add. */
+static size_t
+evbuffer_ring_space(const struct evbuffer *buf)
+{
+	return RING_INFO(buf->first)->size - buf->first->off;
+}
+
+/* Helper for ring evbuffers: make sure that there are at least datlen
+ * contiguous free bytes after the data in buf.  Returns -1 if the ring
+ * doesn't have room. */
+static int
+evbuffer_ring_make_room(struct evbuffer *buf, size_t datlen)
+{
+	struct evbuffer_chain *chain = buf->first;
+
+	if (datlen > evbuffer_ring_space(buf))
+		return (-1);
+	if (CHAIN_SPACE_LEN(chain) < datlen) {
+		/* Only an unmirrored ring gets here. */
+		if (CHAIN_PINNED(chain))
+			return (-1);
+		evbuffer_chain_align(buf, chain);
+	}
+	return (0);
+}
+
+/* Helper for ring evbuffers: remove the first len bytes of buf, which must
+ * have at least that many.  Doesn't invoke callbacks. */
+static void
+evbuffer_ring_drain(struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_chain *chain = buf->first;
+
+	chain->misalign += len;
+	chain->off -= len;
+	evbuffer_ring_fix(chain);
+	buf->total_len -= len;
+	buf->n_del_for_cb += len;
+}
+
+/* Helper for ring evbuffers: add datlen bytes to the front of buf. */
+static int
+evbuffer_ring_prepend(struct evbuffer *buf, const void *data, size_t datlen)
+{
+	struct evbuffer_chain *chain = buf->first;
+	struct evbuffer_chain_ring *ring = RING_INFO(chain);
+
+	if (datlen > evbuffer_ring_space(buf) || CHAIN_PINNED(chain))
+		return (-1);
+	if (chain->misalign < datlen) {
+		if (ring->mirrored) {
+			/* Look at the same data through the second
+			 * mapping. */
+			chain->misalign += ring->size;
+		} else {
+			memmove(chain->buffer + datlen,
+			    chain->buffer + chain->misalign, chain->off);
+			buf->n_bytes_moved += chain->off;
+			chain->misalign = datlen;
+		}
+	}
+	chain->misalign -= datlen;
+	memcpy(chain->buffer + chain->misalign, data, datlen);
+	chain->off += datlen;
+	evbuffer_ring_fix(chain);
+	buf->total_len += datlen;
+	buf->n_add_for_cb += datlen;
+	return (0);
+}
+
+/* Helper: copy up to datlen bytes from the front of src to the end of dst,
+ * where at least one of them is a ring evbuffer, and drain them from src
+ * if drain is true.  If all is true, fail unless we can copy all datlen
+ * bytes.  Returns the number of bytes copied, or -1 on failure.  The
+ * caller must hold both locks. */
+static int
+evbuffer_ring_transfer(struct evbuffer *src, struct evbuffer *dst,
+    size_t datlen, int drain, int all)
+{
+	struct evbuffer_chain *chain, *dchain;
+	unsigned char *p;
+	size_t n;
+
+	if (datlen > src->total_len)
+		datlen = src->total_len;
+	if (dst->ring) {
+		/* Data that only sendfile can reach isn't in memory, so we
+		 * can copy only what comes before it. */
+		for (chain = src->first, n = 0; chain && n < datlen;
+		     chain = chain->next) {
+			if (chain->flags & EVBUFFER_SENDFILE)
+				break;
+			n += chain->off;
+		}
+		if (n < datlen) {
+			if (all || n == 0)
+				return (-1);
+			datlen = n;
+		}
+		if (datlen > evbuffer_ring_space(dst)) {
+			if (all)
+				return (-1);
+			datlen = evbuffer_ring_space(dst);
+		}
+		if (datlen == 0)
+			return (0);
+		if (evbuffer_ring_make_room(dst, datlen) < 0)
+			return (-1);
+		dchain = dst->first;
+		p = CHAIN_SPACE_PTR(dchain);
+		for (chain = src->first, n = datlen; n; chain = chain->next) {
+			size_t len = chain->off < n ? chain->off : n;
+			memcpy(p, chain->buffer + chain->misalign, len);
+			p += len;
+			n -= len;
+		}
+		dchain->off += datlen;
+		dst->total_len += datlen;
+		dst->n_add_for_cb += datlen;
+		evbuffer_invoke_callbacks(dst);
+	} else {
+		/* A ring's data is always contiguous. */
+		if (datlen == 0)
+			return (0);
+		chain = src->first;
+		if (evbuffer_add(dst, chain->buffer + chain->misalign,
+			datlen) < 0)
+			return (-1);
+	}
+	if (drain)
+		evbuffer_drain(src, datlen);
+	return (int)datlen;
+}
+
+#if defined(_EVENT_HAVE_MMAP) && !defined(WIN32)
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+/* Helper for evbuffer_set_ring(): map size bytes of memory twice in a row.
+ * Returns the start of the mapping, or NULL on failure. */
+static void *
+evbuffer_ring_map(size_t size)
+{
+	void *base, *p;
+	int fd = -1;
+
+#if defined(_EVENT_HAVE_MEMFD_CREATE) && defined(MFD_CLOEXEC)
+	fd = memfd_create("evbuffer-ring", MFD_CLOEXEC);
+#endif
+	if (fd < 0) {
+		char path[] = "/tmp/evbuffer-ring-XXXXXX";
+		if ((fd = mkstemp(path)) < 0)
+			return (NULL);
+		unlink(path);
+	}
+	if (ftruncate(fd, size) < 0)
+		goto err;
+
+	/* Reserve room for both copies, then map the file over it twice. */
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS,
+	    -1, 0);
+	if (base == MAP_FAILED)
+		goto err;
+	p = mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+	    fd, 0);
+	if (p != MAP_FAILED)
+		p = mmap((char *)base + size, size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED) {
+		munmap(base, 2 * size);
+		goto err;
+	}
+
+	close(fd);
+	return (base);
+err:
+	close(fd);
+	return (NULL);
+}
+#endif
+
+int
+evbuffer_set_ring(struct evbuffer *buf, size_t size, unsigned flags)
+{
+	struct evbuffer_chain *chain = NULL;
+	struct evbuffer_chain_ring *ring;
+	void *mem = NULL;
+	int mirrored = 0, result = -1;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->ring || buf->total_len || size == 0 || size > INT_MAX)
+		goto done;
+#ifdef WIN32
+	if (buf->is_overlapped)
+		goto done;
+#endif
+#if defined(_EVENT_HAVE_MMAP) && !defined(WIN32)
+	if (flags & EVBUFFER_RING_MIRROR) {
+		size_t page_size = 4096;
+#ifdef _SC_PAGESIZE
+		long ps = sysconf(_SC_PAGESIZE);
+		if (ps > 0)
+			page_size = ps;
+#endif
+		size = (size + page_size - 1) & ~(page_size - 1);
+		if ((mem = evbuffer_ring_map(size)) != NULL)
+			mirrored = 1;
+	}
+#endif
+	if (mem == NULL && (mem = mm_malloc(size)) == NULL)
+		goto done;
+	if ((chain = evbuffer_chain_new(sizeof(*ring))) == NULL)
+		goto done;
+
+	chain->flags |= EVBUFFER_RING;
+	chain->buffer = mem;
+	chain->buffer_len = size;
+	ring = RING_INFO(chain);
+	ring->size = size;
+	ring->mirrored = mirrored;
+
+	/* Throw away any empty chains we had. */
+	while (buf->first) {
+		struct evbuffer_chain *next = buf->first->next;
+		evbuffer_chain_free(buf->first);
+		buf->first = next;
+	}
+	buf->first = buf->last = chain;
+	buf->previous_to_last = NULL;
+	buf->ring = 1;
+	result = 0;
+done:
+	if (result < 0 && mem) {
+#if defined(_EVENT_HAVE_MMAP) && !defined(WIN32)
+		if (mirrored)
+			munmap(mem, 2 * size);
+		else
+#endif
+			mm_free(mem);
+	}
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+size_t
+_evbuffer_get_ring_size(struct evbuffer *buf)
+{
+	size_t size = 0;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->ring)
+		size = RING_INFO(buf->first)->size;
+	EVBUFFER_UNLOCK(buf);
+	return size;
+}
+
+int
+_evbuffer_is_disposable(struct evbuffer *buf, int n_cbs)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_cb_entry *cbent;
+	int r = 0;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->total_len || buf->refcnt != 1 || buf->own_lock ||
+	    buf->deferred_cbs || buf->deferred.queued || buf->zerocopy ||
+	    buf->coalesce || buf->max_read || buf->ring || buf->cb_batch)
+		goto done;
+#ifdef WIN32
+	if (buf->is_overlapped)
+		goto done;
+#endif
+	for (chain = buf->first; chain != NULL; chain = chain->next) {
+		if (CHAIN_PINNED(chain))
+			goto done;
+	}
+	TAILQ_FOREACH(cbent, &buf->callbacks, next) {
+		if (--n_cbs < 0)
+			goto done;
+	}
+	r = 1;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return r;
+}
+
 int
 evbuffer_reserve_space(struct evbuffer *buf, ev_ssize_t size,
     struct evbuffer_iovec *vec, int n_vecs)
@@ -512,7 +1040,7 @@ evbuffer_reserve_space(struct evbuffer *buf, ev_ssize_t size,
 	if (n_vecs < 1)
 		goto done;
 	if (n_vecs == 1) {
-		if (evbuffer_expand(buf, size) == -1)
+		if (evbuffer_expand_singlechain(buf, size) == -1)
 			goto done;
 		chain = buf->last;
 
@@ -639,6 +1167,14 @@ evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 		goto done;
 	}
 
+	if (outbuf->ring || inbuf->ring) {
+		/* A ring's chain can't move to another buffer. */
+		if (evbuffer_ring_transfer(inbuf, outbuf, in_total_len, 1,
+			1) < 0)
+			result = -1;
+		goto done;
+	}
+
 	if (out_total_len == 0) {
 		COPY_CHAIN(outbuf, inbuf);
 	} else {
@@ -677,6 +1213,25 @@ evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 		goto done;
 	}
 
+	if (outbuf->ring) {
+		unsigned char *data = evbuffer_pullup(inbuf, -1);
+		if (data == NULL ||
+		    evbuffer_ring_prepend(outbuf, data, in_total_len) < 0) {
+			result = -1;
+			goto done;
+		}
+		evbuffer_invoke_callbacks(outbuf);
+		evbuffer_drain(inbuf, in_total_len);
+		goto done;
+	} else if (inbuf->ring) {
+		struct evbuffer_chain *chain = inbuf->first;
+		result = evbuffer_prepend(outbuf,
+		    chain->buffer + chain->misalign, in_total_len);
+		if (result == 0)
+			evbuffer_drain(inbuf, in_total_len);
+		goto done;
+	}
+
 	if (out_total_len == 0) {
 		COPY_CHAIN(outbuf, inbuf);
 	} else {
@@ -695,6 +1250,62 @@ done:
 	return result;
 }
 
+/* Return true iff we may copy data into free space in chain. */
+#define CHAIN_WRITABLE(ch)						\
+	(((ch)->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_SENDFILE|		\
+	    EVBUFFER_MEM_PINNED_ANY)) == 0)
+
+/* Helper for evbuffer_drain: after the front of buf has been drained,
+ * merge its first two chains for as long as that takes no more than
+ * buf->max_move bytes of copying.  This keeps the buffer from degrading
+ * into a long list of nearly-empty chains. */
+static void
+evbuffer_coalesce_front(struct evbuffer *buf)
+{
+	struct evbuffer_chain *first, *second;
+
+	while ((first = buf->first) != NULL && (second = first->next) != NULL) {
+		if (CHAIN_PINNED(first) || CHAIN_PINNED(second) ||
+		    (first->flags & EVBUFFER_SENDFILE) ||
+		    (second->flags & EVBUFFER_SENDFILE))
+			break;
+		/* A record mark has to stay at the end of its chain. */
+		if (first->off <= buf->max_move && CHAIN_WRITABLE(second) &&
+		    !(first->flags & EVBUFFER_RECORD_END) &&
+		    (size_t)second->misalign >= first->off) {
+			/* The first chain fits in front of the second. */
+			memcpy(second->buffer + second->misalign - first->off,
+			    first->buffer + first->misalign, first->off);
+			second->misalign -= first->off;
+			second->off += first->off;
+			buf->n_bytes_moved += first->off;
+			buf->first = second;
+			if (buf->previous_to_last == first)
+				buf->previous_to_last = NULL;
+			evbuffer_chain_free(first);
+		} else if (second->off <= buf->max_move &&
+		    CHAIN_WRITABLE(first) &&
+		    !(second->flags & EVBUFFER_RECORD_END) &&
+		    CHAIN_SPACE_LEN(first) >= second->off) {
+			/* The second chain fits after the first. */
+			memcpy(CHAIN_SPACE_PTR(first),
+			    second->buffer + second->misalign, second->off);
+			first->off += second->off;
+			buf->n_bytes_moved += second->off;
+			first->next = second->next;
+			if (buf->last == second) {
+				buf->last = first;
+				buf->previous_to_last = NULL;
+			} else if (buf->previous_to_last == second) {
+				buf->previous_to_last = first;
+			}
+			evbuffer_chain_free(second);
+		} else {
+			break;
+		}
+	}
+}
+
 int
 evbuffer_drain(struct evbuffer *buf, size_t len)
 {
@@ -713,6 +1324,13 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 		goto done;
 	}
 
+	if (buf->ring) {
+		if (len > old_len)
+			len = old_len;
+		evbuffer_ring_drain(buf, len);
+		evbuffer_invoke_callbacks(buf);
+		goto done;
+	}
 
 	if (len >= old_len && !(buf->last && CHAIN_PINNED_R(buf->last))) {
                 len = old_len;
@@ -743,6 +1361,9 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 			buf->previous_to_last = NULL;
 		chain->misalign += len;
 		chain->off -= len;
+
+		if (buf->coalesce && buf->max_move)
+			evbuffer_coalesce_front(buf);
 	}
 
         buf->n_del_for_cb += len;
@@ -782,6 +1403,14 @@ evbuffer_remove(struct evbuffer *buf, void *data_out, size_t datlen)
 
 	nread = datlen;
 
+	if (buf->ring) {
+		memcpy(data, chain->buffer + chain->misalign, datlen);
+		evbuffer_ring_drain(buf, datlen);
+		evbuffer_invoke_callbacks(buf);
+		result = nread;
+		goto done;
+	}
+
 	while (datlen && datlen >= chain->off) {
 		memcpy(data, chain->buffer + chain->misalign, chain->off);
 		data += chain->off;
@@ -816,18 +1445,64 @@ done:
         return result;
 }
 
-/* reads data from the src buffer to the dst buffer, avoids memcpy as
- * possible. */
-int
-evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
-    size_t datlen)
+/* Helper for evbuffer_remove_buffer_reference: make a new chain for dst
+ * that shares the first len bytes of chain, which belongs to src.  If
+ * chain is itself shared from src, the new chain shares the original
+ * instead.  Chains shared from any other buffer are not shared again,
+ * since that would mean locking a third buffer while holding src and
+ * dst.  Returns NULL if the memory can't be shared, in which case the
+ * caller should copy it.  Both buffers must be locked. */
+static struct evbuffer_chain *
+evbuffer_chain_new_slice(struct evbuffer *src, struct evbuffer *dst,
+    struct evbuffer_chain *chain, size_t len)
 {
-	/*XXX We should have an option to force this to be zero-copy.*/
-
-	/*XXX can fail badly on sendfile case. */
-	struct evbuffer_chain *chain, *previous, *previous_to_previous = NULL;
-	size_t nread = 0;
-        int result;
+	struct evbuffer_chain *parent = chain, *slice;
+	struct evbuffer_multicast_parent *info;
+
+	if (chain->buffer == NULL || CHAIN_PINNED(chain) ||
+	    (chain->flags & (EVBUFFER_SENDFILE|EVBUFFER_RING)))
+		return NULL;
+	if (chain->flags & EVBUFFER_MULTICAST) {
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent,
+		    chain);
+		if (info->source != src)
+			return NULL;
+		parent = info->parent;
+	}
+	/* Buffers must never end up holding references to each other.
+	 * If nobody shares data from dst, then dst can't be part of such a
+	 * loop, so it is safe for dst to share from src. */
+	if (dst->refcnt > 1)
+		return NULL;
+
+	if ((slice = evbuffer_chain_new(sizeof(*info))) == NULL)
+		return NULL;
+	slice->flags |= EVBUFFER_MULTICAST | EVBUFFER_IMMUTABLE;
+	slice->buffer = chain->buffer;
+	slice->buffer_len = chain->buffer_len;
+	slice->misalign = chain->misalign;
+	slice->off = len;
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent, slice);
+	info->source = src;
+	info->parent = parent;
+	parent->flags |= EVBUFFER_IMMUTABLE;
+	++parent->refcnt;
+	++src->refcnt;
+	return slice;
+}
+
+/* reads data from the src buffer to the dst buffer, avoids memcpy as
+ * possible. */
+static int
+evbuffer_remove_buffer_impl(struct evbuffer *src, struct evbuffer *dst,
+    size_t datlen, int by_reference)
+{
+	/*XXX can fail badly on sendfile case. */
+	struct evbuffer_chain *chain, *previous, *previous_to_previous = NULL;
+	struct evbuffer_chain *slice = NULL;
+	unsigned char *data;
+	size_t nread = 0;
+        int result;
 
         EVBUFFER_LOCK2(src, dst);
 
@@ -843,6 +1518,11 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 		goto done;
 	}
 
+	if (src->ring || dst->ring) {
+		result = evbuffer_ring_transfer(src, dst, datlen, 1, 0);
+		goto done;
+	}
+
 	/* short-cut if there is no more data buffered */
 	if (datlen >= src->total_len) {
 		datlen = src->total_len;
@@ -879,8 +1559,21 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 	}
 
 	/* we know that there is more data in the src buffer than
-	 * we want to read, so we manually drain the chain */
-	evbuffer_add(dst, chain->buffer + chain->misalign, datlen);
+	 * we want to read, so we manually drain the chain.  Small pieces
+	 * are cheaper to copy than to share (see MIN_SLICE_SIZE).  So are
+	 * pieces of the last two chains (where evbuffer_read() puts new
+	 * data) that are smaller than the chain's free space, since sharing
+	 * makes the chain read-only, and src would have to allocate new
+	 * memory for data that would have fit there. */
+	if (by_reference && datlen >= MIN_SLICE_SIZE &&
+	    ((chain != src->last && chain->next != src->last) ||
+		datlen >= CHAIN_SPACE_LEN(chain)))
+		slice = evbuffer_chain_new_slice(src, dst, chain, datlen);
+	if (slice) {
+		evbuffer_chain_insert(dst, slice);
+		dst->n_add_for_cb += datlen;
+	}
+	data = chain->buffer + chain->misalign;
 	chain->misalign += datlen;
 	chain->off -= datlen;
 	nread += datlen;
@@ -888,6 +1581,11 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 	src->total_len -= nread;
         src->n_del_for_cb += nread;
 
+	/* Copy last: evbuffer_add() runs dst's callbacks, which may use src
+	 * again, so src has to be consistent by now. */
+	if (!slice)
+		evbuffer_add(dst, data, datlen);
+
 	if (nread) {
 		evbuffer_invoke_callbacks(dst);
 		evbuffer_invoke_callbacks(src);
@@ -899,6 +1597,20 @@ done:
 	return result;
 }
 
+int
+evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
+    size_t datlen)
+{
+	return evbuffer_remove_buffer_impl(src, dst, datlen, 0);
+}
+
+int
+evbuffer_remove_buffer_reference(struct evbuffer *src, struct evbuffer *dst,
+    size_t datlen)
+{
+	return evbuffer_remove_buffer_impl(src, dst, datlen, 1);
+}
+
 unsigned char *
 evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 {
@@ -947,7 +1659,8 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		tmp->off = size;
 		size -= old_off;
 		chain = chain->next;
-	} else if (chain->buffer_len - chain->misalign >= (size_t)size) {
+	} else if (!(chain->flags & EVBUFFER_IMMUTABLE) &&
+	    chain->buffer_len - chain->misalign >= (size_t)size) {
 		/* already have enough space in the first chain */
 		size_t old_off = chain->off;
 		buffer = chain->buffer + chain->misalign + chain->off;
@@ -974,12 +1687,21 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		memcpy(buffer, chain->buffer + chain->misalign, chain->off);
 		size -= chain->off;
 		buffer += chain->off;
+		buf->n_bytes_moved += chain->off;
+		/* Keep a record mark that falls at the end of the pulled-up
+		 * data; marks inside it are lost. */
+		if (size == 0 && (chain->flags & EVBUFFER_RECORD_END) &&
+		    !CHAIN_PINNED(tmp)) {
+			tmp->flags |= EVBUFFER_RECORD_END|EVBUFFER_IMMUTABLE;
+			tmp->tag = chain->tag;
+		}
 
 		evbuffer_chain_free(chain);
 	}
 
 	if (chain != NULL) {
 		memcpy(buffer, chain->buffer + chain->misalign, size);
+		buf->n_bytes_moved += size;
 		chain->misalign += size;
 		chain->off -= size;
 		if (chain == buf->last)
@@ -1241,10 +1963,20 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 
         chain = buf->last;
 
+	if (buf->ring) {
+		if (evbuffer_ring_make_room(buf, datlen) < 0)
+			goto done;
+		memcpy(CHAIN_SPACE_PTR(chain), data, datlen);
+		chain->off += datlen;
+		buf->total_len += datlen;
+		buf->n_add_for_cb += datlen;
+		goto out;
+	}
+
 	/* If there are no chains allocated for this buffer, allocate one
 	 * big enough to hold all the data. */
 	if (chain == NULL) {
-		if (evbuffer_expand(buf, datlen) == -1)
+		if (evbuffer_expand_singlechain(buf, datlen) == -1)
 			goto done;
 		chain = buf->last;
 	}
@@ -1260,9 +1992,12 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 			buf->total_len += datlen;
                         buf->n_add_for_cb += datlen;
 			goto out;
-		} else if ((size_t)chain->misalign >= datlen && !CHAIN_PINNED(chain)) {
+		} else if (!CHAIN_PINNED(chain) && (buf->coalesce ?
+			(chain->off <= buf->max_move &&
+			    remain + chain->misalign >= datlen) :
+			(size_t)chain->misalign >= datlen)) {
 			/* we can fit the data into the misalignment */
-			evbuffer_chain_align(chain);
+			evbuffer_chain_align(buf, chain);
 
 			memcpy(chain->buffer + chain->off, data, datlen);
 			chain->off += datlen;
@@ -1281,6 +2016,8 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 		to_alloc <<= 1;
 	if (datlen > to_alloc)
 		to_alloc = datlen;
+	if (to_alloc < buf->min_chain_size)
+		to_alloc = buf->min_chain_size;
 	tmp = evbuffer_chain_new(to_alloc);
 	if (tmp == NULL)
 		goto done;
@@ -1299,6 +2036,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 	memcpy(tmp->buffer, data, datlen);
 	tmp->off = datlen;
 	evbuffer_chain_insert(buf, tmp);
+	buf->n_add_for_cb += datlen;
 
 out:
 	evbuffer_invoke_callbacks(buf);
@@ -1320,17 +2058,24 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 		goto done;
 	}
 
+	if (buf->ring) {
+		if (evbuffer_ring_prepend(buf, data, datlen) < 0)
+			goto done;
+		goto out;
+	}
+
         chain = buf->first;
 
 	if (chain == NULL) {
-		if (evbuffer_expand(buf, datlen) == -1)
+		if (evbuffer_expand_singlechain(buf, datlen) == -1)
 			goto done;
 		chain = buf->first;
 		chain->misalign = chain->buffer_len;
 	}
 
-	/* we cannot touch immutable buffers */
-	if ((chain->flags & EVBUFFER_IMMUTABLE) == 0) {
+	/* we cannot touch immutable buffers, or the front of a chain the
+	 * kernel may still be sending from */
+	if ((chain->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_W)) == 0) {
 		if ((size_t)chain->misalign >= datlen) {
 			/* we have enough space */
 			memcpy(chain->buffer + chain->misalign - datlen,
@@ -1377,32 +2122,36 @@ done:
 
 /** Helper: realigns the memory in chain->buffer so that misalign is 0. */
 static void
-evbuffer_chain_align(struct evbuffer_chain *chain)
+evbuffer_chain_align(struct evbuffer *buf, struct evbuffer_chain *chain)
 {
 	EVUTIL_ASSERT(!(chain->flags & EVBUFFER_IMMUTABLE));
 	EVUTIL_ASSERT(!(chain->flags & EVBUFFER_MEM_PINNED_ANY));
 	memmove(chain->buffer, chain->buffer + chain->misalign, chain->off);
 	chain->misalign = 0;
+	buf->n_bytes_moved += chain->off;
 }
 
-/* Expands the available space in the event buffer to at least datlen */
-
-int
-evbuffer_expand(struct evbuffer *buf, size_t datlen)
+/* Expands the available space in the last chain of the event buffer to
+ * at least datlen.  The caller must hold the lock. */
+static int
+evbuffer_expand_singlechain(struct evbuffer *buf, size_t datlen)
 {
 	/* XXX we should either make this function less costly, or call it
 	 * less often.  */
 	struct evbuffer_chain *chain, *tmp;
 	size_t need, length;
-        int result = -1;
 
-        EVBUFFER_LOCK(buf);
+        ASSERT_EVBUFFER_LOCKED(buf);
+
+	if (buf->ring)
+		return evbuffer_ring_make_room(buf, datlen);
 
         chain = buf->last;
 
 	if (chain == NULL ||
 	    (chain->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_ANY))) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new(datlen > buf->min_chain_size ?
+		    datlen : buf->min_chain_size);
 		if (chain == NULL)
 			goto err;
 
@@ -1421,7 +2170,7 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 	 * Afterwards, we have enough space.
 	 */
 	if (chain->buffer_len - chain->off >= datlen) {
-		evbuffer_chain_align(chain);
+		evbuffer_chain_align(buf, chain);
 		goto ok;
 	}
 
@@ -1445,9 +2194,21 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 	evbuffer_chain_free(chain);
 
 ok:
-        result = 0;
+        return (0);
 err:
-        EVBUFFER_UNLOCK(buf);
+	return (-1);
+}
+
+/* Expands the available space in the event buffer to at least datlen */
+
+int
+evbuffer_expand(struct evbuffer *buf, size_t datlen)
+{
+	int result;
+
+	EVBUFFER_LOCK(buf);
+	result = evbuffer_expand_singlechain(buf, datlen);
+	EVBUFFER_UNLOCK(buf);
 	return result;
 }
 
@@ -1461,6 +2222,9 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 
         ASSERT_EVBUFFER_LOCKED(buf);
 
+	if (buf->ring)
+		return evbuffer_ring_make_room(buf, datlen);
+
 	if (chain == NULL || (chain->flags & EVBUFFER_IMMUTABLE)) {
 		chain = evbuffer_chain_new(datlen);
 		if (chain == NULL)
@@ -1472,7 +2236,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 
 	/* How many bytes can we stick at the end of chain? */
 
-	if (chain->off) {
+	if (chain->off || (chain->flags & EVBUFFER_MEM_PINNED_W)) {
 		avail = chain->buffer_len - (chain->off + chain->misalign);
 		avail_in_prev = 0;
 	} else {
@@ -1547,8 +2311,55 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 #endif
 #endif
 
+#if defined(USE_IOVEC_IMPL) && defined(_EVENT_HAVE_SYS_UIO_H) &&	\
+    defined(_EVENT_HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) &&	\
+    defined(SO_ZEROCOPY) && defined(_EVENT_HAVE_POLL_H) && defined(__linux__)
+#define USE_ZEROCOPY
+#endif
+
 #define EVBUFFER_MAX_READ	4096
 
+/* Helper for evbuffer_read in adaptive mode: we offered to read 'offered'
+ * bytes and got 'got'.  If that filled the whole read, there's probably
+ * more waiting, so try twice as much next time; if it didn't fill half,
+ * go back down. */
+static inline void
+evbuffer_adapt_read_size(struct evbuffer *buf, int offered, int got)
+{
+	size_t floor = EVBUFFER_MAX_READ;
+
+	if ((size_t)offered < buf->read_size) {
+		/* The caller limited this read, so it tells us nothing. */
+		return;
+	}
+	if (floor > buf->max_read)
+		floor = buf->max_read;
+	if (got == offered) {
+		buf->read_size <<= 1;
+		if (buf->read_size > buf->max_read)
+			buf->read_size = buf->max_read;
+	} else if ((size_t)got < buf->read_size / 2) {
+		buf->read_size >>= 1;
+		if (buf->read_size < floor)
+			buf->read_size = floor;
+	}
+}
+
+int
+evbuffer_set_adaptive_read(struct evbuffer *buf, size_t max_read)
+{
+	if (max_read > INT_MAX)
+		max_read = INT_MAX;
+
+        EVBUFFER_LOCK(buf);
+	buf->max_read = max_read;
+	buf->read_size = max_read < EVBUFFER_MAX_READ ?
+	    max_read : EVBUFFER_MAX_READ;
+        EVBUFFER_UNLOCK(buf);
+
+	return 0;
+}
+
 /** Helper function to figure out which space to use for reading data into
     an evbuffer.  Internal use only.
 
@@ -1636,11 +2447,24 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 		goto done;
 	}
 
+	if (buf->ring) {
+		/* We read into whatever room the ring has; there's no need
+		 * to ask the kernel how much is waiting. */
+		if ((n = (int)evbuffer_ring_space(buf)) == 0) {
+			EVUTIL_SET_SOCKET_ERROR(ENOBUFS);
+			result = -1;
+			goto done;
+		}
+	} else if (buf->max_read) {
+		/* We're sizing reads ourselves, so there's no need to ask
+		 * the kernel how much is waiting. */
+		n = (int)buf->read_size;
+	}
 #if defined(FIONREAD)
 #ifdef WIN32
-	if (ioctlsocket(fd, FIONREAD, &lng) == -1 || (n=lng) <= 0) {
+	else if (ioctlsocket(fd, FIONREAD, &lng) == -1 || (n=lng) <= 0) {
 #else
-	if (ioctl(fd, FIONREAD, &n) == -1 || n <= 0) {
+	else if (ioctl(fd, FIONREAD, &n) == -1 || n <= 0) {
 #endif
 		n = EVBUFFER_MAX_READ;
 	} else if (n > EVBUFFER_MAX_READ && n > howmuch) {
@@ -1709,7 +2533,7 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 	/* If we don't have FIONREAD, we might waste some space here */
 	/* XXX we _will_ waste some space here if there is any space left
 	 * over on buf->last. */
-	if (evbuffer_expand(buf, howmuch) == -1) {
+	if (evbuffer_expand_singlechain(buf, howmuch) == -1) {
 		result = -1;
                 goto done;
         }
@@ -1753,6 +2577,9 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 	buf->total_len += n;
         buf->n_add_for_cb += n;
 
+	if (buf->max_read)
+		evbuffer_adapt_read_size(buf, howmuch, n);
+
 	/* Tell someone about changes in this buffer */
 	evbuffer_invoke_callbacks(buf);
         result = n;
@@ -1762,18 +2589,16 @@ done:
 }
 
 #ifdef USE_IOVEC_IMPL
+/* Helper: fill in up to NUM_IOVEC entries of iov to point at the first
+ * howmuch bytes of buffer, stopping at the first sendfile chain.  Returns
+ * the number of entries used. */
 static inline int
-evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
+evbuffer_write_setup_iovec(struct evbuffer *buffer, IOV_TYPE *iov,
     ev_ssize_t howmuch)
 {
-	IOV_TYPE iov[NUM_IOVEC];
 	struct evbuffer_chain *chain = buffer->first;
-	int n, i = 0;
-
-	if (howmuch < 0)
-		return -1;
+	int i = 0;
 
-        ASSERT_EVBUFFER_LOCKED(buffer);
 	/* XXX make this top out at some maximal data length?  if the
 	 * buffer has (say) 1MB in it, split over 128 chains, there's
 	 * no way it all gets written in one go. */
@@ -1793,6 +2618,21 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
 		}
 		chain = chain->next;
 	}
+	return i;
+}
+
+static inline int
+evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
+    ev_ssize_t howmuch)
+{
+	IOV_TYPE iov[NUM_IOVEC];
+	int n, i;
+
+	if (howmuch < 0)
+		return -1;
+
+        ASSERT_EVBUFFER_LOCKED(buffer);
+	i = evbuffer_write_setup_iovec(buffer, iov, howmuch);
 #ifdef WIN32
 	{
 		DWORD bytesSent;
@@ -1808,50 +2648,198 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
 }
 #endif
 
+#ifdef USE_ZEROCOPY
+/* Make sure we have at least n spare pin records, so that we can record a
+ * send of up to n chains without allocating. */
+static int
+evbuffer_zerocopy_reserve(struct evbuffer_zerocopy *zc, int n)
+{
+	struct evbuffer_zerocopy_pin *pin;
+
+	while (zc->n_spare < n) {
+		if ((pin = mm_calloc(1, sizeof(*pin))) == NULL)
+			return (-1);
+		TAILQ_INSERT_HEAD(&zc->spare, pin, next);
+		++zc->n_spare;
+	}
+	return (0);
+}
+
+/* Record that the zero-copy send 'id' covered the first n bytes of
+ * buffer, and pin every chain it touched. */
+static void
+evbuffer_zerocopy_pin_chains(struct evbuffer *buffer, ev_uint32_t id,
+    size_t n)
+{
+	struct evbuffer_zerocopy *zc = buffer->zerocopy;
+	struct evbuffer_zerocopy_pin *pin;
+	struct evbuffer_chain *chain;
+
+	for (chain = buffer->first; chain != NULL && n; chain = chain->next) {
+		pin = NULL;
+		if (chain->flags & EVBUFFER_MEM_PINNED_W) {
+			/* Already in flight from an earlier send; it's
+			 * nearly always the most recent pin. */
+			for (pin = TAILQ_LAST(&zc->pins,
+				 evbuffer_zerocopy_pinq); pin != NULL;
+			     pin = TAILQ_PREV(pin, evbuffer_zerocopy_pinq,
+				 next)) {
+				if (pin->chain == chain)
+					break;
+			}
+		}
+		/* A pinned chain with no pin record was abandoned, and
+		 * stays pinned for good; there's nothing to track. */
+		if (pin) {
+			pin->last_id = id;
+		} else if (!(chain->flags & EVBUFFER_MEM_PINNED_W)) {
+			EVUTIL_ASSERT(zc->n_spare > 0);
+			pin = TAILQ_FIRST(&zc->spare);
+			TAILQ_REMOVE(&zc->spare, pin, next);
+			--zc->n_spare;
+			pin->chain = chain;
+			pin->first_id = pin->last_id = id;
+			pin->n_done = 0;
+			_evbuffer_chain_pin(chain, EVBUFFER_MEM_PINNED_W);
+			TAILQ_INSERT_TAIL(&zc->pins, pin, next);
+		}
+		if (n <= chain->off)
+			break;
+		n -= chain->off;
+	}
+}
+
+static void
+evbuffer_zerocopy_release(struct evbuffer_zerocopy *zc,
+    struct evbuffer_zerocopy_pin *pin)
+{
+	TAILQ_REMOVE(&zc->pins, pin, next);
+	_evbuffer_chain_unpin(pin->chain, EVBUFFER_MEM_PINNED_W);
+	pin->chain = NULL;
+	TAILQ_INSERT_HEAD(&zc->spare, pin, next);
+	++zc->n_spare;
+}
+
+/* Forget about a send whose completion we will never see.  We can't know
+ * whether the kernel is still reading from the chain, so it stays pinned:
+ * once drained, it is never freed or written to again. */
+static void
+evbuffer_zerocopy_abandon(struct evbuffer_zerocopy *zc,
+    struct evbuffer_zerocopy_pin *pin)
+{
+	TAILQ_REMOVE(&zc->pins, pin, next);
+	pin->chain = NULL;
+	TAILQ_INSERT_HEAD(&zc->spare, pin, next);
+	++zc->n_spare;
+}
+
+/* The kernel has finished with sends lo through hi inclusive. */
+static void
+evbuffer_zerocopy_complete(struct evbuffer_zerocopy *zc,
+    ev_uint32_t lo, ev_uint32_t hi)
+{
+	struct evbuffer_zerocopy_pin *pin, *next;
+	ev_int32_t span, a, b;
+
+	zc->n_completed += hi - lo + 1;
+	for (pin = TAILQ_FIRST(&zc->pins); pin != NULL; pin = next) {
+		next = TAILQ_NEXT(pin, next);
+		/* Ids wrap, so work relative to the pin's first id. */
+		span = (ev_int32_t)(pin->last_id - pin->first_id);
+		a = (ev_int32_t)(lo - pin->first_id);
+		b = (ev_int32_t)(hi - pin->first_id);
+		if (a < 0)
+			a = 0;
+		if (b > span)
+			b = span;
+		if (a > b)
+			continue;
+		pin->n_done += b - a + 1;
+		if (pin->n_done > (ev_uint32_t)span)
+			evbuffer_zerocopy_release(zc, pin);
+	}
+}
+
+static int
+evbuffer_write_zerocopy(struct evbuffer *buffer, evutil_socket_t fd,
+    ev_ssize_t howmuch)
+{
+	struct evbuffer_zerocopy *zc = buffer->zerocopy;
+	IOV_TYPE iov[NUM_IOVEC];
+	struct msghdr msg;
+	int n, i;
+
+        ASSERT_EVBUFFER_LOCKED(buffer);
+	i = evbuffer_write_setup_iovec(buffer, iov, howmuch);
+	if (evbuffer_zerocopy_reserve(zc, i) < 0)
+		return writev(fd, iov, i);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = i;
+	n = sendmsg(fd, &msg, MSG_ZEROCOPY);
+	if (n < 0 && errno == ENOBUFS) {
+		/* The socket is out of option memory for completion
+		 * notices; copy this time instead. */
+		return writev(fd, iov, i);
+	}
+	if (n > 0)
+		evbuffer_zerocopy_pin_chains(buffer, zc->next_id++, n);
+	return (n);
+}
+#endif
+
 #ifdef USE_SENDFILE
+/* Helper: send up to howmuch bytes of the sendfile chain at the front of
+ * buffer. */
 static inline int
 evbuffer_write_sendfile(struct evbuffer *buffer, evutil_socket_t fd,
     ev_ssize_t howmuch)
 {
 	struct evbuffer_chain *chain = buffer->first;
-	struct evbuffer_chain_fd *info =
-	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+	int source_fd;
 #if defined(SENDFILE_IS_MACOSX) || defined(SENDFILE_IS_FREEBSD)
 	int res;
 	off_t len = chain->off;
 #elif defined(SENDFILE_IS_LINUX) || defined(SENDFILE_IS_SOLARIS)
 	ev_ssize_t res;
 	off_t offset = chain->misalign;
+	size_t len = chain->off;
 #endif
 
         ASSERT_EVBUFFER_LOCKED(buffer);
 
+	if (chain->flags & EVBUFFER_FILESEGMENT) {
+		struct evbuffer_chain_file_segment *info =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment,
+			chain);
+		source_fd = info->segment->fd;
+	} else {
+		struct evbuffer_chain_fd *info =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+		source_fd = info->fd;
+	}
+	if ((size_t)howmuch < chain->off)
+		len = howmuch;
+
 #if defined(SENDFILE_IS_MACOSX)
-	res = sendfile(info->fd, fd, chain->misalign, &len, NULL, 0);
+	res = sendfile(source_fd, fd, chain->misalign, &len, NULL, 0);
 	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
 		return (-1);
 
 	return (len);
 #elif defined(SENDFILE_IS_FREEBSD)
-	res = sendfile(info->fd, fd, chain->misalign, chain->off, NULL, &len, 0);
+	res = sendfile(source_fd, fd, chain->misalign, len, NULL, &len, 0);
 	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
 		return (-1);
 
 	return (len);
-#elif defined(SENDFILE_IS_LINUX)
+#elif defined(SENDFILE_IS_LINUX) || defined(SENDFILE_IS_SOLARIS)
 	/* TODO(niels): implement splice */
-	res = sendfile(fd, info->fd, &offset, chain->off);
-	if (res == -1 && EVUTIL_ERR_RW_RETRIABLE(errno)) {
-		/* if this is EAGAIN or EINTR return 0; otherwise, -1 */
-		return (0);
-	}
-	return (res);
-#elif defined(SENDFILE_IS_SOLARIS)
-	res = sendfile(fd, info->fd, &offset, chain->off);
-	if (res == -1 && EVUTIL_ERR_RW_RETRIABLE(errno)) {
-		/* if this is EAGAIN or EINTR return 0; otherwise, -1 */
-		return (0);
-	}
+	/* If this fails with EAGAIN or EINTR, we return -1 and leave errno
+	 * alone, just like writev would: returning 0 would look like EOF to
+	 * our callers. */
+	res = sendfile(fd, source_fd, &offset, len);
 	return (res);
 #endif
 }
@@ -1862,6 +2850,7 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
     ev_ssize_t howmuch)
 {
 	int n = -1;
+	int total = 0;
 
         EVBUFFER_LOCK(buffer);
 
@@ -1869,31 +2858,73 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
 		goto done;
 	}
 
-	if (howmuch < 0)
+	if (howmuch < 0 || (size_t)howmuch > buffer->total_len)
 		howmuch = buffer->total_len;
 
-	{
+	n = 0;
+	while (howmuch > 0) {
 #ifdef USE_SENDFILE
+		/* Whether the write below went through sendfile, and whether
+		 * it sent the whole front chain. */
+		int is_sendfile = 0, whole_chain = 0;
 		struct evbuffer_chain *chain = buffer->first;
-		if (chain != NULL && (chain->flags & EVBUFFER_SENDFILE))
+		if (chain->flags & EVBUFFER_SENDFILE) {
+			is_sendfile = 1;
 			n = evbuffer_write_sendfile(buffer, fd, howmuch);
+			whole_chain = n > 0 && (size_t)n == chain->off;
+		} else
+#endif
+#ifdef USE_ZEROCOPY
+		if (buffer->zerocopy && buffer->zerocopy->active &&
+		    buffer->zerocopy->threshold &&
+		    (size_t)howmuch >= buffer->zerocopy->threshold &&
+		    buffer->total_len >= buffer->zerocopy->threshold)
+			n = evbuffer_write_zerocopy(buffer, fd, howmuch);
 		else
 #endif
 #ifdef USE_IOVEC_IMPL
 		n = evbuffer_write_iovec(buffer, fd, howmuch);
 #elif defined(WIN32)
-		/* XXX(nickm) Don't disable this code until we know if
-		 * the WSARecv code above works. */
-		void *p = evbuffer_pullup(buffer, howmuch);
-		n = send(fd, p, howmuch, 0);
+		{
+			/* XXX(nickm) Don't disable this code until we know if
+			 * the WSARecv code above works. */
+			void *p = evbuffer_pullup(buffer, howmuch);
+			n = send(fd, p, howmuch, 0);
+		}
+#else
+		{
+			void *p = evbuffer_pullup(buffer, howmuch);
+			n = write(fd, p, howmuch);
+		}
+#endif
+		if (n <= 0)
+			break;
+
+		evbuffer_drain(buffer, n);
+		total += n;
+		howmuch -= n;
+
+#ifdef USE_SENDFILE
+		/* writev stops at the first sendfile chain, and sendfile
+		 * only sends one chain.  So if the kernel took everything we
+		 * offered and the next chain needs the other kind of write
+		 * (or is another file), keep going: that way a response made
+		 * of headers and file ranges goes out in one call. */
+		if (!howmuch || !buffer->first)
+			break;
+		if (is_sendfile) {
+			if (!whole_chain)
+				break;
+		} else if (!(buffer->first->flags & EVBUFFER_SENDFILE)) {
+			break;
+		}
 #else
-		void *p = evbuffer_pullup(buffer, howmuch);
-		n = write(fd, p, howmuch);
+		break;
 #endif
 	}
 
-        if (n > 0)
-                evbuffer_drain(buffer, n);
+	if (total > 0)
+		n = total;
 
 done:
         EVBUFFER_UNLOCK(buffer);
@@ -1906,6 +2937,181 @@ evbuffer_write(struct evbuffer *buffer, evutil_socket_t fd)
 	return evbuffer_write_atmost(buffer, fd, -1);
 }
 
+static void
+evbuffer_zerocopy_free(struct evbuffer_zerocopy *zc)
+{
+	struct evbuffer_zerocopy_pin *pin;
+
+	/* We can't tell the kernel to stop reading from chains that are
+	 * still in flight, so we leave them pinned, and they are never
+	 * freed.  Callers should wait for completions first; see
+	 * _evbuffer_zerocopy_linger(). */
+	while ((pin = TAILQ_FIRST(&zc->pins))) {
+		TAILQ_REMOVE(&zc->pins, pin, next);
+		mm_free(pin);
+	}
+	while ((pin = TAILQ_FIRST(&zc->spare))) {
+		TAILQ_REMOVE(&zc->spare, pin, next);
+		mm_free(pin);
+	}
+	mm_free(zc);
+}
+
+int
+_evbuffer_set_zerocopy(struct evbuffer *buffer, evutil_socket_t fd,
+    size_t threshold)
+{
+#ifdef USE_ZEROCOPY
+	struct evbuffer_zerocopy *zc;
+	struct evbuffer_zerocopy_pin *pin;
+	int one = 1;
+	int result = -1;
+
+	EVBUFFER_LOCK(buffer);
+	if ((zc = buffer->zerocopy) == NULL) {
+		if (!threshold) {
+			result = 0;
+			goto done;
+		}
+		if (buffer->ring)
+			goto done;
+		if ((zc = mm_calloc(1, sizeof(*zc))) == NULL)
+			goto done;
+		zc->fd = -1;
+		TAILQ_INIT(&zc->pins);
+		TAILQ_INIT(&zc->spare);
+		buffer->zerocopy = zc;
+	}
+
+	if (zc->fd != fd) {
+		/* Completions for sends on the old socket will never show
+		 * up on the new one. */
+		while ((pin = TAILQ_FIRST(&zc->pins)))
+			evbuffer_zerocopy_abandon(zc, pin);
+		zc->fd = fd;
+		zc->next_id = 0;
+		zc->active = 0;
+	}
+
+	zc->threshold = threshold;
+	if (threshold && fd >= 0 && !zc->active) {
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+			(void*)&one, sizeof(one)) < 0)
+			goto done;
+		zc->active = 1;
+	}
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buffer);
+	return result;
+#else
+	return threshold ? -1 : 0;
+#endif
+}
+
+size_t
+_evbuffer_get_zerocopy(struct evbuffer *buffer)
+{
+	size_t threshold;
+
+	EVBUFFER_LOCK(buffer);
+	threshold = buffer->zerocopy ? buffer->zerocopy->threshold : 0;
+	EVBUFFER_UNLOCK(buffer);
+	return threshold;
+}
+
+int
+_evbuffer_zerocopy_reap(struct evbuffer *buffer, evutil_socket_t fd)
+{
+#ifdef USE_ZEROCOPY
+	struct evbuffer_zerocopy *zc;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char control[128];
+	int result = 0;
+
+	EVBUFFER_LOCK(buffer);
+	zc = buffer->zerocopy;
+	if (zc == NULL || fd != zc->fd)
+		goto done;
+
+	/* Every send we haven't heard about yet has a pin, so if there are
+	 * no pins there is nothing on the error queue for us. */
+	while (!TAILQ_EMPTY(&zc->pins)) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (!EVUTIL_ERR_RW_RETRIABLE(errno))
+				result = -1;
+			break;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == IPPROTO_IP &&
+				cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == IPPROTO_IPV6 &&
+				cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    serr->ee_errno != 0)
+				continue;
+			evbuffer_zerocopy_complete(zc, serr->ee_info,
+			    serr->ee_data);
+		}
+	}
+done:
+	EVBUFFER_UNLOCK(buffer);
+	return result;
+#else
+	return 0;
+#endif
+}
+
+int
+_evbuffer_zerocopy_linger(struct evbuffer *buffer, evutil_socket_t fd,
+    int msec)
+{
+#ifdef USE_ZEROCOPY
+	struct timeval now, end, tv;
+	struct pollfd pfd;
+	int pinned;
+
+	evutil_gettimeofday(&end, NULL);
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	evutil_timeradd(&end, &tv, &end);
+
+	for (;;) {
+		if (_evbuffer_zerocopy_reap(buffer, fd) < 0)
+			return -1;
+		EVBUFFER_LOCK(buffer);
+		pinned = buffer->zerocopy && buffer->zerocopy->fd == fd &&
+		    !TAILQ_EMPTY(&buffer->zerocopy->pins);
+		EVBUFFER_UNLOCK(buffer);
+		if (!pinned)
+			return 0;
+
+		evutil_gettimeofday(&now, NULL);
+		if (!evutil_timercmp(&now, &end, <))
+			return -1;
+		evutil_timersub(&end, &now, &tv);
+		/* Completions arrive as errors on the socket, which poll
+		 * always reports. */
+		pfd.fd = fd;
+		pfd.events = 0;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000)
+		    < 0 && errno != EINTR)
+			return -1;
+	}
+#else
+	return 0;
+#endif
+}
+
 unsigned char *
 evbuffer_find(struct evbuffer *buffer, const unsigned char *what, size_t len)
 {
@@ -2122,55 +3328,462 @@ evbuffer_peek(struct evbuffer *buffer, ev_ssize_t len,
 }
 
 
-int
-evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
-{
-	char *buffer;
-	size_t space;
-	int sz, result = -1;
-	va_list aq;
+#ifndef va_copy
+#define	va_copy(dst, src)	memcpy(&(dst), &(src), sizeof(va_list))
+#endif
 
-        EVBUFFER_LOCK(buf);
+/* Helper for evbuffer_add_vprintf(): return the number of bytes we can
+ * format into at the end of buf without adding a chain. */
+#define PRINTF_SPACE_LEN(buf)						\
+	((buf)->last && CHAIN_WRITABLE((buf)->last) ?			\
+	    CHAIN_SPACE_LEN((buf)->last) : 0)
 
-	if (buf->freeze_end) {
-		goto done;
+/* Helper for evbuffer_add_vprintf(): add a chain to the end of buf with
+ * room for at least len bytes.  Unlike evbuffer_expand(), we never copy
+ * the data we've added so far into a bigger chain. */
+static struct evbuffer_chain *
+evbuffer_printf_grow(struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_chain *chain;
+	size_t to_alloc = buf->last ? buf->last->buffer_len : 0;
+
+	if (buf->ring)
+		return (NULL);
+	if (to_alloc <= EVBUFFER_CHAIN_MAX_AUTO_SIZE/2)
+		to_alloc <<= 1;
+	if (len > to_alloc)
+		to_alloc = len;
+	if (to_alloc < buf->min_chain_size)
+		to_alloc = buf->min_chain_size;
+	if ((chain = evbuffer_chain_new(to_alloc)) == NULL)
+		return (NULL);
+	evbuffer_chain_insert(buf, chain);
+	return (chain);
+}
+
+/* The space that evbuffer_add_vprintf_fast() is formatting into: the
+ * free space at the end of the last chain of buf.  We only add what we
+ * wrote to that chain when it runs out or we're done. */
+struct evbuffer_printf_state {
+	struct evbuffer *buf;
+	/* Where the next byte goes. */
+	char *pos;
+	/* The end of the space we're allowed to use.  Like snprintf, we
+	 * always leave room for a NUL after that: plenty of callers have come
+	 * to rely on finding one there. */
+	char *limit;
+};
+
+/* Helper for evbuffer_add_vprintf_fast(): add the bytes we've formatted
+ * so far to the last chain. */
+static void
+evbuffer_printf_commit(struct evbuffer_printf_state *st)
+{
+	struct evbuffer_chain *chain = st->buf->last;
+	size_t n;
+
+	if (st->pos) {
+		n = st->pos - (char *)CHAIN_SPACE_PTR(chain);
+		chain->off += n;
+		st->buf->total_len += n;
+		st->pos = st->limit = NULL;
 	}
+}
 
-	/* make sure that at least some space is available */
-	if (evbuffer_expand(buf, 64) == -1)
-		goto done;
+/* Helper for evbuffer_add_vprintf_fast(): append len bytes to buf, copied
+ * from data, or else len copies of c if data is NULL. */
+static int
+evbuffer_printf_append(struct evbuffer_printf_state *st, const char *data,
+    int c, size_t len)
+{
+	struct evbuffer *buf = st->buf;
+	size_t n;
+
+	while (len) {
+		n = st->limit - st->pos;
+		if (n == 0) {
+			evbuffer_printf_commit(st);
+			if (PRINTF_SPACE_LEN(buf) <= 1 &&
+			    evbuffer_printf_grow(buf, len + 1) == NULL)
+				return (-1);
+			st->pos = (char *)CHAIN_SPACE_PTR(buf->last);
+			st->limit = st->pos + CHAIN_SPACE_LEN(buf->last) - 1;
+			continue;
+		}
+		if (n > len)
+			n = len;
+		if (data) {
+			memcpy(st->pos, data, n);
+			data += n;
+		} else {
+			memset(st->pos, c, n);
+		}
+		st->pos += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/* Helper for evbuffer_add_vprintf_fast(): format the rest of fmt with
+ * evutil_vsnprintf(), the way evbuffer_add_vprintf() always used to. */
+static int
+evbuffer_printf_tail(struct evbuffer *buf, const char *fmt, va_list ap)
+{
+	struct evbuffer_chain *chain;
+	size_t space = PRINTF_SPACE_LEN(buf);
+	int sz;
+	va_list aq;
+
+	va_copy(aq, ap);
+	sz = evutil_vsnprintf(space ? (char *)CHAIN_SPACE_PTR(buf->last) :
+	    NULL, space, fmt, aq);
+	va_end(aq);
+	if (sz < 0)
+		return (-1);
+	if ((size_t)sz >= space) {
+		if (evbuffer_printf_grow(buf, sz + 1) == NULL)
+			return (-1);
+		sz = evutil_vsnprintf((char *)CHAIN_SPACE_PTR(buf->last),
+		    CHAIN_SPACE_LEN(buf->last), fmt, ap);
+		if (sz < 0)
+			return (-1);
+	}
+	chain = buf->last;
+	chain->off += sz;
+	buf->total_len += sz;
+	return (sz);
+}
+
+/* Helper for evbuffer_add_vprintf_fast(): write the decimal digits of v
+ * into the bytes before end, and return a pointer to the first one.  We
+ * do two digits per division, and stay in 32 bits when we can, since
+ * this is where most of the time goes when formatting numbers. */
+static char *
+evbuffer_printf_decimal(char *end, ev_uint64_t v)
+{
+	static const char pairs[] =
+	    "00010203040506070809101112131415161718192021222324"
+	    "25262728293031323334353637383940414243444546474849"
+	    "50515253545556575859606162636465666768697071727374"
+	    "75767778798081828384858687888990919293949596979899";
+	ev_uint32_t v32;
+
+	while (v > 0xffffffffu) {
+		end -= 2;
+		memcpy(end, pairs + 2*(v % 100), 2);
+		v /= 100;
+	}
+	v32 = (ev_uint32_t)v;
+	while (v32 >= 100) {
+		end -= 2;
+		memcpy(end, pairs + 2*(v32 % 100), 2);
+		v32 /= 100;
+	}
+	if (v32 >= 10) {
+		end -= 2;
+		memcpy(end, pairs + 2*v32, 2);
+	} else {
+		*--end = '0' + (char)v32;
+	}
+	return end;
+}
+
+/* Helper for evbuffer_add_vprintf(): format fmt straight into the free
+ * space at the end of buf, adding chains as we run out.  We handle the
+ * conversions that make up nearly all real-world formats (%d, %i, %u, %x,
+ * %X, %c, %s and %% with the hh, h, l, ll and z modifiers, the - and 0
+ * flags, widths, and precisions for strings) ourselves.  At the first
+ * conversion we don't handle, we pass the rest of the format and the
+ * arguments we haven't used yet to evutil_vsnprintf().  Returns the number
+ * of bytes added, or -1 on error.  On error, the caller must remove
+ * whatever we added. */
+static int
+evbuffer_add_vprintf_fast(struct evbuffer *buf, const char *fmt, va_list ap)
+{
+	/* Big enough for a sign and the digits of any 64-bit integer. */
+	char tmp[24];
+	const char *p, *s, *spec, *digits;
+	char *q;
+	size_t total = 0, len, pad;
+	int left, zero, width, prec, star_width, star_prec, lng, neg, ok, r;
+	ev_uint64_t uv;
+	ev_int64_t sv;
+	struct evbuffer_printf_state st;
+
+	st.buf = buf;
+	st.pos = st.limit = NULL;
 
 	for (;;) {
-		struct evbuffer_chain *chain = buf->last;
-		size_t used = chain->misalign + chain->off;
-		buffer = (char *)chain->buffer + chain->misalign + chain->off;
-		EVUTIL_ASSERT(chain->buffer_len >= used);
-		space = chain->buffer_len - used;
+		/* Copy everything up to the next conversion as-is. */
+		if ((p = strchr(fmt, '%')) == NULL)
+			p = fmt + strlen(fmt);
+		if (p != fmt) {
+			len = p - fmt;
+			if (evbuffer_printf_append(&st, fmt, 0, len) < 0)
+				return (-1);
+			total += len;
+		}
+		if (!*p)
+			break;
+		spec = p++;
+
+		/* Parse the whole conversion first: once we've taken an
+		 * argument from ap, we can't hand this one to snprintf. */
+		left = zero = width = star_width = star_prec = 0;
+		prec = -1;
+		for (;; ++p) {
+			if (*p == '-')
+				left = 1;
+			else if (*p == '0')
+				zero = 1;
+			else
+				break;
+		}
+		if (*p == '*') {
+			star_width = 1;
+			++p;
+		} else {
+			while (*p >= '0' && *p <= '9') {
+				width = width*10 + (*p++ - '0');
+				if (width > 65536)
+					goto tail;
+			}
+		}
+		if (*p == '.') {
+			++p;
+			prec = 0;
+			if (*p == '*') {
+				star_prec = 1;
+				++p;
+			} else {
+				while (*p >= '0' && *p <= '9') {
+					prec = prec*10 + (*p++ - '0');
+					if (prec > 65536)
+						goto tail;
+				}
+			}
+		}
 
-#ifndef va_copy
-#define	va_copy(dst, src)	memcpy(&(dst), &(src), sizeof(va_list))
+		/* lng is -2 for hh, -1 for h, 1 for l, 2 for ll, 3 for z. */
+		lng = 0;
+		if (*p == 'h') {
+			lng = -1;
+			if (*++p == 'h') {
+				lng = -2;
+				++p;
+			}
+		} else if (*p == 'l') {
+			lng = 1;
+			if (*++p == 'l') {
+				lng = 2;
+				++p;
+			}
+		} else if (*p == 'z') {
+			lng = 3;
+			++p;
+		}
+
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'x': case 'X':
+			/* A precision on an integer changes its minimum
+			 * number of digits; leave that to snprintf. */
+			ok = prec < 0;
+#ifndef _EVENT_SIZEOF_LONG_LONG
+			if (lng == 2)
+				ok = 0;
 #endif
-		va_copy(aq, ap);
+			break;
+		case 'c':
+			ok = !lng && prec < 0;
+			break;
+		case 's':
+			ok = !lng && !zero;
+			break;
+		case '%':
+			ok = p == spec + 1;
+			break;
+		default:
+			ok = 0;
+			break;
+		}
+		if (!ok)
+			goto tail;
+
+		if (star_width) {
+			width = va_arg(ap, int);
+			if (width < 0) {
+				left = 1;
+				width = width == INT_MIN ? INT_MAX : -width;
+			}
+		}
+		if (star_prec) {
+			prec = va_arg(ap, int);
+			if (prec < 0)
+				prec = -1;
+		}
+
+		neg = 0;
+		digits = "0123456789abcdef";
+		switch (*p) {
+		case 'd':
+		case 'i':
+			switch (lng) {
+			case -2: sv = (signed char)va_arg(ap, int); break;
+			case -1: sv = (short)va_arg(ap, int); break;
+			case 1: sv = va_arg(ap, long); break;
+#ifdef _EVENT_SIZEOF_LONG_LONG
+			case 2: sv = va_arg(ap, long long); break;
+#endif
+			case 3: sv = va_arg(ap, ev_ssize_t); break;
+			default: sv = va_arg(ap, int); break;
+			}
+			if (sv < 0) {
+				neg = 1;
+				uv = -(ev_uint64_t)sv;
+			} else {
+				uv = sv;
+			}
+			goto number;
+		case 'u':
+		case 'x':
+		case 'X':
+			switch (lng) {
+			case -2: uv = (unsigned char)va_arg(ap, unsigned); break;
+			case -1: uv = (unsigned short)va_arg(ap, unsigned); break;
+			case 1: uv = va_arg(ap, unsigned long); break;
+#ifdef _EVENT_SIZEOF_LONG_LONG
+			case 2: uv = va_arg(ap, unsigned long long); break;
+#endif
+			case 3: uv = va_arg(ap, size_t); break;
+			default: uv = va_arg(ap, unsigned); break;
+			}
+		number:
+			q = tmp + sizeof(tmp);
+			if (*p == 'x' || *p == 'X') {
+				if (*p == 'X')
+					digits = "0123456789ABCDEF";
+				do {
+					*--q = digits[uv & 0xf];
+					uv >>= 4;
+				} while (uv);
+			} else {
+				q = evbuffer_printf_decimal(q, uv);
+			}
+			if (neg)
+				*--q = '-';
+			s = q;
+			len = tmp + sizeof(tmp) - q;
+			if (zero && !left && neg && (size_t)width > len) {
+				/* Zeros go between the sign and the digits. */
+				if (evbuffer_printf_append(&st, "-", 0, 1) < 0)
+					return (-1);
+				++s;
+				--len;
+				--width;
+				++total;
+			}
+			break;
+		case 'c':
+			tmp[0] = (char)va_arg(ap, int);
+			s = tmp;
+			len = 1;
+			zero = 0;
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			if (prec >= 0) {
+				for (len = 0; len < (size_t)prec && s[len]; ++len)
+					;
+			} else {
+				len = strlen(s);
+			}
+			break;
+		default: /* '%' */
+			s = "%";
+			len = 1;
+			break;
+		}
+		fmt = p + 1;
 
-		sz = evutil_vsnprintf(buffer, space, fmt, aq);
+		pad = (size_t)width > len ? width - len : 0;
+		if (pad && !left && evbuffer_printf_append(&st, NULL,
+			zero ? '0' : ' ', pad) < 0)
+			return (-1);
+		if (evbuffer_printf_append(&st, s, 0, len) < 0)
+			return (-1);
+		if (pad && left && evbuffer_printf_append(&st, NULL, ' ',
+			pad) < 0)
+			return (-1);
+		total += len + pad;
+	}
 
-		va_end(aq);
+	evbuffer_printf_commit(&st);
+	if (PRINTF_SPACE_LEN(buf))
+		*CHAIN_SPACE_PTR(buf->last) = '\0';
+	goto done;
 
-		if (sz < 0)
-			goto done;
-		if ((size_t)sz < space) {
-			chain->off += sz;
-			buf->total_len += sz;
-                        buf->n_add_for_cb += sz;
+tail:
+	evbuffer_printf_commit(&st);
+	if ((r = evbuffer_printf_tail(buf, spec, ap)) < 0)
+		return (-1);
+	total += r;
+done:
+	if (total > INT_MAX)
+		return (-1);
+	return (int)total;
+}
 
-			evbuffer_invoke_callbacks(buf);
-			result = sz;
-                        goto done;
-		}
-		if (evbuffer_expand(buf, sz + 1) == -1)
-                        goto done;
-        }
-	/* NOTREACHED */
+/* Remove everything past the first len bytes of buf, after an
+ * evbuffer_add_vprintf() that failed partway through. */
+static void
+evbuffer_printf_undo(struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_chain *chain = buf->first, *prev = NULL, *next;
+
+	if (len == buf->total_len)
+		return;
+	while (chain->off < len) {
+		len -= chain->off;
+		prev = chain;
+		chain = chain->next;
+	}
+	chain->off = len;
+	for (next = chain->next; next; next = chain->next) {
+		chain->next = next->next;
+		evbuffer_chain_free(next);
+	}
+	buf->last = chain;
+	buf->previous_to_last = prev;
+}
+
+int
+evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
+{
+	size_t old_len;
+	int result = -1;
+
+        EVBUFFER_LOCK(buf);
+
+	if (buf->freeze_end) {
+		goto done;
+	}
+	/* Gather all of the ring's free space at the end. */
+	if (buf->ring &&
+	    evbuffer_ring_make_room(buf, evbuffer_ring_space(buf)) < 0)
+		goto done;
+
+	old_len = buf->total_len;
+	result = evbuffer_add_vprintf_fast(buf, fmt, ap);
+	if (result < 0) {
+		evbuffer_printf_undo(buf, old_len);
+		buf->total_len = old_len;
+		goto done;
+	}
+
+	buf->n_add_for_cb += result;
+	evbuffer_invoke_callbacks(buf);
 
 done:
         EVBUFFER_UNLOCK(buf);
@@ -2212,7 +3825,7 @@ evbuffer_add_reference(struct evbuffer *outbuf,
 	info->extra = extra;
 
         EVBUFFER_LOCK(outbuf);
-	if (outbuf->freeze_end) {
+	if (outbuf->freeze_end || outbuf->ring) {
 		/* don't call chain_free; we do not want to actually invoke
 		 * the cleanup function */
 		mm_free(chain);
@@ -2230,6 +3843,129 @@ done:
 	return result;
 }
 
+int
+evbuffer_add_buffer_reference(struct evbuffer *outbuf, struct evbuffer *inbuf)
+{
+	struct evbuffer_chain *chain, *tmp, *first = NULL, *last = NULL;
+	struct evbuffer_multicast_parent *info;
+	size_t in_total_len;
+	int result = -1;
+
+	EVBUFFER_LOCK2(inbuf, outbuf);
+	in_total_len = inbuf->total_len;
+
+	if (outbuf == inbuf || outbuf->freeze_end || outbuf->ring ||
+	    inbuf->ring)
+		goto done;
+	if (in_total_len == 0) {
+		result = 0;
+		goto done;
+	}
+
+	for (chain = inbuf->first; chain; chain = chain->next) {
+		/* We can't share file data that isn't in memory.  We also
+		 * refuse to share data that is itself shared from
+		 * elsewhere, so that two buffers can never hold references
+		 * to each other. */
+		if (chain->flags & (EVBUFFER_SENDFILE|EVBUFFER_MULTICAST))
+			goto done;
+	}
+
+	/* Allocate everything first, so that we can fail cleanly. */
+	for (chain = inbuf->first; chain; chain = chain->next) {
+		if (chain->off == 0)
+			continue;
+		tmp = evbuffer_chain_new(
+			sizeof(struct evbuffer_multicast_parent));
+		if (tmp == NULL) {
+			for (; first; first = tmp) {
+				tmp = first->next;
+				mm_free(first);
+			}
+			goto done;
+		}
+		tmp->flags |= EVBUFFER_MULTICAST | EVBUFFER_IMMUTABLE;
+		tmp->buffer = chain->buffer;
+		tmp->buffer_len = chain->buffer_len;
+		tmp->misalign = chain->misalign;
+		tmp->off = chain->off;
+		tmp->flags |= chain->flags & EVBUFFER_RECORD_END;
+		tmp->tag = chain->tag;
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent,
+		    tmp);
+		info->source = inbuf;
+		info->parent = chain;
+		if (last)
+			last->next = tmp;
+		else
+			first = tmp;
+		last = tmp;
+	}
+
+	for (tmp = first; tmp; tmp = chain) {
+		chain = tmp->next;
+		tmp->next = NULL;
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent,
+		    tmp);
+		/* From now on, nobody may write into or move the parent. */
+		info->parent->flags |= EVBUFFER_IMMUTABLE;
+		++info->parent->refcnt;
+		++inbuf->refcnt;
+		evbuffer_chain_insert(outbuf, tmp);
+	}
+	outbuf->n_add_for_cb += in_total_len;
+	evbuffer_invoke_callbacks(outbuf);
+	result = 0;
+
+done:
+	EVBUFFER_UNLOCK2(inbuf, outbuf);
+	return result;
+}
+
+int
+evbuffer_mark_record_end(struct evbuffer *buf, ev_uint32_t tag)
+{
+	struct evbuffer_chain *chain;
+	int result = -1;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->ring)
+		goto done;
+	chain = buf->last;
+	if (chain && chain->off == 0)
+		chain = buf->previous_to_last;
+	if (chain == NULL || chain->off == 0 || CHAIN_PINNED(chain))
+		goto done;
+	/* Nothing may be appended to the chain after the mark. */
+	chain->flags |= EVBUFFER_RECORD_END | EVBUFFER_IMMUTABLE;
+	chain->tag = tag;
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+ev_ssize_t
+evbuffer_get_record_length(struct evbuffer *buf, ev_uint32_t *tag_out)
+{
+	struct evbuffer_chain *chain;
+	ev_ssize_t result = -1;
+	size_t len = 0;
+
+	EVBUFFER_LOCK(buf);
+	for (chain = buf->first; chain; chain = chain->next) {
+		len += chain->off;
+		if (chain->flags & EVBUFFER_RECORD_END) {
+			if (tag_out)
+				*tag_out = chain->tag;
+			result = (ev_ssize_t)len;
+			break;
+		}
+	}
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
 /* TODO(niels): maybe we don't want to own the fd, however, in that
  * case, we should dup it - dup is cheap.  Perhaps, we should use a
  * callback instead?
@@ -2265,7 +4001,7 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 		info->fd = fd;
 
                 EVBUFFER_LOCK(outbuf);
-		if (outbuf->freeze_end) {
+		if (outbuf->freeze_end || outbuf->ring) {
 			mm_free(chain);
 			ok = 0;
 		} else {
@@ -2312,7 +4048,7 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 		info->fd = fd;
 
                 EVBUFFER_LOCK(outbuf);
-		if (outbuf->freeze_end) {
+		if (outbuf->freeze_end || outbuf->ring) {
 			info->fd = -1;
 			evbuffer_chain_free(chain);
 			ok = 0;
@@ -2356,7 +4092,7 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 		}
 
                 EVBUFFER_LOCK(outbuf);
-		if (outbuf->freeze_end) {
+		if (outbuf->freeze_end || outbuf->ring) {
 			evbuffer_free(tmp);
 			ok = 0;
 		} else {
@@ -2377,6 +4113,201 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 	return ok ? 0 : -1;
 }
 
+/* Helper for evbuffer_file_segment_new: get the contents of seg into
+ * memory, by mapping them if we can and by reading them if we can't. */
+static int
+evbuffer_file_segment_materialize(struct evbuffer_file_segment *seg)
+{
+	const off_t offset = seg->file_offset;
+	const off_t length = seg->length;
+	char *mem;
+	off_t done = 0;
+
+#if defined(_EVENT_HAVE_MMAP)
+	if (use_mmap && !(seg->flags & EVBUF_FS_DISABLE_MMAP)) {
+		/* mmap offsets have to be page-aligned, so map from the start
+		 * of the page that holds our first byte. */
+		off_t leftover = offset;
+		void *mapped;
+#ifdef _SC_PAGESIZE
+		long page_size = sysconf(_SC_PAGESIZE);
+		if (page_size > 0)
+			leftover = offset % page_size;
+#endif
+		mapped = mmap(NULL, length + leftover, PROT_READ,
+#ifdef MAP_NOCACHE
+		    MAP_NOCACHE |
+#endif
+#ifdef MAP_FILE
+		    MAP_FILE |
+#endif
+		    MAP_PRIVATE,
+		    seg->fd, offset - leftover);
+		if (mapped != MAP_FAILED) {
+			seg->mapping = mapped;
+			seg->mapping_len = length + leftover;
+			seg->contents = (char *)mapped + leftover;
+			seg->is_mapping = 1;
+			return 0;
+		}
+		/* Fall back to reading the file. */
+	}
+#endif
+
+	if ((mem = mm_malloc(length)) == NULL)
+		return -1;
+#ifdef WIN32
+#define lseek _lseek
+#define read _read
+#endif
+	if (lseek(seg->fd, offset, SEEK_SET) == -1) {
+		mm_free(mem);
+		return -1;
+	}
+	while (done < length) {
+		ev_ssize_t n = read(seg->fd, mem + done, length - done);
+		if (n <= 0) {
+			/* Either an error, or the file is shorter than we were
+			 * told. */
+			mm_free(mem);
+			return -1;
+		}
+		done += n;
+	}
+#ifdef WIN32
+#undef read
+#endif
+	seg->contents = mem;
+	return 0;
+}
+
+struct evbuffer_file_segment *
+evbuffer_file_segment_new(
+	int fd, off_t offset, off_t length, unsigned flags)
+{
+	struct evbuffer_file_segment *seg;
+
+	if (offset < 0)
+		return NULL;
+	if (length < 0) {
+		struct stat st;
+		if (fstat(fd, &st) < 0 || st.st_size < offset)
+			return NULL;
+		length = st.st_size - offset;
+	}
+
+	if ((seg = mm_calloc(1, sizeof(struct evbuffer_file_segment))) == NULL)
+		return NULL;
+	seg->refcnt = 1;
+	seg->fd = fd;
+	seg->flags = flags;
+	seg->file_offset = offset;
+	seg->length = length;
+
+#if defined(USE_SENDFILE)
+	if (use_sendfile && !(flags & EVBUF_FS_DISABLE_SENDFILE))
+		seg->can_sendfile = 1;
+	else
+#endif
+	if (length && evbuffer_file_segment_materialize(seg) < 0) {
+		mm_free(seg);
+		return NULL;
+	}
+
+	if (!(flags & EVBUF_FS_DISABLE_LOCKING))
+		EVTHREAD_ALLOC_LOCK(seg->lock, 0);
+	return seg;
+}
+
+void
+evbuffer_file_segment_free(struct evbuffer_file_segment *seg)
+{
+	int refcnt;
+
+	EVLOCK_LOCK(seg->lock, 0);
+	refcnt = --seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+	if (refcnt > 0)
+		return;
+	EVUTIL_ASSERT(refcnt == 0);
+
+#if defined(_EVENT_HAVE_MMAP)
+	if (seg->is_mapping) {
+		if (munmap(seg->mapping, seg->mapping_len) == -1)
+			event_warn("%s: munmap failed", __func__);
+	} else
+#endif
+	if (seg->contents) {
+		mm_free(seg->contents);
+	}
+
+	if ((seg->flags & EVBUF_FS_CLOSE_ON_FREE) && seg->fd >= 0) {
+		if (close(seg->fd) == -1)
+			event_warn("%s: close(%d) failed", __func__, seg->fd);
+	}
+
+	EVTHREAD_FREE_LOCK(seg->lock, 0);
+	mm_free(seg);
+}
+
+int
+evbuffer_add_file_segment(struct evbuffer *buf,
+    struct evbuffer_file_segment *seg, off_t offset, off_t length)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_file_segment *extra;
+
+	if (offset < 0 || offset > seg->length)
+		return -1;
+	if (length < 0)
+		length = seg->length - offset;
+	if (length > seg->length - offset)
+		return -1;
+	if (length == 0)
+		return 0;
+
+	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_file_segment));
+	if (chain == NULL) {
+		event_warn("%s: out of memory", __func__);
+		return -1;
+	}
+
+	EVBUFFER_LOCK(buf);
+	if (buf->freeze_end || buf->ring) {
+		EVBUFFER_UNLOCK(buf);
+		mm_free(chain);
+		return -1;
+	}
+
+	EVLOCK_LOCK(seg->lock, 0);
+	++seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+
+	extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
+	extra->segment = seg;
+	chain->flags |= EVBUFFER_FILESEGMENT | EVBUFFER_IMMUTABLE;
+	if (seg->can_sendfile) {
+		/* Like evbuffer_add_file: misalign is the offset in the
+		 * file, and there is nothing to read in memory. */
+		chain->flags |= EVBUFFER_SENDFILE;
+		chain->buffer = NULL;
+		chain->misalign = seg->file_offset + offset;
+	} else {
+		chain->buffer = (unsigned char *)seg->contents;
+		chain->misalign = offset;
+	}
+	chain->off = length;
+	chain->buffer_len = chain->misalign + length;
+
+	buf->n_add_for_cb += length;
+	evbuffer_chain_insert(buf, chain);
+
+	evbuffer_invoke_callbacks(buf);
+	EVBUFFER_UNLOCK(buf);
+
+	return 0;
+}
+
 
 void
 evbuffer_setcb(struct evbuffer *buffer, evbuffer_cb cb, void *cbarg)
@@ -2511,3 +4442,246 @@ evbuffer_cb_unsuspend(struct evbuffer *buffer, struct evbuffer_cb_entry *cb)
 	}
 }
 #endif
+
+#ifdef _EVENT_HAVE_SYNC_BUILTINS
+#define HANDOFF_LOCK(h) _EVUTIL_NIL_STMT
+#define HANDOFF_UNLOCK(h) _EVUTIL_NIL_STMT
+#define HANDOFF_BARRIER() __sync_synchronize()
+#define HANDOFF_CAS(p, oldval, newval)			\
+	__sync_bool_compare_and_swap((p), (oldval), (newval))
+#define HANDOFF_ADD(p, n) ((void)__sync_add_and_fetch((p), (n)))
+#define HANDOFF_SUB(p, n) ((void)__sync_sub_and_fetch((p), (n)))
+#else
+/* No atomics: everything that touches shared state happens under a lock,
+ * so plain operations will do. */
+#define HANDOFF_LOCK(h) EVLOCK_LOCK((h)->lock, 0)
+#define HANDOFF_UNLOCK(h) EVLOCK_UNLOCK((h)->lock, 0)
+#define HANDOFF_BARRIER() _EVUTIL_NIL_STMT
+#define HANDOFF_CAS(p, oldval, newval)				\
+	(*(p) == (oldval) ? (*(p) = (newval), 1) : 0)
+#define HANDOFF_ADD(p, n) ((void)(*(p) += (n)))
+#define HANDOFF_SUB(p, n) ((void)(*(p) -= (n)))
+#endif
+
+static void evbuffer_handoff_deferred_cb(struct deferred_cb *cb, void *arg);
+
+struct evbuffer_handoff *
+evbuffer_handoff_new(void)
+{
+	struct evbuffer_handoff *h;
+	struct evbuffer_handoff_node *dummy;
+
+	if ((h = mm_calloc(1, sizeof(struct evbuffer_handoff))) == NULL)
+		return NULL;
+	if ((dummy = mm_calloc(1, sizeof(struct evbuffer_handoff_node)))
+	    == NULL) {
+		mm_free(h);
+		return NULL;
+	}
+	h->head = h->tail = h->first = h->head_copy = dummy;
+#ifndef _EVENT_HAVE_SYNC_BUILTINS
+	EVTHREAD_ALLOC_LOCK(h->lock, 0);
+#endif
+	return h;
+}
+
+void
+evbuffer_handoff_free(struct evbuffer_handoff *h)
+{
+	struct evbuffer_handoff_node *node, *next;
+	struct evbuffer_chain *chain, *next_chain;
+
+	if (h->consumer)
+		event_deferred_cb_cancel(h->cb_queue, &h->deferred);
+
+	/* Free the data nobody pulled... */
+	for (node = h->head->next; node; node = node->next) {
+		for (chain = node->first; chain; chain = next_chain) {
+			next_chain = chain->next;
+			evbuffer_chain_free(chain);
+			if (chain == node->last)
+				break;
+		}
+	}
+	/* ...and every batch we ever allocated. */
+	for (node = h->first; node; node = next) {
+		next = node->next;
+		mm_free(node);
+	}
+#ifndef _EVENT_HAVE_SYNC_BUILTINS
+	EVTHREAD_FREE_LOCK(h->lock, 0);
+#endif
+	mm_free(h);
+}
+
+/* Producer only: get a batch to publish, reusing one that the consumer is
+ * done with if we can. */
+static struct evbuffer_handoff_node *
+evbuffer_handoff_node_new(struct evbuffer_handoff *h)
+{
+	struct evbuffer_handoff_node *node;
+
+	if (h->first == h->head_copy) {
+		h->head_copy = h->head;
+		/* Don't touch anything before head until we've seen the
+		 * consumer's update to it. */
+		HANDOFF_BARRIER();
+	}
+	if (h->first != h->head_copy) {
+		node = h->first;
+		h->first = node->next;
+		return node;
+	}
+	return mm_malloc(sizeof(struct evbuffer_handoff_node));
+}
+
+int
+evbuffer_handoff_push(struct evbuffer_handoff *h, struct evbuffer *src)
+{
+	struct evbuffer_handoff_node *node;
+	size_t len;
+	int wake = 0;
+
+	EVBUFFER_LOCK(src);
+	if (src->freeze_start || src->ring) {
+		EVBUFFER_UNLOCK(src);
+		return -1;
+	}
+	if ((len = src->total_len) == 0) {
+		EVBUFFER_UNLOCK(src);
+		return 0;
+	}
+
+	HANDOFF_LOCK(h);
+	if ((node = evbuffer_handoff_node_new(h)) == NULL) {
+		HANDOFF_UNLOCK(h);
+		EVBUFFER_UNLOCK(src);
+		return -1;
+	}
+	node->next = NULL;
+	node->first = src->first;
+	node->last = src->last;
+	node->previous_to_last = src->previous_to_last;
+	node->len = len;
+
+	/* Count the bytes before publishing them, so that the consumer
+	 * never subtracts more than we have added. */
+	HANDOFF_ADD(&h->total_len, len);
+	/* Make sure the batch is complete before the consumer can see it. */
+	HANDOFF_BARRIER();
+	h->tail->next = node;
+	h->tail = node;
+	/* And make sure the consumer can see it before we look at whether
+	 * it is asleep. */
+	HANDOFF_BARRIER();
+	if (h->sleeping && HANDOFF_CAS(&h->sleeping, 1, 0))
+		wake = 1;
+	HANDOFF_UNLOCK(h);
+
+	ZERO_CHAIN(src);
+	src->n_del_for_cb += len;
+	evbuffer_invoke_callbacks(src);
+	EVBUFFER_UNLOCK(src);
+
+	if (wake)
+		event_deferred_cb_schedule(h->cb_queue, &h->deferred);
+	return 0;
+}
+
+size_t
+evbuffer_handoff_pull(struct evbuffer_handoff *h, struct evbuffer *dst)
+{
+	struct evbuffer_handoff_node *node;
+	size_t moved = 0;
+
+	EVBUFFER_LOCK(dst);
+	if (dst->freeze_end || dst->ring) {
+		EVBUFFER_UNLOCK(dst);
+		return 0;
+	}
+
+	HANDOFF_LOCK(h);
+	while ((node = h->head->next) != NULL) {
+		/* Don't read the batch until we've seen it published. */
+		HANDOFF_BARRIER();
+		if (dst->last == NULL) {
+			dst->first = node->first;
+			dst->previous_to_last = node->previous_to_last;
+		} else {
+			dst->last->next = node->first;
+			dst->previous_to_last = node->previous_to_last ?
+			    node->previous_to_last : dst->last;
+		}
+		dst->last = node->last;
+		dst->total_len += node->len;
+		moved += node->len;
+
+		/* Once head moves on, the producer may reuse the old head;
+		 * make sure we are done with it first. */
+		HANDOFF_BARRIER();
+		h->head = node;
+	}
+	if (moved)
+		HANDOFF_SUB(&h->total_len, moved);
+	HANDOFF_UNLOCK(h);
+
+	if (moved) {
+		dst->n_add_for_cb += moved;
+		evbuffer_invoke_callbacks(dst);
+	}
+	EVBUFFER_UNLOCK(dst);
+	return moved;
+}
+
+size_t
+evbuffer_handoff_get_length(const struct evbuffer_handoff *h)
+{
+	return h->total_len;
+}
+
+static void
+evbuffer_handoff_deferred_cb(struct deferred_cb *cb, void *arg)
+{
+	struct evbuffer_handoff *h = arg;
+	size_t moved;
+	int again, stalled = 0;
+
+	do {
+		moved = evbuffer_handoff_pull(h, h->consumer);
+
+		/* Ask for a wakeup, then check whether the producer published
+		 * something before it could have seen us asking.  We have to
+		 * check even if we pulled nothing: a batch published just
+		 * after our pull found the queue empty saw us awake, and
+		 * nobody will schedule us for it.  But if we already came
+		 * back once and still pulled nothing, the consumer buffer
+		 * won't take data; stay asleep until the next push. */
+		HANDOFF_LOCK(h);
+		h->sleeping = 1;
+		HANDOFF_BARRIER();
+		/* If the producer has already claimed the wakeup, it will
+		 * schedule us again; otherwise we take it back ourselves. */
+		again = !(stalled && !moved) && h->head->next != NULL &&
+		    HANDOFF_CAS(&h->sleeping, 1, 0);
+		HANDOFF_UNLOCK(h);
+		stalled = !moved;
+	} while (again);
+}
+
+int
+evbuffer_handoff_set_consumer(struct evbuffer_handoff *h,
+    struct event_base *base, struct evbuffer *dst)
+{
+	if (h->consumer || !base || !dst)
+		return -1;
+
+	h->consumer = dst;
+	h->cb_queue = event_base_get_deferred_cb_queue(base);
+	event_deferred_cb_init(&h->deferred, evbuffer_handoff_deferred_cb, h);
+
+	/* Run once from the loop to pick up anything already pushed; after
+	 * that, we sleep until the producer wakes us. */
+	h->sleeping = 0;
+	event_deferred_cb_schedule(h->cb_queue, &h->deferred);
+	return 0;
+}
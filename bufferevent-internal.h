@@ -53,6 +53,8 @@ extern "C" {
 #define BEV_SUSPEND_BW 0x02
 /* On a base bufferevent: when we have emptied the group's bandwidth bucket. */
 #define BEV_SUSPEND_BW_GROUP 0x04
+/* Either of the rate-limiting reasons above. */
+#define BEV_SUSPEND_RLIM (BEV_SUSPEND_BW|BEV_SUSPEND_BW_GROUP)
 
 struct bufferevent_rate_limit_group {
 	/** List of all members in the group */
@@ -61,23 +63,55 @@ struct bufferevent_rate_limit_group {
 	struct ev_token_bucket rate_limit;
 	struct ev_token_bucket_cfg rate_limit_cfg;
 
+	/** Members that are suspended for reading [0] or writing [1] until
+	 * the group gives them a turn, in the order they'll get it.  A
+	 * member is on one of these lists exactly when it is suspended with
+	 * BEV_SUSPEND_BW_GROUP for that direction. */
+	struct rlim_group_member_list waiting[2];
+	/** The number of members on each of the waiting lists. */
+	int n_waiting[2];
+
+	/** The group whose limits also apply to everything in this one, or
+	 * NULL. */
+	struct bufferevent_rate_limit_group *parent;
+	/** Child groups with members waiting for reading [0] or writing [1]
+	 * because we ran out, in the order they'll get their turns. */
+	TAILQ_HEAD(rlim_group_list, bufferevent_rate_limit_group)
+	    waiting_children[2];
+	/** The number of groups on each of the waiting_children lists. */
+	int n_waiting_children[2];
+	/** Links for our parent's waiting_children lists.  Protected by the
+	 * parent's lock, like child_waiting. */
+	TAILQ_ENTRY(bufferevent_rate_limit_group) next_waiting_child[2];
+	/** Which of our parent's waiting_children lists we're on: bit 0 for
+	 * reading, bit 1 for writing. */
+	unsigned child_waiting : 2;
+	/** How much more we may read [0] or write [1] on the turn our parent
+	 * last gave us.  Like a member's deficit, but only good for the
+	 * parent's round in deficit_round.  Protected by the parent's lock. */
+	ev_int32_t deficit[2];
+	unsigned deficit_round[2];
+	/** Counts our refills, so that turns we gave our child groups lapse
+	 * at the next one. */
+	unsigned round[2];
+	/** The number of child groups with some of this round's turn left. */
+	int n_owed_children[2];
+
 	/** True iff we don't want to read from any member of the group.until
-	 * the token bucket refills.  */
+	 * the token bucket refills.  Members notice this, and join the
+	 * waiting list, the next time they try to read. */
 	unsigned read_suspended : 1;
 	/** True iff we don't want to write from any member of the group.until
 	 * the token bucket refills.  */
 	unsigned write_suspended : 1;
-	/** True iff we were unable to suspend one of the bufferevents in the
-	 * group for reading the last time we tried, and we should try
-	 * again. */
-	unsigned pending_unsuspend_read : 1;
-	/** True iff we were unable to suspend one of the bufferevents in the
-	 * group for writing the last time we tried, and we should try
-	 * again. */
-	unsigned pending_unsuspend_write : 1;
 
 	/** The number of bufferevents in the group. */
 	int n_members;
+	/** The number of bufferevents in the group and all the groups below
+	 * it. */
+	int n_members_total;
+	/** The number of child groups with any bufferevents in them. */
+	int n_busy_children;
 
 	/** The smallest number of bytes that any member of the group should
 	 * be limited to read or write at a time. */
@@ -86,8 +120,9 @@ struct bufferevent_rate_limit_group {
 	 * to refill. */
 	struct event master_refill_event;
 	/** Lock to protect the members of this group.  This lock should nest
-	 * within every bufferevent lock: if you are holding this lock, do
-	 * not assume you can lock another bufferevent. */
+	 * within every bufferevent lock, and within the locks of the groups
+	 * below this one: if you are holding this lock, do not assume you
+	 * can lock another bufferevent or a child group. */
 	void *lock;
 };
 
@@ -99,6 +134,16 @@ struct bufferevent_rate_limit {
 	 * Note that this field is supposed to be protected by the group
 	 * lock */
 	TAILQ_ENTRY(bufferevent_private) next_in_group;
+	/* Linked-list elements for the group's waiting lists, for reading
+	 * [0] and writing [1].  Also protected by the group lock. */
+	TAILQ_ENTRY(bufferevent_private) next_waiting[2];
+	/* Which of the group's waiting lists we're on: bit 0 for reading,
+	 * bit 1 for writing.  Protected by the group lock. */
+	unsigned waiting : 2;
+	/* How many more bytes the group has promised to let us read [0] or
+	 * write [1] since it last gave us a turn.  Protected by the group
+	 * lock. */
+	ev_int32_t deficit[2];
 	/** The rate-limiting group for this bufferevent, or NULL if it is
 	 * only rate-limited on its own. */
 	struct bufferevent_rate_limit_group *group;
@@ -114,6 +159,33 @@ struct bufferevent_rate_limit {
 	struct event refill_bucket_event;
 };
 
+/** Counters for a bufferevent created with BEV_OPT_STATS. */
+struct bufferevent_stats_block {
+	/** The counters themselves, not counting blocking in progress. */
+	struct bufferevent_stats s;
+	/** When reading [0] or writing [1] was suspended for a watermark or
+	 * a rate limit, if it still is; cleared otherwise. */
+	struct timeval wm_since[2];
+	struct timeval rlim_since[2];
+	/** When we started connecting, if we're waiting for the first byte
+	 * from the connection; cleared otherwise. */
+	struct timeval connect_started;
+	/** The event_base whose totals include these counters, if any. */
+	struct event_base *base;
+	/** Links for bufferevent_base_stats.live.  Protected by the base
+	 * lock. */
+	TAILQ_ENTRY(bufferevent_stats_block) next;
+};
+
+/** The counters for the bufferevents with BEV_OPT_STATS on an event_base.
+ * Protected by the base lock. */
+struct bufferevent_base_stats {
+	/** The sum of the counters of every such bufferevent we've freed. */
+	struct bufferevent_stats retired;
+	/** The counters of every such bufferevent still using the base. */
+	TAILQ_HEAD(bev_stats_list, bufferevent_stats_block) live;
+};
+
 /** Parts of the bufferevent structure that are shared among all bufferevent
  * types, but not exposed in bufferevent_struct.h. */
 struct bufferevent_private {
@@ -134,6 +206,9 @@ struct bufferevent_private {
 	unsigned writecb_pending : 1;
 	/** Flag: set if we are currently busy connecting. */
 	unsigned connecting : 1;
+	/** Flag: set once bufferevent_free() has been called.  Other
+	 * references may keep us around for a while after that. */
+	unsigned freed : 1;
 	/** Set to the events pending if we have deferred callbacks and
 	 * an events callback is pending. */
 	short eventcb_pending;
@@ -167,6 +242,30 @@ struct bufferevent_private {
 
 	/** Rate-limiting information for this bufferevent */
 	struct bufferevent_rate_limit *rate_limiting;
+
+	/** For an edge-triggered socket bufferevent, the most we read or
+	 * write in one turn; 0 if we aren't edge-triggered. */
+	size_t edge_budget;
+	/** For an edge-triggered socket bufferevent, a timer that we set to
+	 * go off right away when we stop reading or writing before the
+	 * socket would block: the backend won't tell us about the rest. */
+	struct event *edge_more;
+	/** EV_READ and/or EV_WRITE: what edge_more should resume. */
+	short edge_more_pending;
+
+	/** For a socket bufferevent: work saved for the end of the loop
+	 * iteration, namely writing out the output (with BEV_OPT_CORK) and
+	 * freeing empty buffers (with BEV_OPT_LAZY_BUFFERS). */
+	struct deferred_cb deferred_sock;
+	/** For a socket bufferevent, the number of calls to
+	 * bufferevent_socket_cork() not yet undone. */
+	unsigned cork_count;
+	/** Set if we're corked, and the socket's TCP_CORK is doing the
+	 * holding back for us. */
+	unsigned tcp_corked : 1;
+
+	/** Our counters, if we have BEV_OPT_STATS; NULL otherwise. */
+	struct bufferevent_stats_block *stats;
 };
 
 /** Possible operations for a control callback. */
@@ -232,6 +331,7 @@ struct bufferevent_ops {
 extern const struct bufferevent_ops bufferevent_ops_socket;
 extern const struct bufferevent_ops bufferevent_ops_filter;
 extern const struct bufferevent_ops bufferevent_ops_pair;
+extern const struct bufferevent_ops bufferevent_ops_pair_cross;
 
 #define BEV_IS_SOCKET(bevp) ((bevp)->be_ops == &bufferevent_ops_socket)
 #define BEV_IS_FILTER(bevp) ((bevp)->be_ops == &bufferevent_ops_filter)
@@ -294,6 +394,12 @@ void _bufferevent_run_eventcb(struct bufferevent *bufev, short what);
  * which case add ev with no timeout. */
 int _bufferevent_add_event(struct event *ev, const struct timeval *tv);
 
+/** Internal: Return the input (if iotype is EV_READ) or output buffer of a
+ * socket bufferevent with BEV_OPT_LAZY_BUFFERS, creating it if it doesn't
+ * exist yet.  Returns NULL on failure. */
+struct evbuffer *_bufferevent_socket_get_buffer(struct bufferevent *bufev,
+    short iotype);
+
 /* =========
  * These next functions implement timeouts for bufferevents that aren't doing
  * anything else with ev_read and ev_write, to handle timeouts.
@@ -353,6 +459,25 @@ int _bufferevent_decrement_read_buckets(struct bufferevent_private *bev,
 int _bufferevent_get_read_max(struct bufferevent_private *bev);
 int _bufferevent_get_write_max(struct bufferevent_private *bev);
 
+/* ==== For BEV_OPT_STATS. */
+
+/** Internal: Count a call that tried to read (if iotype is EV_READ) or
+ * write on bev's socket, and returned 'res'. */
+void _bufferevent_stats_io(struct bufferevent_private *bev, short iotype,
+    ev_ssize_t res);
+/** Internal: Note that bev has just started connecting. */
+void _bufferevent_stats_connecting(struct bufferevent_private *bev);
+/** Internal: Move bev's counters over to the totals for 'base'.  Returns 0
+ * on success, -1 on failure. */
+int _bufferevent_stats_set_base(struct bufferevent_private *bev,
+    struct event_base *base);
+
+/** Internal: As _bufferevent_stats_io(), if bev keeps counters. */
+#define BEV_STATS_IO(bev, iotype, res) do {				\
+		if ((bev)->stats)					\
+			_bufferevent_stats_io((bev), (iotype), (res));	\
+	} while (0)
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,6 +32,7 @@
 #ifdef _EVENT_HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/queue.h>
 
 #include <errno.h>
 #include <stdio.h>
@@ -53,21 +54,32 @@
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event-internal.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "evbuffer-internal.h"
 #include "util-internal.h"
 
+static void bufferevent_stats_suspended(struct bufferevent_private *bufev_p,
+    int is_write, short old_what, short new_what);
+static void bufferevent_stats_retire(struct bufferevent_private *bufev_p);
+
 void
 bufferevent_suspend_read(struct bufferevent *bufev, short what)
 {
 	struct bufferevent_private *bufev_private =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	short old_what;
 	BEV_LOCK(bufev);
+	old_what = bufev_private->read_suspended;
 	if (!bufev_private->read_suspended)
 		bufev->be_ops->disable(bufev, EV_READ);
 	bufev_private->read_suspended |= what;
+	if (bufev_private->stats)
+		bufferevent_stats_suspended(bufev_private, 0, old_what,
+		    bufev_private->read_suspended);
 	BEV_UNLOCK(bufev);
 }
 
@@ -76,8 +88,13 @@ bufferevent_unsuspend_read(struct bufferevent *bufev, short what)
 {
 	struct bufferevent_private *bufev_private =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	short old_what;
 	BEV_LOCK(bufev);
+	old_what = bufev_private->read_suspended;
 	bufev_private->read_suspended &= ~what;
+	if (bufev_private->stats)
+		bufferevent_stats_suspended(bufev_private, 0, old_what,
+		    bufev_private->read_suspended);
 	if (!bufev_private->read_suspended)
 		bufev->be_ops->enable(bufev, EV_READ);
 	BEV_UNLOCK(bufev);
@@ -88,10 +105,15 @@ bufferevent_suspend_write(struct bufferevent *bufev, short what)
 {
 	struct bufferevent_private *bufev_private =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	short old_what;
 	BEV_LOCK(bufev);
+	old_what = bufev_private->write_suspended;
 	if (!bufev_private->write_suspended)
 		bufev->be_ops->disable(bufev, EV_WRITE);
 	bufev_private->write_suspended |= what;
+	if (bufev_private->stats)
+		bufferevent_stats_suspended(bufev_private, 1, old_what,
+		    bufev_private->write_suspended);
 	BEV_UNLOCK(bufev);
 }
 
@@ -100,8 +122,13 @@ bufferevent_unsuspend_write(struct bufferevent *bufev, short what)
 {
 	struct bufferevent_private *bufev_private =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	short old_what;
 	BEV_LOCK(bufev);
+	old_what = bufev_private->write_suspended;
 	bufev_private->write_suspended &= ~what;
+	if (bufev_private->stats)
+		bufferevent_stats_suspended(bufev_private, 1, old_what,
+		    bufev_private->write_suspended);
 	if (!bufev_private->write_suspended)
 		bufev->be_ops->enable(bufev, EV_WRITE);
 	BEV_UNLOCK(bufev);
@@ -235,12 +262,16 @@ bufferevent_init_common(struct bufferevent_private *bufev_private,
 {
 	struct bufferevent *bufev = &bufev_private->bev;
 
-	if (!bufev->input) {
+	/* Only socket bufferevents know how to make their buffers later. */
+	if (ops != &bufferevent_ops_socket)
+		options &= ~BEV_OPT_LAZY_BUFFERS;
+
+	if (!bufev->input && !(options & BEV_OPT_LAZY_BUFFERS)) {
 		if ((bufev->input = evbuffer_new()) == NULL)
 			return -1;
 	}
 
-	if (!bufev->output) {
+	if (!bufev->output && !(options & BEV_OPT_LAZY_BUFFERS)) {
 		if ((bufev->output = evbuffer_new()) == NULL) {
 			evbuffer_free(bufev->input);
 			return -1;
@@ -277,10 +308,32 @@ bufferevent_init_common(struct bufferevent_private *bufev_private,
 		    bufev_private);
 	}
 
+	if (options & BEV_OPT_STATS) {
+		bufev_private->stats =
+		    mm_calloc(1, sizeof(struct bufferevent_stats_block));
+		if (!bufev_private->stats ||
+		    _bufferevent_stats_set_base(bufev_private, base) < 0) {
+			if (bufev_private->stats)
+				mm_free(bufev_private->stats);
+			bufev_private->stats = NULL;
+			if (bufev->input)
+				evbuffer_free(bufev->input);
+			if (bufev->output)
+				evbuffer_free(bufev->output);
+			if (bufev_private->own_lock)
+				EVTHREAD_FREE_LOCK(bufev_private->lock,
+				    EVTHREAD_LOCKTYPE_RECURSIVE);
+			bufev_private->lock = NULL;
+			return -1;
+		}
+	}
+
 	bufev_private->options = options;
 
-	evbuffer_set_parent(bufev->input, bufev);
-	evbuffer_set_parent(bufev->output, bufev);
+	if (bufev->input)
+		evbuffer_set_parent(bufev->input, bufev);
+	if (bufev->output)
+		evbuffer_set_parent(bufev->output, bufev);
 
 	return 0;
 }
@@ -300,15 +353,22 @@ bufferevent_setcb(struct bufferevent *bufev,
 	BEV_UNLOCK(bufev);
 }
 
+/* (A bufferevent's buffers are only ever missing if it's a socket
+ * bufferevent with BEV_OPT_LAZY_BUFFERS.) */
+
 struct evbuffer *
 bufferevent_get_input(struct bufferevent *bufev)
 {
+	if (!bufev->input)
+		return _bufferevent_socket_get_buffer(bufev, EV_READ);
 	return bufev->input;
 }
 
 struct evbuffer *
 bufferevent_get_output(struct bufferevent *bufev)
 {
+	if (!bufev->output)
+		return _bufferevent_socket_get_buffer(bufev, EV_WRITE);
 	return bufev->output;
 }
 
@@ -320,31 +380,57 @@ bufferevent_get_output(struct bufferevent *bufev)
 int
 bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
 {
-	if (evbuffer_add(bufev->output, data, size) == -1)
-		return (-1);
+	struct evbuffer *output;
+	int r = 0;
 
-	return 0;
+	BEV_LOCK(bufev);
+	output = bufferevent_get_output(bufev);
+	if (!output || evbuffer_add(output, data, size) == -1)
+		r = -1;
+	BEV_UNLOCK(bufev);
+
+	return r;
 }
 
 int
 bufferevent_write_buffer(struct bufferevent *bufev, struct evbuffer *buf)
 {
-	if (evbuffer_add_buffer(bufev->output, buf) == -1)
-		return (-1);
+	struct evbuffer *output;
+	int r = 0;
 
-	return 0;
+	BEV_LOCK(bufev);
+	output = bufferevent_get_output(bufev);
+	if (!output || evbuffer_add_buffer(output, buf) == -1)
+		r = -1;
+	BEV_UNLOCK(bufev);
+
+	return r;
 }
 
 size_t
 bufferevent_read(struct bufferevent *bufev, void *data, size_t size)
 {
-	return (evbuffer_remove(bufev->input, data, size));
+	size_t r = 0;
+
+	BEV_LOCK(bufev);
+	if (bufev->input)
+		r = evbuffer_remove(bufev->input, data, size);
+	BEV_UNLOCK(bufev);
+
+	return r;
 }
 
 int
 bufferevent_read_buffer(struct bufferevent *bufev, struct evbuffer *buf)
 {
-	return (evbuffer_add_buffer(buf, bufev->input));
+	int r = 0;
+
+	BEV_LOCK(bufev);
+	if (bufev->input)
+		r = evbuffer_add_buffer(buf, bufev->input);
+	BEV_UNLOCK(bufev);
+
+	return r;
 }
 
 int
@@ -453,7 +539,7 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 		bufev->wm_read.low = lowmark;
 		bufev->wm_read.high = highmark;
 
-		if (highmark) {
+		if (highmark && bufev->input) {
 			/* There is now a new high-water mark for read.
 			   enable the callback if needed, and see if we should
 			   suspend/bufferevent_wm_unsuspend. */
@@ -472,6 +558,9 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 				bufferevent_wm_suspend_read(bufev);
 			else if (evbuffer_get_length(bufev->input) < highmark)
 				bufferevent_wm_unsuspend_read(bufev);
+		} else if (highmark) {
+			/* Our input buffer doesn't exist yet; whoever makes
+			 * it will call us again. */
 		} else {
 			/* There is now no high-water mark for read. */
 			if (bufev_private->read_watermarks_cb)
@@ -528,18 +617,30 @@ _bufferevent_decref_and_unlock(struct bufferevent *bufev)
 	 * The buffers can share a lock with this bufferevent object,
 	 * but the lock might be destroyed below. */
 	/* evbuffer will free the callbacks */
-	evbuffer_free(bufev->input);
-	evbuffer_free(bufev->output);
-
+	if (bufev->input)
+		evbuffer_free(bufev->input);
+	if (bufev->output)
+		evbuffer_free(bufev->output);
+
+	if (bufev_private->rate_limiting &&
+	    bufev_private->rate_limiting->group) {
+		/* This frees rate_limiting if the group was all it was
+		 * there for. */
+		bufferevent_remove_from_rate_limit_group(bufev);
+	}
 	if (bufev_private->rate_limiting) {
-		if (bufev_private->rate_limiting->group)
-			bufferevent_remove_from_rate_limit_group(bufev);
 		if (event_initialized(&bufev_private->rate_limiting->refill_bucket_event))
 			event_del(&bufev_private->rate_limiting->refill_bucket_event);
 		mm_free(bufev_private->rate_limiting);
 		bufev_private->rate_limiting = NULL;
 	}
 
+	if (bufev_private->stats) {
+		bufferevent_stats_retire(bufev_private);
+		mm_free(bufev_private->stats);
+		bufev_private->stats = NULL;
+	}
+
 	BEV_UNLOCK(bufev);
 	if (bufev_private->own_lock)
 		EVTHREAD_FREE_LOCK(bufev_private->lock,
@@ -562,6 +663,7 @@ void
 bufferevent_free(struct bufferevent *bufev)
 {
 	BEV_LOCK(bufev);
+	BEV_UPCAST(bufev)->freed = 1;
 	_bufferevent_decref_and_unlock(bufev);
 }
 
@@ -602,8 +704,10 @@ bufferevent_enable_locking(struct bufferevent *bufev, void *lock)
 		BEV_UPCAST(bufev)->lock = lock;
 		BEV_UPCAST(bufev)->own_lock = 0;
 	}
-	evbuffer_enable_locking(bufev->input, lock);
-	evbuffer_enable_locking(bufev->output, lock);
+	if (bufev->input)
+		evbuffer_enable_locking(bufev->input, lock);
+	if (bufev->output)
+		evbuffer_enable_locking(bufev->output, lock);
 
 	if (underlying && !BEV_UPCAST(underlying)->lock)
 		bufferevent_enable_locking(underlying, lock);
@@ -717,3 +821,225 @@ _bufferevent_add_event(struct event *ev, const struct timeval *tv)
 	else
 		return event_add(ev, tv);
 }
+
+/* Add the time since 'since' (as of 'now') to 'total'. */
+static void
+bev_stats_add_since(struct timeval *total, const struct timeval *since,
+    const struct timeval *now)
+{
+	struct timeval d;
+
+	if (!evutil_timerisset(since) || evutil_timercmp(now, since, <))
+		return;
+	evutil_timersub(now, since, &d);
+	evutil_timeradd(total, &d, total);
+}
+
+/* Add the counters in 'st', including any blocking still in progress as of
+ * 'now', to 'out'. */
+static void
+bev_stats_sum(struct bufferevent_stats *out,
+    const struct bufferevent_stats_block *st, const struct timeval *now)
+{
+	out->bytes_read += st->s.bytes_read;
+	out->bytes_written += st->s.bytes_written;
+	out->read_calls += st->s.read_calls;
+	out->write_calls += st->s.write_calls;
+	evutil_timeradd(&out->read_blocked_wm, &st->s.read_blocked_wm,
+	    &out->read_blocked_wm);
+	evutil_timeradd(&out->write_blocked_wm, &st->s.write_blocked_wm,
+	    &out->write_blocked_wm);
+	evutil_timeradd(&out->read_blocked_rlim, &st->s.read_blocked_rlim,
+	    &out->read_blocked_rlim);
+	evutil_timeradd(&out->write_blocked_rlim, &st->s.write_blocked_rlim,
+	    &out->write_blocked_rlim);
+	evutil_timeradd(&out->connect_to_first_byte,
+	    &st->s.connect_to_first_byte, &out->connect_to_first_byte);
+	out->n_first_bytes += st->s.n_first_bytes;
+
+	bev_stats_add_since(&out->read_blocked_wm, &st->wm_since[0], now);
+	bev_stats_add_since(&out->write_blocked_wm, &st->wm_since[1], now);
+	bev_stats_add_since(&out->read_blocked_rlim, &st->rlim_since[0], now);
+	bev_stats_add_since(&out->write_blocked_rlim, &st->rlim_since[1], now);
+}
+
+/* Start or stop the clock on one kind of blocking. */
+static void
+bev_stats_track(struct timeval *since, struct timeval *total, int was,
+    int is, const struct timeval *now)
+{
+	if (!was && is) {
+		*since = *now;
+	} else if (was && !is) {
+		bev_stats_add_since(total, since, now);
+		evutil_timerclear(since);
+	}
+}
+
+/* Called when a bufferevent with counters has its reading or writing
+ * suspension conditions change from old_what to new_what. */
+static void
+bufferevent_stats_suspended(struct bufferevent_private *bufev_p,
+    int is_write, short old_what, short new_what)
+{
+	struct bufferevent_stats_block *st = bufev_p->stats;
+	short changed = old_what ^ new_what;
+	struct timeval now;
+
+	if (!(changed & (BEV_SUSPEND_WM|BEV_SUSPEND_RLIM)))
+		return;
+	event_base_gettimeofday_cached(bufev_p->bev.ev_base, &now);
+
+	bev_stats_track(&st->wm_since[is_write],
+	    is_write ? &st->s.write_blocked_wm : &st->s.read_blocked_wm,
+	    old_what & BEV_SUSPEND_WM, new_what & BEV_SUSPEND_WM, &now);
+	bev_stats_track(&st->rlim_since[is_write],
+	    is_write ? &st->s.write_blocked_rlim : &st->s.read_blocked_rlim,
+	    old_what & BEV_SUSPEND_RLIM, new_what & BEV_SUSPEND_RLIM, &now);
+}
+
+void
+_bufferevent_stats_io(struct bufferevent_private *bufev_p, short iotype,
+    ev_ssize_t res)
+{
+	struct bufferevent_stats_block *st = bufev_p->stats;
+	struct timeval now;
+
+	if (iotype == EV_WRITE) {
+		++st->s.write_calls;
+		if (res > 0)
+			st->s.bytes_written += res;
+		return;
+	}
+
+	++st->s.read_calls;
+	if (res <= 0)
+		return;
+	st->s.bytes_read += res;
+	if (evutil_timerisset(&st->connect_started)) {
+		event_base_gettimeofday_cached(bufev_p->bev.ev_base, &now);
+		bev_stats_add_since(&st->s.connect_to_first_byte,
+		    &st->connect_started, &now);
+		++st->s.n_first_bytes;
+		evutil_timerclear(&st->connect_started);
+	}
+}
+
+void
+_bufferevent_stats_connecting(struct bufferevent_private *bufev_p)
+{
+	if (bufev_p->stats)
+		event_base_gettimeofday_cached(bufev_p->bev.ev_base,
+		    &bufev_p->stats->connect_started);
+}
+
+int
+_bufferevent_stats_set_base(struct bufferevent_private *bufev_p,
+    struct event_base *base)
+{
+	struct bufferevent_stats_block *st = bufev_p->stats;
+	struct event_base *old_base = st->base;
+	int r = 0;
+
+	if (base == old_base)
+		return 0;
+
+	if (old_base) {
+		EVBASE_ACQUIRE_LOCK(old_base, th_base_lock);
+		TAILQ_REMOVE(&old_base->bev_stats->live, st, next);
+		EVBASE_RELEASE_LOCK(old_base, th_base_lock);
+		st->base = NULL;
+	}
+	if (!base)
+		return 0;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (!base->bev_stats) {
+		base->bev_stats = mm_calloc(1, sizeof(*base->bev_stats));
+		if (base->bev_stats)
+			TAILQ_INIT(&base->bev_stats->live);
+	}
+	if (base->bev_stats) {
+		TAILQ_INSERT_TAIL(&base->bev_stats->live, st, next);
+		st->base = base;
+	} else {
+		r = -1;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return r;
+}
+
+/* Fold the counters of a bufferevent we're about to free into its base's
+ * totals. */
+static void
+bufferevent_stats_retire(struct bufferevent_private *bufev_p)
+{
+	struct bufferevent_stats_block *st = bufev_p->stats;
+	struct event_base *base = st->base;
+	struct timeval now;
+
+	if (!base)
+		return;
+	event_base_gettimeofday_cached(base, &now);
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	TAILQ_REMOVE(&base->bev_stats->live, st, next);
+	bev_stats_sum(&base->bev_stats->retired, st, &now);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	st->base = NULL;
+}
+
+void
+_bufferevent_base_stats_free(struct event_base *base)
+{
+	struct bufferevent_stats_block *st;
+
+	/* Bufferevents that outlive the base keep their own counters, but
+	 * have no totals to add them to any more. */
+	while ((st = TAILQ_FIRST(&base->bev_stats->live))) {
+		TAILQ_REMOVE(&base->bev_stats->live, st, next);
+		st->base = NULL;
+	}
+	mm_free(base->bev_stats);
+	base->bev_stats = NULL;
+}
+
+int
+bufferevent_get_stats(struct bufferevent *bev,
+    struct bufferevent_stats *stats)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
+	struct timeval now;
+	int r = -1;
+
+	BEV_LOCK(bev);
+	if (bufev_p->stats) {
+		memset(stats, 0, sizeof(*stats));
+		evutil_timerclear(&now);
+		if (bev->ev_base)
+			event_base_gettimeofday_cached(bev->ev_base, &now);
+		bev_stats_sum(stats, bufev_p->stats, &now);
+		r = 0;
+	}
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+int
+event_base_get_bufferevent_stats(struct event_base *base,
+    struct bufferevent_stats *stats)
+{
+	struct bufferevent_stats_block *st;
+	struct timeval now;
+
+	memset(stats, 0, sizeof(*stats));
+	event_base_gettimeofday_cached(base, &now);
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (base->bev_stats) {
+		*stats = base->bev_stats->retired;
+		TAILQ_FOREACH(st, &base->bev_stats->live, next)
+			bev_stats_sum(stats, st, &now);
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return 0;
+}
@@ -55,6 +55,7 @@
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "util-internal.h"
+#include "defer-internal.h"
 
 /* prototypes */
 static int be_filter_enable(struct bufferevent *, short);
@@ -70,6 +71,7 @@ static int be_filter_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union
 
 static void bufferevent_filtered_outbuf_cb(struct evbuffer *buf,
     const struct evbuffer_cb_info *info, void *arg);
+static void be_filter_deferred_cb(struct deferred_cb *, void *);
 
 struct bufferevent_filtered {
 	struct bufferevent_private bev;
@@ -81,6 +83,9 @@ struct bufferevent_filtered {
         /** True iff we have received an EOF callback from the underlying
          * bufferevent. */
 	unsigned got_eof;
+        /** Runs the filters on whatever has piled up while we were
+         * disabled or held back by a rate limit; see be_filter_enable(). */
+	struct deferred_cb deferred;
 
         /** Function to free context when we're done. */
 	void (*free_context)(void *);
@@ -130,7 +135,8 @@ be_underlying_writebuf_full(struct bufferevent_filtered *bevf,
         struct bufferevent *u = bevf->underlying;
         return state == BEV_NORMAL &&
             u->wm_write.high &&
-            evbuffer_get_length(u->output) >= u->wm_write.high;
+            evbuffer_get_length(bufferevent_get_output(u)) >=
+            u->wm_write.high;
 }
 
 /** Return 1 if our input buffer is at or over its high watermark such that we
@@ -146,13 +152,56 @@ be_readbuf_full(struct bufferevent_filtered *bevf,
 }
 
 
+/** Clamp 'limit' (-1 for none) to what our rate limit lets us read, or
+ * write if is_write, right now. */
+static ev_ssize_t
+be_filter_clamp_to_rlim(struct bufferevent_filtered *bevf, int is_write,
+    ev_ssize_t limit)
+{
+	ev_ssize_t max;
+
+	if (!bevf->bev.rate_limiting)
+		return limit;
+	max = is_write ? _bufferevent_get_write_max(&bevf->bev) :
+	    _bufferevent_get_read_max(&bevf->bev);
+	if (max < 0)
+		max = 0;
+	if (limit < 0 || limit > max)
+		limit = max;
+	return limit;
+}
+
+/** Charge our rate limit for reading, or writing if is_write, for a run of
+ * a filter that moved 'user_bytes' on our side of it and
+ * 'underlying_bytes' on the underlying bufferevent's side. */
+static void
+be_filter_charge_rlim(struct bufferevent_filtered *bevf, int is_write,
+    size_t user_bytes, size_t underlying_bytes)
+{
+	size_t n;
+
+	if (!bevf->bev.rate_limiting)
+		return;
+	n = (bevf->bev.options & BEV_OPT_RATELIM_UNDERLYING) ?
+	    underlying_bytes : user_bytes;
+	if (!n)
+		return;
+	if (is_write)
+		_bufferevent_decrement_write_buckets(&bevf->bev, (int)n);
+	else
+		_bufferevent_decrement_read_buckets(&bevf->bev, (int)n);
+}
+
 /* Filter to use when we're created with a NULL filter. */
 static enum bufferevent_filter_result
 be_null_filter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t lim,
 	       enum bufferevent_flush_mode state, void *ctx)
 {
 	(void)state;
-	if (evbuffer_remove_buffer(src, dst, lim) == 0)
+	/* evbuffer_remove_buffer_reference() returns the number of bytes
+	 * moved; it shares memory instead of copying it, so a pass-through
+	 * filter costs O(chains) rather than O(bytes). */
+	if (evbuffer_remove_buffer_reference(src, dst, lim) >= 0)
 		return BEV_OK;
 	else
 		return BEV_ERROR;
@@ -198,6 +247,8 @@ bufferevent_filter_new(struct bufferevent *underlying,
 
 	bufev_f->outbuf_cb = evbuffer_add_cb(downcast(bufev_f)->output,
 	   bufferevent_filtered_outbuf_cb, bufev_f);
+	event_deferred_cb_init(&bufev_f->deferred, be_filter_deferred_cb,
+	    bufev_f);
 
 	_bufferevent_init_generic_timeout_cbs(downcast(bufev_f));
 	bufferevent_incref(underlying);
@@ -224,6 +275,15 @@ be_filter_enable(struct bufferevent *bev, short event)
 {
 	struct bufferevent_filtered *bevf = upcast(bev);
 	_bufferevent_generic_adj_timeouts(bev);
+	/* Data may have been waiting on either side of us while we were
+	 * disabled, and the underlying bufferevent won't tell us about it
+	 * again: run the filters at the end of this loop iteration. */
+	if (!bevf->deferred.queued) {
+		bufferevent_incref(bev);
+		event_deferred_cb_schedule(
+		    event_base_get_deferred_cb_queue(bev->ev_base),
+		    &bevf->deferred);
+	}
 	return bufferevent_enable(bevf->underlying, event);
 }
 
@@ -232,6 +292,13 @@ be_filter_disable(struct bufferevent *bev, short event)
 {
 	struct bufferevent_filtered *bevf = upcast(bev);
 	_bufferevent_generic_adj_timeouts(bev);
+	/* If we're still enabled for writing, a rate limit is holding us
+	 * back: we'll stop filtering, but the underlying bufferevent can
+	 * still send what we've already given it. */
+	if (bev->enabled & EV_WRITE)
+		event &= ~EV_WRITE;
+	if (!event)
+		return 0;
 	return bufferevent_disable(bevf->underlying, event);
 }
 
@@ -245,27 +312,41 @@ be_filter_process_input(struct bufferevent_filtered *bevf,
 
         if (state == BEV_NORMAL) {
                 /* If we're in 'normal' mode, don't urge data on the filter
-                 * unless we're reading data and under our high-water mark.*/
+                 * unless we're reading data, under our high-water mark,
+                 * and not held back by a rate limit. */
                 if (!(bev->enabled & EV_READ) ||
-                    be_readbuf_full(bevf, state))
+                    be_readbuf_full(bevf, state) ||
+                    bevf->bev.read_suspended)
                         return BEV_OK;
         }
 
 	do {
+                struct evbuffer *src = bufferevent_get_input(bevf->underlying);
+                size_t src_len = evbuffer_get_length(src);
+                size_t dst_len = evbuffer_get_length(bev->input);
                 ev_ssize_t limit = -1;
                 if (state == BEV_NORMAL && bev->wm_read.high)
-                        limit = bev->wm_read.high -
-                            evbuffer_get_length(bev->input);
+                        limit = bev->wm_read.high - dst_len;
+                if (state == BEV_NORMAL &&
+                    !(limit = be_filter_clamp_to_rlim(bevf, 0, limit))) {
+                        res = BEV_OK;
+                        break;
+                }
 
-		res = bevf->process_in(bevf->underlying->input,
-                    bev->input, limit, state, bevf->context);
+		res = bevf->process_in(src, bev->input, limit, state,
+                    bevf->context);
+
+                be_filter_charge_rlim(bevf, 0,
+                    evbuffer_get_length(bev->input) - dst_len,
+                    src_len - evbuffer_get_length(src));
 
 		if (res == BEV_OK)
 			*processed_out = 1;
 	} while (res == BEV_OK &&
 		 (bev->enabled & EV_READ) &&
-		 evbuffer_get_length(bevf->underlying->input) &&
-  		 !be_readbuf_full(bevf, state));
+		 evbuffer_get_length(bufferevent_get_input(bevf->underlying)) &&
+  		 !be_readbuf_full(bevf, state) &&
+		 !(state == BEV_NORMAL && bevf->bev.read_suspended));
 
 	if (*processed_out)
 		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
@@ -292,7 +373,8 @@ be_filter_process_output(struct bufferevent_filtered *bevf,
                  * call the filter no matter what. */
                 if (!(bufev->enabled & EV_WRITE) ||
                     be_underlying_writebuf_full(bevf, state) ||
-                    !evbuffer_get_length(bufev->output))
+                    !evbuffer_get_length(bufev->output) ||
+                    bevf->bev.write_suspended)
                         return BEV_OK;
         }
 
@@ -305,18 +387,29 @@ be_filter_process_output(struct bufferevent_filtered *bevf,
                 again = 0;
 
                 do {
+                        struct evbuffer *dst =
+                            bufferevent_get_output(bevf->underlying);
+                        size_t src_len = evbuffer_get_length(bufev->output);
+                        size_t dst_len = evbuffer_get_length(dst);
                         ev_ssize_t limit = -1;
                         if (state == BEV_NORMAL &&
                             bevf->underlying->wm_write.high)
                                 limit = bevf->underlying->wm_write.high -
-                                    evbuffer_get_length(bevf->underlying->output);
+                                    dst_len;
+                        if (state == BEV_NORMAL && !(limit =
+                                be_filter_clamp_to_rlim(bevf, 1, limit)))
+                                break;
 
                         res = bevf->process_out(downcast(bevf)->output,
-                            bevf->underlying->output,
+                            dst,
                             limit,
                             state,
                             bevf->context);
 
+                        be_filter_charge_rlim(bevf, 1,
+                            src_len - evbuffer_get_length(bufev->output),
+                            evbuffer_get_length(dst) - dst_len);
+
                         if (res == BEV_OK)
                                 processed = *processed_out = 1;
                 } while (/* Stop if the filter wasn't successful...*/
@@ -327,7 +420,9 @@ be_filter_process_output(struct bufferevent_filtered *bevf,
                          * not flushing. */
                         evbuffer_get_length(bufev->output) &&
                         /* Or if we have filled the underlying output buffer. */
-                        !be_underlying_writebuf_full(bevf,state));
+                        !be_underlying_writebuf_full(bevf,state) &&
+                        /* Or if our rate limit is used up. */
+                        !(state == BEV_NORMAL && bevf->bev.write_suspended));
 
                 if (processed &&
                     evbuffer_get_length(bufev->output) <= bufev->wm_write.low) {
@@ -337,7 +432,9 @@ be_filter_process_output(struct bufferevent_filtered *bevf,
                         if (res == BEV_OK &&
                             (bufev->enabled & EV_WRITE) &&
                             evbuffer_get_length(bufev->output) &&
-                            !be_underlying_writebuf_full(bevf, state)) {
+                            !be_underlying_writebuf_full(bevf, state) &&
+                            !(state == BEV_NORMAL &&
+                                bevf->bev.write_suspended)) {
                                 again = 1;
                         }
                 }
@@ -414,6 +511,22 @@ be_filter_writecb(struct bufferevent *underlying, void *_me)
 	_bufferevent_decref_and_unlock(bev);
 }
 
+/* Scheduled by be_filter_enable(): pick up whatever is waiting for us in
+ * the underlying input buffer or our output buffer. */
+static void
+be_filter_deferred_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_filtered *bevf = arg;
+	struct bufferevent *bev = downcast(bevf);
+
+	BEV_LOCK(bev);
+	if (evbuffer_get_length(bufferevent_get_input(bevf->underlying)))
+		be_filter_readcb(bevf->underlying, bevf);
+	if (evbuffer_get_length(bev->output))
+		be_filter_writecb(bevf->underlying, bevf);
+	_bufferevent_decref_and_unlock(bev);
+}
+
 /* Called when the underlying socket has given us an error */
 static void
 be_filter_eventcb(struct bufferevent *underlying, short what, void *_me)
@@ -31,6 +31,7 @@
 #ifdef _EVENT_HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/queue.h>
 
 #include <errno.h>
 #include <stdio.h>
@@ -46,6 +47,10 @@
 #ifdef WIN32
 #include <winsock2.h>
 #endif
+#if defined(_EVENT_HAVE_PTHREADS) && !defined(_EVENT_DISABLE_THREAD_SUPPORT)
+#include <pthread.h>
+#define USE_HANDSHAKE_POOL
+#endif
 
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_struct.h"
@@ -56,6 +61,9 @@
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "log-internal.h"
+#include "defer-internal.h"
+#include "evthread-internal.h"
+#include "event-internal.h"
 
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
@@ -294,9 +302,48 @@ struct bufferevent_openssl {
 	 * and we need to try it again with this many bytes. */
 	ev_ssize_t last_write;
 
+	/* How many bytes our BIOs had read and written when we last charged
+	 * them to our rate limits; see decrement_underlying_buckets(). */
+	ev_uint64_t n_underlying_read;
+	ev_uint64_t n_underlying_written;
+
+	/* Where we gather small chains from the output buffer into a single
+	 * TLS record.  Allocated when we first need it. */
+	char *record_buf;
+	/* When we last wrote, and how much we've written since we were last
+	 * idle; see record_size(). */
+	struct timeval last_write_time;
+	size_t n_written_since_idle;
+	/* Writes whatever was added to the output buffer during this loop
+	 * iteration, all together; see be_openssl_outbuf_cb().  On a filter,
+	 * also takes the first step of the handshake. */
+	struct deferred_cb deferred;
+
+	/* The session cache we're resuming from and adding to, and the server
+	 * we're connecting to, if any; see do_handshake(). */
+	struct bufferevent_openssl_session_cache *session_cache;
+	char *session_host;
+	int session_port;
+
 #define NUM_ERRORS 3
 	ev_uint32_t errors[NUM_ERRORS];
 
+	/* The pool of threads doing our handshake, if any; see
+	 * do_handshake().  While handshake_in_worker is set, a worker thread
+	 * owns our SSL, and reports back through handshake_done. */
+	struct bufferevent_openssl_handshake_pool *handshake_pool;
+	TAILQ_ENTRY(bufferevent_openssl) handshake_next;
+	struct deferred_cb handshake_done;
+	/* Pending for as long as a worker has our SSL: deferred callbacks
+	 * alone won't keep the event loop running till the worker is done. */
+	struct event handshake_keepalive;
+	/* What the worker's SSL_do_handshake() returned, what SSL_get_error()
+	 * made of it, and the OpenSSL errors it left behind. */
+	int handshake_result;
+	int handshake_err;
+	unsigned long handshake_errors[NUM_ERRORS];
+	int n_handshake_errors;
+
 	/* When we next get available space, we should say "read" instead of
 	   "write". This can happen if there's a renegotiation during a read
 	   operation. */
@@ -309,6 +356,8 @@ struct bufferevent_openssl {
 	unsigned fd_is_set : 1;
 	/* XXX */
 	unsigned n_errors : 2;
+	/* True iff a worker thread is running SSL_do_handshake() for us. */
+	unsigned handshake_in_worker : 1;
 
 	/* Are we currently connecting, accepting, or doing IO? */
 	unsigned state : 2;
@@ -360,6 +409,35 @@ put_error(struct bufferevent_openssl *bev_ssl, unsigned long err)
 	bev_ssl->errors[bev_ssl->n_errors++] = (ev_uint32_t) err;
 }
 
+/* With BEV_OPT_RATELIM_UNDERLYING, charge our rate limits for the bytes that
+ * our BIOs have read and written since we last looked.  If 'charge' is
+ * false, just remember where their counts are now, as when we get new BIOs.
+ */
+static void
+decrement_underlying_buckets(struct bufferevent_openssl *bev_ssl, int charge)
+{
+	/* Requires lock */
+	BIO *bio;
+	ev_uint64_t n;
+
+	if (!(bev_ssl->bev.options & BEV_OPT_RATELIM_UNDERLYING))
+		return;
+	if ((bio = SSL_get_rbio(bev_ssl->ssl))) {
+		n = BIO_number_read(bio);
+		if (charge && n != bev_ssl->n_underlying_read)
+			_bufferevent_decrement_read_buckets(&bev_ssl->bev,
+			    (int)(n - bev_ssl->n_underlying_read));
+		bev_ssl->n_underlying_read = n;
+	}
+	if ((bio = SSL_get_wbio(bev_ssl->ssl))) {
+		n = BIO_number_written(bio);
+		if (charge && n != bev_ssl->n_underlying_written)
+			_bufferevent_decrement_write_buckets(&bev_ssl->bev,
+			    (int)(n - bev_ssl->n_underlying_written));
+		bev_ssl->n_underlying_written = n;
+	}
+}
+
 /* Have the base communications channel (either the underlying bufferevent or
  * ev_read and ev_write) start reading.  Take the read-blocked-on-write flag
  * into account. */
@@ -539,14 +617,15 @@ do_read(struct bufferevent_openssl *bev_ssl, int n_to_read)
 		if (bev_ssl->bev.read_suspended)
 			break;
 		r = SSL_read(bev_ssl->ssl, space[i].iov_base, space[i].iov_len);
+		decrement_underlying_buckets(bev_ssl, 1);
 		if (r>0) {
 			if (bev_ssl->read_blocked_on_write)
 				clear_rbow(bev_ssl);
 			++n_used;
 			space[i].iov_len = r;
-			/* Not exactly right; we probably want to do
-			 * our rate-limiting on the underlying bytes. */
-			_bufferevent_decrement_read_buckets(&bev_ssl->bev, r);
+			if (!(bev_ssl->bev.options & BEV_OPT_RATELIM_UNDERLYING))
+				_bufferevent_decrement_read_buckets(
+				    &bev_ssl->bev, r);
 		} else {
 			int err = SSL_get_error(bev_ssl->ssl, r);
 			print_err(err);
@@ -583,39 +662,100 @@ do_read(struct bufferevent_openssl *bev_ssl, int n_to_read)
 	return blocked ? 0 : 1;
 }
 
+/* The most plaintext that fits in one TLS record. */
+#define MAX_RECORD 16384
+/* Right after we've been idle, we send records this small, so that each
+ * fits in a single TCP segment and the peer can start decrypting as soon
+ * as it arrives... */
+#define SMALL_RECORD 1400
+/* ...until we've written this much without going idle.  Then we switch to
+ * full records, which cost less CPU and bandwidth per byte. */
+#define SMALL_RECORD_BYTES 65536
+/* We count as idle if we haven't written for this many seconds. */
+#define RECORD_IDLE_SEC 1
+
+/* Return how much plaintext to put in the next TLS record we write. */
+static int
+record_size(struct bufferevent_openssl *bev_ssl)
+{
+	struct timeval now, idle_since;
+
+	event_base_gettimeofday_cached(bev_ssl->bev.bev.ev_base, &now);
+	idle_since = now;
+	idle_since.tv_sec -= RECORD_IDLE_SEC;
+	if (evutil_timercmp(&bev_ssl->last_write_time, &idle_since, <=))
+		bev_ssl->n_written_since_idle = 0;
+	return bev_ssl->n_written_since_idle < SMALL_RECORD_BYTES ?
+	    SMALL_RECORD : MAX_RECORD;
+}
+
 static int
 do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 {
-	int i, r, n, n_written = 0, blocked=0;
+	int i, r, n, size, n_written = 0, blocked=0;
 	struct bufferevent *bev = &bev_ssl->bev.bev;
 	struct evbuffer *output = bev->output;
-	struct evbuffer_iovec space[8];
+	struct evbuffer_iovec space[64];
+	char *record;
 
 	if (bev_ssl->last_write > 0)
 		atmost = bev_ssl->last_write;
-	else
+	else if (atmost > _bufferevent_get_write_max(&bev_ssl->bev))
 		atmost = _bufferevent_get_write_max(&bev_ssl->bev);
 
-	n = evbuffer_peek(output, atmost, NULL, space, 8);
-	if (n < 0)
-		return -1;
-
-	if (n > 8)
-		n = 8;
-	for (i=0; i < n; ++i) {
+	while (n_written < atmost) {
 		if (bev_ssl->bev.write_suspended)
 			break;
 
-		r = SSL_write(bev_ssl->ssl, space[i].iov_base,
-		    space[i].iov_len);
+		/* If we're retrying a write, it has to be the same size as
+		 * before. */
+		if (bev_ssl->last_write > 0)
+			size = bev_ssl->last_write;
+		else
+			size = record_size(bev_ssl);
+		if (size > atmost - n_written)
+			size = atmost - n_written;
+
+		n = evbuffer_peek(output, size, NULL, space, 64);
+		if (n <= 0)
+			break;
+		if (n == 1 || space[0].iov_len >= (size_t)size) {
+			/* The record is all in one chain: no need to copy. */
+			record = space[0].iov_base;
+			if (space[0].iov_len < (size_t)size)
+				size = space[0].iov_len;
+		} else {
+			/* Gather as much of the record as we peeked at. */
+			if (!bev_ssl->record_buf &&
+			    !(bev_ssl->record_buf = mm_malloc(MAX_RECORD)))
+				return -1;
+			record = bev_ssl->record_buf;
+			if (n > 64)
+				n = 64;
+			for (i = 0, r = 0; i < n && r < size; ++i) {
+				size_t len = space[i].iov_len;
+				if (len > (size_t)(size - r))
+					len = size - r;
+				memcpy(record + r, space[i].iov_base, len);
+				r += len;
+			}
+			size = r;
+		}
+
+		r = SSL_write(bev_ssl->ssl, record, size);
+		decrement_underlying_buckets(bev_ssl, 1);
 		if (r > 0) {
 			if (bev_ssl->write_blocked_on_read)
 				clear_wbor(bev_ssl);
+			evbuffer_drain(output, r);
 			n_written += r;
+			bev_ssl->n_written_since_idle += r;
+			event_base_gettimeofday_cached(bev->ev_base,
+			    &bev_ssl->last_write_time);
 			bev_ssl->last_write = -1;
-			/* Not exactly right; we probably want to do
-			 * our rate-limiting on the underlying bytes. */
-			_bufferevent_decrement_write_buckets(&bev_ssl->bev, r);
+			if (!(bev_ssl->bev.options & BEV_OPT_RATELIM_UNDERLYING))
+				_bufferevent_decrement_write_buckets(
+				    &bev_ssl->bev, r);
 		} else {
 			int err = SSL_get_error(bev_ssl->ssl, r);
 			print_err(err);
@@ -624,14 +764,14 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 				/* Can't read until underlying has more data. */
 				if (bev_ssl->write_blocked_on_read)
 					clear_wbor(bev_ssl);
-				bev_ssl->last_write = space[i].iov_len;
+				bev_ssl->last_write = size;
 				break;
 			case SSL_ERROR_WANT_READ:
 				/* This read operation requires a write, and the
 				 * underlying is full */
 				if (!bev_ssl->write_blocked_on_read)
 					set_wbor(bev_ssl);
-				bev_ssl->last_write = space[i].iov_len;
+				bev_ssl->last_write = size;
 				break;
 			default:
 				conn_closed(bev_ssl, err, r);
@@ -643,7 +783,6 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 		}
 	}
 	if (n_written) {
-		evbuffer_drain(output, n_written);
 		if (bev_ssl->underlying)
 			BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
 
@@ -653,7 +792,7 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 	return blocked ? 0 : 1;
 }
 
-#define WRITE_FRAME 15000
+#define WRITE_FRAME MAX_RECORD
 
 #define READ_DEFAULT 4096
 
@@ -703,7 +842,7 @@ consider_writing(struct bufferevent_openssl *bev_ssl)
 	if (bev_ssl->read_blocked_on_write)
 		return;
 	if (bev_ssl->underlying) {
-		target = bev_ssl->underlying->output;
+		target = bufferevent_get_output(bev_ssl->underlying);
 		wm = &bev_ssl->underlying->wm_write;
 	}
 	while ((bev_ssl->bev.bev.enabled & EV_WRITE) &&
@@ -818,24 +957,387 @@ set_open_callbacks(struct bufferevent_openssl *bev_ssl, evutil_socket_t fd)
 	}
 }
 
-static int
-do_handshake(struct bufferevent_openssl *bev_ssl)
+/* --------------------
+   A client session cache.  We remember the session from each full
+   handshake under the name and port of the server it was with, so that
+   the next bufferevent connecting there can resume it.  The cache is a
+   list kept in least-recently-used order; it's meant to be small.
+   -------------------- */
+
+struct session_cache_entry {
+	TAILQ_ENTRY(session_cache_entry) next;
+	char *host;
+	int port;
+	SSL_SESSION *session;
+	/* When we stop offering this session. */
+	struct timeval expires;
+};
+
+struct bufferevent_openssl_session_cache {
+	/* Most recently used first. */
+	TAILQ_HEAD(session_cache_entryq, session_cache_entry) entries;
+	int n_entries;
+	int max_entries;
+	int ttl_secs;
+
+	ev_uint64_t n_resumed;
+	ev_uint64_t n_full;
+
+	void *lock;
+};
+
+struct bufferevent_openssl_session_cache *
+bufferevent_openssl_session_cache_new(int max_sessions, int ttl_secs)
 {
+	struct bufferevent_openssl_session_cache *cache;
+
+	if (max_sessions <= 0 || ttl_secs <= 0)
+		return NULL;
+	if (!(cache = mm_calloc(1, sizeof(*cache))))
+		return NULL;
+	TAILQ_INIT(&cache->entries);
+	cache->max_entries = max_sessions;
+	cache->ttl_secs = ttl_secs;
+	EVTHREAD_ALLOC_LOCK(cache->lock, 0);
+	return cache;
+}
+
+/* Requires lock */
+static void
+session_cache_remove(struct bufferevent_openssl_session_cache *cache,
+    struct session_cache_entry *ent)
+{
+	TAILQ_REMOVE(&cache->entries, ent, next);
+	--cache->n_entries;
+	SSL_SESSION_free(ent->session);
+	mm_free(ent->host);
+	mm_free(ent);
+}
+
+void
+bufferevent_openssl_session_cache_free(
+	struct bufferevent_openssl_session_cache *cache)
+{
+	while (!TAILQ_EMPTY(&cache->entries))
+		session_cache_remove(cache, TAILQ_FIRST(&cache->entries));
+	EVTHREAD_FREE_LOCK(cache->lock, 0);
+	mm_free(cache);
+}
+
+/* Requires lock.  Return the entry for host:port, forgetting it instead if
+ * it has expired. */
+static struct session_cache_entry *
+session_cache_find(struct bufferevent_openssl_session_cache *cache,
+    const char *host, int port)
+{
+	struct session_cache_entry *ent;
+	struct timeval now;
+
+	TAILQ_FOREACH(ent, &cache->entries, next) {
+		if (ent->port == port && !strcmp(ent->host, host))
+			break;
+	}
+	if (!ent)
+		return NULL;
+	evutil_gettimeofday(&now, NULL);
+	if (evutil_timercmp(&ent->expires, &now, <=)) {
+		session_cache_remove(cache, ent);
+		return NULL;
+	}
+	return ent;
+}
+
+/* Requires lock.  Remember the session that ssl just negotiated with
+ * host:port. */
+static void
+session_cache_store(struct bufferevent_openssl_session_cache *cache,
+    const char *host, int port, SSL *ssl)
+{
+	struct session_cache_entry *ent;
+	SSL_SESSION *session;
+
+	if (!(session = SSL_get1_session(ssl)))
+		return;
+	if ((ent = session_cache_find(cache, host, port))) {
+		SSL_SESSION_free(ent->session);
+		TAILQ_REMOVE(&cache->entries, ent, next);
+	} else {
+		if (cache->n_entries == cache->max_entries)
+			session_cache_remove(cache,
+			    TAILQ_LAST(&cache->entries, session_cache_entryq));
+		if (!(ent = mm_calloc(1, sizeof(*ent))) ||
+		    !(ent->host = mm_strdup(host))) {
+			if (ent)
+				mm_free(ent);
+			SSL_SESSION_free(session);
+			return;
+		}
+		ent->port = port;
+		++cache->n_entries;
+	}
+	ent->session = session;
+	evutil_gettimeofday(&ent->expires, NULL);
+	ent->expires.tv_sec += cache->ttl_secs;
+	TAILQ_INSERT_HEAD(&cache->entries, ent, next);
+}
+
+int
+bufferevent_openssl_set_session_cache(struct bufferevent *bev,
+    struct bufferevent_openssl_session_cache *cache,
+    const char *host, int port)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+	struct session_cache_entry *ent;
+	char *host_copy;
+	int r = -1;
+
+	if (!bev_ssl)
+		return -1;
+	BEV_LOCK(bev);
+	if (bev_ssl->state != BUFFEREVENT_SSL_CONNECTING ||
+	    !SSL_in_before(bev_ssl->ssl) || bev_ssl->session_cache)
+		goto done;
+	if (!(host_copy = mm_strdup(host)))
+		goto done;
+
+	EVLOCK_LOCK(cache->lock, 0);
+	if ((ent = session_cache_find(cache, host, port))) {
+		/* Offer the session, and note that we used it. */
+		SSL_set_session(bev_ssl->ssl, ent->session);
+		TAILQ_REMOVE(&cache->entries, ent, next);
+		TAILQ_INSERT_HEAD(&cache->entries, ent, next);
+	}
+	EVLOCK_UNLOCK(cache->lock, 0);
+
+	bev_ssl->session_cache = cache;
+	bev_ssl->session_host = host_copy;
+	bev_ssl->session_port = port;
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+void
+bufferevent_openssl_session_cache_get_counts(
+	struct bufferevent_openssl_session_cache *cache,
+	ev_uint64_t *n_resumed_out, ev_uint64_t *n_full_out)
+{
+	EVLOCK_LOCK(cache->lock, 0);
+	*n_resumed_out = cache->n_resumed;
+	*n_full_out = cache->n_full;
+	EVLOCK_UNLOCK(cache->lock, 0);
+}
+
+/* Our first handshake just finished: count it, and remember its session if
+ * it didn't resume one.  We don't count renegotiations. */
+static void
+handshake_done_with_cache(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent_openssl_session_cache *cache = bev_ssl->session_cache;
+
+	EVLOCK_LOCK(cache->lock, 0);
+	if (SSL_session_reused(bev_ssl->ssl)) {
+		++cache->n_resumed;
+	} else {
+		++cache->n_full;
+		session_cache_store(cache, bev_ssl->session_host,
+		    bev_ssl->session_port, bev_ssl->ssl);
+	}
+	EVLOCK_UNLOCK(cache->lock, 0);
+	bev_ssl->session_cache = NULL;
+}
+
+/* --------------------
+   A handshake pool.  The public-key operations in a handshake take long
+   enough that a burst of new connections can stall everything else on the
+   event loop, so we can give each step of a handshake to a pool of worker
+   threads instead.  A worker takes over the SSL, runs SSL_do_handshake()
+   on it, and schedules a deferred callback to tell the bufferevent what
+   happened.  Meanwhile, the bufferevent leaves the SSL and its socket
+   alone.
+
+   We only do this for bufferevents on a socket: a filtering bufferevent's
+   SSL would touch the underlying bufferevent from the worker thread.
+   -------------------- */
+
+#ifdef USE_HANDSHAKE_POOL
+struct bufferevent_openssl_handshake_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Bufferevents waiting for a worker. */
+	TAILQ_HEAD(handshake_jobq, bufferevent_openssl) jobs;
+	int shutting_down;
+
+	pthread_t *threads;
+	int n_threads;
+};
+
+static void *
+handshake_worker(void *arg)
+{
+	struct bufferevent_openssl_handshake_pool *pool = arg;
+	struct bufferevent_openssl *bev_ssl;
+	unsigned long err;
 	int r;
 
-	switch (bev_ssl->state) {
-	default:
-	case BUFFEREVENT_SSL_OPEN:
-		EVUTIL_ASSERT(0);
-		break;
-	case BUFFEREVENT_SSL_CONNECTING:
-	case BUFFEREVENT_SSL_ACCEPTING:
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&pool->jobs) && !pool->shutting_down)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (TAILQ_EMPTY(&pool->jobs))
+			break;
+		bev_ssl = TAILQ_FIRST(&pool->jobs);
+		TAILQ_REMOVE(&pool->jobs, bev_ssl, handshake_next);
+		pthread_mutex_unlock(&pool->lock);
+
 		r = SSL_do_handshake(bev_ssl->ssl);
-		break;
+		bev_ssl->handshake_result = r;
+		bev_ssl->handshake_err =
+		    r == 1 ? SSL_ERROR_NONE : SSL_get_error(bev_ssl->ssl, r);
+		/* OpenSSL's error queue belongs to this thread, so we need to
+		 * carry its contents back to the bufferevent. */
+		bev_ssl->n_handshake_errors = 0;
+		while ((err = ERR_get_error())) {
+			if (bev_ssl->n_handshake_errors < NUM_ERRORS)
+				bev_ssl->handshake_errors[
+					bev_ssl->n_handshake_errors++] = err;
+		}
+		/* Once this is scheduled, the bufferevent isn't ours. */
+		event_deferred_cb_schedule(
+		    event_base_get_deferred_cb_queue(bev_ssl->bev.bev.ev_base),
+		    &bev_ssl->handshake_done);
+
+		pthread_mutex_lock(&pool->lock);
 	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+#endif
+
+struct bufferevent_openssl_handshake_pool *
+bufferevent_openssl_handshake_pool_new(int n_threads)
+{
+#ifdef USE_HANDSHAKE_POOL
+	struct bufferevent_openssl_handshake_pool *pool;
+	int i;
+
+	if (n_threads <= 0)
+		return NULL;
+	if (!(pool = mm_calloc(1, sizeof(*pool))))
+		return NULL;
+	if (!(pool->threads = mm_calloc(n_threads, sizeof(pthread_t)))) {
+		mm_free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	TAILQ_INIT(&pool->jobs);
+	for (i = 0; i < n_threads; ++i) {
+		if (pthread_create(&pool->threads[i], NULL, handshake_worker,
+			pool)) {
+			event_warnx("%s: couldn't start a worker thread",
+			    __func__);
+			bufferevent_openssl_handshake_pool_free(pool);
+			return NULL;
+		}
+		++pool->n_threads;
+	}
+	return pool;
+#else
+	return NULL;
+#endif
+}
+
+void
+bufferevent_openssl_handshake_pool_free(
+	struct bufferevent_openssl_handshake_pool *pool)
+{
+#ifdef USE_HANDSHAKE_POOL
+	int i;
+
+	/* The workers finish any handshake steps still queued before they
+	 * exit. */
+	pthread_mutex_lock(&pool->lock);
+	pool->shutting_down = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->n_threads; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	mm_free(pool->threads);
+	mm_free(pool);
+#endif
+}
+
+int
+bufferevent_openssl_set_handshake_pool(struct bufferevent *bev,
+    struct bufferevent_openssl_handshake_pool *pool)
+{
+#ifdef USE_HANDSHAKE_POOL
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+	int r = -1;
+
+	if (!bev_ssl || !pool)
+		return -1;
+	BEV_LOCK(bev);
+	/* Without locking, a worker can't wake up the event loop. */
+	if (!bev_ssl->underlying &&
+	    bev_ssl->state != BUFFEREVENT_SSL_OPEN &&
+	    EVBASE_USING_LOCKS(bev->ev_base)) {
+		bev_ssl->handshake_pool = pool;
+		r = 0;
+	}
+	BEV_UNLOCK(bev);
+	return r;
+#else
+	return -1;
+#endif
+}
+
+#ifdef USE_HANDSHAKE_POOL
+static void
+be_openssl_handshake_keepalive_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+/* Give the next step of our handshake to a worker thread.  Till it's done,
+ * we stop watching our socket: the worker will read or write it as
+ * needed. */
+static void
+handshake_pool_submit(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent_openssl_handshake_pool *pool =
+	    bev_ssl->handshake_pool;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	struct timeval one_hour = { 3600, 0 };
+
+	if (bev_ssl->handshake_in_worker)
+		return;
+	event_del(&bev->ev_read);
+	event_del(&bev->ev_write);
+	event_add(&bev_ssl->handshake_keepalive, &one_hour);
+	bev_ssl->handshake_in_worker = 1;
+	bufferevent_incref(bev);
+
+	pthread_mutex_lock(&pool->lock);
+	TAILQ_INSERT_TAIL(&pool->jobs, bev_ssl, handshake_next);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+#endif
 
+/* Act on the result of a call to SSL_do_handshake(): r is what it
+ * returned, and err is what SSL_get_error() made of that. */
+static int
+handshake_step_done(struct bufferevent_openssl *bev_ssl, int r, int err)
+{
 	if (r==1) {
 		/* We're done! */
+		if (bev_ssl->session_cache)
+			handshake_done_with_cache(bev_ssl);
 		bev_ssl->state = BUFFEREVENT_SSL_OPEN;
 		set_open_callbacks(bev_ssl, -1);
 		/* Call do_read and do_write as needed */
@@ -844,7 +1346,6 @@ do_handshake(struct bufferevent_openssl *bev_ssl)
 		    BEV_EVENT_CONNECTED);
 		return 1;
 	} else {
-		int err = SSL_get_error(bev_ssl->ssl, r);
 		print_err(err);
 		switch (err) {
 		case SSL_ERROR_WANT_WRITE:
@@ -866,6 +1367,59 @@ do_handshake(struct bufferevent_openssl *bev_ssl)
 	}
 }
 
+#ifdef USE_HANDSHAKE_POOL
+static void
+be_openssl_handshake_done_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+	int i, r;
+
+	BEV_LOCK(&bev_ssl->bev.bev);
+	bev_ssl->handshake_in_worker = 0;
+	event_del(&bev_ssl->handshake_keepalive);
+	decrement_underlying_buckets(bev_ssl, 1);
+	for (i = 0; i < bev_ssl->n_handshake_errors; ++i)
+		put_error(bev_ssl, bev_ssl->handshake_errors[i]);
+	r = bev_ssl->handshake_result;
+	/* conn_closed() takes an I/O error with an empty error queue to be a
+	 * dirty shutdown, but the worker has emptied the queue already. */
+	if (r == 0 && bev_ssl->n_handshake_errors)
+		r = -1;
+	/* If the user freed the bufferevent while the worker had it, they
+	 * won't want to hear how it went. */
+	if (!bev_ssl->bev.freed)
+		handshake_step_done(bev_ssl, r, bev_ssl->handshake_err);
+	_bufferevent_decref_and_unlock(&bev_ssl->bev.bev);
+}
+#endif
+
+static int
+do_handshake(struct bufferevent_openssl *bev_ssl)
+{
+	int r;
+
+	switch (bev_ssl->state) {
+	default:
+	case BUFFEREVENT_SSL_OPEN:
+		EVUTIL_ASSERT(0);
+		break;
+	case BUFFEREVENT_SSL_CONNECTING:
+	case BUFFEREVENT_SSL_ACCEPTING:
+#ifdef USE_HANDSHAKE_POOL
+		if (bev_ssl->handshake_pool) {
+			handshake_pool_submit(bev_ssl);
+			return 0;
+		}
+#endif
+		r = SSL_do_handshake(bev_ssl->ssl);
+		decrement_underlying_buckets(bev_ssl, 1);
+		break;
+	}
+
+	return handshake_step_done(bev_ssl, r,
+	    r == 1 ? SSL_ERROR_NONE : SSL_get_error(bev_ssl->ssl, r));
+}
+
 static void
 be_openssl_handshakecb(struct bufferevent *bev_base, void *ctx)
 {
@@ -894,7 +1448,6 @@ set_handshake_callbacks(struct bufferevent_openssl *bev_ssl, evutil_socket_t fd)
 		    be_openssl_handshakecb, be_openssl_handshakecb,
 		    be_openssl_eventcb,
 		    bev_ssl);
-		do_handshake(bev_ssl);
 	} else {
 		struct bufferevent *bev = &bev_ssl->bev.bev;
 		if (fd < 0 && bev_ssl->fd_is_set)
@@ -925,23 +1478,42 @@ bufferevent_ssl_renegotiate(struct bufferevent *bev)
 		return -1;
 	bev_ssl->state = BUFFEREVENT_SSL_CONNECTING;
 	set_handshake_callbacks(bev_ssl, -1);
-	if (!bev_ssl->underlying)
-		do_handshake(bev_ssl);
+	do_handshake(bev_ssl);
 	return 0;
 }
 
+static void
+be_openssl_deferred_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+
+	BEV_LOCK(&bev_ssl->bev.bev);
+	if (bev_ssl->state == BUFFEREVENT_SSL_OPEN)
+		consider_writing(bev_ssl);
+	else
+		do_handshake(bev_ssl);
+	_bufferevent_decref_and_unlock(&bev_ssl->bev.bev);
+}
+
 static void
 be_openssl_outbuf_cb(struct evbuffer *buf,
         const struct evbuffer_cb_info *cbinfo, void *arg)
 {
 	struct bufferevent_openssl *bev_ssl = arg;
-	/* XXX need to hold a reference here. */
 
 	if (cbinfo->n_added && bev_ssl->state == BUFFEREVENT_SSL_OPEN) {
 		if (cbinfo->orig_size == 0)
 			_bufferevent_add_event(&bev_ssl->bev.bev.ev_write,
 			    &bev_ssl->bev.bev.timeout_write);
-		consider_writing(bev_ssl);
+		/* Don't write yet: wait till the end of this loop iteration,
+		 * so that lots of small writes can share a TLS record. */
+		if (!bev_ssl->deferred.queued) {
+			bufferevent_incref(&bev_ssl->bev.bev);
+			event_deferred_cb_schedule(
+			    event_base_get_deferred_cb_queue(
+				    bev_ssl->bev.bev.ev_base),
+			    &bev_ssl->deferred);
+		}
 	}
 }
 
@@ -1004,8 +1576,22 @@ be_openssl_destruct(struct bufferevent *bev)
 			bufferevent_free(bev_ssl->underlying);
 			bev_ssl->underlying = NULL;
 		}
+		/* OpenSSL won't let anybody resume a session whose connection
+		 * was freed without shutting down, so if we got as far as
+		 * putting our session in a cache, and nothing went wrong,
+		 * shut down quietly to keep it good. */
+		if (bev_ssl->session_host &&
+		    bev_ssl->state == BUFFEREVENT_SSL_OPEN &&
+		    !bev_ssl->n_errors) {
+			SSL_set_quiet_shutdown(bev_ssl->ssl, 1);
+			SSL_shutdown(bev_ssl->ssl);
+		}
 		SSL_free(bev_ssl->ssl);
 	}
+	if (bev_ssl->record_buf)
+		mm_free(bev_ssl->record_buf);
+	if (bev_ssl->session_host)
+		mm_free(bev_ssl->session_host);
 }
 
 static void
@@ -1040,6 +1626,9 @@ be_openssl_ctrl(struct bufferevent *bev,
 	case BEV_CTRL_SET_FD:
 		if (bev_ssl->underlying)
 			return -1;
+		/* A worker thread is using our SSL and its BIO. */
+		if (bev_ssl->handshake_in_worker)
+			return -1;
 		{
 			int flag = 0;
 			BIO *bio;
@@ -1047,6 +1636,7 @@ be_openssl_ctrl(struct bufferevent *bev,
 				flag = 1;
 			bio = BIO_new_socket(data->fd, flag);
 			SSL_set_bio(bev_ssl->ssl, bio, bio);
+			decrement_underlying_buckets(bev_ssl, 0);
 			bev_ssl->fd_is_set = 1;
 		}
 		if (bev_ssl->state == BUFFEREVENT_SSL_OPEN)
@@ -1114,6 +1704,14 @@ bufferevent_openssl_new_impl(struct event_base *base,
 
 	bev_ssl->outbuf_cb = evbuffer_add_cb(bev_p->bev.output,
 	    be_openssl_outbuf_cb, bev_ssl);
+	event_deferred_cb_init(&bev_ssl->deferred,
+	    be_openssl_deferred_cb, bev_ssl);
+#ifdef USE_HANDSHAKE_POOL
+	event_deferred_cb_init(&bev_ssl->handshake_done,
+	    be_openssl_handshake_done_cb, bev_ssl);
+	event_assign(&bev_ssl->handshake_keepalive, base, -1, EV_PERSIST,
+	    be_openssl_handshake_keepalive_cb, bev_ssl);
+#endif
 
 	if (options & BEV_OPT_THREADSAFE)
 		bufferevent_enable_locking(&bev_ssl->bev.bev, NULL);
@@ -1125,6 +1723,7 @@ bufferevent_openssl_new_impl(struct event_base *base,
 
 	bev_ssl->state = state;
 	bev_ssl->last_write = -1;
+	decrement_underlying_buckets(bev_ssl, 0);
 
 	switch (state) {
 	case BUFFEREVENT_SSL_ACCEPTING:
@@ -1142,9 +1741,18 @@ bufferevent_openssl_new_impl(struct event_base *base,
 		goto err;
 	}
 
-	if (underlying)
+	if (underlying) {
 		bufferevent_enable(underlying, EV_READ|EV_WRITE);
-	else {
+		if (state != BUFFEREVENT_SSL_OPEN) {
+			/* Start the handshake once we're back in the loop, so
+			 * that the caller can still set up the SSL (say, with
+			 * bufferevent_openssl_set_session_cache()). */
+			bufferevent_incref(&bev_ssl->bev.bev);
+			event_deferred_cb_schedule(
+			    event_base_get_deferred_cb_queue(base),
+			    &bev_ssl->deferred);
+		}
+	} else {
 		bev_ssl->bev.bev.enabled = EV_READ|EV_WRITE;
 		if (bev_ssl->fd_is_set) {
 			/* XXX Is this quite right? */
@@ -39,6 +39,7 @@
 #include "event2/event.h"
 #include "defer-internal.h"
 #include "bufferevent-internal.h"
+#include "evthread-internal.h"
 #include "mm-internal.h"
 #include "util-internal.h"
 
@@ -300,3 +301,415 @@ const struct bufferevent_ops bufferevent_ops_pair = {
 	be_pair_flush,
 	NULL, /* ctrl */
 };
+
+/* Cross-base pairs.
+ *
+ * The two ends of a cross-base pair live on different event_bases, which
+ * usually means different threads, so neither end may touch the other's
+ * buffers.  Instead, each direction has its own evbuffer_handoff: the
+ * writing end pushes its output into the handoff, and schedules a deferred
+ * callback on the reading end's base, which pulls the data into the
+ * reading end's input.  The data itself moves without any locks; the
+ * shared lock only guards the wakeups, and the ends' lifetimes.
+ *
+ * For flow control, the writing end stops pushing once the reading end's
+ * read high-water mark's worth of data is waiting in the handoff, and asks
+ * to be woken.  The reading end, for its part, stops pulling while its
+ * input is above its high-water mark, and wakes the writing end whenever
+ * it pulls.
+ */
+
+struct bufferevent_cross_pair;
+
+/* The state shared by the two ends of a cross-base pair. */
+struct cross_pair_shared {
+	/* Guards every other field here.  The handoff queues need no
+	 * locking. */
+	void *lock;
+	/* The two ends; set to NULL when an end is freed. */
+	struct bufferevent_cross_pair *ends[2];
+	/* queue[i] carries the data that ends[i] writes to ends[!i]. */
+	struct evbuffer_handoff *queue[2];
+	/* True iff ends[i] stopped pushing because its peer is full, and
+	 * wants waking when the peer pulls. */
+	unsigned writer_blocked[2];
+	/* True iff ends[i] will write no more: once its peer has read
+	 * everything, the peer gets an EOF. */
+	unsigned closed[2];
+	/* How many ends are still using this structure. */
+	int refcnt;
+};
+
+struct bufferevent_cross_pair {
+	struct bufferevent_private bev;
+	struct cross_pair_shared *shared;
+	/* Which of shared->ends we are. */
+	int idx;
+	/* Holds the part of our output that our peer has room for, when it
+	 * doesn't have room for all of it. */
+	struct evbuffer *staging;
+	/* Runs on our base when our peer has written to us. */
+	struct deferred_cb read_more;
+	/* Runs on our base when our peer has room for more data. */
+	struct deferred_cb write_more;
+	/* True iff we have told the user about our peer's EOF. */
+	unsigned eof_reported : 1;
+};
+
+static inline struct bufferevent_cross_pair *
+upcast_cross(struct bufferevent *bev)
+{
+	struct bufferevent_cross_pair *bev_c;
+	if (bev->be_ops != &bufferevent_ops_pair_cross)
+		return NULL;
+	bev_c = EVUTIL_UPCAST(bev, struct bufferevent_cross_pair, bev.bev);
+	EVUTIL_ASSERT(bev_c->bev.bev.be_ops == &bufferevent_ops_pair_cross);
+	return bev_c;
+}
+
+/* Schedule a deferred callback belonging to end on end's base.  The caller
+ * must hold the shared lock, and end must not have been freed. */
+static inline void
+be_cross_schedule(struct bufferevent_cross_pair *end, struct deferred_cb *cb)
+{
+	event_deferred_cb_schedule(
+		event_base_get_deferred_cb_queue(downcast(end)->ev_base), cb);
+}
+
+/* Move our output to our peer, if it has room for it. */
+static void
+be_cross_push(struct bufferevent_cross_pair *bev_c, int ignore_wm)
+{
+	struct bufferevent *bev = downcast(bev_c);
+	struct cross_pair_shared *shared = bev_c->shared;
+	struct evbuffer_handoff *queue = shared->queue[bev_c->idx];
+	struct bufferevent_cross_pair *peer;
+	struct evbuffer *src = bev->output;
+	size_t high, queued, room = 0;
+	int r;
+
+	if (!evbuffer_get_length(bev->output))
+		return;
+
+	EVLOCK_LOCK(shared->lock, 0);
+	peer = shared->ends[!bev_c->idx];
+	if (!peer || shared->closed[bev_c->idx]) {
+		EVLOCK_UNLOCK(shared->lock, 0);
+		return;
+	}
+	/* The peer may change its watermark at any time; a stale value is
+	 * good enough here. */
+	high = ignore_wm ? 0 : downcast(peer)->wm_read.high;
+	if (high) {
+		queued = evbuffer_handoff_get_length(queue);
+		if (queued >= high) {
+			shared->writer_blocked[bev_c->idx] = 1;
+			EVLOCK_UNLOCK(shared->lock, 0);
+			return;
+		}
+		room = high - queued;
+		/* If we can't hand over everything, we'll want to hand
+		 * over the rest once there's room for it. */
+		if (room < evbuffer_get_length(bev->output))
+			shared->writer_blocked[bev_c->idx] = 1;
+	}
+	EVLOCK_UNLOCK(shared->lock, 0);
+
+	evbuffer_unfreeze(bev->output, 1);
+	if (room && room < evbuffer_get_length(bev->output)) {
+		evbuffer_remove_buffer(bev->output, bev_c->staging, room);
+		src = bev_c->staging;
+	}
+	r = evbuffer_handoff_push(queue, src);
+	evbuffer_freeze(bev->output, 1);
+	if (r < 0) {
+		_bufferevent_run_eventcb(bev, BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+		return;
+	}
+
+	EVLOCK_LOCK(shared->lock, 0);
+	if ((peer = shared->ends[!bev_c->idx]) != NULL)
+		be_cross_schedule(peer, &peer->read_more);
+	EVLOCK_UNLOCK(shared->lock, 0);
+
+	BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
+	if (evbuffer_get_length(bev->output) <= bev->wm_write.low)
+		_bufferevent_run_writecb(bev);
+}
+
+/* Move whatever our peer has written to us into our input, if we're
+ * reading and have room for it. */
+static void
+be_cross_pull(struct bufferevent_cross_pair *bev_c, int ignore_wm)
+{
+	struct bufferevent *bev = downcast(bev_c);
+	struct cross_pair_shared *shared = bev_c->shared;
+	struct evbuffer_handoff *queue = shared->queue[!bev_c->idx];
+	struct bufferevent_cross_pair *peer;
+	size_t n;
+	int eof;
+
+	if (!ignore_wm) {
+		if (!(bev->enabled & EV_READ) || bev_c->bev.read_suspended)
+			return;
+		if (bev->wm_read.high &&
+		    evbuffer_get_length(bev->input) >= bev->wm_read.high)
+			return;
+	}
+
+	evbuffer_unfreeze(bev->input, 0);
+	n = evbuffer_handoff_pull(queue, bev->input);
+	evbuffer_freeze(bev->input, 0);
+
+	EVLOCK_LOCK(shared->lock, 0);
+	peer = shared->ends[!bev_c->idx];
+	if (peer && shared->writer_blocked[!bev_c->idx]) {
+		shared->writer_blocked[!bev_c->idx] = 0;
+		be_cross_schedule(peer, &peer->write_more);
+	}
+	/* The peer closes only after its last push, so if it has closed
+	 * and the queue is empty, we have seen everything. */
+	eof = shared->closed[!bev_c->idx] && !bev_c->eof_reported &&
+	    evbuffer_handoff_get_length(queue) == 0;
+	EVLOCK_UNLOCK(shared->lock, 0);
+
+	if (n) {
+		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
+		if (evbuffer_get_length(bev->input) >= bev->wm_read.low)
+			_bufferevent_run_readcb(bev);
+	}
+	if (eof) {
+		bev_c->eof_reported = 1;
+		_bufferevent_run_eventcb(bev, BEV_EVENT_READING|BEV_EVENT_EOF);
+	}
+}
+
+static void
+be_cross_read_more_cb(struct deferred_cb *cb, void *arg)
+{
+	struct bufferevent_cross_pair *bev_c = arg;
+
+	_bufferevent_incref_and_lock(downcast(bev_c));
+	be_cross_pull(bev_c, 0);
+	_bufferevent_decref_and_unlock(downcast(bev_c));
+}
+
+static void
+be_cross_write_more_cb(struct deferred_cb *cb, void *arg)
+{
+	struct bufferevent_cross_pair *bev_c = arg;
+
+	_bufferevent_incref_and_lock(downcast(bev_c));
+	if (downcast(bev_c)->enabled & EV_WRITE)
+		be_cross_push(bev_c, 0);
+	_bufferevent_decref_and_unlock(downcast(bev_c));
+}
+
+static void
+be_cross_outbuf_cb(struct evbuffer *outbuf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct bufferevent_cross_pair *bev_c = arg;
+	struct bufferevent *bev = downcast(bev_c);
+
+	/* Pushing to the handoff drains the output, and calls us again;
+	 * ignore that. */
+	if (!info->n_added)
+		return;
+
+	_bufferevent_incref_and_lock(bev);
+	if (bev->enabled & EV_WRITE)
+		be_cross_push(bev_c, 0);
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static struct bufferevent_cross_pair *
+bufferevent_cross_pair_elt_new(struct event_base *base, int options,
+    struct cross_pair_shared *shared, int idx)
+{
+	struct bufferevent_cross_pair *bufev;
+	if (!(bufev = mm_calloc(1, sizeof(struct bufferevent_cross_pair))))
+		return NULL;
+	if (bufferevent_init_common(&bufev->bev, base,
+		&bufferevent_ops_pair_cross, options)) {
+		mm_free(bufev);
+		return NULL;
+	}
+	bufev->shared = shared;
+	bufev->idx = idx;
+	shared->ends[idx] = bufev;
+	++shared->refcnt;
+	event_deferred_cb_init(&bufev->read_more, be_cross_read_more_cb,
+	    bufev);
+	event_deferred_cb_init(&bufev->write_more, be_cross_write_more_cb,
+	    bufev);
+	_bufferevent_init_generic_timeout_cbs(&bufev->bev.bev);
+
+	if (!(bufev->staging = evbuffer_new()) ||
+	    !evbuffer_add_cb(bufev->bev.bev.output, be_cross_outbuf_cb,
+		bufev)) {
+		bufferevent_free(downcast(bufev));
+		return NULL;
+	}
+
+	evbuffer_freeze(bufev->bev.bev.input, 0);
+	evbuffer_freeze(bufev->bev.bev.output, 1);
+
+	return bufev;
+}
+
+static void
+cross_pair_shared_free(struct cross_pair_shared *shared)
+{
+	if (shared->queue[0])
+		evbuffer_handoff_free(shared->queue[0]);
+	if (shared->queue[1])
+		evbuffer_handoff_free(shared->queue[1]);
+	EVTHREAD_FREE_LOCK(shared->lock, 0);
+	mm_free(shared);
+}
+
+int
+bufferevent_pair_new_cross_base(struct event_base *base1,
+    struct event_base *base2, int options, struct bufferevent *pair[2])
+{
+	struct cross_pair_shared *shared;
+	struct bufferevent_cross_pair *bufev1, *bufev2;
+
+	if (!(shared = mm_calloc(1, sizeof(struct cross_pair_shared))))
+		return -1;
+	EVTHREAD_ALLOC_LOCK(shared->lock, 0);
+	/* Hold a reference of our own until both ends exist, so that
+	 * freeing a half-built pair doesn't free the shared state. */
+	shared->refcnt = 1;
+	shared->queue[0] = evbuffer_handoff_new();
+	shared->queue[1] = evbuffer_handoff_new();
+	if (!shared->queue[0] || !shared->queue[1])
+		goto err;
+
+	/* As with a same-base pair, we always defer callbacks, so that a
+	 * write can't call back into the user's code. */
+	options |= BEV_OPT_DEFER_CALLBACKS;
+
+	if (!(bufev1 = bufferevent_cross_pair_elt_new(base1, options,
+		    shared, 0)))
+		goto err;
+	if (!(bufev2 = bufferevent_cross_pair_elt_new(base2, options,
+		    shared, 1))) {
+		bufferevent_free(downcast(bufev1));
+		goto err;
+	}
+	--shared->refcnt;
+
+	pair[0] = downcast(bufev1);
+	pair[1] = downcast(bufev2);
+
+	return 0;
+err:
+	if (--shared->refcnt == 0)
+		cross_pair_shared_free(shared);
+	return -1;
+}
+
+static int
+be_cross_enable(struct bufferevent *bev, short events)
+{
+	struct bufferevent_cross_pair *bev_c = upcast_cross(bev);
+
+	_bufferevent_incref_and_lock(bev);
+	_bufferevent_generic_adj_timeouts(bev);
+	if (events & EV_READ)
+		be_cross_pull(bev_c, 0);
+	if (events & EV_WRITE)
+		be_cross_push(bev_c, 0);
+	_bufferevent_decref_and_unlock(bev);
+	return 0;
+}
+
+static int
+be_cross_disable(struct bufferevent *bev, short events)
+{
+	_bufferevent_generic_adj_timeouts(bev);
+	return 0;
+}
+
+static void
+be_cross_destruct(struct bufferevent *bev)
+{
+	struct bufferevent_cross_pair *bev_c = upcast_cross(bev);
+	struct cross_pair_shared *shared = bev_c->shared;
+	struct deferred_cb_queue *queue =
+	    event_base_get_deferred_cb_queue(bev->ev_base);
+	struct bufferevent_cross_pair *peer;
+	int push, last;
+
+	/* Hand over whatever output flow control was holding back, so that
+	 * our peer reads everything we were asked to write before it sees
+	 * the EOF.  We can't use be_cross_push() here: it may run our
+	 * callbacks, and we have no references left. */
+	EVLOCK_LOCK(shared->lock, 0);
+	push = shared->ends[!bev_c->idx] && !shared->closed[bev_c->idx];
+	EVLOCK_UNLOCK(shared->lock, 0);
+	if (push && evbuffer_get_length(bev->output)) {
+		evbuffer_unfreeze(bev->output, 1);
+		evbuffer_handoff_push(shared->queue[bev_c->idx], bev->output);
+	}
+
+	/* Once we are out of ends[], our peer won't schedule our callbacks
+	 * any more, so we can cancel the ones it already has. */
+	EVLOCK_LOCK(shared->lock, 0);
+	shared->ends[bev_c->idx] = NULL;
+	shared->closed[bev_c->idx] = 1;
+	if ((peer = shared->ends[!bev_c->idx]) != NULL)
+		be_cross_schedule(peer, &peer->read_more);
+	last = --shared->refcnt == 0;
+	EVLOCK_UNLOCK(shared->lock, 0);
+
+	event_deferred_cb_cancel(queue, &bev_c->read_more);
+	event_deferred_cb_cancel(queue, &bev_c->write_more);
+	_bufferevent_del_generic_timeout_cbs(bev);
+	if (bev_c->staging)
+		evbuffer_free(bev_c->staging);
+
+	if (last)
+		cross_pair_shared_free(shared);
+}
+
+static int
+be_cross_flush(struct bufferevent *bev, short iotype,
+    enum bufferevent_flush_mode mode)
+{
+	struct bufferevent_cross_pair *bev_c = upcast_cross(bev);
+	struct cross_pair_shared *shared = bev_c->shared;
+	struct bufferevent_cross_pair *peer;
+
+	if (mode == BEV_NORMAL)
+		return 0;
+
+	_bufferevent_incref_and_lock(bev);
+	if ((iotype & EV_READ) != 0)
+		be_cross_pull(bev_c, 1);
+	if ((iotype & EV_WRITE) != 0) {
+		be_cross_push(bev_c, 1);
+		if (mode == BEV_FINISHED) {
+			EVLOCK_LOCK(shared->lock, 0);
+			shared->closed[bev_c->idx] = 1;
+			if ((peer = shared->ends[!bev_c->idx]) != NULL)
+				be_cross_schedule(peer, &peer->read_more);
+			EVLOCK_UNLOCK(shared->lock, 0);
+		}
+	}
+	_bufferevent_decref_and_unlock(bev);
+	return 0;
+}
+
+const struct bufferevent_ops bufferevent_ops_pair_cross = {
+	"cross_pair_elt",
+	evutil_offsetof(struct bufferevent_cross_pair, bev),
+	be_cross_enable,
+	be_cross_disable,
+	be_cross_destruct,
+	_bufferevent_generic_adj_timeouts,
+	be_cross_flush,
+	NULL, /* ctrl */
+};
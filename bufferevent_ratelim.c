@@ -61,13 +61,41 @@ ev_token_bucket_init(struct ev_token_bucket *bucket,
 		if (bucket->write_limit > cfg->write_maximum)
 			bucket->write_limit = cfg->write_maximum;
 	} else {
-		bucket->read_limit = cfg->read_rate;
-		bucket->write_limit = cfg->write_rate;
+		/* Start out with a tick's worth, or (for a tick-less bucket
+		 * shallower than a second's worth) a full bucket. */
+		bucket->read_limit = cfg->read_rate < cfg->read_maximum ?
+		    cfg->read_rate : cfg->read_maximum;
+		bucket->write_limit = cfg->write_rate < cfg->write_maximum ?
+		    cfg->write_rate : cfg->write_maximum;
 		bucket->last_updated = current_tick;
+		bucket->read_frac = bucket->write_frac = 0;
 	}
 	return 0;
 }
 
+/** Helper for a tick-less bucket: add what <b>rate</b> bytes per second
+    come to over <b>usec</b> microseconds to *limit, keeping the fraction
+    of a byte left over in *frac, and never going over <b>maximum</b>. */
+static void
+ev_token_bucket_fill(ev_int32_t *limit, ev_uint32_t *frac,
+    ev_uint32_t rate, ev_uint32_t maximum, ev_uint32_t usec)
+{
+	/* Both of these fit easily in 64 bits. */
+	ev_uint64_t room = ((ev_uint64_t)((ev_int64_t)maximum - *limit))
+	    * 1000000;
+	ev_uint64_t earned = (ev_uint64_t)usec * rate + *frac;
+
+	if ((ev_int64_t)maximum <= *limit)
+		return;
+	if (earned >= room) {
+		*limit = maximum;
+		*frac = 0;
+	} else {
+		*limit += (ev_int32_t)(earned / 1000000);
+		*frac = (ev_uint32_t)(earned % 1000000);
+	}
+}
+
 int
 ev_token_bucket_update(struct ev_token_bucket *bucket,
     const struct ev_token_bucket_cfg *cfg,
@@ -77,6 +105,23 @@ ev_token_bucket_update(struct ev_token_bucket *bucket,
 	 * wrap around when we do the unsigned substraction. */
 	unsigned n_ticks = current_tick - bucket->last_updated;
 
+	if (EV_TOKEN_BUCKET_TICKLESS(cfg)) {
+		/* Our ticks are microseconds, so they wrap every 71
+		 * minutes; anything over half that, we take as a long
+		 * idle spell rather than as time rolling back. */
+		if (n_ticks == 0)
+			return 0;
+		if (n_ticks > INT_MAX)
+			n_ticks = INT_MAX;
+		ev_token_bucket_fill(&bucket->read_limit, &bucket->read_frac,
+		    cfg->read_rate, cfg->read_maximum, n_ticks);
+		ev_token_bucket_fill(&bucket->write_limit,
+		    &bucket->write_frac, cfg->write_rate, cfg->write_maximum,
+		    n_ticks);
+		bucket->last_updated = current_tick;
+		return 1;
+	}
+
 	/* Make sure some ticks actually happened, and that time didn't
 	 * roll back. */
 	if (n_ticks == 0 || n_ticks > INT_MAX)
@@ -120,8 +165,41 @@ ev_token_bucket_get_tick(const struct timeval *tv,
 
 	/* We cast to an ev_uint64_t first, since we don't want to overflow
 	 * before we do the final divide. */
-	ev_uint64_t msec = (ev_uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
-	return (unsigned)(msec / cfg->msec_per_tick);
+	ev_uint64_t usec = (ev_uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	if (EV_TOKEN_BUCKET_TICKLESS(cfg))
+		return (ev_uint32_t)usec;
+	return (ev_uint32_t)(usec / cfg->usec_per_tick);
+}
+
+void
+ev_token_bucket_get_delay(const struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg, int is_write, ev_int32_t want,
+    struct timeval *tv)
+{
+	ev_int32_t limit;
+	ev_uint32_t rate, frac;
+	ev_uint64_t need, usec;
+
+	if (!EV_TOKEN_BUCKET_TICKLESS(cfg)) {
+		*tv = cfg->tick_timeout;
+		return;
+	}
+	limit = is_write ? bucket->write_limit : bucket->read_limit;
+	rate = is_write ? cfg->write_rate : cfg->read_rate;
+	frac = is_write ? bucket->write_frac : bucket->read_frac;
+	if (want > (ev_int32_t)(is_write ? cfg->write_maximum :
+		cfg->read_maximum))
+		want = is_write ? cfg->write_maximum : cfg->read_maximum;
+
+	/* Round up, and never wait for no time at all. */
+	if (limit >= want) {
+		usec = 1;
+	} else {
+		need = (ev_uint64_t)((ev_int64_t)want - limit) * 1000000 - frac;
+		usec = (need + rate - 1) / rate;
+	}
+	tv->tv_sec = (long)(usec / 1000000);
+	tv->tv_usec = (long)(usec % 1000000);
 }
 
 struct ev_token_bucket_cfg *
@@ -136,9 +214,19 @@ ev_token_bucket_cfg_new(ev_uint32_t read_rate, ev_uint32_t read_burst,
 		g.tv_usec = 0;
 		tick_len = &g;
 	}
-	if (read_rate > read_burst || write_rate > write_burst ||
-	    read_rate < 1 || write_rate < 1)
+	if (read_rate < 1 || write_rate < 1 ||
+	    tick_len->tv_sec < 0 || tick_len->tv_usec < 0 ||
+	    (ev_uint64_t)tick_len->tv_sec * 1000000 + tick_len->tv_usec >
+	    EV_UINT32_MAX)
 		return NULL;
+	/* A tick-less bucket's burst is just how deep it is, so it can be
+	 * less than a second's worth. */
+	if (tick_len->tv_sec || tick_len->tv_usec) {
+		if (read_rate > read_burst || write_rate > write_burst)
+			return NULL;
+	} else if (read_burst < 1 || write_burst < 1) {
+		return NULL;
+	}
 	r = mm_calloc(1, sizeof(struct ev_token_bucket_cfg));
 	if (!r)
 		return NULL;
@@ -147,7 +235,8 @@ ev_token_bucket_cfg_new(ev_uint32_t read_rate, ev_uint32_t read_burst,
 	r->read_maximum = read_burst;
 	r->write_maximum = write_burst;
 	memcpy(&r->tick_timeout, tick_len, sizeof(struct timeval));
-	r->msec_per_tick = (tick_len->tv_sec * 1000) + tick_len->tv_usec/1000;
+	r->usec_per_tick = (ev_uint32_t)
+	    ((ev_uint64_t)tick_len->tv_sec * 1000000 + tick_len->tv_usec);
 	return r;
 }
 
@@ -163,12 +252,28 @@ ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg)
 /* No matter how big our bucket gets, don't try to write more than this
  * much in a single write operation. */
 #define MAX_TO_WRITE_EVER 16384
+/* When a tick-less bucket runs dry, wait until it has this much, or a
+ * millisecond's worth of tokens if that's less, before trying again, rather
+ * than waking up for every few bytes. */
+#define MIN_TO_REFILL 1024
 
 #define LOCK_GROUP(g) EVLOCK_LOCK((g)->lock, 0)
 #define UNLOCK_GROUP(g) EVLOCK_UNLOCK((g)->lock, 0)
 
 static int _bev_group_suspend_reading(struct bufferevent_rate_limit_group *g);
 static int _bev_group_suspend_writing(struct bufferevent_rate_limit_group *g);
+static void _bev_group_suspend_member(struct bufferevent_private *bev,
+    int is_write);
+static void _bev_group_charge_member(struct bufferevent_private *bev,
+    int is_write, int bytes);
+static struct bufferevent_rate_limit_group *_bev_group_check_ancestors(
+	struct bufferevent_rate_limit_group *g, int is_write,
+	ev_int32_t *share);
+static void _bev_group_decrement(struct bufferevent_rate_limit_group *g,
+    int is_write, int bytes);
+static void _bev_schedule_refill(struct bufferevent_private *bev);
+static void _bev_group_update(struct bufferevent_rate_limit_group *g);
+static void _bev_group_schedule_refill(struct bufferevent_rate_limit_group *g);
 
 /** Helper: figure out the maximum amount we should write if is_write, or
     the maximum amount we should read if is_read.  Return that maximum, or
@@ -214,25 +319,34 @@ _bufferevent_get_rlim_max(struct bufferevent_private *bev, int is_write)
 	if (bev->rate_limiting->group) {
 		struct bufferevent_rate_limit_group *g =
 		    bev->rate_limiting->group;
-		ev_uint32_t share;
+		ev_int32_t share = max_so_far, s;
 		LOCK_GROUP(g);
-		if (GROUP_SUSPENDED(g)) {
-			/* We can get here if we failed to lock this
-			 * particular bufferevent while suspending the whole
-			 * group. */
-			if (is_write)
-				bufferevent_suspend_write(&bev->bev,
-				    BEV_SUSPEND_BW_GROUP);
-			else
-				bufferevent_suspend_read(&bev->bev,
-				    BEV_SUSPEND_BW_GROUP);
+		_bev_group_update(g);
+		if (GROUP_SUSPENDED(g) ||
+		    _bev_group_check_ancestors(g, is_write, &share)) {
+			/* The group's bucket, or the bucket of a group
+			 * containing it, is empty: wait for a turn. */
+			_bev_group_suspend_member(bev, is_write);
+			share = 0;
+		} else if (bev->rate_limiting->deficit[is_write] > 0) {
+			/* We're using up a turn the group gave us. */
+			if (share > bev->rate_limiting->deficit[is_write])
+				share = bev->rate_limiting->deficit[is_write];
+			if (share > LIM(g->rate_limit))
+				share = LIM(g->rate_limit);
+		} else if (g->n_waiting[is_write]) {
+			/* Other members are waiting for their turns; don't
+			 * jump the queue. */
+			_bev_group_suspend_member(bev, is_write);
 			share = 0;
 		} else {
-			/* XXXX probably we should divide among the active
-			 * members, not the total members. */
-			share = LIM(g->rate_limit) / g->n_members;
-			if (share < g->min_share)
-				share = g->min_share;
+			/* Nobody is waiting: take an equal share of what's
+			 * left, so that a burst gets spread around too. */
+			s = LIM(g->rate_limit) / g->n_members;
+			if (s < (ev_int32_t)g->min_share)
+				s = g->min_share;
+			if (share > s)
+				share = s;
 		}
 		UNLOCK_GROUP(g);
 		CLAMPTO(share);
@@ -264,18 +378,17 @@ _bufferevent_decrement_read_buckets(struct bufferevent_private *bev, int bytes)
 		bev->rate_limiting->limit.read_limit -= bytes;
 		if (bev->rate_limiting->limit.read_limit <= 0) {
 			bufferevent_suspend_read(&bev->bev, BEV_SUSPEND_BW);
-			event_add(&bev->rate_limiting->refill_bucket_event,
-			    &bev->rate_limiting->cfg->tick_timeout);
+			_bev_schedule_refill(bev);
 		}
 	}
 
 	if (bev->rate_limiting->group) {
-		LOCK_GROUP(bev->rate_limiting->group);
-		bev->rate_limiting->group->rate_limit.read_limit -= bytes;
-		if (bev->rate_limiting->group->rate_limit.read_limit <= 0) {
-			_bev_group_suspend_reading(bev->rate_limiting->group);
-		}
-		UNLOCK_GROUP(bev->rate_limiting->group);
+		struct bufferevent_rate_limit_group *g =
+		    bev->rate_limiting->group;
+		LOCK_GROUP(g);
+		_bev_group_decrement(g, 0, bytes);
+		_bev_group_charge_member(bev, 0, bytes);
+		UNLOCK_GROUP(g);
 	}
 
 	return 0;
@@ -292,64 +405,251 @@ _bufferevent_decrement_write_buckets(struct bufferevent_private *bev, int bytes)
 		bev->rate_limiting->limit.write_limit -= bytes;
 		if (bev->rate_limiting->limit.write_limit <= 0) {
 			bufferevent_suspend_write(&bev->bev, BEV_SUSPEND_BW);
-			event_add(&bev->rate_limiting->refill_bucket_event,
-			    &bev->rate_limiting->cfg->tick_timeout);
+			_bev_schedule_refill(bev);
 		}
 	}
 
 	if (bev->rate_limiting->group) {
-		LOCK_GROUP(bev->rate_limiting->group);
-		bev->rate_limiting->group->rate_limit.write_limit -= bytes;
-		if (bev->rate_limiting->group->rate_limit.write_limit <= 0) {
-			_bev_group_suspend_writing(bev->rate_limiting->group);
-		}
-		UNLOCK_GROUP(bev->rate_limiting->group);
+		struct bufferevent_rate_limit_group *g =
+		    bev->rate_limiting->group;
+		LOCK_GROUP(g);
+		_bev_group_decrement(g, 1, bytes);
+		_bev_group_charge_member(bev, 1, bytes);
+		UNLOCK_GROUP(g);
 	}
 
 	return 0;
 }
 
-/** Stop reading on every bufferevent in <b>g</b> */
+/** Put <b>bev</b> at the back of its group's list of members waiting to
+ * read (or write, if is_write). */
+static void
+_bev_group_wait(struct bufferevent_private *bev, int is_write)
+{
+	/* Needs group lock */
+	struct bufferevent_rate_limit_group *g = bev->rate_limiting->group;
+
+	if (bev->rate_limiting->waiting & (1<<is_write))
+		return;
+	TAILQ_INSERT_TAIL(&g->waiting[is_write], bev,
+	    rate_limiting->next_waiting[is_write]);
+	bev->rate_limiting->waiting |= (1<<is_write);
+	++g->n_waiting[is_write];
+	_bev_group_schedule_refill(g);
+}
+
+/** Take <b>bev</b> off its group's list of members waiting to read (or
+ * write, if is_write), if it's there. */
+static void
+_bev_group_unwait(struct bufferevent_private *bev, int is_write)
+{
+	/* Needs group lock */
+	struct bufferevent_rate_limit_group *g = bev->rate_limiting->group;
+
+	if (!(bev->rate_limiting->waiting & (1<<is_write)))
+		return;
+	TAILQ_REMOVE(&g->waiting[is_write], bev,
+	    rate_limiting->next_waiting[is_write]);
+	bev->rate_limiting->waiting &= ~(1<<is_write);
+	--g->n_waiting[is_write];
+}
+
+/** Stop reading (or writing, if is_write) on <b>bev</b> until its group
+ * gives it a turn. */
+static void
+_bev_group_suspend_member(struct bufferevent_private *bev, int is_write)
+{
+	/* Needs lock on bev and group lock */
+	if (is_write)
+		bufferevent_suspend_write(&bev->bev, BEV_SUSPEND_BW_GROUP);
+	else
+		bufferevent_suspend_read(&bev->bev, BEV_SUSPEND_BW_GROUP);
+	_bev_group_wait(bev, is_write);
+}
+
+/** Note that <b>bev</b> has read (or written, if is_write) <b>bytes</b>
+ * bytes out of its group's bucket.  If that uses up the turn the group gave
+ * it, and others are waiting, it goes to the back of the line. */
+static void
+_bev_group_charge_member(struct bufferevent_private *bev, int is_write,
+    int bytes)
+{
+	/* Needs lock on bev and group lock */
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+
+	if (rlim->deficit[is_write] <= 0)
+		return;
+	rlim->deficit[is_write] -= bytes;
+	if (rlim->deficit[is_write] <= 0) {
+		rlim->deficit[is_write] = 0;
+		if (rlim->group->n_waiting[is_write])
+			_bev_group_suspend_member(bev, is_write);
+	}
+}
+
+/** Stop reading on every bufferevent in <b>g</b>.  We don't visit the
+ * members here: each one finds out the next time it tries to read, and
+ * joins the waiting list then, so this costs the same no matter how big
+ * the group is. */
 static int
 _bev_group_suspend_reading(struct bufferevent_rate_limit_group *g)
 {
 	/* Needs group lock */
-	struct bufferevent_private *bev;
 	g->read_suspended = 1;
-	g->pending_unsuspend_read = 0;
-
-	/* Note that in this loop we call EVLOCK_TRY_LOCK instead of BEV_LOCK,
-	   to prevent a deadlock.  (Ordinarily, the group lock nests inside
-	   the bufferevent locks.  If we are unable to lock any individual
-	   bufferevent, it will find out later when it looks at its limit
-	   and sees that its group is suspended.
-	*/
-	TAILQ_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
-		if (EVLOCK_TRY_LOCK(bev->lock)) {
-			bufferevent_suspend_read(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
-		}
-	}
+	_bev_group_schedule_refill(g);
 	return 0;
 }
 
-/** Stop writing on every bufferevent in <b>g</b> */
+/** Stop writing on every bufferevent in <b>g</b>.  As above, the members
+ * find out for themselves. */
 static int
 _bev_group_suspend_writing(struct bufferevent_rate_limit_group *g)
 {
 	/* Needs group lock */
-	struct bufferevent_private *bev;
 	g->write_suspended = 1;
-	g->pending_unsuspend_write = 0;
-	TAILQ_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
-		if (EVLOCK_TRY_LOCK(bev->lock)) {
-			bufferevent_suspend_write(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
+	_bev_group_schedule_refill(g);
+	return 0;
+}
+
+/** Put <b>g</b> at the back of its parent's list of child groups waiting
+ * to read (or write, if is_write). */
+static void
+_bev_group_wait_child(struct bufferevent_rate_limit_group *g, int is_write)
+{
+	/* Needs the parent's group lock */
+	struct bufferevent_rate_limit_group *p = g->parent;
+
+	if (g->child_waiting & (1<<is_write))
+		return;
+	TAILQ_INSERT_TAIL(&p->waiting_children[is_write], g,
+	    next_waiting_child[is_write]);
+	g->child_waiting |= (1<<is_write);
+	++p->n_waiting_children[is_write];
+	_bev_group_schedule_refill(p);
+}
+
+/** Take <b>g</b> off its parent's list of child groups waiting to read (or
+ * write, if is_write), if it's there. */
+static void
+_bev_group_unwait_child(struct bufferevent_rate_limit_group *g, int is_write)
+{
+	/* Needs the parent's group lock */
+	struct bufferevent_rate_limit_group *p = g->parent;
+
+	if (!(g->child_waiting & (1<<is_write)))
+		return;
+	TAILQ_REMOVE(&p->waiting_children[is_write], g,
+	    next_waiting_child[is_write]);
+	g->child_waiting &= ~(1<<is_write);
+	--p->n_waiting_children[is_write];
+}
+
+/** Return how much is left of the turn <b>c</b>'s parent gave it this
+ * round for reading (or writing, if is_write). */
+static ev_int32_t
+_bev_group_child_deficit(struct bufferevent_rate_limit_group *c,
+    int is_write)
+{
+	/* Needs the parent's group lock */
+	if (c->deficit_round[is_write] != c->parent->round[is_write])
+		return 0;
+	return c->deficit[is_write];
+}
+
+/** Take <b>bytes</b> out of the read (or write) bucket of <b>g</b> and of
+ * every group containing it, suspending any bucket that runs out, and out
+ * of the turns each group on the way was given by its parent. */
+static void
+_bev_group_decrement(struct bufferevent_rate_limit_group *g, int is_write,
+    int bytes)
+{
+	/* Needs group lock on g */
+	struct bufferevent_rate_limit_group *a, *c = NULL;
+
+	for (a = g; a; c = a, a = a->parent) {
+		if (a != g)
+			LOCK_GROUP(a);
+		if (is_write) {
+			a->rate_limit.write_limit -= bytes;
+			if (a->rate_limit.write_limit <= 0)
+				_bev_group_suspend_writing(a);
+		} else {
+			a->rate_limit.read_limit -= bytes;
+			if (a->rate_limit.read_limit <= 0)
+				_bev_group_suspend_reading(a);
+		}
+		if (c && _bev_group_child_deficit(c, is_write) > 0) {
+			c->deficit[is_write] -= bytes;
+			if (c->deficit[is_write] <= 0) {
+				/* That was c's turn.  If anybody else is due
+				 * one, c waits for its next. */
+				c->deficit[is_write] = 0;
+				--a->n_owed_children[is_write];
+				if (a->n_waiting_children[is_write] ||
+				    a->n_owed_children[is_write])
+					_bev_group_wait_child(c, is_write);
+			}
 		}
+		if (a != g)
+			UNLOCK_GROUP(a);
 	}
-	return 0;
+}
+
+/** Look at the groups containing <b>g</b>.  If one of them is suspended for
+    reading (or writing, if is_write), or owes turns to other child groups
+    while the one we came through has used its turn up, put every group
+    between it and <b>g</b> in line for a turn from it, and return it.
+    Otherwise, lower *share to the least that those groups allow, and
+    return NULL.
+
+    Between turns, each group splits what it has evenly between its own
+    members and its busy child groups, and each child splits its part among
+    the bufferevents below it, so that a child with many members gets no
+    more than one with few.
+ */
+static struct bufferevent_rate_limit_group *
+_bev_group_check_ancestors(struct bufferevent_rate_limit_group *g,
+    int is_write, ev_int32_t *share)
+{
+	/* Needs group lock on g.  We take the others child-first. */
+	struct bufferevent_rate_limit_group *a, *c, *blocked = NULL;
+	ev_int32_t s;
+	int below = g->n_members_total, n;
+
+	for (c = g, a = g->parent; a; c = a, a = a->parent) {
+		LOCK_GROUP(a);
+		_bev_group_update(a);
+		s = _bev_group_child_deficit(c, is_write);
+		if (GROUP_SUSPENDED(a) || (s <= 0 &&
+			(a->n_waiting_children[is_write] ||
+			    a->n_owed_children[is_write]))) {
+			blocked = a;
+			UNLOCK_GROUP(a);
+			break;
+		}
+		if (s <= 0) {
+			/* Between turns, c's part is shared by everything
+			 * below it. */
+			n = a->n_members + a->n_busy_children;
+			s = LIM(a->rate_limit) / (n ? n : 1) /
+			    (below ? below : 1);
+			if (s < (ev_int32_t)a->min_share)
+				s = a->min_share;
+		}
+		if (*share > s)
+			*share = s;
+		below = a->n_members_total;
+		UNLOCK_GROUP(a);
+	}
+	if (!blocked)
+		return NULL;
+
+	for (c = g; c != blocked; c = c->parent) {
+		LOCK_GROUP(c->parent);
+		_bev_group_wait_child(c, is_write);
+		UNLOCK_GROUP(c->parent);
+	}
+	return blocked;
 }
 
 /** Timer callback invoked on a single bufferevent with one or more exhausted
@@ -395,54 +695,121 @@ _bev_refill_callback(evutil_socket_t fd, short what, void *arg)
 		   XXXX if we need to be quiet for more ticks, we should
 		   maybe figure out what timeout we really want.
 		*/
-		event_add(&bev->rate_limiting->refill_bucket_event,
-		    &bev->rate_limiting->cfg->tick_timeout);
+		_bev_schedule_refill(bev);
 	}
 	BEV_UNLOCK(&bev->bev);
 }
 
-/** Helper: grab a random element from a bufferevent group. */
-static struct bufferevent_private *
-_bev_group_random_element(struct bufferevent_rate_limit_group *group)
+/** Arm the refill timer of <b>bev</b> for when its own bucket will let it
+    read or write again: at the next tick, or, for a tick-less bucket, at
+    the moment it will have enough tokens. */
+static void
+_bev_schedule_refill(struct bufferevent_private *bev)
 {
-	int which;
-	struct bufferevent_private *bev;
-
-	/* requires group lock */
-
-	if (!group->n_members)
-		return NULL;
-
-	EVUTIL_ASSERT(! TAILQ_EMPTY(&group->members));
-
-	which = _evutil_weakrand() % group->n_members;
-
-	bev = TAILQ_FIRST(&group->members);
-	while (which--)
-		bev = TAILQ_NEXT(bev, rate_limiting->next_in_group);
-
-	return bev;
+	/* needs lock on bev */
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	struct timeval tv, tv_write;
+	ev_uint32_t want;
+	int pending = 0;
+
+#define WANT(rate) \
+	((rate) / 1000 > MIN_TO_REFILL ? MIN_TO_REFILL : \
+	    (rate) < 1000 ? 1 : (ev_int32_t)((rate) / 1000))
+	if (rlim->limit.read_limit <= 0) {
+		want = WANT(rlim->cfg->read_rate);
+		ev_token_bucket_get_delay(&rlim->limit, rlim->cfg, 0,
+		    want, &tv);
+		pending = 1;
+	}
+	if (rlim->limit.write_limit <= 0) {
+		want = WANT(rlim->cfg->write_rate);
+		ev_token_bucket_get_delay(&rlim->limit, rlim->cfg, 1,
+		    want, &tv_write);
+		if (!pending || evutil_timercmp(&tv_write, &tv, <))
+			tv = tv_write;
+		pending = 1;
+	}
+#undef WANT
+	if (pending)
+		event_add(&rlim->refill_bucket_event, &tv);
 }
 
-/** Iterate over the elements of a rate-limiting group 'g' with a random
-    starting point, assigning each to the variable 'bev', and executing the
-    block 'block'.
+/** Give turns to the members and child groups of <b>g</b> waiting to
+    read (or write, if is_write), in the order they started waiting, for as
+    long as the group's bucket (or <b>cap</b>, if that's less) lasts.
 
-    We do this in a half-baked effort to get fairness among group members.
-    XXX Round-robin or some kind of priority queue would be even more fair.
+    This is deficit round-robin: each member we wake gets a quantum of an
+    equal share of the budget, and gets back in line once it has used its
+    quantum up while others wait.  A child group we wake hands its quantum
+    on to its own waiters the same way.  The cost is proportional to the
+    number of members and groups we wake, not to the size or depth of the
+    hierarchy.
  */
-#define FOREACH_RANDOM_ORDER(block)			\
-	do {						\
-		first = _bev_group_random_element(g);	\
-		for (bev = first; bev != TAILQ_END(&g->members); \
-		    bev = TAILQ_NEXT(bev, rate_limiting->next_in_group)) { \
-			block ;					 \
-		}						 \
-		for (bev = TAILQ_FIRST(&g->members); bev && bev != first; \
-		    bev = TAILQ_NEXT(bev, rate_limiting->next_in_group)) { \
-			block ;						\
-		}							\
-	} while (0)
+static void
+_bev_group_unsuspend_waiting(struct bufferevent_rate_limit_group *g,
+    int is_write, ev_int32_t cap)
+{
+	/* Needs group lock */
+	struct bufferevent_private *bev;
+	struct bufferevent_rate_limit_group *c;
+	ev_int32_t budget = LIM(g->rate_limit);
+	ev_int32_t quantum;
+	int n, progress;
+
+	if (budget > cap)
+		budget = cap;
+	if ((!g->n_waiting[is_write] && !g->n_waiting_children[is_write]) ||
+	    budget < (ev_int32_t)g->min_share)
+		return;
+	n = g->n_waiting[is_write] + g->n_waiting_children[is_write];
+	quantum = budget / n;
+	if (quantum < (ev_int32_t)g->min_share)
+		quantum = g->min_share;
+
+	/* Alternate between members and child groups, so that neither can
+	 * crowd out the other. */
+	do {
+		progress = 0;
+		/* As when suspending, we can't wait for a bufferevent's or a
+		 * child group's lock while holding the group lock.  If we
+		 * can't get it, it and everyone behind it get their turn next
+		 * tick. */
+		if ((bev = TAILQ_FIRST(&g->waiting[is_write])) != NULL &&
+		    EVLOCK_TRY_LOCK(bev->lock)) {
+			_bev_group_unwait(bev, is_write);
+			bev->rate_limiting->deficit[is_write] += quantum;
+			budget -= quantum;
+			if (is_write)
+				bufferevent_unsuspend_write(&bev->bev,
+				    BEV_SUSPEND_BW_GROUP);
+			else
+				bufferevent_unsuspend_read(&bev->bev,
+				    BEV_SUSPEND_BW_GROUP);
+			EVLOCK_UNLOCK(bev->lock, 0);
+			progress = 1;
+		}
+		if (budget > 0 &&
+		    (c = TAILQ_FIRST(&g->waiting_children[is_write])) != NULL &&
+		    EVLOCK_TRY_LOCK(c->lock)) {
+			_bev_group_unwait_child(c, is_write);
+			if (_bev_group_child_deficit(c, is_write) > 0) {
+				c->deficit[is_write] += quantum;
+			} else {
+				c->deficit[is_write] = quantum;
+				c->deficit_round[is_write] = g->round[is_write];
+				++g->n_owed_children[is_write];
+			}
+			/* A child whose own bucket is empty serves its
+			 * waiters when it refills. */
+			if (!GROUP_SUSPENDED(c))
+				_bev_group_unsuspend_waiting(c, is_write,
+				    quantum);
+			budget -= quantum;
+			EVLOCK_UNLOCK(c->lock, 0);
+			progress = 1;
+		}
+	} while (progress && budget > 0);
+}
 
 /** Callback invoked every tick to add more elements to the group bucket
     and unsuspend group members as needed.
@@ -453,8 +820,8 @@ _bev_group_refill_callback(evutil_socket_t fd, short what, void *arg)
 	struct bufferevent_rate_limit_group *g = arg;
 	unsigned tick;
 	struct timeval now;
-	int again = 0;
-	struct bufferevent_private *bev, *first;
+	ev_int32_t share, cap;
+	int is_write;
 
 	event_base_gettimeofday_cached(event_get_base(&g->master_refill_event), &now);
 
@@ -462,45 +829,118 @@ _bev_group_refill_callback(evutil_socket_t fd, short what, void *arg)
 	tick = ev_token_bucket_get_tick(&now, &g->rate_limit_cfg);
 	ev_token_bucket_update(&g->rate_limit, &g->rate_limit_cfg, tick);
 
-	if (g->pending_unsuspend_read ||
-	    (g->read_suspended && (g->rate_limit.read_limit >= g->min_share))) {
-		g->read_suspended = 0;
-		again = 0;
-		FOREACH_RANDOM_ORDER({
-			if (EVLOCK_TRY_LOCK(bev->lock)) {
-				bufferevent_unsuspend_read(&bev->bev,
-				    BEV_SUSPEND_BW_GROUP);
-				EVLOCK_UNLOCK(bev->lock, 0);
-			} else {
-				again = 1;
-			}
-		});
-		g->pending_unsuspend_read = again;
-	}
-	if (g->pending_unsuspend_write ||
-	    (g->write_suspended && (g->rate_limit.write_limit >= g->min_share))){
-		g->write_suspended = 0;
-		again = 0;
-		FOREACH_RANDOM_ORDER({
-			if (EVLOCK_TRY_LOCK(bev->lock)) {
-				bufferevent_unsuspend_write(&bev->bev,
-				    BEV_SUSPEND_BW_GROUP);
-				EVLOCK_UNLOCK(bev->lock, 0);
-			} else {
-				again = 1;
-			}
-		});
-		g->pending_unsuspend_write = again;
+	for (is_write = 0; is_write < 2; ++is_write) {
+		/* Turns left over from last round lapse. */
+		++g->round[is_write];
+		g->n_owed_children[is_write] = 0;
+		if (GROUP_SUSPENDED(g) &&
+		    LIM(g->rate_limit) >= (ev_int32_t)g->min_share) {
+			if (is_write)
+				g->write_suspended = 0;
+			else
+				g->read_suspended = 0;
+		}
+		if (GROUP_SUSPENDED(g) || (!g->n_waiting[is_write] &&
+			!g->n_waiting_children[is_write]))
+			continue;
+		/* If a group containing this one is out of tokens, our
+		 * waiters get their turns when that group refills.
+		 * Otherwise, don't hand out more than the groups above us
+		 * would let our members have. */
+		share = EV_INT32_MAX;
+		if (_bev_group_check_ancestors(g, is_write, &share))
+			continue;
+		cap = EV_INT32_MAX;
+		if (share < EV_INT32_MAX / (g->n_members_total + 1))
+			cap = share * (g->n_members_total + 1);
+		_bev_group_unsuspend_waiting(g, is_write, cap);
 	}
-
-	/* XXXX Rather than waiting to the next tick to unsuspend stuff
-	 * with pending_unsuspend_write/read, we should do it on the
-	 * next iteration of the mainloop.
-	 */
+	_bev_group_schedule_refill(g);
 
 	UNLOCK_GROUP(g);
 }
 
+/** Bring a tick-less group's bucket up to date.  (A group with ticks gets
+ * its tokens from its refill callback instead.) */
+static void
+_bev_group_update(struct bufferevent_rate_limit_group *g)
+{
+	/* Needs group lock */
+	struct timeval now;
+
+	if (!EV_TOKEN_BUCKET_TICKLESS(&g->rate_limit_cfg))
+		return;
+	event_base_gettimeofday_cached(
+		event_get_base(&g->master_refill_event), &now);
+	ev_token_bucket_update(&g->rate_limit, &g->rate_limit_cfg,
+	    ev_token_bucket_get_tick(&now, &g->rate_limit_cfg));
+}
+
+/** A tick-less group has no refill timer running all the time.  Arm it
+    for the moment <b>g</b> will have enough tokens for a suspended
+    direction to resume, or for everyone waiting in an unsuspended one to
+    get another turn.  Do nothing if there's nothing to wait for. */
+static void
+_bev_group_schedule_refill(struct bufferevent_rate_limit_group *g)
+{
+	/* Needs group lock */
+	struct timeval tv, tv_dir, now, when;
+	ev_int64_t want, batch;
+	int is_write, n, pending = 0;
+
+	if (!EV_TOKEN_BUCKET_TICKLESS(&g->rate_limit_cfg))
+		return;
+	for (is_write = 0; is_write < 2; ++is_write) {
+		n = g->n_waiting[is_write] + g->n_waiting_children[is_write];
+		if (!n && !GROUP_SUSPENDED(g))
+			continue;
+		/* Wait for a minimum share apiece, and for at least a
+		 * millisecond's worth of tokens, so that we don't wake up
+		 * to hand out a few bytes at a time. */
+		batch = (ev_int64_t)g->min_share * (n ? n : 1);
+		if (batch < (is_write ? g->rate_limit_cfg.write_rate :
+			g->rate_limit_cfg.read_rate) / 1000)
+			batch = (is_write ? g->rate_limit_cfg.write_rate :
+			    g->rate_limit_cfg.read_rate) / 1000;
+		if (GROUP_SUSPENDED(g))
+			want = batch;
+		else
+			want = (ev_int64_t)LIM(g->rate_limit) + batch;
+		if (want > EV_INT32_MAX)
+			want = EV_INT32_MAX;
+		ev_token_bucket_get_delay(&g->rate_limit, &g->rate_limit_cfg,
+		    is_write, (ev_int32_t)want, &tv_dir);
+		if (!pending || evutil_timercmp(&tv_dir, &tv, <))
+			tv = tv_dir;
+		pending = 1;
+	}
+	if (!pending)
+		return;
+	/* Don't put off a refill that's due sooner. */
+	if (event_pending(&g->master_refill_event, EV_TIMEOUT, &when)) {
+		evutil_gettimeofday(&now, NULL);
+		evutil_timeradd(&now, &tv, &now);
+		if (evutil_timercmp(&when, &now, <=))
+			return;
+	}
+	event_add(&g->master_refill_event, &tv);
+}
+
+/* Free bev's rate-limiting state if it's no longer limited either on its
+ * own or as part of a group; it gets allocated again when it's needed. */
+static void
+_bev_free_unused_rate_limit(struct bufferevent_private *bev)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+
+	if (!rlim || rlim->cfg || rlim->group)
+		return;
+	if (event_initialized(&rlim->refill_bucket_event))
+		event_del(&rlim->refill_bucket_event);
+	mm_free(rlim);
+	bev->rate_limiting = NULL;
+}
+
 int
 bufferevent_set_rate_limit(struct bufferevent *bev,
     struct ev_token_bucket_cfg *cfg)
@@ -520,6 +960,7 @@ bufferevent_set_rate_limit(struct bufferevent *bev,
 			bevp->rate_limiting->cfg = NULL;
 			bufferevent_unsuspend_read(bev, BEV_SUSPEND_BW);
 			bufferevent_unsuspend_write(bev, BEV_SUSPEND_BW);
+			_bev_free_unused_rate_limit(bevp);
 		}
 		r = 0;
 		goto done;
@@ -531,8 +972,17 @@ bufferevent_set_rate_limit(struct bufferevent *bev,
 	if (bevp->rate_limiting && bevp->rate_limiting->cfg == cfg) {
 		;
 	} else if (bevp->rate_limiting) {
+		/* If we were only rate-limited by a group before, our own
+		 * bucket starts out fresh. */
+		int reinit = bevp->rate_limiting->cfg != NULL;
+		/* Ticks of different lengths don't compare: start counting
+		 * again from now. */
+		if (reinit && bevp->rate_limiting->cfg->usec_per_tick !=
+		    cfg->usec_per_tick)
+			bevp->rate_limiting->limit.last_updated = tick;
 		bevp->rate_limiting->cfg = cfg;
-		ev_token_bucket_init(&bevp->rate_limiting->limit, cfg, tick, 1);
+		ev_token_bucket_init(&bevp->rate_limiting->limit, cfg, tick,
+		    reinit);
 		if (bevp->rate_limiting->limit.read_limit > 0)
 			bufferevent_unsuspend_read(bev, BEV_SUSPEND_BW);
 		else
@@ -541,6 +991,7 @@ bufferevent_set_rate_limit(struct bufferevent *bev,
 			bufferevent_unsuspend_write(bev, BEV_SUSPEND_BW);
 		else
 			bufferevent_suspend_write(bev, BEV_SUSPEND_BW);
+		_bev_schedule_refill(bevp);
 	} else {
 		rlim = mm_calloc(1, sizeof(struct bufferevent_rate_limit));
 		if (!rlim)
@@ -557,6 +1008,27 @@ done:
 	return r;
 }
 
+/** Add <b>n</b> to the count of bufferevents in <b>g</b> and in every group
+ * containing it. */
+static void
+_bev_group_count_members(struct bufferevent_rate_limit_group *g, int n)
+{
+	/* Needs group lock on g */
+	struct bufferevent_rate_limit_group *a, *c;
+	int was_busy = g->n_members_total != 0;
+
+	g->n_members_total += n;
+	for (c = g, a = g->parent; a; c = a, a = a->parent) {
+		int is_busy = c->n_members_total != 0;
+		LOCK_GROUP(a);
+		if (is_busy != was_busy)
+			a->n_busy_children += is_busy ? 1 : -1;
+		was_busy = a->n_members_total != 0;
+		a->n_members_total += n;
+		UNLOCK_GROUP(a);
+	}
+}
+
 struct bufferevent_rate_limit_group *
 bufferevent_rate_limit_group_new(struct event_base *base,
     const struct ev_token_bucket_cfg *cfg)
@@ -573,13 +1045,24 @@ bufferevent_rate_limit_group_new(struct event_base *base,
 		return NULL;
 	memcpy(&g->rate_limit_cfg, cfg, sizeof(g->rate_limit_cfg));
 	TAILQ_INIT(&g->members);
+	TAILQ_INIT(&g->waiting[0]);
+	TAILQ_INIT(&g->waiting[1]);
+	TAILQ_INIT(&g->waiting_children[0]);
+	TAILQ_INIT(&g->waiting_children[1]);
 
 	ev_token_bucket_init(&g->rate_limit, cfg, tick, 0);
 
 	g->min_share = 64;
-	event_assign(&g->master_refill_event, base, -1, EV_PERSIST,
-	    _bev_group_refill_callback, g);
-	event_add(&g->master_refill_event, &cfg->tick_timeout);
+	/* A tick-less group only needs its timer when something is waiting
+	 * for tokens. */
+	if (EV_TOKEN_BUCKET_TICKLESS(cfg)) {
+		evtimer_assign(&g->master_refill_event, base,
+		    _bev_group_refill_callback, g);
+	} else {
+		event_assign(&g->master_refill_event, base, -1, EV_PERSIST,
+		    _bev_group_refill_callback, g);
+		event_add(&g->master_refill_event, &cfg->tick_timeout);
+	}
 
 	EVTHREAD_ALLOC_LOCK(g->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
 	return g;
@@ -589,11 +1072,18 @@ int
 bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
     struct bufferevent_rate_limit_group *g)
 {
-	int wsuspend, rsuspend;
 	struct bufferevent_private *bevp =
 	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
 	BEV_LOCK(bev);
 
+	if (bevp->rate_limiting && bevp->rate_limiting->group == g) {
+		BEV_UNLOCK(bev);
+		return 0;
+	}
+	/* (This may free our rate-limiting state, so do it first.) */
+	if (bevp->rate_limiting && bevp->rate_limiting->group)
+		bufferevent_remove_from_rate_limit_group(bev);
+
 	if (!bevp->rate_limiting) {
 		struct bufferevent_rate_limit *rlim;
 		rlim = mm_calloc(1, sizeof(struct bufferevent_rate_limit));
@@ -606,28 +1096,15 @@ bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
 		bevp->rate_limiting = rlim;
 	}
 
-	if (bevp->rate_limiting->group == g) {
-		BEV_UNLOCK(bev);
-		return 0;
-	}
-	if (bevp->rate_limiting->group)
-		bufferevent_remove_from_rate_limit_group(bev);
-
+	/* If the group is suspended, we find out the first time we try to
+	 * read or write, like every other member. */
 	LOCK_GROUP(g);
 	bevp->rate_limiting->group = g;
 	++g->n_members;
 	TAILQ_INSERT_TAIL(&g->members, bevp, rate_limiting->next_in_group);
-
-	rsuspend = g->read_suspended;
-	wsuspend = g->write_suspended;
-
+	_bev_group_count_members(g, 1);
 	UNLOCK_GROUP(g);
 
-	if (rsuspend)
-		bufferevent_suspend_read(bev, BEV_SUSPEND_BW_GROUP);
-	if (wsuspend)
-		bufferevent_suspend_write(bev, BEV_SUSPEND_BW_GROUP);
-
 	BEV_UNLOCK(bev);
 	return 0;
 }
@@ -642,13 +1119,54 @@ bufferevent_remove_from_rate_limit_group(struct bufferevent *bev)
 		struct bufferevent_rate_limit_group *g =
 		    bevp->rate_limiting->group;
 		LOCK_GROUP(g);
+		_bev_group_unwait(bevp, 0);
+		_bev_group_unwait(bevp, 1);
+		bevp->rate_limiting->deficit[0] =
+		    bevp->rate_limiting->deficit[1] = 0;
 		bevp->rate_limiting->group = NULL;
 		--g->n_members;
 		TAILQ_REMOVE(&g->members, bevp, rate_limiting->next_in_group);
+		_bev_group_count_members(g, -1);
 		UNLOCK_GROUP(g);
 	}
 	bufferevent_unsuspend_read(bev, BEV_SUSPEND_BW_GROUP);
 	bufferevent_unsuspend_write(bev, BEV_SUSPEND_BW_GROUP);
+	_bev_free_unused_rate_limit(bevp);
 	BEV_UNLOCK(bev);
 	return 0;
 }
+
+int
+bufferevent_rate_limit_group_set_parent(
+	struct bufferevent_rate_limit_group *g,
+	struct bufferevent_rate_limit_group *parent)
+{
+	struct bufferevent_rate_limit_group *a;
+	int r = -1;
+
+	LOCK_GROUP(g);
+	/* Moving a group with bufferevents in it would mean recounting every
+	 * group it leaves and joins while its members are busy; don't. */
+	if (g->n_members_total)
+		goto done;
+	for (a = parent; a; a = a->parent) {
+		if (a == g)
+			goto done;
+	}
+	if (g->parent) {
+		LOCK_GROUP(g->parent);
+		_bev_group_unwait_child(g, 0);
+		_bev_group_unwait_child(g, 1);
+		if (_bev_group_child_deficit(g, 0) > 0)
+			--g->parent->n_owed_children[0];
+		if (_bev_group_child_deficit(g, 1) > 0)
+			--g->parent->n_owed_children[1];
+		g->deficit[0] = g->deficit[1] = 0;
+		UNLOCK_GROUP(g->parent);
+	}
+	g->parent = parent;
+	r = 0;
+done:
+	UNLOCK_GROUP(g);
+	return r;
+}
@@ -35,6 +35,7 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -59,16 +60,21 @@
 #ifdef _EVENT_HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
+#ifdef _EVENT_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 
 #include "event2/util.h"
 #include "event2/bufferevent.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
 #include "util-internal.h"
 #ifdef WIN32
 #include "iocp-internal.h"
@@ -98,22 +104,142 @@ const struct bufferevent_ops bufferevent_ops_socket = {
 #define be_socket_add(ev, t)			\
 	_bufferevent_add_event((ev), (t))
 
+/* How much an edge-triggered bufferevent reads or writes in one turn,
+ * unless told otherwise. */
+#define BEV_EDGE_BUDGET_DEFAULT (256*1024)
+
+/* How long we wait for the kernel to finish with our zero-copy sends before
+ * we close or replace a socket. */
+#define BEV_ZEROCOPY_LINGER_MSEC 100
+
+/* True iff a socket bufferevent is corked, and has to hold back its output
+ * itself. */
+#define BEV_SOCKET_HOLDING(bufev_p)					\
+	((bufev_p)->cork_count && !(bufev_p)->tcp_corked)
+
+static void bufferevent_writecb(evutil_socket_t, short, void *);
+
+/* Write as much of the output as we can right away, rather than waiting
+ * for the write event.  The write callback adds the write event if there's
+ * anything left. */
+static void
+be_socket_write_now(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (!(bufev->enabled & EV_WRITE) || bufev_p->write_suspended ||
+	    bufev_p->connecting || BEV_SOCKET_HOLDING(bufev_p) ||
+	    !bufev->output || evbuffer_get_length(bufev->output) == 0 ||
+	    event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		return;
+
+	bufferevent_writecb(event_get_fd(&bufev->ev_write), EV_WRITE, bufev);
+}
+
+/* Free whichever of a lazy bufferevent's buffers are empty, and have
+ * nothing set up on them that we couldn't set up again. */
+static void
+be_socket_free_idle_buffers(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (bufev->input && _evbuffer_is_disposable(bufev->input,
+		bufev_p->read_watermarks_cb ? 1 : 0)) {
+		evbuffer_free(bufev->input);
+		bufev->input = NULL;
+		bufev_p->read_watermarks_cb = NULL;
+	}
+	if (bufev->output && _evbuffer_is_disposable(bufev->output, 1)) {
+		evbuffer_free(bufev->output);
+		bufev->output = NULL;
+	}
+}
+
+/* Arrange for be_socket_deferred_cb() to run at the end of this loop
+ * iteration. */
+static void
+be_socket_schedule_deferred(struct bufferevent_private *bufev_p)
+{
+	if (!bufev_p->deferred_sock.queued) {
+		bufferevent_incref(&bufev_p->bev);
+		event_deferred_cb_schedule(
+		    event_base_get_deferred_cb_queue(bufev_p->bev.ev_base),
+		    &bufev_p->deferred_sock);
+	}
+}
+
+static void
+be_socket_deferred_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_private *bufev_p = arg;
+
+	BEV_LOCK(&bufev_p->bev);
+	be_socket_write_now(&bufev_p->bev);
+	if (bufev_p->options & BEV_OPT_LAZY_BUFFERS)
+		be_socket_free_idle_buffers(&bufev_p->bev);
+	_bufferevent_decref_and_unlock(&bufev_p->bev);
+}
+
+/* If a lazy bufferevent's buffer has just become empty, see about freeing
+ * it at the end of the loop iteration. */
+#define BEV_SOCKET_MAYBE_IDLE(bufev_p, buf)				\
+	do {								\
+		if (((bufev_p)->options & BEV_OPT_LAZY_BUFFERS) &&	\
+		    (buf) && evbuffer_get_length(buf) == 0)		\
+			be_socket_schedule_deferred(bufev_p);		\
+	} while (0)
+
+/* Set or clear TCP_CORK on fd.  Returns 0 on success, or -1 if the socket
+ * or the platform doesn't have it. */
+static int
+be_socket_set_tcp_cork(evutil_socket_t fd, int on)
+{
+#if defined(TCP_CORK) && defined(IPPROTO_TCP)
+	return setsockopt(fd, IPPROTO_TCP, TCP_CORK, (void *)&on, sizeof(on));
+#else
+	return -1;
+#endif
+}
+
 static void
 bufferevent_socket_outbuf_cb(struct evbuffer *buf,
     const struct evbuffer_cb_info *cbinfo,
     void *arg)
 {
 	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 
 	if (cbinfo->n_added &&
 	    (bufev->enabled & EV_WRITE) &&
-	    !event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
+	    !bufev_p->write_suspended &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL) &&
+	    !BEV_SOCKET_HOLDING(bufev_p)) {
 		/* Somebody added data to the buffer, and we would like to
-		 * write, and we were not writing.  So, start writing. */
-		be_socket_add(&bufev->ev_write, &bufev->timeout_write);
+		 * write, and we were not writing.  So, start writing: at the
+		 * end of this loop iteration if we're collecting this
+		 * iteration's writes, or when the socket is ready if not. */
+		if (bufev_p->options & BEV_OPT_CORK) {
+			be_socket_schedule_deferred(bufev_p);
+		} else {
+			be_socket_add(&bufev->ev_write, &bufev->timeout_write);
+		}
 	}
 }
 
+/* Come back to an edge-triggered bufferevent for more reading or writing
+ * ('what') once the other pending events have had a turn. */
+static void
+be_socket_schedule_more(struct bufferevent_private *bufev_p, short what)
+{
+	static const struct timeval now = { 0, 0 };
+
+	bufev_p->edge_more_pending |= what;
+	event_add(bufev_p->edge_more, &now);
+}
+
 static void
 bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 {
@@ -124,6 +250,7 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 	int res = 0;
 	short what = BEV_EVENT_READING;
 	int howmuch = -1, readmax=-1;
+	size_t ring_size, total = 0;
 
 	_bufferevent_incref_and_lock(bufev);
 
@@ -132,57 +259,100 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 		goto error;
 	}
 
-	input = bufev->input;
+	if ((input = bufev->input) == NULL &&
+	    (input = _bufferevent_socket_get_buffer(bufev, EV_READ)) == NULL) {
+		what |= BEV_EVENT_ERROR;
+		goto error;
+	}
 
-	/*
-	 * If we have a high watermark configured then we don't want to
-	 * read more data than would make us reach the watermark.
-	 */
-	if (bufev->wm_read.high != 0) {
-		howmuch = bufev->wm_read.high - evbuffer_get_length(input);
-		/* we somehow lowered the watermark, stop reading */
-		if (howmuch <= 0) {
-			bufferevent_wm_suspend_read(bufev);
-			goto done;
+	/* Errors on the socket wake the read event too; if they were
+	 * zero-copy completions, collect them. */
+	if (bufev->output)
+		_evbuffer_zerocopy_reap(bufev->output, fd);
+
+	/* A ring input buffer can't hold more than its size, so treat that
+	 * as our high watermark. */
+	ring_size = _evbuffer_get_ring_size(input);
+	if (ring_size &&
+	    (bufev->wm_read.high == 0 || bufev->wm_read.high > ring_size))
+		bufferevent_setwatermark(bufev, EV_READ, bufev->wm_read.low,
+		    ring_size);
+
+	/* When we're level-triggered, we read once and let the backend tell
+	 * us if there's more.  When we're edge-triggered, it won't, so we
+	 * keep reading until the socket would block or we run out of
+	 * budget. */
+	for (;;) {
+		/*
+		 * If we have a high watermark configured then we don't want to
+		 * read more data than would make us reach the watermark.
+		 */
+		howmuch = -1;
+		if (bufev->wm_read.high != 0) {
+			howmuch = bufev->wm_read.high -
+			    evbuffer_get_length(input);
+			/* we somehow lowered the watermark, stop reading */
+			if (howmuch <= 0) {
+				bufferevent_wm_suspend_read(bufev);
+				break;
+			}
 		}
-	}
-	readmax = _bufferevent_get_read_max(bufev_p);
-	if (howmuch < 0 || howmuch > readmax) /* The use of -1 for "unlimited"
-					       * uglifies this code. */
-		howmuch = readmax;
-	if (bufev_p->read_suspended)
-		goto done;
+		/* An input buffer that sizes its own reads knows better than
+		 * our fixed cap, unless we're rate-limited. */
+		if (input->max_read && !bufev_p->rate_limiting)
+			readmax = -1;
+		else
+			readmax = _bufferevent_get_read_max(bufev_p);
+		if (howmuch < 0 || (readmax >= 0 && howmuch > readmax))
+			/* The use of -1 for "unlimited" uglifies this code. */
+			howmuch = readmax;
+		if (bufev_p->edge_budget && (howmuch < 0 ||
+			(size_t)howmuch > bufev_p->edge_budget - total))
+			howmuch = (int)(bufev_p->edge_budget - total);
+		if (bufev_p->read_suspended)
+			break;
+
+		evbuffer_unfreeze(input, 0);
+		res = evbuffer_read(input, fd, howmuch);
+		evbuffer_freeze(input, 0);
+		BEV_STATS_IO(bufev_p, EV_READ, res);
 
-	evbuffer_unfreeze(input, 0);
-	res = evbuffer_read(input, fd, howmuch);
-	evbuffer_freeze(input, 0);
+		if (res == -1) {
+			int err = evutil_socket_geterror(fd);
+			if (EVUTIL_ERR_RW_RETRIABLE(err))
+				break;
+			/* error case */
+			what |= BEV_EVENT_ERROR;
+		} else if (res == 0) {
+			/* eof case */
+			what |= BEV_EVENT_EOF;
+		}
 
-	if (res == -1) {
-		int err = evutil_socket_geterror(fd);
-		if (EVUTIL_ERR_RW_RETRIABLE(err))
-			goto reschedule;
-		/* error case */
-		what |= BEV_EVENT_ERROR;
-	} else if (res == 0) {
-		/* eof case */
-		what |= BEV_EVENT_EOF;
-	}
+		if (res <= 0)
+			goto error;
 
-	if (res <= 0)
-		goto error;
+		_bufferevent_decrement_read_buckets(bufev_p, res);
+		total += res;
 
-	_bufferevent_decrement_read_buckets(bufev_p, res);
+		if (!bufev_p->edge_budget || !(bufev->enabled & EV_READ))
+			break;
+		if (total >= bufev_p->edge_budget) {
+			be_socket_schedule_more(bufev_p, EV_READ);
+			break;
+		}
+	}
 
 	/* Invoke the user callback - must always be called last */
-	if (evbuffer_get_length(input) >= bufev->wm_read.low)
+	if (total && evbuffer_get_length(input) >= bufev->wm_read.low)
 		_bufferevent_run_readcb(bufev);
+	BEV_SOCKET_MAYBE_IDLE(bufev_p, bufev->input);
 
 	goto done;
 
- reschedule:
-	goto done;
-
  error:
+	/* Deliver whatever we read before the error first. */
+	if (total && evbuffer_get_length(input) >= bufev->wm_read.low)
+		_bufferevent_run_readcb(bufev);
 	event_del(&bufev->ev_read);
 	_bufferevent_run_eventcb(bufev, what);
 
@@ -190,6 +360,19 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 	_bufferevent_decref_and_unlock(bufev);
 }
 
+/* If we wrote without being asked to by the write event, and couldn't
+ * write everything, make sure the write event will finish the job. */
+static void
+be_socket_rearm_write(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if ((bufev->enabled & EV_WRITE) && !bufev_p->write_suspended &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		be_socket_add(&bufev->ev_write, &bufev->timeout_write);
+}
+
 static void
 bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 {
@@ -200,6 +383,7 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	short what = BEV_EVENT_WRITING;
 	int connected = 0;
 	int atmost = -1;
+	size_t total = 0;
 
 	_bufferevent_incref_and_lock(bufev);
 
@@ -240,20 +424,64 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 		}
 	}
 
-	atmost = _bufferevent_get_write_max(bufev_p);
+	if (!bufev->output &&
+	    !_bufferevent_socket_get_buffer(bufev, EV_WRITE)) {
+		event_del(&bufev->ev_write);
+		goto done;
+	}
+
+	/* Release whatever chains the kernel has finished sending from. */
+	_evbuffer_zerocopy_reap(bufev->output, fd);
+
+	if (BEV_SOCKET_HOLDING(bufev_p)) {
+		event_del(&bufev->ev_write);
+		goto done;
+	}
+
+	/* Held-back output should go out in one call if it can. */
+	if ((bufev_p->options & BEV_OPT_CORK) && !bufev_p->rate_limiting)
+		atmost = -1;
+	else
+		atmost = _bufferevent_get_write_max(bufev_p);
 
 	if (bufev_p->write_suspended)
 		goto done;
 
 	if (evbuffer_get_length(bufev->output)) {
 		evbuffer_unfreeze(bufev->output, 1);
-		res = evbuffer_write_atmost(bufev->output, fd, atmost);
+		/* As with reading: when edge-triggered, write until the
+		 * socket would block or we run out of budget. */
+		for (;;) {
+			if (bufev_p->edge_budget &&
+			    (atmost < 0 ||
+				(size_t)atmost > bufev_p->edge_budget - total))
+				atmost = (int)(bufev_p->edge_budget - total);
+			res = evbuffer_write_atmost(bufev->output, fd, atmost);
+			BEV_STATS_IO(bufev_p, EV_WRITE, res);
+			if (res <= 0)
+				break;
+			_bufferevent_decrement_write_buckets(bufev_p, res);
+			total += res;
+			if (!bufev_p->edge_budget ||
+			    bufev_p->write_suspended ||
+			    evbuffer_get_length(bufev->output) == 0)
+				break;
+			if (total >= bufev_p->edge_budget) {
+				be_socket_schedule_more(bufev_p, EV_WRITE);
+				break;
+			}
+			atmost = _bufferevent_get_write_max(bufev_p);
+		}
 		evbuffer_freeze(bufev->output, 1);
 		if (res == -1) {
 			int err = evutil_socket_geterror(fd);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				goto reschedule;
-			what |= BEV_EVENT_ERROR;
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				if (!total)
+					goto reschedule;
+				res = (int)total;
+			} else {
+				what |= BEV_EVENT_ERROR;
+			}
 		} else if (res == 0) {
 			/* eof case
 			   XXXX Actually, a 0 on write doesn't indicate
@@ -263,12 +491,12 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 		}
 		if (res <= 0)
 			goto error;
-
-		_bufferevent_decrement_write_buckets(bufev_p, res);
 	}
 
 	if (evbuffer_get_length(bufev->output) == 0)
 		event_del(&bufev->ev_write);
+	else
+		be_socket_rearm_write(bufev);
 
 	/*
 	 * Invoke the user callback if our buffer is drained or below the
@@ -277,12 +505,15 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	if ((res || !connected) &&
 	    evbuffer_get_length(bufev->output) <= bufev->wm_write.low)
 		_bufferevent_run_writecb(bufev);
+	BEV_SOCKET_MAYBE_IDLE(bufev_p, bufev->output);
 
 	goto done;
 
  reschedule:
 	if (evbuffer_get_length(bufev->output) == 0)
 		event_del(&bufev->ev_write);
+	else
+		be_socket_rearm_write(bufev);
 	goto done;
 
  error:
@@ -293,6 +524,52 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	_bufferevent_decref_and_unlock(bufev);
 }
 
+static void
+bufferevent_edge_more_cb(evutil_socket_t _, short what, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	short more;
+
+	_bufferevent_incref_and_lock(bufev);
+	more = bufev_p->edge_more_pending;
+	bufev_p->edge_more_pending = 0;
+
+	/* Only resume what's still enabled and unsuspended; either way, this
+	 * counts as activity for the timeouts. */
+	if ((more & EV_READ) &&
+	    event_pending(&bufev->ev_read, EV_READ, NULL)) {
+		if (evutil_timerisset(&bufev->timeout_read))
+			be_socket_add(&bufev->ev_read, &bufev->timeout_read);
+		bufferevent_readcb(event_get_fd(&bufev->ev_read), EV_READ,
+		    bufev);
+	}
+	if ((more & EV_WRITE) &&
+	    event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
+		if (evutil_timerisset(&bufev->timeout_write))
+			be_socket_add(&bufev->ev_write, &bufev->timeout_write);
+		bufferevent_writecb(event_get_fd(&bufev->ev_write), EV_WRITE,
+		    bufev);
+	}
+
+	_bufferevent_decref_and_unlock(bufev);
+}
+
+/* Assign the read and write events for a socket bufferevent. */
+static void
+be_socket_assign_events(struct bufferevent *bufev, evutil_socket_t fd)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	short et = bufev_p->edge_budget ? EV_ET : 0;
+
+	event_assign(&bufev->ev_read, bufev->ev_base, fd,
+	    EV_READ|EV_PERSIST|et, bufferevent_readcb, bufev);
+	event_assign(&bufev->ev_write, bufev->ev_base, fd,
+	    EV_WRITE|EV_PERSIST|et, bufferevent_writecb, bufev);
+}
+
 struct bufferevent *
 bufferevent_socket_new(struct event_base *base, evutil_socket_t fd,
     int options)
@@ -315,19 +592,70 @@ bufferevent_socket_new(struct event_base *base, evutil_socket_t fd,
 	}
 	bufev = &bufev_p->bev;
 
-	event_assign(&bufev->ev_read, bufev->ev_base, fd,
-	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
-	event_assign(&bufev->ev_write, bufev->ev_base, fd,
-	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	/* If we can't be edge-triggered, we stay level-triggered, which is
+	 * always safe. */
+	if ((options & BEV_OPT_EDGE_TRIGGERED) && bufev->ev_base &&
+	    (event_base_get_features(bufev->ev_base) & EV_FEATURE_ET)) {
+		bufev_p->edge_more = event_new(bufev->ev_base, -1, 0,
+		    bufferevent_edge_more_cb, bufev);
+		if (bufev_p->edge_more)
+			bufev_p->edge_budget = BEV_EDGE_BUDGET_DEFAULT;
+	}
+	be_socket_assign_events(bufev, fd);
+	event_deferred_cb_init(&bufev_p->deferred_sock,
+	    be_socket_deferred_cb, bufev_p);
 
-	evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb, bufev);
+	if (!(bufev_p->options & BEV_OPT_LAZY_BUFFERS)) {
+		evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb,
+		    bufev);
 
-	evbuffer_freeze(bufev->input, 0);
-	evbuffer_freeze(bufev->output, 1);
+		evbuffer_freeze(bufev->input, 0);
+		evbuffer_freeze(bufev->output, 1);
+	}
 
 	return bufev;
 }
 
+struct evbuffer *
+_bufferevent_socket_get_buffer(struct bufferevent *bufev, short which)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	struct evbuffer *buf;
+
+	BEV_LOCK(bufev);
+	buf = (which == EV_READ) ? bufev->input : bufev->output;
+	if (buf || bufev->be_ops != &bufferevent_ops_socket)
+		goto done;
+	if ((buf = evbuffer_new()) == NULL)
+		goto done;
+	if (bufev_p->lock)
+		evbuffer_enable_locking(buf, bufev_p->lock);
+	evbuffer_set_parent(buf, bufev);
+
+	if (which == EV_READ) {
+		evbuffer_freeze(buf, 0);
+		bufev->input = buf;
+		/* Put back the high watermark callback, if there is one. */
+		if (bufev->wm_read.high)
+			bufferevent_setwatermark(bufev, EV_READ,
+			    bufev->wm_read.low, bufev->wm_read.high);
+	} else {
+		if (evbuffer_add_cb(buf, bufferevent_socket_outbuf_cb,
+			bufev) == NULL) {
+			evbuffer_free(buf);
+			buf = NULL;
+			goto done;
+		}
+		evbuffer_freeze(buf, 1);
+		bufev->output = buf;
+	}
+
+done:
+	BEV_UNLOCK(bufev);
+	return buf;
+}
+
 int
 bufferevent_socket_connect(struct bufferevent *bev,
     struct sockaddr *sa, int socklen)
@@ -357,6 +685,7 @@ bufferevent_socket_connect(struct bufferevent *bev,
 		ownfd = 1;
 	}
 	if (sa) {
+		_bufferevent_stats_connecting(bufev_p);
 #ifdef WIN32
 		if (bufferevent_async_can_connect(bev)) {
 			bufferevent_setfd(bev, fd);
@@ -383,11 +712,14 @@ bufferevent_socket_connect(struct bufferevent *bev,
 #endif
 	bufferevent_setfd(bev, fd);
 	if (r == 0) {
+		/* Set this first, so that a cork doesn't keep us from
+		 * watching for the connect to finish. */
+		bufev_p->connecting = 1;
 		if (! be_socket_enable(bev, EV_WRITE)) {
-			bufev_p->connecting = 1;
 			result = 0;
 			goto done;
 		}
+		bufev_p->connecting = 0;
 	} else {
 		/* The connect succeeded already. How odd. */
 		result = 0;
@@ -494,10 +826,19 @@ bufferevent_new(evutil_socket_t fd,
 static int
 be_socket_enable(struct bufferevent *bufev, short event)
 {
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 	if (event & EV_READ) {
 		if (be_socket_add(&bufev->ev_read,&bufev->timeout_read) == -1)
 			return -1;
 	}
+	/* Don't watch for writing while we're holding back our output, or
+	 * when a flush is on the way anyway. */
+	if ((event & EV_WRITE) && !bufev_p->connecting &&
+	    (BEV_SOCKET_HOLDING(bufev_p) ||
+		((bufev_p->options & BEV_OPT_CORK) &&
+		    bufev_p->deferred_sock.queued)))
+		event &= ~EV_WRITE;
 	if (event & EV_WRITE) {
 		if (be_socket_add(&bufev->ev_write,&bufev->timeout_write) == -1)
 			return -1;
@@ -534,6 +875,15 @@ be_socket_destruct(struct bufferevent *bufev)
 
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
+	if (bufev_p->edge_more)
+		event_free(bufev_p->edge_more);
+
+	/* Wait a little for the kernel to finish with our zero-copy sends;
+	 * chains it still has when the output buffer goes away are never
+	 * freed. */
+	if (bufev->output)
+		_evbuffer_zerocopy_linger(bufev->output, fd,
+		    BEV_ZEROCOPY_LINGER_MSEC);
 
 	if (bufev_p->options & BEV_OPT_CLOSE_ON_FREE)
 		EVUTIL_CLOSESOCKET(fd);
@@ -559,16 +909,28 @@ be_socket_flush(struct bufferevent *bev, short iotype,
 static void
 be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 {
+	size_t threshold;
+
 	BEV_LOCK(bufev);
 	EVUTIL_ASSERT(bufev->be_ops == &bufferevent_ops_socket);
 
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
 
-	event_assign(&bufev->ev_read, bufev->ev_base, fd,
-	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
-	event_assign(&bufev->ev_write, bufev->ev_base, fd,
-	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	/* Sends on the old socket can only complete there. */
+	if (bufev->output)
+		_evbuffer_zerocopy_linger(bufev->output,
+		    event_get_fd(&bufev->ev_write), BEV_ZEROCOPY_LINGER_MSEC);
+
+	be_socket_assign_events(bufev, fd);
+
+	if (BEV_UPCAST(bufev)->cork_count)
+		BEV_UPCAST(bufev)->tcp_corked =
+		    be_socket_set_tcp_cork(fd, 1) == 0;
+
+	threshold = bufev->output ? _evbuffer_get_zerocopy(bufev->output) : 0;
+	if (threshold)
+		_evbuffer_set_zerocopy(bufev->output, fd, threshold);
 
 	if (fd >= 0)
 		bufferevent_enable(bufev, bufev->enabled);
@@ -576,6 +938,93 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 	BEV_UNLOCK(bufev);
 }
 
+int
+bufferevent_socket_set_zerocopy(struct bufferevent *bufev, size_t threshold)
+{
+	struct evbuffer *output;
+	int r = -1;
+
+	BEV_LOCK(bufev);
+	if (bufev->be_ops != &bufferevent_ops_socket)
+		goto done;
+	if ((output = bufferevent_get_output(bufev)) == NULL)
+		goto done;
+
+	r = _evbuffer_set_zerocopy(output,
+	    event_get_fd(&bufev->ev_write), threshold);
+done:
+	BEV_UNLOCK(bufev);
+	return r;
+}
+
+int
+bufferevent_socket_set_edge_budget(struct bufferevent *bufev, size_t budget)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	int r = -1;
+
+	BEV_LOCK(bufev);
+	if (bufev->be_ops != &bufferevent_ops_socket || !bufev_p->edge_budget)
+		goto done;
+	if (budget > INT_MAX)
+		goto done;
+
+	bufev_p->edge_budget = budget ? budget : BEV_EDGE_BUDGET_DEFAULT;
+	r = 0;
+done:
+	BEV_UNLOCK(bufev);
+	return r;
+}
+
+int
+bufferevent_socket_cork(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	int r = -1;
+
+	BEV_LOCK(bufev);
+	if (bufev->be_ops != &bufferevent_ops_socket)
+		goto done;
+
+	if (bufev_p->cork_count++ == 0)
+		bufev_p->tcp_corked = be_socket_set_tcp_cork(
+			event_get_fd(&bufev->ev_write), 1) == 0;
+	r = 0;
+done:
+	BEV_UNLOCK(bufev);
+	return r;
+}
+
+int
+bufferevent_socket_uncork(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	int r = -1;
+
+	_bufferevent_incref_and_lock(bufev);
+	if (bufev->be_ops != &bufferevent_ops_socket || !bufev_p->cork_count)
+		goto done;
+
+	if (--bufev_p->cork_count == 0) {
+		/* Anything we held back goes out now; with TCP_CORK, it
+		 * joins what the kernel held back, and all of it goes out
+		 * when we pull the cork. */
+		be_socket_write_now(bufev);
+		if (bufev_p->tcp_corked) {
+			be_socket_set_tcp_cork(
+				event_get_fd(&bufev->ev_write), 0);
+			bufev_p->tcp_corked = 0;
+		}
+	}
+	r = 0;
+done:
+	_bufferevent_decref_and_unlock(bufev);
+	return r;
+}
+
 /* XXXX Should non-socket bufferevents support this? */
 int
 bufferevent_priority_set(struct bufferevent *bufev, int priority)
@@ -614,6 +1063,13 @@ bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
 		goto done;
 
 	res = event_base_set(base, &bufev->ev_write);
+	if (res == -1)
+		goto done;
+
+	if (BEV_UPCAST(bufev)->edge_more)
+		res = event_base_set(base, BEV_UPCAST(bufev)->edge_more);
+	if (res == 0 && BEV_UPCAST(bufev)->stats)
+		res = _bufferevent_stats_set_base(BEV_UPCAST(bufev), base);
 done:
 	BEV_UNLOCK(bufev);
 	return res;
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include "event-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+
+#include <zlib.h>
+
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_zlib.h"
+#include "event2/buffer.h"
+#include "event2/event.h"
+#include "event2/util.h"
+#include "evthread-internal.h"
+#include "mm-internal.h"
+#include "util-internal.h"
+
+/* How much space to ask for at a time when (de)compressing into an
+ * evbuffer. */
+#define ZLIB_CHUNK_SIZE 16384
+
+/* A zlib stream, either compressing or decompressing. */
+struct zlib_stream {
+	/* The next idle stream in the pool. */
+	struct zlib_stream *next;
+	z_stream z;
+	/* True iff this stream compresses. */
+	int deflating;
+	/* The compression level we last set. */
+	int level;
+};
+
+struct bufferevent_zlib_pool {
+	void *lock;
+	int max_idle;
+	/* Streams that have been reset and are ready for reuse. */
+	struct zlib_stream *idle_deflate;
+	struct zlib_stream *idle_inflate;
+	int n_idle_deflate;
+	int n_idle_inflate;
+	ev_uint64_t n_created;
+	ev_uint64_t n_reused;
+};
+
+/* The filter context for a zlib bufferevent. */
+struct bufferevent_zlib {
+	struct bufferevent_zlib_pool *pool;
+	int level;
+	int flags;
+	/* Set up the first time we write or read, respectively. */
+	struct zlib_stream *deflate;
+	struct zlib_stream *inflate;
+	/* True iff we've finished the stream in that direction. */
+	unsigned deflate_done : 1;
+	unsigned inflate_done : 1;
+};
+
+/* Let zlib allocate its state with the same functions as we do.  zlib
+ * doesn't need the memory cleared, and its state is large enough that
+ * clearing it would cost more than setting it up. */
+static voidpf
+zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+	if (size && items > EV_SIZE_MAX / size)
+		return NULL;
+	return mm_malloc((size_t)items * size);
+}
+
+static void
+zlib_free(voidpf opaque, voidpf address)
+{
+	mm_free(address);
+}
+
+static void
+zlib_stream_free(struct zlib_stream *s)
+{
+	if (s->deflating)
+		deflateEnd(&s->z);
+	else
+		inflateEnd(&s->z);
+	mm_free(s);
+}
+
+/* Return a stream of the right kind for bz, from its pool if it has one
+ * to spare; or NULL on error. */
+static struct zlib_stream *
+zlib_stream_get(struct bufferevent_zlib *bz, int deflating)
+{
+	struct bufferevent_zlib_pool *pool = bz->pool;
+	struct zlib_stream *s = NULL, **idle;
+	int r;
+
+	if (pool) {
+		EVLOCK_LOCK(pool->lock, 0);
+		idle = deflating ? &pool->idle_deflate : &pool->idle_inflate;
+		if ((s = *idle) != NULL) {
+			*idle = s->next;
+			if (deflating)
+				--pool->n_idle_deflate;
+			else
+				--pool->n_idle_inflate;
+			++pool->n_reused;
+		} else {
+			++pool->n_created;
+		}
+		EVLOCK_UNLOCK(pool->lock, 0);
+	}
+
+	if (s) {
+		/* The stream was reset when it went back to the pool, so
+		 * it's safe to change its level now. */
+		if (!deflating || s->level == bz->level)
+			return s;
+		if (deflateParams(&s->z, bz->level, Z_DEFAULT_STRATEGY) ==
+		    Z_OK) {
+			s->level = bz->level;
+			return s;
+		}
+		zlib_stream_free(s);
+	}
+
+	if (!(s = mm_calloc(1, sizeof(struct zlib_stream))))
+		return NULL;
+	s->z.zalloc = zlib_alloc;
+	s->z.zfree = zlib_free;
+	s->deflating = deflating;
+	s->level = bz->level;
+	if (deflating)
+		r = deflateInit(&s->z, bz->level);
+	else
+		r = inflateInit(&s->z);
+	if (r != Z_OK) {
+		mm_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* Give s back to pool, or free it if the pool is full. */
+static void
+zlib_stream_put(struct bufferevent_zlib_pool *pool, struct zlib_stream *s)
+{
+	int r;
+
+	if (pool) {
+		r = s->deflating ? deflateReset(&s->z) : inflateReset(&s->z);
+		if (r == Z_OK) {
+			EVLOCK_LOCK(pool->lock, 0);
+			if (s->deflating &&
+			    pool->n_idle_deflate < pool->max_idle) {
+				s->next = pool->idle_deflate;
+				pool->idle_deflate = s;
+				++pool->n_idle_deflate;
+				s = NULL;
+			} else if (!s->deflating &&
+			    pool->n_idle_inflate < pool->max_idle) {
+				s->next = pool->idle_inflate;
+				pool->idle_inflate = s;
+				++pool->n_idle_inflate;
+				s = NULL;
+			}
+			EVLOCK_UNLOCK(pool->lock, 0);
+		}
+	}
+	if (s)
+		zlib_stream_free(s);
+}
+
+struct bufferevent_zlib_pool *
+bufferevent_zlib_pool_new(int max_idle)
+{
+	struct bufferevent_zlib_pool *pool;
+
+	if (max_idle < 0)
+		return NULL;
+	if (!(pool = mm_calloc(1, sizeof(struct bufferevent_zlib_pool))))
+		return NULL;
+	EVTHREAD_ALLOC_LOCK(pool->lock, 0);
+	pool->max_idle = max_idle;
+	return pool;
+}
+
+void
+bufferevent_zlib_pool_free(struct bufferevent_zlib_pool *pool)
+{
+	struct zlib_stream *s;
+
+	while ((s = pool->idle_deflate) != NULL) {
+		pool->idle_deflate = s->next;
+		zlib_stream_free(s);
+	}
+	while ((s = pool->idle_inflate) != NULL) {
+		pool->idle_inflate = s->next;
+		zlib_stream_free(s);
+	}
+	EVTHREAD_FREE_LOCK(pool->lock, 0);
+	mm_free(pool);
+}
+
+void
+bufferevent_zlib_pool_get_counts(struct bufferevent_zlib_pool *pool,
+    ev_uint64_t *n_created_out, ev_uint64_t *n_reused_out)
+{
+	EVLOCK_LOCK(pool->lock, 0);
+	*n_created_out = pool->n_created;
+	*n_reused_out = pool->n_reused;
+	EVLOCK_UNLOCK(pool->lock, 0);
+}
+
+/* Compress the data written to us into the underlying output.  We deflate
+ * straight from the chains in src into space reserved in dst, so the data
+ * is never copied anywhere else. */
+static enum bufferevent_filter_result
+zlib_output_filter(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx)
+{
+	struct bufferevent_zlib *bz = ctx;
+	struct evbuffer_iovec v_in, v_out;
+	z_streamp z;
+	size_t produced = 0, nread;
+	int flush, last, r;
+
+	if (bz->deflate_done)
+		return evbuffer_get_length(src) ? BEV_ERROR : BEV_OK;
+	if (!bz->deflate && !(bz->deflate = zlib_stream_get(bz, 1)))
+		return BEV_ERROR;
+	z = &bz->deflate->z;
+
+	if (mode == BEV_FINISHED)
+		flush = Z_FINISH;
+	else if (mode == BEV_FLUSH || (bz->flags & BEV_ZLIB_FLUSH_WRITES))
+		flush = Z_SYNC_FLUSH;
+	else
+		flush = Z_NO_FLUSH;
+
+	for (;;) {
+		if (evbuffer_peek(src, -1, NULL, &v_in, 1) < 1) {
+			v_in.iov_base = NULL;
+			v_in.iov_len = 0;
+		}
+		/* Only flush once deflate() has seen all our data. */
+		last = v_in.iov_len == evbuffer_get_length(src);
+		if (!v_in.iov_len && flush == Z_NO_FLUSH)
+			break;
+		if (lim >= 0 && produced >= (size_t)lim)
+			break;
+
+		if (evbuffer_reserve_space(dst, ZLIB_CHUNK_SIZE, &v_out, 1) < 1)
+			return BEV_ERROR;
+		z->next_in = v_in.iov_base;
+		z->avail_in = v_in.iov_len;
+		z->next_out = v_out.iov_base;
+		z->avail_out = v_out.iov_len;
+
+		r = deflate(z, last ? flush : Z_NO_FLUSH);
+
+		nread = v_in.iov_len - z->avail_in;
+		v_out.iov_len -= z->avail_out;
+		produced += v_out.iov_len;
+		evbuffer_commit_space(dst, &v_out, 1);
+		evbuffer_drain(src, nread);
+
+		if (r == Z_STREAM_END) {
+			bz->deflate_done = 1;
+			break;
+		}
+		if (r == Z_BUF_ERROR && !nread && !v_out.iov_len)
+			break;
+		if (r != Z_OK && r != Z_BUF_ERROR)
+			return BEV_ERROR;
+		/* Once deflate() leaves room in the output, it has done all
+		 * it can with what we gave it; but to finish, we have to
+		 * keep calling it until it says so. */
+		if (last && !z->avail_in && z->avail_out && flush != Z_FINISH)
+			break;
+	}
+
+	return BEV_OK;
+}
+
+/* Decompress the data from the underlying input into our input. */
+static enum bufferevent_filter_result
+zlib_input_filter(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx)
+{
+	struct bufferevent_zlib *bz = ctx;
+	struct evbuffer_iovec v_in, v_out;
+	z_streamp z;
+	size_t produced = 0, nread;
+	int r;
+
+	if (bz->inflate_done)
+		return evbuffer_get_length(src) ? BEV_ERROR : BEV_NEED_MORE;
+	if (!bz->inflate && !(bz->inflate = zlib_stream_get(bz, 0)))
+		return BEV_ERROR;
+	z = &bz->inflate->z;
+
+	while (evbuffer_peek(src, -1, NULL, &v_in, 1) > 0) {
+		if (lim >= 0 && produced >= (size_t)lim)
+			break;
+
+		if (evbuffer_reserve_space(dst, ZLIB_CHUNK_SIZE, &v_out, 1) < 1)
+			return BEV_ERROR;
+		z->next_in = v_in.iov_base;
+		z->avail_in = v_in.iov_len;
+		z->next_out = v_out.iov_base;
+		z->avail_out = v_out.iov_len;
+
+		r = inflate(z, Z_SYNC_FLUSH);
+
+		nread = v_in.iov_len - z->avail_in;
+		v_out.iov_len -= z->avail_out;
+		produced += v_out.iov_len;
+		evbuffer_commit_space(dst, &v_out, 1);
+		evbuffer_drain(src, nread);
+
+		if (r == Z_STREAM_END) {
+			bz->inflate_done = 1;
+			if (evbuffer_get_length(src))
+				return BEV_ERROR;
+			break;
+		}
+		if (r == Z_BUF_ERROR && !nread && !v_out.iov_len)
+			break;
+		if (r != Z_OK && r != Z_BUF_ERROR)
+			return BEV_ERROR;
+	}
+
+	return produced ? BEV_OK : BEV_NEED_MORE;
+}
+
+static void
+zlib_ctx_free(void *ctx)
+{
+	struct bufferevent_zlib *bz = ctx;
+
+	if (bz->deflate)
+		zlib_stream_put(bz->pool, bz->deflate);
+	if (bz->inflate)
+		zlib_stream_put(bz->pool, bz->inflate);
+	mm_free(bz);
+}
+
+struct bufferevent *
+bufferevent_zlib_new(struct bufferevent *underlying, int level, int flags,
+    struct bufferevent_zlib_pool *pool, int options)
+{
+	struct bufferevent_zlib *bz;
+	struct bufferevent *bev;
+
+	if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+		return NULL;
+	if (!(bz = mm_calloc(1, sizeof(struct bufferevent_zlib))))
+		return NULL;
+	bz->pool = pool;
+	bz->level = level;
+	bz->flags = flags;
+
+	bev = bufferevent_filter_new(underlying, zlib_input_filter,
+	    zlib_output_filter, options, zlib_ctx_free, bz);
+	if (!bev) {
+		mm_free(bz);
+		return NULL;
+	}
+	return bev;
+}
@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#if defined(_EVENT_HAVE_RECVMMSG) || defined(_EVENT_HAVE_SENDMMSG)
+/* recvmmsg() and sendmmsg() are GNU extensions. */
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <errno.h>
+#ifdef _EVENT_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef _EVENT_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "event2/dgram.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event2/thread.h"
+#include "event2/util.h"
+#include "log-internal.h"
+#include "mm-internal.h"
+#include "util-internal.h"
+#include "evthread-internal.h"
+#include "defer-internal.h"
+
+#if defined(_EVENT_HAVE_RECVMMSG) && !defined(WIN32)
+#define USE_RECVMMSG 1
+#endif
+#if defined(_EVENT_HAVE_SENDMMSG) && !defined(WIN32)
+#define USE_SENDMMSG 1
+#endif
+
+/** How many datagrams we move per system call unless told otherwise. */
+#define EVDGRAM_DEFAULT_BATCH 32
+/** The most datagrams we'll move per system call.  Linux won't take more
+ * than this many messages in one recvmmsg() or sendmmsg() anyway. */
+#define EVDGRAM_MAX_BATCH 1024
+/** The largest datagram we expect unless told otherwise: enough for
+ * anything that fits in an Ethernet frame. */
+#define EVDGRAM_DEFAULT_MAX_SIZE 2048
+
+/** A datagram waiting to be sent. */
+struct evdgram_out {
+	TAILQ_ENTRY(evdgram_out) next;
+	/** Length of the data, which is stored right after this struct. */
+	size_t len;
+	/** Length of addr, or 0 if we're sending on a connected socket. */
+	ev_socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+TAILQ_HEAD(evdgram_outq, evdgram_out);
+
+/** Return a pointer to the data of an evdgram_out. */
+#define EVDGRAM_OUT_DATA(out) ((unsigned char *)((out) + 1))
+
+struct evdgram {
+	struct event_base *base;
+	evutil_socket_t fd;
+	unsigned options;
+
+	struct event ev_read;
+	/** Pending only while the socket has refused some of our queue. */
+	struct event ev_write;
+	/** Sends whatever we queue once the current callbacks are done. */
+	struct deferred_cb deferred;
+
+	evdgram_read_cb readcb;
+	evdgram_event_cb eventcb;
+	void *cbarg;
+
+	/** The most datagrams we move with one system call. */
+	int batch;
+	/** The largest datagram we can receive or send. */
+	size_t max_size;
+
+	/** Receive buffers: batch blocks of max_size bytes. */
+	unsigned char *in_buf;
+	/** Where we receive each datagram's source address. */
+	struct sockaddr_storage *in_addrs;
+	/** What we pass to the read callback. */
+	struct evdgram_msg *in_msgs;
+#ifndef WIN32
+	/** Scratch space to describe a batch to the kernel, for sending or
+	 * receiving. */
+	struct iovec *iov;
+#if defined(USE_RECVMMSG) || defined(USE_SENDMMSG)
+	struct mmsghdr *hdrs;
+	/** True iff the kernel told us it doesn't implement recvmmsg() or
+	 * sendmmsg(), so that we should move one datagram at a time. */
+	unsigned no_mmsg : 1;
+#endif
+#endif
+
+	/** Datagrams waiting to be sent. */
+	struct evdgram_outq outq;
+	size_t n_queued;
+	/** Sent datagrams that we can reuse without allocating. */
+	struct evdgram_outq spare;
+	int n_spare;
+
+	void *lock;
+	int refcnt;
+};
+
+#define EVDGRAM_LOCK(dg) EVLOCK_LOCK((dg)->lock, 0)
+#define EVDGRAM_UNLOCK(dg) EVLOCK_UNLOCK((dg)->lock, 0)
+
+static void evdgram_readcb(evutil_socket_t fd, short what, void *arg);
+static void evdgram_writecb(evutil_socket_t fd, short what, void *arg);
+static void evdgram_deferred_cb(struct deferred_cb *cb, void *arg);
+
+struct evdgram *
+evdgram_new(struct event_base *base, evutil_socket_t fd, unsigned options,
+    int batch, size_t max_size)
+{
+	struct evdgram *dg;
+
+	if (batch <= 0)
+		batch = EVDGRAM_DEFAULT_BATCH;
+	else if (batch > EVDGRAM_MAX_BATCH)
+		batch = EVDGRAM_MAX_BATCH;
+	if (max_size == 0)
+		max_size = EVDGRAM_DEFAULT_MAX_SIZE;
+	if (max_size > ((size_t)-1) / batch)
+		return NULL;
+
+	if ((dg = mm_calloc(1, sizeof(struct evdgram))) == NULL)
+		return NULL;
+	dg->base = base;
+	dg->fd = fd;
+	dg->options = options;
+	dg->batch = batch;
+	dg->max_size = max_size;
+	dg->refcnt = 1;
+	TAILQ_INIT(&dg->outq);
+	TAILQ_INIT(&dg->spare);
+
+	dg->in_buf = mm_malloc(batch * max_size);
+	dg->in_addrs = mm_calloc(batch, sizeof(struct sockaddr_storage));
+	dg->in_msgs = mm_calloc(batch, sizeof(struct evdgram_msg));
+	if (!dg->in_buf || !dg->in_addrs || !dg->in_msgs)
+		goto err;
+#ifndef WIN32
+	if ((dg->iov = mm_calloc(batch, sizeof(struct iovec))) == NULL)
+		goto err;
+#if defined(USE_RECVMMSG) || defined(USE_SENDMMSG)
+	if ((dg->hdrs = mm_calloc(batch, sizeof(struct mmsghdr))) == NULL)
+		goto err;
+#endif
+#endif
+
+	if (options & EVDGRAM_OPT_THREADSAFE) {
+		EVTHREAD_ALLOC_LOCK(dg->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+		if (dg->lock == NULL)
+			goto err;
+	}
+
+	event_assign(&dg->ev_read, base, fd, EV_READ|EV_PERSIST,
+	    evdgram_readcb, dg);
+	event_assign(&dg->ev_write, base, fd, EV_WRITE|EV_PERSIST,
+	    evdgram_writecb, dg);
+	event_deferred_cb_init(&dg->deferred, evdgram_deferred_cb, dg);
+
+	return dg;
+err:
+	if (dg->in_buf)
+		mm_free(dg->in_buf);
+	if (dg->in_addrs)
+		mm_free(dg->in_addrs);
+	if (dg->in_msgs)
+		mm_free(dg->in_msgs);
+#ifndef WIN32
+	if (dg->iov)
+		mm_free(dg->iov);
+#if defined(USE_RECVMMSG) || defined(USE_SENDMMSG)
+	if (dg->hdrs)
+		mm_free(dg->hdrs);
+#endif
+#endif
+	mm_free(dg);
+	return NULL;
+}
+
+static void
+evdgram_incref_and_lock(struct evdgram *dg)
+{
+	EVDGRAM_LOCK(dg);
+	++dg->refcnt;
+}
+
+/* Helper: throw away every datagram waiting to be sent. */
+static void
+evdgram_discard_queued(struct evdgram *dg)
+{
+	struct evdgram_out *out;
+
+	while ((out = TAILQ_FIRST(&dg->outq)) != NULL) {
+		TAILQ_REMOVE(&dg->outq, out, next);
+		mm_free(out);
+	}
+	dg->n_queued = 0;
+}
+
+static void
+evdgram_decref_and_unlock(struct evdgram *dg)
+{
+	struct evdgram_out *out;
+
+	if (--dg->refcnt) {
+		EVDGRAM_UNLOCK(dg);
+		return;
+	}
+
+	event_del(&dg->ev_read);
+	event_del(&dg->ev_write);
+	evdgram_discard_queued(dg);
+	while ((out = TAILQ_FIRST(&dg->spare)) != NULL) {
+		TAILQ_REMOVE(&dg->spare, out, next);
+		mm_free(out);
+	}
+	if (dg->options & EVDGRAM_OPT_CLOSE_ON_FREE)
+		EVUTIL_CLOSESOCKET(dg->fd);
+
+	EVDGRAM_UNLOCK(dg);
+	EVTHREAD_FREE_LOCK(dg->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+
+	mm_free(dg->in_buf);
+	mm_free(dg->in_addrs);
+	mm_free(dg->in_msgs);
+#ifndef WIN32
+	mm_free(dg->iov);
+#if defined(USE_RECVMMSG) || defined(USE_SENDMMSG)
+	mm_free(dg->hdrs);
+#endif
+#endif
+	mm_free(dg);
+}
+
+void
+evdgram_free(struct evdgram *dg)
+{
+	EVDGRAM_LOCK(dg);
+	/* If we're inside one of our own callbacks, the caller still holds
+	 * a reference; make sure it neither calls the user nor sends
+	 * anything again. */
+	event_del(&dg->ev_read);
+	event_del(&dg->ev_write);
+	evdgram_discard_queued(dg);
+	dg->readcb = NULL;
+	dg->eventcb = NULL;
+	evdgram_decref_and_unlock(dg);
+}
+
+void
+evdgram_setcb(struct evdgram *dg, evdgram_read_cb readcb,
+    evdgram_event_cb eventcb, void *arg)
+{
+	EVDGRAM_LOCK(dg);
+	dg->readcb = readcb;
+	dg->eventcb = eventcb;
+	dg->cbarg = arg;
+	EVDGRAM_UNLOCK(dg);
+}
+
+int
+evdgram_enable(struct evdgram *dg)
+{
+	int r;
+
+	EVDGRAM_LOCK(dg);
+	r = event_add(&dg->ev_read, NULL);
+	EVDGRAM_UNLOCK(dg);
+	return r;
+}
+
+int
+evdgram_disable(struct evdgram *dg)
+{
+	int r;
+
+	EVDGRAM_LOCK(dg);
+	r = event_del(&dg->ev_read);
+	EVDGRAM_UNLOCK(dg);
+	return r;
+}
+
+evutil_socket_t
+evdgram_get_fd(struct evdgram *dg)
+{
+	return dg->fd;
+}
+
+struct event_base *
+evdgram_get_base(struct evdgram *dg)
+{
+	return dg->base;
+}
+
+size_t
+evdgram_get_queued(struct evdgram *dg)
+{
+	size_t n;
+
+	EVDGRAM_LOCK(dg);
+	n = dg->n_queued;
+	EVDGRAM_UNLOCK(dg);
+	return n;
+}
+
+/* Helper: invoke the event callback, keeping the current socket error.
+ * Requires that we hold the lock and a reference. */
+static void
+evdgram_run_eventcb(struct evdgram *dg, short what)
+{
+	int err = EVUTIL_SOCKET_ERROR();
+
+	if (dg->eventcb) {
+		EVUTIL_SET_SOCKET_ERROR(err);
+		dg->eventcb(dg, what, dg->cbarg);
+	}
+}
+
+#ifndef WIN32
+/* Helper: point m at one datagram's worth of memory. */
+static void
+evdgram_fill_msghdr(struct msghdr *m, struct iovec *iov, void *name,
+    ev_socklen_t namelen)
+{
+	memset(m, 0, sizeof(*m));
+	m->msg_name = name;
+	m->msg_namelen = namelen;
+	m->msg_iov = iov;
+	m->msg_iovlen = 1;
+}
+#endif
+
+/* Helper: receive up to a batch of datagrams into our buffers, and set up
+ * in_msgs to describe them.  Returns the number of datagrams we got, or
+ * -1 with the socket error set if we couldn't get any. */
+static int
+evdgram_recv_batch(struct evdgram *dg)
+{
+	int i, n;
+
+#ifndef WIN32
+	for (i = 0; i < dg->batch; ++i) {
+		dg->iov[i].iov_base = dg->in_buf + i * dg->max_size;
+		dg->iov[i].iov_len = dg->max_size;
+	}
+#endif
+#ifdef USE_RECVMMSG
+	if (!dg->no_mmsg) {
+		for (i = 0; i < dg->batch; ++i)
+			evdgram_fill_msghdr(&dg->hdrs[i].msg_hdr, &dg->iov[i],
+			    &dg->in_addrs[i], sizeof(struct sockaddr_storage));
+		n = recvmmsg(dg->fd, dg->hdrs, dg->batch, 0, NULL);
+		if (n >= 0 || errno != ENOSYS) {
+			for (i = 0; i < n; ++i) {
+				struct evdgram_msg *msg = &dg->in_msgs[i];
+				struct msghdr *m = &dg->hdrs[i].msg_hdr;
+				msg->data = dg->iov[i].iov_base;
+				msg->len = dg->hdrs[i].msg_len;
+				msg->addr = (struct sockaddr *)&dg->in_addrs[i];
+				msg->addrlen = (int)m->msg_namelen;
+				msg->truncated = (m->msg_flags & MSG_TRUNC) != 0;
+			}
+			return n;
+		}
+		/* An old kernel: fall back to one datagram per call. */
+		dg->no_mmsg = 1;
+	}
+#endif
+
+	for (n = 0; n < dg->batch; ++n) {
+		struct evdgram_msg *msg = &dg->in_msgs[n];
+		ev_socklen_t addrlen = sizeof(struct sockaddr_storage);
+		int truncated = 0;
+		ev_ssize_t r;
+#ifdef WIN32
+		msg->data = dg->in_buf + n * dg->max_size;
+		r = recvfrom(dg->fd, msg->data, (int)dg->max_size, 0,
+		    (struct sockaddr *)&dg->in_addrs[n], &addrlen);
+		if (r < 0 && EVUTIL_SOCKET_ERROR() == WSAEMSGSIZE) {
+			/* Windows fills the buffer, then calls it an error. */
+			r = dg->max_size;
+			truncated = 1;
+		}
+#else
+		struct msghdr m;
+		msg->data = dg->iov[n].iov_base;
+		evdgram_fill_msghdr(&m, &dg->iov[n], &dg->in_addrs[n],
+		    addrlen);
+		r = recvmsg(dg->fd, &m, 0);
+		addrlen = m.msg_namelen;
+		truncated = (m.msg_flags & MSG_TRUNC) != 0;
+#endif
+		if (r < 0)
+			return n ? n : -1;
+		msg->len = r;
+		msg->addr = (struct sockaddr *)&dg->in_addrs[n];
+		msg->addrlen = (int)addrlen;
+		msg->truncated = truncated;
+	}
+	return n;
+}
+
+/* Helper: remove the first datagram from the send queue. */
+static void
+evdgram_out_pop(struct evdgram *dg)
+{
+	struct evdgram_out *out = TAILQ_FIRST(&dg->outq);
+
+	TAILQ_REMOVE(&dg->outq, out, next);
+	--dg->n_queued;
+	if (dg->n_spare < dg->batch) {
+		TAILQ_INSERT_HEAD(&dg->spare, out, next);
+		++dg->n_spare;
+	} else {
+		mm_free(out);
+	}
+}
+
+/* Helper: send up to a batch of datagrams from the front of the queue, and
+ * remove the ones we sent.  Returns the number of datagrams sent, or -1
+ * with the socket error set if we couldn't send any. */
+static int
+evdgram_send_batch(struct evdgram *dg)
+{
+	struct evdgram_out *out;
+	int i, n;
+
+#ifdef USE_SENDMMSG
+	if (!dg->no_mmsg) {
+		for (i = 0, out = TAILQ_FIRST(&dg->outq);
+		     out && i < dg->batch; out = TAILQ_NEXT(out, next), ++i) {
+			dg->iov[i].iov_base = EVDGRAM_OUT_DATA(out);
+			dg->iov[i].iov_len = out->len;
+			evdgram_fill_msghdr(&dg->hdrs[i].msg_hdr, &dg->iov[i],
+			    out->addrlen ? &out->addr : NULL, out->addrlen);
+		}
+		n = sendmmsg(dg->fd, dg->hdrs, i, 0);
+		if (n >= 0 || errno != ENOSYS)
+			goto done;
+		dg->no_mmsg = 1;
+	}
+#endif
+
+	for (n = 0, out = TAILQ_FIRST(&dg->outq); out && n < dg->batch;
+	     out = TAILQ_NEXT(out, next), ++n) {
+		const struct sockaddr *addr =
+		    out->addrlen ? (struct sockaddr *)&out->addr : NULL;
+#ifdef WIN32
+		if (sendto(dg->fd, (const char *)EVDGRAM_OUT_DATA(out),
+			(int)out->len, 0, addr, out->addrlen) < 0)
+			break;
+#else
+		if (sendto(dg->fd, EVDGRAM_OUT_DATA(out), out->len, 0, addr,
+			out->addrlen) < 0)
+			break;
+#endif
+	}
+	if (n == 0)
+		n = -1;
+#ifdef USE_SENDMMSG
+done:
+#endif
+	for (i = 0; i < n; ++i)
+		evdgram_out_pop(dg);
+	return n;
+}
+
+/* Helper: send as much of the send queue as the socket will take, and make
+ * sure we'll hear about it when the socket can take the rest.  Returns the
+ * number of datagrams sent, or -1 if we couldn't send any of a non-empty
+ * queue.  Requires that we hold the lock and a reference. */
+static int
+evdgram_flush_locked(struct evdgram *dg)
+{
+	int n, sent = 0, failed = 0;
+
+	while (dg->n_queued) {
+		n = evdgram_send_batch(dg);
+		if (n < 0) {
+			int err = EVUTIL_SOCKET_ERROR();
+			if (EVUTIL_ERR_RW_RETRIABLE(err))
+				break;
+			/* Something is wrong with this datagram or its
+			 * destination.  Drop it and go on with the rest. */
+			failed = 1;
+			evdgram_out_pop(dg);
+			EVUTIL_SET_SOCKET_ERROR(err);
+			evdgram_run_eventcb(dg,
+			    EVDGRAM_EVENT_WRITING|EVDGRAM_EVENT_ERROR);
+			continue;
+		}
+		sent += n;
+	}
+
+	if (dg->n_queued)
+		event_add(&dg->ev_write, NULL);
+	else
+		event_del(&dg->ev_write);
+
+	return (sent || !(failed || dg->n_queued)) ? sent : -1;
+}
+
+int
+evdgram_send(struct evdgram *dg, const void *data, size_t len,
+    const struct sockaddr *addr, int addrlen)
+{
+	struct evdgram_out *out;
+
+	if (len > dg->max_size || addrlen < 0 ||
+	    (addr && (size_t)addrlen > sizeof(struct sockaddr_storage)))
+		return -1;
+
+	evdgram_incref_and_lock(dg);
+	if ((out = TAILQ_FIRST(&dg->spare)) != NULL) {
+		TAILQ_REMOVE(&dg->spare, out, next);
+		--dg->n_spare;
+	} else if ((out = mm_malloc(sizeof(struct evdgram_out) +
+		    dg->max_size)) == NULL) {
+		evdgram_decref_and_unlock(dg);
+		return -1;
+	}
+	memcpy(EVDGRAM_OUT_DATA(out), data, len);
+	out->len = len;
+	if (addr) {
+		memcpy(&out->addr, addr, addrlen);
+		out->addrlen = addrlen;
+	} else {
+		out->addrlen = 0;
+	}
+	TAILQ_INSERT_TAIL(&dg->outq, out, next);
+
+	/* Send a full batch at once.  Otherwise, unless we're waiting for
+	 * the socket to become writable, send everything queued so far after
+	 * the event loop is done running callbacks, so that whatever they
+	 * queue goes out together without our asking the backend to watch
+	 * for writability. */
+	if (++dg->n_queued == (size_t)dg->batch) {
+		evdgram_flush_locked(dg);
+	} else if (dg->n_queued == 1 && !dg->deferred.queued) {
+		++dg->refcnt;
+		event_deferred_cb_schedule(
+			event_base_get_deferred_cb_queue(dg->base),
+			&dg->deferred);
+	}
+	evdgram_decref_and_unlock(dg);
+	return 0;
+}
+
+int
+evdgram_flush(struct evdgram *dg)
+{
+	int r;
+
+	evdgram_incref_and_lock(dg);
+	r = evdgram_flush_locked(dg);
+	evdgram_decref_and_unlock(dg);
+	return r;
+}
+
+static void
+evdgram_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdgram *dg = arg;
+	int n;
+
+	evdgram_incref_and_lock(dg);
+	n = evdgram_recv_batch(dg);
+	if (n > 0) {
+		if (dg->readcb)
+			dg->readcb(dg, dg->in_msgs, n, dg->cbarg);
+	} else if (n < 0) {
+		int err = EVUTIL_SOCKET_ERROR();
+		if (!EVUTIL_ERR_RW_RETRIABLE(err))
+			evdgram_run_eventcb(dg,
+			    EVDGRAM_EVENT_READING|EVDGRAM_EVENT_ERROR);
+	}
+	evdgram_decref_and_unlock(dg);
+}
+
+static void
+evdgram_writecb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdgram *dg = arg;
+
+	evdgram_incref_and_lock(dg);
+	evdgram_flush_locked(dg);
+	evdgram_decref_and_unlock(dg);
+}
+
+static void
+evdgram_deferred_cb(struct deferred_cb *cb, void *arg)
+{
+	struct evdgram *dg = arg;
+
+	/* evdgram_send() took a reference for us. */
+	EVDGRAM_LOCK(dg);
+	evdgram_flush_locked(dg);
+	evdgram_decref_and_unlock(dg);
+}
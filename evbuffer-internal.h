@@ -47,6 +47,10 @@ extern "C" {
 #include <sys/queue.h>
 /* minimum allocation for a chain. */
 #define MIN_BUFFER_SIZE	256
+/* smallest piece of a chain that evbuffer_remove_buffer_reference() will
+ * share rather than copy.  Sharing keeps the whole chain alive, and makes
+ * it read-only, so it only pays for itself on larger pieces. */
+#define MIN_SLICE_SIZE	4096
 
 /** A single evbuffer callback for an evbuffer. This function will be invoked
  * when bytes are added to or removed from the evbuffer. */
@@ -68,6 +72,8 @@ struct evbuffer_cb_entry {
 
 struct bufferevent;
 struct evbuffer_chain;
+struct evbuffer_zerocopy;
+struct evbuffer_cb_batch;
 struct evbuffer {
 	/** The first chain in this buffer's linked list of chains. */
 	struct evbuffer_chain *first;
@@ -137,6 +143,58 @@ struct evbuffer {
 	/** The parent bufferevent object this evbuffer belongs to.
 	 * NULL if the evbuffer stands alone. */
 	struct bufferevent *parent;
+
+	/** State for writing this buffer with MSG_ZEROCOPY, or NULL if we
+	 * have never been asked to. */
+	struct evbuffer_zerocopy *zerocopy;
+
+	/** True iff evbuffer_set_coalesce() has been called: use
+	 * min_chain_size and max_move below instead of the default chain
+	 * layout policy. */
+	unsigned coalesce : 1;
+	/** The smallest chain we allocate when adding data. */
+	size_t min_chain_size;
+	/** The most data we memmove at once to reuse free space or to merge
+	 * chains. */
+	size_t max_move;
+	/** Total number of bytes we have ever moved or copied within this
+	 * buffer to realign, pull up, or merge chains. */
+	ev_uint64_t n_bytes_moved;
+
+	/** If nonzero, evbuffer_read() sizes its reads adaptively instead of
+	 * asking the kernel with FIONREAD, and never reads more than this
+	 * much at once. */
+	size_t max_read;
+	/** In adaptive mode, how much evbuffer_read() will try to read next
+	 * time. */
+	size_t read_size;
+
+	/** True iff evbuffer_set_ring() has been called: the buffer's only
+	 * chain is an EVBUFFER_RING chain, which it never frees or grows. */
+	unsigned ring : 1;
+
+	/** If set, the batch that runs this buffer's callbacks for us. */
+	struct evbuffer_cb_batch *cb_batch;
+	/** True iff we are on cb_batch's list of buffers whose callbacks
+	 * need to run. */
+	unsigned batch_pending : 1;
+	/** Our entry in that list. */
+	TAILQ_ENTRY(evbuffer) batch_next;
+};
+
+/** A set of evbuffers whose callbacks run together, either when the user
+ * asks for it or at the end of each event loop iteration. */
+struct evbuffer_cb_batch {
+	/** If set, where to schedule the end-of-iteration flush. */
+	struct deferred_cb_queue *cb_queue;
+	/** Used to flush the batch from the event loop.  Scheduled once per
+	 * batch, not once per buffer. */
+	struct deferred_cb deferred;
+	/** The buffers that have been changed since their callbacks last
+	 * ran. */
+	TAILQ_HEAD(evbuffer_batchq, evbuffer) pending;
+	/** How many evbuffers are using this batch. */
+	int n_buffers;
 };
 
 /** A single item in an evbuffer. */
@@ -158,6 +216,13 @@ struct evbuffer_chain {
 
 	/** Set if special handling is required for this chain */
 	unsigned flags;
+	/** Number of references to this chain: one for the buffer that holds
+	 * it, plus one for each EVBUFFER_MULTICAST chain that shares its
+	 * memory.  The chain is freed when this drops to zero. */
+	int refcnt;
+	/** If EVBUFFER_RECORD_END is set, the tag given to
+	 * evbuffer_mark_record_end() for the record ending here. */
+	ev_uint32_t tag;
 #define EVBUFFER_MMAP		0x0001  /**< memory in buffer is mmaped */
 #define EVBUFFER_SENDFILE	0x0002  /**< a chain used for sendfile */
 #define EVBUFFER_REFERENCE	0x0004	/**< a chain with a mem reference */
@@ -170,6 +235,15 @@ struct evbuffer_chain {
 	/** a chain that should be freed, but can't be freed until it is
 	 * un-pinned. */
 #define EVBUFFER_DANGLING	0x0040
+	/** a chain that shares the memory of a chain in another evbuffer */
+#define EVBUFFER_MULTICAST	0x0080
+	/** a chain that holds a range of an evbuffer_file_segment */
+#define EVBUFFER_FILESEGMENT	0x0100
+	/** the one chain of a ring-buffer evbuffer */
+#define EVBUFFER_RING		0x0200
+	/** a chain whose last byte ends a record.  Such a chain is also
+	 * EVBUFFER_IMMUTABLE, so that nothing gets appended after the mark. */
+#define EVBUFFER_RECORD_END	0x0400
 
 	/** Usually points to the read-write memory belonging to this
 	 * buffer allocated as part of the evbuffer_chain allocation.
@@ -195,6 +269,162 @@ struct evbuffer_chain_reference {
 	void *extra;
 };
 
+/** A file (or part of one) that can be added to any number of evbuffers,
+ * in any number of ranges.  Each chain that holds a range of it keeps a
+ * reference, so the fd stays open and any memory stays mapped until the
+ * last range has been written or drained. */
+struct evbuffer_file_segment {
+	/** Protects refcnt, since chains in different evbuffers (and so,
+	 * possibly, in different threads) share this segment. */
+	void *lock;
+	/** One for the caller, plus one for each EVBUFFER_FILESEGMENT chain
+	 * that refers to us. */
+	int refcnt;
+	/** Some combination of EVBUF_FS_* flags. */
+	unsigned flags;
+	/** True iff we send the data with sendfile, and don't keep a copy
+	 * of it in memory. */
+	unsigned can_sendfile : 1;
+	/** True iff contents points into an mmap()ed region. */
+	unsigned is_mapping : 1;
+	/** The fd that the data comes from. */
+	int fd;
+	/** If we aren't using sendfile, the data of the segment: either in
+	 * mapping, or in memory we allocated and read the file into. */
+	char *contents;
+	/** If is_mapping is set, the start and length of the mapped region.
+	 * This can start before contents, since mmap offsets have to be a
+	 * multiple of the page size. */
+	void *mapping;
+	size_t mapping_len;
+	/** Where in the file the segment starts, and how long it is. */
+	off_t file_offset;
+	off_t length;
+};
+
+/** Extra data for an EVBUFFER_FILESEGMENT chain. */
+struct evbuffer_chain_file_segment {
+	/** The segment this chain holds a range of.  We hold a reference
+	 * to it. */
+	struct evbuffer_file_segment *segment;
+};
+
+/** Extra data for the EVBUFFER_RING chain of an evbuffer that
+ * evbuffer_set_ring() has turned into a ring buffer.  The chain's data
+ * always starts at a misalign of less than size.  If the ring is mirrored,
+ * chain->buffer points at 2*size bytes of address space whose halves map
+ * the same memory, and we keep chain->buffer_len at misalign + size so that
+ * the free space after the data is contiguous too. */
+struct evbuffer_chain_ring {
+	/** How many bytes the ring holds. */
+	size_t size;
+	/** True iff the ring memory is mapped twice. */
+	unsigned mirrored : 1;
+};
+
+/** A chain that we have handed to the kernel with one or more MSG_ZEROCOPY
+ * sends.  It stays pinned with EVBUFFER_MEM_PINNED_W until the kernel has
+ * reported every one of those sends as complete. */
+struct evbuffer_zerocopy_pin {
+	TAILQ_ENTRY(evbuffer_zerocopy_pin) next;
+	/** The pinned chain.  It may have been drained out of the buffer
+	 * already, in which case it is marked EVBUFFER_DANGLING. */
+	struct evbuffer_chain *chain;
+	/** Ids of the first and last sends that may refer to this chain. */
+	ev_uint32_t first_id, last_id;
+	/** How many ids in [first_id, last_id] the kernel has completed. */
+	ev_uint32_t n_done;
+};
+
+TAILQ_HEAD(evbuffer_zerocopy_pinq, evbuffer_zerocopy_pin);
+
+/** Per-evbuffer state for zero-copy sends on a socket. */
+struct evbuffer_zerocopy {
+	/** The socket we enabled SO_ZEROCOPY on, or -1. */
+	evutil_socket_t fd;
+	/** Writes of fewer than this many bytes go through writev as
+	 * usual; 0 if we should not start any new zero-copy sends. */
+	size_t threshold;
+	/** True iff SO_ZEROCOPY is enabled on fd. */
+	unsigned active : 1;
+	/** The id the kernel will give to our next zero-copy send. */
+	ev_uint32_t next_id;
+	/** How many sends the kernel has reported complete. */
+	ev_uint32_t n_completed;
+	/** Pinned chains, in the order we sent them. */
+	struct evbuffer_zerocopy_pinq pins;
+	/** Unused pin records, kept so that we never have to allocate after
+	 * the kernel already has our memory. */
+	struct evbuffer_zerocopy_pinq spare;
+	int n_spare;
+};
+
+/** Extra data for an EVBUFFER_MULTICAST chain: which chain it shares memory
+ * with, and the buffer that chain came from. */
+struct evbuffer_multicast_parent {
+	/** The evbuffer that the parent chain was added from.  We hold a
+	 * reference to it, so that its lock outlives the parent chain. */
+	struct evbuffer *source;
+	/** The chain whose memory we point into.  We hold a reference to it,
+	 * and it is marked EVBUFFER_IMMUTABLE so nobody will move or
+	 * overwrite its data. */
+	struct evbuffer_chain *parent;
+};
+
+/** A batch of chains handed from the producer of an evbuffer_handoff to
+ * its consumer. */
+struct evbuffer_handoff_node {
+	/** The next batch, or NULL.  Written by the producer to publish a
+	 * batch; read by the consumer. */
+	struct evbuffer_handoff_node *volatile next;
+	/** The chains in this batch, as they were in the producer's
+	 * evbuffer. */
+	struct evbuffer_chain *first, *last, *previous_to_last;
+	/** Total number of bytes in the chains. */
+	size_t len;
+};
+
+/** A single-producer/single-consumer queue of evbuffer chains.
+ *
+ * This is an unbounded SPSC linked queue: the consumer's head is always a
+ * dummy batch whose chains it has already taken, and the producer reuses
+ * batches that the consumer has moved past, so neither side allocates in
+ * the steady state or waits for the other.
+ */
+struct evbuffer_handoff {
+	/* Consumer side. */
+	/** The last batch we consumed.  Only the consumer writes this; the
+	 * producer reads it to find batches it can reuse. */
+	struct evbuffer_handoff_node *volatile head;
+	/** If set, an evbuffer that we should move data into from the
+	 * consumer's event loop whenever the producer adds some. */
+	struct evbuffer *consumer;
+	struct deferred_cb_queue *cb_queue;
+	struct deferred_cb deferred;
+
+	/* Producer side. */
+	/** The last batch we published. */
+	struct evbuffer_handoff_node *tail;
+	/** The oldest batch we allocated: every batch from here up to
+	 * (but not including) head_copy can be reused. */
+	struct evbuffer_handoff_node *first;
+	/** A recent value of head. */
+	struct evbuffer_handoff_node *head_copy;
+
+	/* Shared. */
+	/** Bytes published but not yet consumed. */
+	volatile size_t total_len;
+	/** True iff the consumer has run out of data, and wants the
+	 * producer to wake it up.  Whoever clears it gets to (or has to)
+	 * schedule the consumer. */
+	volatile int sleeping;
+#ifndef _EVENT_HAVE_SYNC_BUILTINS
+	/** Without atomic operations, we just lock around pushes and
+	 * pulls. */
+	void *lock;
+#endif
+};
+
 #define EVBUFFER_CHAIN_SIZE sizeof(struct evbuffer_chain)
 /** Return a pointer to extra data allocated along with an evbuffer. */
 #define EVBUFFER_CHAIN_EXTRA(t, c) (t *)((struct evbuffer_chain *)(c) + 1)
@@ -255,6 +485,35 @@ int _evbuffer_read_setup_vecs(struct evbuffer *buf, ev_ssize_t howmuch,
 /** Set the parent bufferevent object for buf to bev */
 void evbuffer_set_parent(struct evbuffer *buf, struct bufferevent *bev);
 
+/** Make evbuffer_write_atmost() use MSG_ZEROCOPY for writes of at least
+ * 'threshold' bytes to the socket 'fd', or turn that off if threshold is 0.
+ * If fd is -1, remember the threshold until we are called with a real
+ * socket.  Returns 0 on success, -1 if the kernel or platform doesn't
+ * support zero-copy sends. */
+int _evbuffer_set_zerocopy(struct evbuffer *buf, evutil_socket_t fd,
+    size_t threshold);
+/** Return the threshold most recently passed to _evbuffer_set_zerocopy(),
+ * or 0 if zero-copy sends are off. */
+size_t _evbuffer_get_zerocopy(struct evbuffer *buf);
+/** Read zero-copy completion notices from the error queue of fd, and unpin
+ * every chain that the kernel no longer needs.  Returns 0 on success, -1
+ * on error. */
+int _evbuffer_zerocopy_reap(struct evbuffer *buf, evutil_socket_t fd);
+/** Like _evbuffer_zerocopy_reap(), but if chains are still pinned, wait up
+ * to msec milliseconds for their completions.  Returns 0 if nothing is
+ * pinned any more, -1 if something still is or on error. */
+int _evbuffer_zerocopy_linger(struct evbuffer *buf, evutil_socket_t fd,
+    int msec);
+
+/** Return the capacity of buf if it is a ring evbuffer, or 0 if it isn't
+ * one. */
+size_t _evbuffer_get_ring_size(struct evbuffer *buf);
+
+/** Return true iff buf is empty, and nothing has been set up on it but
+ * n_cbs callbacks belonging to its owner, so that the owner could free it
+ * and later replace it with a fresh evbuffer without anyone noticing. */
+int _evbuffer_is_disposable(struct evbuffer *buf, int n_cbs);
+
 #ifdef __cplusplus
 }
 #endif
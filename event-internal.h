@@ -162,6 +162,10 @@ struct event_base {
 
 	struct deferred_cb_queue defer_queue;
 
+	/** Counters for the bufferevents using this base that keep them, or
+	 * NULL if there have never been any. */
+	struct bufferevent_base_stats *bev_stats;
+
 	/** Mapping from file descriptors to enabled events */
 	struct event_io_map  io;
 
@@ -242,6 +246,10 @@ int _evsig_restore_handler(struct event_base *base, int evsignal);
 
 void event_active_nolock(struct event *ev, int res, short count);
 
+/** Free the bufferevent counters of a base that is going away, detaching
+ * the bufferevents that still use them. */
+void _bufferevent_base_stats_free(struct event_base *base);
+
 #ifdef __cplusplus
 }
 #endif
@@ -463,6 +463,8 @@ event_base_free(struct event_base *base)
 	}
 	if (base->common_timeout_queues)
 		mm_free(base->common_timeout_queues);
+	if (base->bev_stats)
+		_bufferevent_base_stats_free(base);
 
 	for (i = 0; i < base->nactivequeues; ++i) {
 		for (ev = TAILQ_FIRST(&base->activequeues[i]); ev; ) {
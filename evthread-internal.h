@@ -71,17 +71,19 @@ extern int _evthread_lock_debugging_enabled;
 			_evthread_lock_fns.free(_lock_tmp_, (locktype)); \
 	} while (0)
 
-/** Acquire a lock. */
+/** Acquire a lock.  Most objects (evbuffers in particular) never have
+    locking enabled, and this runs on every call, so we tell the compiler
+    to lay out the unlocked case as the straight line through. */
 #define EVLOCK_LOCK(lockvar,mode)					\
 	do {								\
-		if (lockvar)						\
+		if (EVUTIL_UNLIKELY((lockvar) != NULL))			\
 			_evthread_lock_fns.lock(mode, lockvar);		\
 	} while (0)
 
 /** Release a lock */
 #define EVLOCK_UNLOCK(lockvar,mode)					\
 	do {								\
-		if (lockvar)						\
+		if (EVUTIL_UNLIKELY((lockvar) != NULL))			\
 			_evthread_lock_fns.unlock(mode, lockvar);	\
 	} while (0)
 
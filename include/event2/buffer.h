@@ -174,6 +174,88 @@ size_t evbuffer_get_length(const struct evbuffer *buf);
 */
 size_t evbuffer_get_contiguous_space(const struct evbuffer *buf);
 
+/**
+   Tune how an evbuffer packs small additions into chains.
+
+   By default, adding many small pieces of data to an evbuffer can leave it
+   with many small chains, which makes for long iovec lists when writing
+   and expensive calls to evbuffer_pullup().  After this function is called,
+   the buffer:
+
+     - never allocates a chain smaller than min_chain_size when adding
+       data;
+     - moves up to max_move bytes to the front of its last chain when that
+       frees enough room at the end for new data;
+     - after evbuffer_drain(), merges its first two chains whenever that
+       means copying no more than max_move bytes.
+
+   @param buf the evbuffer to configure
+   @param min_chain_size the smallest chain to allocate for new data, or 0
+     for the default.
+   @param max_move the most bytes to move at once in order to reuse free
+     space or merge chains, or 0 to never move data for those reasons.
+   @return 0 on success, -1 on failure.
+   @see evbuffer_get_n_chains(), evbuffer_get_n_bytes_moved()
+*/
+int evbuffer_set_coalesce(struct evbuffer *buf, size_t min_chain_size,
+    size_t max_move);
+
+/**
+   Returns the number of chains that currently make up an evbuffer.
+
+   This takes time proportional to the number of chains; it is meant for
+   tuning and debugging, not for use on every operation.
+
+   @param buf pointer to the evbuffer
+   @return the number of chains in the buffer
+*/
+size_t evbuffer_get_n_chains(const struct evbuffer *buf);
+
+/**
+   Returns the total number of bytes that an evbuffer has ever moved or
+   copied internally to realign, pull up, or merge its chains.
+
+   @param buf pointer to the evbuffer
+   @return the number of bytes moved since the buffer was created
+*/
+ev_uint64_t evbuffer_get_n_bytes_moved(const struct evbuffer *buf);
+
+/** Flag for evbuffer_set_ring(): map the ring's memory twice in a row, so
+ * that data which wraps around the end of the ring is still contiguous.
+ * Ignored where mmap() is unavailable. */
+#define EVBUFFER_RING_MIRROR 0x01
+
+/**
+   Make an evbuffer keep all of its data in one ring buffer, allocated now,
+   that never grows.
+
+   Adding to or reading into a ring evbuffer copies into the free space of
+   the ring and never allocates memory, and evbuffer_read() and
+   evbuffer_write() become a single read and a single write call.  The
+   buffer's contents are always one contiguous extent: with
+   EVBUFFER_RING_MIRROR because the ring is mapped twice, and otherwise
+   because the buffer moves its data back to the start of the ring when it
+   needs the room.  evbuffer_reserve_space(), evbuffer_commit_space() and
+   evbuffer_peek() work as usual, and each returns a single extent.
+
+   Operations that would need more room than the ring has left fail instead
+   of growing the buffer: evbuffer_add() and friends return -1, and
+   evbuffer_read() reads no more than fits and fails with ENOBUFS when the
+   ring is full.  A bufferevent that reads into a ring evbuffer stops
+   reading while the ring is full, as if it had a read high-water mark of
+   the ring's size.  Moving data between a ring evbuffer and another
+   evbuffer copies it.  Adding files, file segments, or references (with
+   evbuffer_add_reference() or evbuffer_add_buffer_reference()) is not
+   supported.
+
+   @param buf the evbuffer to configure; it must be empty.
+   @param size the number of bytes the ring holds.  With
+     EVBUFFER_RING_MIRROR this is rounded up to a whole number of pages.
+   @param flags 0 or EVBUFFER_RING_MIRROR
+   @return 0 on success, -1 on failure.
+*/
+int evbuffer_set_ring(struct evbuffer *buf, size_t size, unsigned flags);
+
 /**
   Expands the available space in an event buffer.
 
@@ -280,6 +362,29 @@ int evbuffer_remove(struct evbuffer *buf, void *data, size_t datlen);
 int evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
     size_t datlen);
 
+/**
+  Like evbuffer_remove_buffer(), but never copies more than a little data.
+
+  evbuffer_remove_buffer() moves whole chunks of memory from src to dst,
+  but copies the part of a chunk that is only partly transferred.  This
+  function instead shares that part by reference, as
+  evbuffer_add_buffer_reference() would, so that the cost of the transfer
+  depends on the number of chunks rather than the number of bytes.  The
+  rest of the shared chunk stays in src, and becomes read-only there.
+  Pieces too small to be worth sharing, data that can't be shared (such
+  as file data sent with sendfile), and data that src itself shares from
+  another buffer are still copied.  Transfers to
+  or from a ring evbuffer copy, as usual.
+
+  @param src the event buffer to be read from
+  @param dst the destination event buffer to store the result into
+  @param datlen the maximum numbers of bytes to transfer
+  @return the number of bytes read, or -1 on error
+  @see evbuffer_remove_buffer()
+ */
+int evbuffer_remove_buffer_reference(struct evbuffer *src,
+    struct evbuffer *dst, size_t datlen);
+
 /** Used to tell evbuffer_readln what kind of line-ending to look for.
  */
 enum evbuffer_eol_style {
@@ -346,6 +451,66 @@ int evbuffer_add_reference(struct evbuffer *outbuf,
     const void *data, size_t datlen,
     evbuffer_ref_cleanup_cb cleanupfn, void *extra);
 
+/**
+  Add the contents of one evbuffer to another without copying or draining.
+
+  The data in inbuf is shared with outbuf by reference: no bytes are
+  copied, and inbuf keeps its contents.  This is useful for sending the
+  same message to many connections.  The shared memory is freed once every
+  buffer holding it has drained it (or been freed).
+
+  Afterwards the shared chains in inbuf become read-only, so anything added
+  to inbuf later goes into fresh memory.  Data in inbuf that was itself
+  added with evbuffer_add_buffer_reference() cannot be shared again, and
+  neither can data added with evbuffer_add_file() that uses sendfile.
+
+  @param outbuf the output buffer
+  @param inbuf the buffer whose contents should be shared
+  @return 0 if successful, or -1 if an error occurred
+ */
+int evbuffer_add_buffer_reference(struct evbuffer *outbuf,
+    struct evbuffer *inbuf);
+
+/**
+  Mark the end of the data in an evbuffer as the end of a record.
+
+  Record marks let code that adds whole messages to a buffer tell code
+  that removes them where each message ends, without a length header or
+  a scan through the data.  A mark stays attached to the byte it was set
+  after when that byte is moved to another buffer with
+  evbuffer_add_buffer(), evbuffer_remove_buffer(),
+  evbuffer_remove_buffer_reference(), or evbuffer_add_buffer_reference().
+  It is dropped when that byte is drained or removed, when the data is
+  copied (as with evbuffer_remove() or ring evbuffers), and when
+  evbuffer_pullup() merges it into the middle of the pulled-up data.
+
+  Data added to the buffer after the mark goes into a new chunk of memory.
+  Setting a mark doesn't run the buffer's callbacks, so a reader waiting
+  for a whole record won't notice it until more data arrives.  To hand a
+  record to a buffer that someone is watching, build it in an evbuffer of
+  its own, mark that, and then move it with evbuffer_add_buffer().
+
+  @param buf the evbuffer to mark
+  @param tag a value for the caller's use, returned by
+    evbuffer_get_record_length()
+  @return 0 if successful, or -1 if the buffer is empty, is a ring
+    evbuffer, or has its last byte in use by a pending read or write.
+  @see evbuffer_get_record_length()
+ */
+int evbuffer_mark_record_end(struct evbuffer *buf, ev_uint32_t tag);
+
+/**
+  Find the first record mark in an evbuffer.
+
+  @param buf the evbuffer to examine
+  @param tag_out if not NULL, set to the tag of the first record mark
+  @return the number of bytes up to and including the end of the first
+    record, or -1 if the buffer holds no record mark.
+  @see evbuffer_mark_record_end()
+ */
+ev_ssize_t evbuffer_get_record_length(struct evbuffer *buf,
+    ev_uint32_t *tag_out);
+
 /**
   Move data from a file into the evbuffer for writing to a socket.
 
@@ -368,9 +533,86 @@ int evbuffer_add_reference(struct evbuffer *outbuf,
 int evbuffer_add_file(struct evbuffer *output, int fd, off_t offset,
     size_t length);
 
+/**
+  A part of a file that can be added to evbuffers, in whole or in pieces,
+  any number of times.
+
+  Unlike evbuffer_add_file(), which hands a whole fd to a single evbuffer,
+  a file segment is reference-counted: every range added from it shares
+  the same fd (and, if the segment is kept in memory, the same copy of the
+  data).  This makes it cheap to send several ranges of one file, or the
+  same file to many connections.
+ */
+struct evbuffer_file_segment;
+
+/** Flag for evbuffer_file_segment_new: close the fd once the segment and
+    every range added from it have been freed. */
+#define EVBUF_FS_CLOSE_ON_FREE    0x01
+/** Flag for evbuffer_file_segment_new: don't use mmap to read the file. */
+#define EVBUF_FS_DISABLE_MMAP     0x02
+/** Flag for evbuffer_file_segment_new: don't use sendfile to send the
+    file. */
+#define EVBUF_FS_DISABLE_SENDFILE 0x04
+/** Flag for evbuffer_file_segment_new: don't allocate a lock for the
+    segment.  Only safe if it is never used from more than one thread. */
+#define EVBUF_FS_DISABLE_LOCKING  0x08
+
+/**
+  Create a new file segment for the bytes of fd from offset to
+  offset+length.
+
+  Where sendfile is available, no data is read until the segment is
+  written to a socket.  Otherwise, the segment is mapped into memory with
+  mmap if possible, and read into memory if not.
+
+  @param fd an open file descriptor, positioned anywhere
+  @param offset where in the file the segment starts
+  @param length how long the segment is, or -1 to go up to the end of the
+    file
+  @param flags any number of the EVBUF_FS_* flags
+  @return a new file segment, or NULL on failure
+ */
+struct evbuffer_file_segment *evbuffer_file_segment_new(
+	int fd, off_t offset, off_t length, unsigned flags);
+
+/**
+  Release the caller's reference to a file segment.
+
+  Ranges that have already been added to evbuffers stay valid; the segment
+  is really freed when the last of them is gone.
+ */
+void evbuffer_file_segment_free(struct evbuffer_file_segment *seg);
+
+/**
+  Add a range of a file segment to the end of an evbuffer.
+
+  Ranges of the same segment, or of different ones, can be added to the
+  same evbuffer with other data between them; evbuffer_write() sends the
+  in-memory data with writev and the file data with sendfile, switching
+  between them as needed.
+
+  As with evbuffer_add_file(), the results of using evbuffer_remove() or
+  evbuffer_pullup() on a range that is sent with sendfile are undefined.
+
+  @param buf the evbuffer to append to
+  @param seg the file segment to take data from
+  @param offset where in the segment the range starts
+  @param length how long the range is, or -1 to go up to the end of the
+    segment
+  @return 0 if successful, or -1 if an error occurred
+ */
+int evbuffer_add_file_segment(struct evbuffer *buf,
+    struct evbuffer_file_segment *seg, off_t offset, off_t length);
+
 /**
   Append a formatted string to the end of an evbuffer.
 
+  The string is formatted directly into the free space at the end of the
+  buffer.  Common conversions (%d, %i, %u, %x, %X, %c, %s and %%, with the
+  hh, h, l, ll and z length modifiers, the - and 0 flags, and field widths)
+  are handled without calling snprintf; anything else is passed along to
+  evutil_vsnprintf().
+
   @param buf the evbuffer that will be appended to
   @param fmt a format string
   @param ... arguments that will be passed to printf(3)
@@ -443,6 +685,28 @@ int evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
  */
 int evbuffer_read(struct evbuffer *buffer, evutil_socket_t fd, int howmuch);
 
+/**
+  Make evbuffer_read() choose its own read sizes.
+
+  Normally, evbuffer_read() asks the kernel how much data is waiting
+  before every read, and limits each read to a few kilobytes unless told
+  otherwise.  In adaptive mode, it skips that extra system call.  Instead,
+  it doubles the size of its next read (up to max_read) whenever a read
+  fills all the space it offered, and halves it (down to its default size)
+  whenever a read fills less than half.  Bulk transfers thus quickly move
+  to large reads, while mostly-idle connections keep using small ones.
+
+  A bufferevent whose input buffer is in adaptive mode, and that has no
+  rate limit, lets evbuffer_read() decide how much to read.
+
+  @param buf the evbuffer to configure
+  @param max_read the largest single read to attempt, or 0 to turn
+    adaptive mode off.
+  @return 0 on success, -1 on failure.
+  @see evbuffer_read()
+ */
+int evbuffer_set_adaptive_read(struct evbuffer *buf, size_t max_read);
+
 /**
    Search for a string within an evbuffer.
 
@@ -719,6 +983,143 @@ struct event_base;
  */
 int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 
+/**
+   A group of evbuffers whose callbacks are run in batches.
+
+   Normally, every change to an evbuffer runs all of its callbacks.  An
+   evbuffer in a batch only records how much was added and removed, and
+   runs its callbacks once, with the totals, when the batch is flushed.
+   Many small changes to a buffer with several callbacks then cost one
+   pass over its callbacks instead of one per change.
+
+   Callbacks that libevent itself relies on, such as the one that enforces
+   a bufferevent's watermarks, still run immediately.
+
+   The evbuffers in a batch should only be modified from one thread at a
+   time: the thread that flushes the batch.
+ */
+struct evbuffer_cb_batch;
+
+/**
+   Create a new callback batch.
+
+   @param base if not NULL, the batch is flushed automatically at the end
+     of every iteration of this event_base's loop in which any of its
+     buffers changed.  If NULL, it is only flushed by
+     evbuffer_cb_batch_flush() and evbuffer_flush_callbacks().
+   @return the new batch, or NULL on failure
+ */
+struct evbuffer_cb_batch *evbuffer_cb_batch_new(struct event_base *base);
+
+/**
+   Free a callback batch.  Every evbuffer that was using it must have been
+   freed or removed from it first.
+ */
+void evbuffer_cb_batch_free(struct evbuffer_cb_batch *batch);
+
+/**
+   Make an evbuffer's callbacks run as part of a batch.
+
+   An evbuffer can't use both a batch and evbuffer_defer_callbacks().
+
+   @param buffer the evbuffer
+   @param batch the batch to join, or NULL to leave the current batch
+     (running any callbacks that were pending)
+   @return 0 on success, -1 on failure
+ */
+int evbuffer_set_cb_batch(struct evbuffer *buffer,
+    struct evbuffer_cb_batch *batch);
+
+/**
+   Run the callbacks of every evbuffer in a batch that has changed since
+   its callbacks last ran.
+ */
+void evbuffer_cb_batch_flush(struct evbuffer_cb_batch *batch);
+
+/**
+   If an evbuffer is in a batch and has changed since its callbacks last
+   ran, run them now.
+ */
+void evbuffer_flush_callbacks(struct evbuffer *buffer);
+
+/**
+   A lock-free queue for handing evbuffer data from one thread to another.
+
+   Exactly one thread (the producer) may call evbuffer_handoff_push(), and
+   exactly one thread (the consumer) may call evbuffer_handoff_pull().  The
+   data moves as whole chains, without being copied, and neither thread
+   takes a lock to do it, so the evbuffers on each side don't need
+   evbuffer_enable_locking().
+
+   On platforms without atomic operations, this falls back to using a lock
+   for each push and pull.
+ */
+struct evbuffer_handoff;
+
+/**
+   Allocate a new, empty evbuffer_handoff.
+
+   @return the new handoff queue, or NULL on failure
+ */
+struct evbuffer_handoff *evbuffer_handoff_new(void);
+
+/**
+   Free an evbuffer_handoff, along with any data still in it.
+
+   Neither the producer nor the consumer may be using it any more.
+ */
+void evbuffer_handoff_free(struct evbuffer_handoff *h);
+
+/**
+   Move all the data from src into the handoff queue.  Producer only.
+
+   src's callbacks are run as for any other drain.  If a consumer evbuffer
+   was set with evbuffer_handoff_set_consumer() and it was waiting for
+   data, it is woken up.
+
+   @param h the handoff queue
+   @param src the evbuffer to take data from
+   @return 0 on success, -1 on failure
+ */
+int evbuffer_handoff_push(struct evbuffer_handoff *h, struct evbuffer *src);
+
+/**
+   Move all the data published so far from the handoff queue to the end of
+   dst.  Consumer only.
+
+   dst's callbacks are run as for any other add.
+
+   @param h the handoff queue
+   @param dst the evbuffer to add data to
+   @return the number of bytes moved
+ */
+size_t evbuffer_handoff_pull(struct evbuffer_handoff *h, struct evbuffer *dst);
+
+/**
+   Return the number of bytes that have been pushed into the queue and not
+   yet pulled.  If the other thread is active, this is only a snapshot.
+ */
+size_t evbuffer_handoff_get_length(const struct evbuffer_handoff *h);
+
+/**
+   Make the handoff queue deliver its data to an evbuffer automatically.
+
+   Whenever the producer pushes data while the queue is empty, the consumer
+   is woken up from base's event loop (which may be running in another
+   thread) and the data is pulled into dst; dst's own callbacks can then
+   process it.  Waking up a loop in another thread requires that threading
+   be set up, and that base be notifiable.
+
+   This must be called before the producer starts pushing.
+
+   @param h the handoff queue
+   @param base the event_base that the consumer runs in
+   @param dst the evbuffer to deliver data to
+   @return 0 on success, -1 on failure
+ */
+int evbuffer_handoff_set_consumer(struct evbuffer_handoff *h,
+    struct event_base *base, struct evbuffer *dst);
+
 #ifdef __cplusplus
 }
 #endif
@@ -126,7 +126,49 @@ enum bufferevent_options {
 	BEV_OPT_THREADSAFE = (1<<1),
 
 	/** If set, callbacks are run deferred in the event loop. */
-	BEV_OPT_DEFER_CALLBACKS = (1<<2)
+	BEV_OPT_DEFER_CALLBACKS = (1<<2),
+
+	/** If set, a socket bufferevent watches its socket edge-triggered,
+	 * and each time the socket becomes readable or writable it reads or
+	 * writes until the socket would block, a watermark or rate limit
+	 * stops it, or it has moved its share of bytes for the turn; see
+	 * bufferevent_socket_set_edge_budget().  Ignored if the event_base's
+	 * backend doesn't support EV_ET. */
+	BEV_OPT_EDGE_TRIGGERED = (1<<3),
+
+	/** If set, a socket bufferevent holds back data added to its output
+	 * buffer until the end of the current event loop iteration, and then
+	 * writes it all with a single call, so that several writes in one
+	 * iteration go out together.  Output still held back when the
+	 * bufferevent is freed is written, as far as the socket will take
+	 * it, before the bufferevent goes away. */
+	BEV_OPT_CORK = (1<<4),
+
+	/** If set, a socket bufferevent doesn't create its input and output
+	 * buffers until it needs them, and frees each one again at the end
+	 * of a loop iteration in which reading or writing left it empty.
+	 * Rate-limiting state is likewise freed once the bufferevent has no
+	 * rate limit and is in no group.  This saves memory on
+	 * connections that are idle most of the time.  The pointers returned
+	 * by bufferevent_get_input() and bufferevent_get_output() are only
+	 * good until the end of the current loop iteration; a buffer that
+	 * has been configured (with a callback, evbuffer_set_ring(), and so
+	 * on) is never freed.  Code that reads the input and output fields
+	 * of struct bufferevent directly won't work with this option.
+	 * Ignored for bufferevents that aren't socket bufferevents. */
+	BEV_OPT_LAZY_BUFFERS = (1<<5),
+
+	/** If set, the bufferevent keeps traffic and latency counters; see
+	 * bufferevent_get_stats(). */
+	BEV_OPT_STATS = (1<<6),
+
+	/** If set, an SSL or filtering bufferevent charges its rate limits
+	 * for the bytes it reads from and writes to whatever is under it --
+	 * the encrypted bytes of an SSL connection, handshakes included, or
+	 * the bytes on the far side of a filter -- rather than for the bytes
+	 * it hands to and takes from the user.  This way a limit caps what
+	 * actually goes over the network.  Ignored for other bufferevents. */
+	BEV_OPT_RATELIM_UNDERLYING = (1<<7)
 };
 
 /**
@@ -192,6 +234,79 @@ struct evdns_base;
 int bufferevent_socket_connect_hostname(struct bufferevent *b,
     struct evdns_base *, int, const char *, int);
 
+/**
+   Send large writes from a socket bufferevent without copying them.
+
+   When enabled, any write of at least 'threshold' bytes from the
+   bufferevent's output buffer is handed to the kernel with MSG_ZEROCOPY
+   instead of being copied by writev().  The chains holding that data stay
+   pinned, and are not freed or moved, until the kernel reports on the
+   socket's error queue that it is done with them.  Smaller writes are
+   copied as usual, since for them the bookkeeping costs more than the copy
+   saves.
+
+   Zero-copy sends are only worthwhile for large transfers: a threshold of
+   a few tens of kilobytes is a reasonable place to start.  Note that if
+   the bufferevent is freed while the kernel is still sending from its
+   buffers, those buffers are released anyway.
+
+   @param bufev a bufferevent allocated with bufferevent_socket_new()
+   @param threshold the smallest write to send without copying, or 0 to
+      turn zero-copy sends off.
+   @return 0 if successful, or -1 if this bufferevent, platform, or kernel
+      doesn't support zero-copy sends.
+ */
+int bufferevent_socket_set_zerocopy(struct bufferevent *bufev,
+    size_t threshold);
+
+/**
+   Set how much an edge-triggered socket bufferevent may read, or write, in
+   one turn.
+
+   A bufferevent created with BEV_OPT_EDGE_TRIGGERED keeps reading from its
+   socket until the socket would block, so that it doesn't miss data that
+   arrived before the next edge.  To keep one busy connection from starving
+   the rest of the event loop, it stops once it has read 'budget' bytes,
+   lets other events run, and then comes back for the rest.  The same limit
+   applies to writing.
+
+   @param bufev a bufferevent allocated with bufferevent_socket_new() and
+      BEV_OPT_EDGE_TRIGGERED
+   @param budget the most bytes to read or write in one turn, or 0 for the
+      default of 256 KB
+   @return 0 if successful, or -1 if this bufferevent isn't edge-triggered
+      or the budget is too large.
+ */
+int bufferevent_socket_set_edge_budget(struct bufferevent *bufev,
+    size_t budget);
+
+/**
+   Hold back all output on a socket bufferevent until it is uncorked.
+
+   Use this to build a message out of several writes, possibly across
+   several loop iterations, without sending any part of it early.  On a
+   TCP socket where the platform supports it, this sets TCP_CORK, so output
+   keeps moving into the kernel, which holds back partial segments;
+   elsewhere, output stays in the output buffer.  Calls nest: the
+   bufferevent is uncorked when every call has been matched by a call to
+   bufferevent_socket_uncork().
+
+   @param bufev a bufferevent allocated with bufferevent_socket_new()
+   @return 0 if successful, or -1 if this isn't a socket bufferevent.
+ */
+int bufferevent_socket_cork(struct bufferevent *bufev);
+
+/**
+   Undo a call to bufferevent_socket_cork().
+
+   When the last cork is removed, whatever output was held back is written
+   at once.
+
+   @param bufev a bufferevent allocated with bufferevent_socket_new()
+   @return 0 if successful, or -1 if the bufferevent wasn't corked.
+ */
+int bufferevent_socket_uncork(struct bufferevent *bufev);
+
 /**
   Assign a bufferevent to a specific event_base.
 
@@ -448,7 +563,8 @@ enum bufferevent_filter_result {
     @param dst An evbuffer to add data to.
     @param limit A suggested upper bound of bytes to write to dst.
        The filter may ignore this value, but doing so means that
-       it will overflow the high-water mark associated with dst.
+       it will overflow the high-water mark associated with dst, or go
+       over the rate limit of the filtering bufferevent.
        -1 means "no limit".
     @param mode Whether we should write data as may be convenient
        (BEV_NORMAL), or flush as much data as we can (BEV_FLUSH),
@@ -459,6 +575,12 @@ enum bufferevent_filter_result {
     @return BEV_OK if we wrote some data; BEV_NEED_MORE if we can't
        produce any more output until we get some input; and BEV_ERROR
        on an error.
+
+    A filter that passes data through unchanged, or only adds or strips
+    framing, can avoid copying the payload: evbuffer_remove_buffer_reference()
+    moves data from src to dst by sharing memory, and
+    evbuffer_mark_record_end() and evbuffer_get_record_length() let the
+    filter find message boundaries that its writer marked.
  */
 typedef enum bufferevent_filter_result (*bufferevent_filter_cb)(
     struct evbuffer *src, struct evbuffer *dst, ev_ssize_t dst_limit,
@@ -499,6 +621,36 @@ int
 bufferevent_pair_new(struct event_base *base, int options,
     struct bufferevent *pair[2]);
 
+/**
+   Allocate a pair of linked bufferevents whose ends live on two different
+   event_bases, so that two threads can talk to each other.
+
+   The ends behave like those of bufferevent_pair_new(), except that data
+   written to one end reaches the other through a lock-free queue, and the
+   other end's event_base is woken up to read it.  Each end must only be
+   used, and freed, from the thread running its own event_base.  The other
+   end gets an EOF once one end is freed, or flushed with BEV_FINISHED, and
+   it has read everything written before then.
+
+   If an end has a read high-water mark, its peer stops handing over data
+   once that much is waiting to be read; the rest stays in the peer's
+   output buffer until there is room for it.  Freeing an end hands over
+   everything left in its output buffer, regardless of the watermark.
+
+   Threading must be enabled before either event_base is created (for
+   instance, with evthread_use_pthreads()), so that the ends can wake each
+   other's event_base up.
+
+   @param base1 The event base for pair[0].
+   @param base2 The event base for pair[1].
+   @param options A set of options for both bufferevents.
+   @param pair A pointer to an array to hold the two new bufferevent objects.
+   @return 0 on success, -1 on failure.
+ */
+int
+bufferevent_pair_new_cross_base(struct event_base *base1,
+    struct event_base *base2, int options, struct bufferevent *pair[2]);
+
 
 /**
    Abstract type used to configure rate-limiting on a bufferevent or a group
@@ -522,7 +674,16 @@ struct bufferevent_rate_limit_group;
      average.
    @param write_burst The maximum number of bytes to write in any single tick.
    @param tick_len The length of a single tick.  Defaults to one second.
-     Any fractions of a millisecond are ignored.
+     Ticks may be as short as a microsecond.  A zero-length tick makes the
+     bucket tick-less: see below.
+
+   A tick-less bucket fills continuously instead of once a tick, so
+   traffic is paced smoothly rather than sent in a burst at the start of
+   each tick.  Its rates are in bytes per second, and its bursts are just
+   how many bytes it can hold, which may be less than a second's worth.
+   Bufferevents and groups that run out of tokens wake up when they have
+   enough again, rather than at a fixed interval; how precisely they can
+   do so depends on the timer resolution of the event_base's backend.
 
    Note that all rate-limits hare are currently best-effort: future versions
    of Libevent may implement them more tightly.
@@ -545,8 +706,10 @@ void ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg);
    'bev'.
 
    Note that only some bufferevent types currently respect rate-limiting.
-   They are: socket-based bufferevents (normal and IOCP-based), and SSL-based
-   bufferevents.
+   They are: socket-based bufferevents (normal and IOCP-based), SSL-based
+   bufferevents, and filtering bufferevents.  SSL and filtering bufferevents
+   count the bytes their user reads and writes, unless they were created
+   with BEV_OPT_RATELIM_UNDERLYING.
 
    Return 0 on sucess, -1 on failure.
  */
@@ -590,6 +753,84 @@ int bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
 /** Remove 'bev' from its current rate-limit group (if any). */
 int bufferevent_remove_from_rate_limit_group(struct bufferevent *bev);
 
+/**
+   Nest the rate-limit group 'g' inside 'parent', so that everything 'g'
+   contains is also limited by 'parent'.  If 'parent' is NULL, 'g' stops
+   being nested in any group.
+
+   Groups can nest to any depth: for example, one group per tenant inside a
+   group for the whole server.  When a group runs out, it gives its
+   members and the child groups waiting on it turns in round-robin order,
+   so that busy children can't starve the others.
+
+   A group must not contain any bufferevents, directly or in its child
+   groups, when its parent changes.
+
+   Return 0 on success, and -1 if 'g' is not empty or if 'parent' is 'g' or
+   is nested inside 'g'.
+ */
+int bufferevent_rate_limit_group_set_parent(
+	struct bufferevent_rate_limit_group *g,
+	struct bufferevent_rate_limit_group *parent);
+
+/**
+   Traffic and latency counters for a bufferevent created with
+   BEV_OPT_STATS, or for all such bufferevents on an event_base.
+
+   Byte and call counts are kept by socket bufferevents only.  Times
+   blocked include any blocking still in progress.
+ */
+struct bufferevent_stats {
+	/** Bytes read from the socket. */
+	ev_uint64_t bytes_read;
+	/** Bytes written to the socket. */
+	ev_uint64_t bytes_written;
+	/** Calls that tried to read from the socket, successful or not. */
+	ev_uint64_t read_calls;
+	/** Calls that tried to write to the socket, successful or not. */
+	ev_uint64_t write_calls;
+	/** Time spent not reading because the input buffer was at its high
+	 * watermark. */
+	struct timeval read_blocked_wm;
+	/** Time spent not writing because a buffer further along was at
+	 * its high watermark. */
+	struct timeval write_blocked_wm;
+	/** Time spent not reading because of a rate limit. */
+	struct timeval read_blocked_rlim;
+	/** Time spent not writing because of a rate limit. */
+	struct timeval write_blocked_rlim;
+	/** Time from the start of bufferevent_socket_connect() to the first
+	 * byte read afterwards, added up over n_first_bytes connections. */
+	struct timeval connect_to_first_byte;
+	/** The number of connections counted in connect_to_first_byte. */
+	ev_uint64_t n_first_bytes;
+};
+
+/**
+   Get the counters of a bufferevent created with BEV_OPT_STATS.
+
+   @param bev the bufferevent to examine
+   @param stats set to the bufferevent's counters
+   @return 0 on success, or -1 if the bufferevent doesn't keep counters.
+ */
+int bufferevent_get_stats(struct bufferevent *bev,
+    struct bufferevent_stats *stats);
+
+/**
+   Get the sum of the counters of every bufferevent created with
+   BEV_OPT_STATS that is or was using an event_base, including those that
+   have since been freed.
+
+   The result is only approximate while other threads are using those
+   bufferevents.
+
+   @param base the event_base to examine
+   @param stats set to the total counters
+   @return 0 on success, -1 on failure.
+ */
+int event_base_get_bufferevent_stats(struct event_base *base,
+    struct bufferevent_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
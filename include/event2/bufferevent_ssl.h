@@ -69,6 +69,124 @@ int bufferevent_ssl_renegotiate(struct bufferevent *bev);
 
 unsigned long bufferevent_get_openssl_error(struct bufferevent *bev);
 
+/**
+   A cache of TLS client sessions, shared by SSL bufferevents that connect
+   to the same servers, so that they can resume an earlier session rather
+   than doing a full handshake each time.
+
+   @see bufferevent_openssl_session_cache_new(),
+     bufferevent_openssl_set_session_cache()
+ */
+struct bufferevent_openssl_session_cache;
+
+/**
+   Create a new TLS session cache.
+
+   @param max_sessions the most sessions to remember.  When the cache is
+     full, it forgets the session it used least recently.
+   @param ttl_secs how long to remember a session for, in seconds.
+   @return a new session cache, or NULL on error.
+ */
+struct bufferevent_openssl_session_cache *
+bufferevent_openssl_session_cache_new(int max_sessions, int ttl_secs);
+
+/**
+   Free a TLS session cache.
+
+   No bufferevent may still be using the cache.
+ */
+void bufferevent_openssl_session_cache_free(
+	struct bufferevent_openssl_session_cache *cache);
+
+/**
+   Make a connecting SSL bufferevent use a TLS session cache.
+
+   If the cache has a session for host and port, the bufferevent offers to
+   resume it.  Once the handshake is done, the bufferevent remembers the
+   session it negotiated in the cache, unless it resumed one.
+
+   This must be called before the handshake starts: just after creating
+   the bufferevent, before the event loop runs.  The cache must outlive
+   the bufferevent's handshake.
+
+   @param bev an SSL bufferevent created in BUFFEREVENT_SSL_CONNECTING state
+   @param cache the session cache to use
+   @param host the name of the server we're connecting to
+   @param port the port we're connecting to
+   @return 0 on success, or -1 if bev isn't a connecting SSL bufferevent
+     or its handshake has already started.
+ */
+int bufferevent_openssl_set_session_cache(struct bufferevent *bev,
+    struct bufferevent_openssl_session_cache *cache,
+    const char *host, int port);
+
+/**
+   Count the handshakes done by the bufferevents using a TLS session cache.
+
+   @param cache the session cache to examine
+   @param n_resumed_out set to the number of handshakes that resumed a
+     session from the cache
+   @param n_full_out set to the number of full handshakes
+ */
+void bufferevent_openssl_session_cache_get_counts(
+	struct bufferevent_openssl_session_cache *cache,
+	ev_uint64_t *n_resumed_out, ev_uint64_t *n_full_out);
+
+/**
+   A pool of worker threads that run TLS handshakes for SSL bufferevents,
+   so that the public-key work in a burst of handshakes doesn't hold up the
+   other connections on the event loop.
+
+   @see bufferevent_openssl_handshake_pool_new(),
+     bufferevent_openssl_set_handshake_pool()
+ */
+struct bufferevent_openssl_handshake_pool;
+
+/**
+   Create a new pool of handshake worker threads.
+
+   This is only supported where libevent uses pthreads.
+
+   @param n_threads the number of worker threads to start
+   @return a new handshake pool, or NULL on error or if handshake pools
+     aren't supported.
+ */
+struct bufferevent_openssl_handshake_pool *
+bufferevent_openssl_handshake_pool_new(int n_threads);
+
+/**
+   Stop the threads in a handshake pool, and free it.
+
+   The workers finish any handshake steps they were given before they
+   stop.  No bufferevent may use the pool after this.
+ */
+void bufferevent_openssl_handshake_pool_free(
+	struct bufferevent_openssl_handshake_pool *pool);
+
+/**
+   Make an SSL bufferevent run its handshake on a pool of worker threads.
+
+   Each time the handshake can make progress, a worker runs
+   SSL_do_handshake() on the bufferevent's SSL, and then hands the result
+   back to the bufferevent's event loop.  Meanwhile, the bufferevent
+   doesn't touch the SSL, and neither should you.  The pool is only used
+   for handshakes, including renegotiations; once the connection is open,
+   reading and writing happen in the event loop as usual.
+
+   Threading must be enabled before the bufferevent's event_base is
+   created (for instance, with evthread_use_pthreads()), so that the
+   workers can wake the event loop up.
+
+   @param bev an SSL bufferevent on a socket, whose handshake hasn't
+     finished
+   @param pool the handshake pool to use
+   @return 0 on success, or -1 if bev is a filtering bufferevent, if it's
+     done with its handshake, if its event_base doesn't use locking, or if
+     handshake pools aren't supported.
+ */
+int bufferevent_openssl_set_handshake_pool(struct bufferevent *bev,
+    struct bufferevent_openssl_handshake_pool *pool);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVENT2_BUFFEREVENT_ZLIB_H_
+#define _EVENT2_BUFFEREVENT_ZLIB_H_
+
+/** @file bufferevent_zlib.h
+
+    zlib compression support for bufferevents.
+ */
+
+#include <event-config.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _EVENT_HAVE_LIBZ
+
+/**
+   A pool of idle zlib streams, shared by zlib bufferevents so that each new
+   connection can reuse the (fairly large) compression state of an old one
+   rather than allocating its own.
+
+   @see bufferevent_zlib_pool_new(), bufferevent_zlib_new()
+ */
+struct bufferevent_zlib_pool;
+
+/**
+   Create a new pool of zlib streams.
+
+   @param max_idle the most idle streams of each kind (compressing or
+     decompressing) to keep.  When a bufferevent is freed and the pool
+     already has this many, its stream is freed instead.
+   @return a new pool, or NULL on error.
+ */
+struct bufferevent_zlib_pool *bufferevent_zlib_pool_new(int max_idle);
+
+/**
+   Free a pool of zlib streams, along with all its idle streams.
+
+   No bufferevent may still be using the pool.
+ */
+void bufferevent_zlib_pool_free(struct bufferevent_zlib_pool *pool);
+
+/**
+   Count the streams that the bufferevents using a pool have set up.
+
+   @param pool the pool to examine
+   @param n_created_out set to the number of streams that had to be
+     created, because the pool had none of the right kind
+   @param n_reused_out set to the number of streams that were taken from
+     the pool
+ */
+void bufferevent_zlib_pool_get_counts(struct bufferevent_zlib_pool *pool,
+    ev_uint64_t *n_created_out, ev_uint64_t *n_reused_out);
+
+/**
+   Flags for bufferevent_zlib_new().
+ */
+enum bufferevent_zlib_flags {
+	/** Flush the compressor each time it catches up with what we have
+	    written, so the peer can decompress every write at once, at some
+	    cost in compression. */
+	BEV_ZLIB_FLUSH_WRITES = (1<<0)
+};
+
+/**
+   Allocate a new bufferevent that compresses the data written to it, and
+   decompresses the data read from it, over an underlying bufferevent.
+
+   The data on the wire is a zlib stream in each direction.  Unless
+   BEV_ZLIB_FLUSH_WRITES is set, the compressor holds on to data until it
+   has enough to compress well; call bufferevent_flush() with BEV_FLUSH to
+   send everything written so far, or with BEV_FINISHED to end the stream.
+
+   Each direction sets up its zlib stream the first time it's used, taking
+   it from the pool if it has one.  When the bufferevent is freed, its
+   streams go back to the pool.
+
+   @param underlying the underlying bufferevent.
+   @param level a zlib compression level, from 0 to 9, or -1 for zlib's
+     default.
+   @param flags a set of bufferevent_zlib_flags.
+   @param pool a pool of zlib streams to use, or NULL.  The pool must
+     outlive the bufferevent.
+   @param options a bitfield of bufferevent options.
+   @return a new bufferevent, or NULL on error.
+ */
+struct bufferevent *
+bufferevent_zlib_new(struct bufferevent *underlying, int level, int flags,
+    struct bufferevent_zlib_pool *pool, int options);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVENT2_BUFFEREVENT_ZLIB_H_ */
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVENT2_DGRAM_H_
+#define _EVENT2_DGRAM_H_
+
+/** @file dgram.h
+
+  Batched I/O on datagram sockets.
+
+  An evdgram does for a datagram (UDP) socket what a bufferevent does for
+  a stream socket.  Each time the socket becomes readable, it receives up
+  to a batch of datagrams at once -- with a single recvmmsg() call where
+  the platform has one -- into memory that it allocated up front, and
+  hands them all to a single read callback along with their source
+  addresses.  Datagrams passed to evdgram_send() are queued, and go out
+  together from the event loop with a single sendmmsg() call where
+  possible.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <event2/event-config.h>
+#ifdef _EVENT_HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#include <event2/util.h>
+
+struct sockaddr;
+struct event_base;
+struct evdgram;
+
+/** One datagram received by an evdgram. */
+struct evdgram_msg {
+	/** The datagram's contents.  This memory belongs to the evdgram,
+	 * and is only valid until the read callback returns. */
+	void *data;
+	/** The number of bytes in data. */
+	size_t len;
+	/** The address that sent the datagram. */
+	struct sockaddr *addr;
+	/** The length of addr. */
+	int addrlen;
+	/** True iff the datagram was larger than the evdgram's maximum
+	 * datagram size, and we only got the first part of it. */
+	int truncated;
+};
+
+/**
+   A callback that we invoke when an evdgram has received some datagrams.
+
+   @param dg the evdgram that received the datagrams
+   @param msgs an array of the datagrams, in the order they arrived
+   @param n_msgs the number of datagrams in msgs; always at least 1
+   @param arg the argument passed to evdgram_setcb()
+ */
+typedef void (*evdgram_read_cb)(struct evdgram *dg,
+    const struct evdgram_msg *msgs, int n_msgs, void *arg);
+
+/**
+   A callback that we invoke when an evdgram has a socket error.
+
+   The socket error is available from EVUTIL_SOCKET_ERROR().  A failed
+   receive doesn't disable the evdgram.  A datagram that we fail to send is
+   dropped, and we go on with the rest of the queue.
+
+   @param dg the evdgram that had the error
+   @param what EVDGRAM_EVENT_ERROR, plus EVDGRAM_EVENT_READING or
+     EVDGRAM_EVENT_WRITING to say which operation failed
+   @param arg the argument passed to evdgram_setcb()
+ */
+typedef void (*evdgram_event_cb)(struct evdgram *dg, short what, void *arg);
+
+/** Error encountered while receiving. */
+#define EVDGRAM_EVENT_READING	0x01
+/** Error encountered while sending. */
+#define EVDGRAM_EVENT_WRITING	0x02
+/** A socket error occurred. */
+#define EVDGRAM_EVENT_ERROR	0x20
+
+/** Flag: Free the socket when the evdgram is freed. */
+#define EVDGRAM_OPT_CLOSE_ON_FREE	(1u<<0)
+/** Flag: Make the evdgram safe to use from multiple threads at once. */
+#define EVDGRAM_OPT_THREADSAFE		(1u<<1)
+
+/**
+   Create a new evdgram on an existing datagram socket.
+
+   The evdgram doesn't start receiving until you call evdgram_enable().
+
+   @param base the event_base to use
+   @param fd a nonblocking datagram socket.  It can be connected, in which
+     case evdgram_send() doesn't need a destination address.
+   @param options zero or more EVDGRAM_OPT_* flags
+   @param batch the largest number of datagrams to receive or send with a
+     single system call, or 0 for a reasonable default
+   @param max_size the size of the largest datagram we expect to receive
+     or to send, or 0 for a reasonable default.  We preallocate batch
+     buffers of this size for receiving.
+   @return a new evdgram, or NULL on error
+ */
+struct evdgram *evdgram_new(struct event_base *base, evutil_socket_t fd,
+    unsigned options, int batch, size_t max_size);
+
+/**
+   Disable and deallocate an evdgram.
+
+   Any datagrams still queued for sending are discarded; call
+   evdgram_flush() first if you want to try to send them.  It is safe to
+   call this function from the evdgram's own callbacks.
+ */
+void evdgram_free(struct evdgram *dg);
+
+/**
+   Set the callbacks for an evdgram.
+
+   @param dg the evdgram to configure
+   @param readcb callback to invoke with each batch of received datagrams
+   @param eventcb callback to invoke when there is an error, or NULL
+   @param arg an argument to pass to both callbacks
+ */
+void evdgram_setcb(struct evdgram *dg, evdgram_read_cb readcb,
+    evdgram_event_cb eventcb, void *arg);
+
+/** Start receiving datagrams on an evdgram.  Returns 0 on success, -1 on
+ * failure. */
+int evdgram_enable(struct evdgram *dg);
+
+/** Stop receiving datagrams on an evdgram.  Queued datagrams are still
+ * sent.  Returns 0 on success, -1 on failure. */
+int evdgram_disable(struct evdgram *dg);
+
+/**
+   Queue a datagram to be sent from an evdgram.
+
+   The data is copied, so you may reuse it as soon as this function
+   returns.  Queued datagrams are sent in order, the next time the event
+   loop finds the socket writable, or at once when a whole batch is
+   waiting.
+
+   @param dg the evdgram to send from
+   @param data the contents of the datagram
+   @param len the length of the datagram; at most the evdgram's maximum
+     datagram size
+   @param addr the destination, or NULL if the socket is connected
+   @param addrlen the length of addr
+   @return 0 if the datagram was queued, -1 on error
+ */
+int evdgram_send(struct evdgram *dg, const void *data, size_t len,
+    const struct sockaddr *addr, int addrlen);
+
+/**
+   Try to send every datagram queued on an evdgram now.
+
+   @return the number of datagrams sent, or -1 if the queue is not empty
+     and we couldn't send any of it
+ */
+int evdgram_flush(struct evdgram *dg);
+
+/** Return the number of datagrams waiting to be sent on an evdgram. */
+size_t evdgram_get_queued(struct evdgram *dg);
+
+/** Return the socket that an evdgram is using. */
+evutil_socket_t evdgram_get_fd(struct evdgram *dg);
+
+/** Return the event_base that an evdgram is using. */
+struct event_base *evdgram_get_base(struct evdgram *dg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVENT2_DGRAM_H_ */
@@ -42,6 +42,9 @@ struct ev_token_bucket {
 	/** When was this bucket last updated?  Measured in abstract 'ticks'
 	 * relative to the token bucket configuration. */
 	ev_uint32_t last_updated;
+	/** In a tick-less bucket, the millionths of a byte that we've earned
+	 * but not yet added to read_limit and write_limit. */
+	ev_uint32_t read_frac, write_frac;
 };
 
 /** Configuration info for a token bucket or set of token buckets. */
@@ -55,14 +58,18 @@ struct ev_token_bucket_cfg {
 	/** How many bytes are we willing to write at most in any one tick? */
 	ev_uint32_t write_maximum;
 
-	/* How long is a tick?  Note that fractions of a millisecond are
-	 * ignored. */
+	/* How long is a tick?  Zero for a tick-less bucket. */
 	struct timeval tick_timeout;
 
-	/* How long is a tick, in milliseconds?  Derived from tick_timeout. */
-	unsigned msec_per_tick;
+	/* How long is a tick, in microseconds?  Derived from tick_timeout.
+	 * Zero for a tick-less bucket, which fills continuously: its rates
+	 * are per second, and its ticks are microseconds. */
+	ev_uint32_t usec_per_tick;
 };
 
+/** True iff 'cfg' describes a tick-less bucket. */
+#define EV_TOKEN_BUCKET_TICKLESS(cfg) ((cfg)->usec_per_tick == 0)
+
 /** The current tick is 'current_tick': add bytes to 'bucket' as specified in
  * 'cfg'. */
 int ev_token_bucket_update(struct ev_token_bucket *bucket,
@@ -84,6 +91,13 @@ int ev_token_bucket_init(struct ev_token_bucket *bucket,
     ev_uint32_t current_tick,
     int reinitialize);
 
+/** Set 'tv' to how long to wait before the read (or write, if is_write)
+ * limit of 'bucket' reaches 'want'.  For a bucket with ticks, that's one
+ * tick; for a tick-less bucket, it's just long enough. */
+void ev_token_bucket_get_delay(const struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg, int is_write, ev_int32_t want,
+    struct timeval *tv);
+
 /** Decrease the read limit of 'b' by 'n' bytes */
 #define ev_token_bucket_decrement_read(b,n)	\
 	do {					\
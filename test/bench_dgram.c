@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/dgram.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark bounces UDP datagrams off an echo server over loopback,
+ * a burst at a time, and reports how many round trips it managed per
+ * second.  By default both ends use evdgrams.  With -l, they use the
+ * hand-rolled approach instead: an event whose callback calls recvfrom()
+ * until it would block, and sendto() for each reply.
+ */
+
+struct side {
+	evutil_socket_t fd;
+	struct sockaddr_in sin;
+	/* The evdgram on fd, or NULL with -l. */
+	struct evdgram *dg;
+	/* The read event on fd, with -l. */
+	struct event *ev;
+};
+
+static struct event_base *base;
+static struct side client, server;
+static long num_msgs = 200000;
+static int burst = 32;
+static int msg_size = 64;
+static char *msg;
+static long n_sent, n_echoed, n_echoed_last_tick;
+
+static void
+send_burst(void)
+{
+	int i;
+
+	for (i = 0; i < burst && n_sent < num_msgs; ++i, ++n_sent) {
+		if (client.dg)
+			evdgram_send(client.dg, msg, msg_size,
+			    (struct sockaddr *)&server.sin,
+			    sizeof(server.sin));
+		else
+			sendto(client.fd, msg, msg_size, 0,
+			    (struct sockaddr *)&server.sin,
+			    sizeof(server.sin));
+	}
+}
+
+static void
+got_echoes(int n)
+{
+	n_echoed += n;
+	if (n_echoed == num_msgs)
+		event_base_loopexit(base, NULL);
+	else if (n_echoed == n_sent)
+		send_burst();
+}
+
+static void
+server_readcb(struct evdgram *dg, const struct evdgram_msg *msgs, int n,
+    void *arg)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		evdgram_send(dg, msgs[i].data, msgs[i].len, msgs[i].addr,
+		    msgs[i].addrlen);
+}
+
+static void
+client_readcb(struct evdgram *dg, const struct evdgram_msg *msgs, int n,
+    void *arg)
+{
+	got_echoes(n);
+}
+
+static void
+legacy_server_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct sockaddr_storage ss;
+	ev_socklen_t slen;
+	char buf[2048];
+	int n;
+
+	for (;;) {
+		slen = sizeof(ss);
+		n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&ss,
+		    &slen);
+		if (n < 0)
+			break;
+		sendto(fd, buf, n, 0, (struct sockaddr *)&ss, slen);
+	}
+}
+
+static void
+legacy_client_cb(evutil_socket_t fd, short what, void *arg)
+{
+	char buf[2048];
+	int n = 0;
+
+	while (recv(fd, buf, sizeof(buf), 0) >= 0)
+		++n;
+	if (n)
+		got_echoes(n);
+}
+
+static void
+watchdog_cb(evutil_socket_t fd, short what, void *arg)
+{
+	if (n_echoed == n_echoed_last_tick) {
+		fprintf(stderr, "stalled after %ld of %ld datagrams; "
+		    "were some dropped?\n", n_echoed, n_sent);
+		event_base_loopexit(base, NULL);
+	}
+	n_echoed_last_tick = n_echoed;
+}
+
+static void
+side_init(struct side *s, int legacy, int batch)
+{
+	ev_socklen_t slen = sizeof(s->sin);
+
+	memset(&s->sin, 0, sizeof(s->sin));
+	s->sin.sin_family = AF_INET;
+	s->sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	if ((s->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    bind(s->fd, (struct sockaddr *)&s->sin, sizeof(s->sin)) < 0 ||
+	    getsockname(s->fd, (struct sockaddr *)&s->sin, &slen) < 0 ||
+	    evutil_make_socket_nonblocking(s->fd) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (!legacy) {
+		s->dg = evdgram_new(base, s->fd, EVDGRAM_OPT_CLOSE_ON_FREE,
+		    batch, 0);
+		if (s->dg == NULL) {
+			fprintf(stderr, "evdgram_new failed\n");
+			exit(1);
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timeval ts, te, one_sec = { 1, 0 };
+	struct event *watchdog;
+	int c, legacy = 0;
+	double usec;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "b:ln:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'l':
+			legacy = 1;
+			break;
+		case 'n':
+			num_msgs = atol(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_msgs <= 0 || burst <= 0 || msg_size <= 0 || msg_size > 2048) {
+		fprintf(stderr, "-n and -b must be positive, and -s must be "
+		    "between 1 and 2048\n");
+		exit(1);
+	}
+	if ((msg = malloc(msg_size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msg_size);
+
+	base = event_base_new();
+	side_init(&client, legacy, burst);
+	side_init(&server, legacy, burst);
+	if (legacy) {
+		client.ev = event_new(base, client.fd, EV_READ|EV_PERSIST,
+		    legacy_client_cb, NULL);
+		server.ev = event_new(base, server.fd, EV_READ|EV_PERSIST,
+		    legacy_server_cb, NULL);
+		event_add(client.ev, NULL);
+		event_add(server.ev, NULL);
+	} else {
+		evdgram_setcb(client.dg, client_readcb, NULL, NULL);
+		evdgram_setcb(server.dg, server_readcb, NULL, NULL);
+		evdgram_enable(client.dg);
+		evdgram_enable(server.dg);
+	}
+	watchdog = event_new(base, -1, EV_PERSIST, watchdog_cb, NULL);
+	event_add(watchdog, &one_sec);
+
+	evutil_gettimeofday(&ts, NULL);
+	send_burst();
+	event_base_dispatch(base);
+	evutil_gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%s: %ld datagrams of %d bytes in bursts of %d "
+	    "in %.0f usec: %.0f datagrams/sec\n",
+	    legacy ? "recvfrom/sendto" : "evdgram", n_echoed, msg_size, burst,
+	    usec, usec > 0 ? n_echoed * 1000000.0 / usec : 0.0);
+
+	event_free(watchdog);
+	if (legacy) {
+		event_free(client.ev);
+		event_free(server.ev);
+		EVUTIL_CLOSESOCKET(client.fd);
+		EVUTIL_CLOSESOCKET(server.fd);
+	} else {
+		evdgram_free(client.dg);
+		evdgram_free(server.dg);
+	}
+	event_base_free(base);
+	free(msg);
+
+	return (n_echoed == num_msgs ? 0 : 1);
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures what a few small evbuffer calls cost, which
+ * is mostly the lock checks that every call makes.  By default the buffer
+ * never has locking enabled, as most buffers don't; with -l, it is
+ * locked with pthread locks.  To see what a change to the locking code
+ * buys, run it against libraries built before and after the change.
+ */
+
+static long num_calls = 10000000;
+static int num_runs = 5;
+
+/* Return how long each API call on buf took, in nanoseconds. */
+static double
+time_calls(struct evbuffer *buf)
+{
+	struct timeval ts, te;
+	char out[8];
+	long i;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_calls; i += 3) {
+		evbuffer_add(buf, "abcdefgh", 8);
+		if (evbuffer_get_length(buf) != 8) {
+			fprintf(stderr, "lost some data\n");
+			exit(1);
+		}
+		evbuffer_remove(buf, out, 8);
+	}
+	gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	return (te.tv_sec * 1e9 + te.tv_usec * 1e3) / num_calls;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evbuffer *buf;
+	double t, best = -1.0;
+	int c, i, locked = 0;
+
+	while ((c = getopt(argc, argv, "ln:r:")) != -1) {
+		switch (c) {
+		case 'l':
+			locked = 1;
+			break;
+		case 'n':
+			num_calls = atol(optarg);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_calls <= 0 || num_runs <= 0) {
+		fprintf(stderr, "-n and -r must be positive\n");
+		exit(1);
+	}
+
+	if (locked && evthread_use_pthreads() < 0) {
+		fprintf(stderr, "evthread_use_pthreads failed\n");
+		exit(1);
+	}
+	if ((buf = evbuffer_new()) == NULL) {
+		fprintf(stderr, "evbuffer_new failed\n");
+		exit(1);
+	}
+	if (locked && evbuffer_enable_locking(buf, NULL) < 0) {
+		fprintf(stderr, "evbuffer_enable_locking failed\n");
+		exit(1);
+	}
+
+	/* The first run warms up; keep the fastest of the rest. */
+	time_calls(buf);
+	for (i = 0; i < num_runs; ++i) {
+		t = time_calls(buf);
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	fprintf(stdout, "%s evbuffer: %ld calls, best of %d runs: "
+	    "%.1f nsec/call\n", locked ? "locked" : "unlocked",
+	    num_calls, num_runs, best);
+
+	evbuffer_free(buf);
+
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures a stack of framing filters: each layer puts a
+ * 4-byte length in front of every message it writes, and takes it off
+ * again when reading.  The writer marks the end of each message with
+ * evbuffer_mark_record_end(), so that the output filters find messages
+ * without scanning.  The two stacks talk over a socketpair, so the
+ * reading side gets its data in arbitrary pieces, as from a network.
+ *
+ * With -r, the sockets read up to that many bytes at a time, so that
+ * each read holds many messages.
+ *
+ * By default the filters move messages with
+ * evbuffer_remove_buffer_reference(), which shares memory.  With -c, they
+ * use evbuffer_remove_buffer(), which copies whatever part of a message
+ * doesn't fill a whole chunk of memory.
+ */
+
+static int num_msgs = 100000;
+static int batch = 64;
+static int depth = 3;
+static size_t msg_size = 16*1024;
+static int copy_mode;
+static size_t max_read;
+static char *msg;
+static struct event_base *base;
+
+static int n_msgs_read;
+static int n_msgs_expected;
+static size_t n_read;
+
+static int
+move_data(struct evbuffer *src, struct evbuffer *dst, size_t len)
+{
+	if (copy_mode)
+		return evbuffer_remove_buffer(src, dst, len);
+	else
+		return evbuffer_remove_buffer_reference(src, dst, len);
+}
+
+/* Each filter builds its messages in an evbuffer of its own, and hands
+ * each one over whole, mark and all: adding to dst runs its callbacks, and
+ * the next layer down mustn't see a message before its mark is set. */
+static enum bufferevent_filter_result
+frame_output(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx)
+{
+	enum bufferevent_filter_result res = BEV_NEED_MORE;
+	struct evbuffer *msgbuf = ctx;
+	ev_ssize_t len;
+	ev_uint32_t hdr;
+
+	while ((len = evbuffer_get_record_length(src, NULL)) > 0) {
+		hdr = htonl((ev_uint32_t)len);
+		evbuffer_add(msgbuf, &hdr, 4);
+		if (move_data(src, msgbuf, len) != len ||
+		    evbuffer_mark_record_end(msgbuf, 0) < 0 ||
+		    evbuffer_add_buffer(dst, msgbuf) < 0)
+			return BEV_ERROR;
+		res = BEV_OK;
+	}
+	return res;
+}
+
+static enum bufferevent_filter_result
+frame_input(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx)
+{
+	enum bufferevent_filter_result res = BEV_NEED_MORE;
+	struct evbuffer *msgbuf = ctx;
+	ev_uint32_t hdr;
+	size_t len;
+
+	while (evbuffer_get_length(src) >= 4) {
+		memcpy(&hdr, evbuffer_pullup(src, 4), 4);
+		len = ntohl(hdr);
+		if (evbuffer_get_length(src) < len + 4)
+			break;
+		evbuffer_drain(src, 4);
+		if (move_data(src, msgbuf, len) != (int)len ||
+		    evbuffer_mark_record_end(msgbuf, 0) < 0 ||
+		    evbuffer_add_buffer(dst, msgbuf) < 0)
+			return BEV_ERROR;
+		res = BEV_OK;
+	}
+	return res;
+}
+
+static void
+msgbuf_free(void *ctx)
+{
+	evbuffer_free(ctx);
+}
+
+static struct bufferevent *
+stack_new(evutil_socket_t fd)
+{
+	struct bufferevent *bev;
+	int i;
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (bev && max_read)
+		evbuffer_set_adaptive_read(bufferevent_get_input(bev),
+		    max_read);
+	for (i = 0; bev && i < depth; ++i)
+		bev = bufferevent_filter_new(bev, frame_input, frame_output,
+		    BEV_OPT_CLOSE_ON_FREE, msgbuf_free, evbuffer_new());
+	if (!bev) {
+		fprintf(stderr, "couldn't create the filters\n");
+		exit(1);
+	}
+	return bev;
+}
+
+static void
+readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	ev_ssize_t len;
+
+	while ((len = evbuffer_get_record_length(input, NULL)) > 0) {
+		if ((size_t)len != msg_size) {
+			fprintf(stderr, "got a message of %ld bytes\n",
+			    (long)len);
+			exit(1);
+		}
+		evbuffer_drain(input, len);
+		n_read += len;
+		++n_msgs_read;
+	}
+	if (n_msgs_read == n_msgs_expected)
+		event_base_loopbreak(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bufferevent *writer, *reader;
+	struct evbuffer *out;
+	evutil_socket_t pair[2];
+	struct timeval ts, te;
+	int c, i;
+	double usec;
+
+	while ((c = getopt(argc, argv, "b:cd:n:r:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'c':
+			copy_mode = 1;
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'n':
+			num_msgs = atoi(optarg);
+			break;
+		case 'r':
+			max_read = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_msgs <= 0 || batch <= 0 || depth <= 0 || msg_size == 0) {
+		fprintf(stderr, "-b, -d, -n and -s must be positive\n");
+		exit(1);
+	}
+
+	if ((msg = malloc(msg_size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msg_size);
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	base = event_base_new();
+	writer = stack_new(pair[0]);
+	reader = stack_new(pair[1]);
+	bufferevent_setcb(reader, readcb, NULL, NULL, NULL);
+	bufferevent_enable(reader, EV_READ);
+	bufferevent_enable(writer, EV_WRITE);
+	out = evbuffer_new();
+
+	gettimeofday(&ts, NULL);
+	while (n_msgs_read < num_msgs) {
+		n_msgs_expected = n_msgs_read + batch;
+		if (n_msgs_expected > num_msgs)
+			n_msgs_expected = num_msgs;
+		for (i = n_msgs_read; i < n_msgs_expected; ++i) {
+			evbuffer_add_reference(out, msg, msg_size, NULL, NULL);
+			evbuffer_mark_record_end(out, 0);
+		}
+		bufferevent_write_buffer(writer, out);
+		event_base_dispatch(base);
+	}
+	gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%s, %d layers: %d messages of %lu bytes in %.0f usec: "
+	    "%.2f MB/sec\n",
+	    copy_mode ? "evbuffer_remove_buffer" :
+	    "evbuffer_remove_buffer_reference", depth,
+	    num_msgs, (unsigned long)msg_size, usec,
+	    usec > 0 ? n_read / usec : 0.0);
+
+	evbuffer_free(out);
+	bufferevent_free(writer);
+	bufferevent_free(reader);
+	event_base_free(base);
+	free(msg);
+
+	return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures how quickly two threads, each running its own
+ * event_base, can bounce a message back and forth.  By default the data
+ * moves through a pair of evbuffer_handoff queues.  With -l, it moves
+ * through a pair of shared evbuffers with locking enabled and deferred
+ * callbacks instead, which is how you had to do it before.
+ */
+
+struct side {
+	struct event_base *base;
+	/* Where our peer's data shows up. */
+	struct evbuffer *in;
+	/* Where we stage data for our peer (unused with -l). */
+	struct evbuffer *out;
+	/* With -l, the shared buffer we add our peer's data to. */
+	struct evbuffer *peer_in;
+	/* Otherwise, the queue we push our peer's data into. */
+	struct evbuffer_handoff *to_peer;
+	/* Keeps the loop running until we're done. */
+	struct event *keepalive;
+	/* True for the side that counts round trips. */
+	int is_client;
+	long n_seen;
+};
+
+static long num_rounds = 100000;
+static size_t msg_size = 64;
+static char *msg;
+
+static void
+side_send(struct side *s)
+{
+	if (s->to_peer) {
+		evbuffer_handoff_push(s->to_peer, s->out);
+	} else {
+		/* Both buffers are locked, so this takes two locks. */
+		evbuffer_add_buffer(s->peer_in, s->out);
+	}
+}
+
+static void
+side_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+	struct side *s = arg;
+
+	/* Ignore the calls caused by our own evbuffer_remove_buffer(). */
+	if (!info->n_added)
+		return;
+	while (evbuffer_get_length(s->in) >= msg_size) {
+		evbuffer_remove_buffer(s->in, s->out, msg_size);
+		if (++s->n_seen == num_rounds) {
+			if (!s->is_client)
+				side_send(s);
+			event_base_loopexit(s->base, NULL);
+			return;
+		}
+		if (s->is_client) {
+			/* Reply with a fresh message, as a real producer
+			 * would. */
+			evbuffer_drain(s->out, msg_size);
+			evbuffer_add(s->out, msg, msg_size);
+		}
+		side_send(s);
+	}
+}
+
+static void
+side_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct side *s = arg;
+	fprintf(stderr, "timed out after %ld messages\n", s->n_seen);
+	event_base_loopexit(s->base, NULL);
+}
+
+static void *
+side_run(void *arg)
+{
+	struct side *s = arg;
+	event_base_dispatch(s->base);
+	return (NULL);
+}
+
+static void
+side_init(struct side *s, int locked)
+{
+	struct timeval tv = { 600, 0 };
+
+	memset(s, 0, sizeof(*s));
+	s->base = event_base_new();
+	s->in = evbuffer_new();
+	s->out = evbuffer_new();
+	if (!s->base || !s->in || !s->out) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+	if (evthread_make_base_notifiable(s->base) < 0) {
+		fprintf(stderr, "evthread_make_base_notifiable failed\n");
+		exit(1);
+	}
+	if (locked) {
+		evbuffer_enable_locking(s->in, NULL);
+		evbuffer_enable_locking(s->out, NULL);
+		evbuffer_defer_callbacks(s->in, s->base);
+	}
+	evbuffer_add_cb(s->in, side_cb, s);
+	s->keepalive = evtimer_new(s->base, side_timeout_cb, s);
+	evtimer_add(s->keepalive, &tv);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct side client, server;
+	struct evbuffer_handoff *to_server = NULL, *to_client = NULL;
+	struct timeval ts, te;
+	pthread_t thread;
+	int c, locked = 0;
+	double usec;
+
+	while ((c = getopt(argc, argv, "ln:s:")) != -1) {
+		switch (c) {
+		case 'l':
+			locked = 1;
+			break;
+		case 'n':
+			num_rounds = atol(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_rounds <= 0 || msg_size == 0) {
+		fprintf(stderr, "-n and -s must be positive\n");
+		exit(1);
+	}
+
+	if (evthread_use_pthreads() < 0) {
+		fprintf(stderr, "evthread_use_pthreads failed\n");
+		exit(1);
+	}
+	if ((msg = malloc(msg_size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msg_size);
+
+	side_init(&client, locked);
+	side_init(&server, locked);
+	client.is_client = 1;
+	if (locked) {
+		client.peer_in = server.in;
+		server.peer_in = client.in;
+	} else {
+		to_server = evbuffer_handoff_new();
+		to_client = evbuffer_handoff_new();
+		if (!to_server || !to_client) {
+			fprintf(stderr, "evbuffer_handoff_new failed\n");
+			exit(1);
+		}
+		evbuffer_handoff_set_consumer(to_server, server.base,
+		    server.in);
+		evbuffer_handoff_set_consumer(to_client, client.base,
+		    client.in);
+		client.to_peer = to_server;
+		server.to_peer = to_client;
+	}
+
+	pthread_create(&thread, NULL, side_run, &server);
+
+	gettimeofday(&ts, NULL);
+	evbuffer_add(client.out, msg, msg_size);
+	side_send(&client);
+	event_base_dispatch(client.base);
+	gettimeofday(&te, NULL);
+
+	pthread_join(thread, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%s: %ld round trips of %lu bytes in %.0f usec: "
+	    "%.0f round trips/sec, %.2f usec/round trip\n",
+	    locked ? "locked evbuffers" : "evbuffer_handoff",
+	    client.n_seen, (unsigned long)msg_size, usec,
+	    usec > 0 ? client.n_seen * 1000000.0 / usec : 0.0,
+	    client.n_seen ? usec / client.n_seen : 0.0);
+
+	if (to_server)
+		evbuffer_handoff_free(to_server);
+	if (to_client)
+		evbuffer_handoff_free(to_client);
+	event_free(client.keepalive);
+	event_free(server.keepalive);
+	evbuffer_free(client.in);
+	evbuffer_free(client.out);
+	evbuffer_free(server.in);
+	evbuffer_free(server.out);
+	event_base_free(client.base);
+	event_base_free(server.base);
+	free(msg);
+
+	return (client.n_seen == num_rounds ? 0 : 1);
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures how quickly one thread can stream data to
+ * another through a pair of bufferevents.  By default, the writer and the
+ * reader each run their own event_base, linked by a cross-base pair.
+ * With -l, both ends of an ordinary pair live on the reader's event_base
+ * with locking enabled, and the writer thread calls bufferevent_write()
+ * on its end directly, which is how you had to do it before.
+ */
+
+static long total_bytes = 256*1024*1024;
+static size_t chunk_size = 4096;
+static size_t high_wm = 256*1024;
+static char *chunk;
+
+static struct event_base *reader_base, *writer_base;
+static struct bufferevent *pair[2];
+static long n_read, n_written;
+
+/* With -l, the writer sleeps on this until the reader has caught up. */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_woken;
+
+static void
+reader_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t len = evbuffer_get_length(input);
+
+	evbuffer_drain(input, len);
+	n_read += len;
+	if (n_read >= total_bytes) {
+		event_base_loopexit(reader_base, NULL);
+		if (writer_base)
+			event_base_loopexit(writer_base, NULL);
+	}
+}
+
+/* Keep the writer's output topped up to twice the reader's high-water
+ * mark. */
+static void
+writer_writecb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *output = bufferevent_get_output(bev);
+
+	while (n_written < total_bytes &&
+	    evbuffer_get_length(output) < 2 * high_wm) {
+		bufferevent_write(bev, chunk, chunk_size);
+		n_written += chunk_size;
+	}
+}
+
+/* With -l, this runs in the reader's thread: wake the writer up.  We're
+ * called with the pair locked, so the writer mustn't touch the pair while
+ * holding writer_lock. */
+static void
+locked_writecb(struct bufferevent *bev, void *arg)
+{
+	pthread_mutex_lock(&writer_lock);
+	writer_woken = 1;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+static void
+locked_write_all(void)
+{
+	struct evbuffer *output = bufferevent_get_output(pair[0]);
+
+	while (n_written < total_bytes) {
+		if (evbuffer_get_length(output) >= 2 * high_wm) {
+			pthread_mutex_lock(&writer_lock);
+			while (!writer_woken)
+				pthread_cond_wait(&writer_cond, &writer_lock);
+			writer_woken = 0;
+			pthread_mutex_unlock(&writer_lock);
+			continue;
+		}
+		bufferevent_write(pair[0], chunk, chunk_size);
+		n_written += chunk_size;
+	}
+}
+
+static void
+timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	fprintf(stderr, "timed out after %ld bytes\n", n_read);
+	exit(1);
+}
+
+static void *
+reader_run(void *arg)
+{
+	event_base_dispatch(reader_base);
+	return (NULL);
+}
+
+static struct event_base *
+new_base(struct event **keepalive)
+{
+	struct timeval tv = { 600, 0 };
+	struct event_base *base;
+
+	if ((base = event_base_new()) == NULL) {
+		fprintf(stderr, "event_base_new failed\n");
+		exit(1);
+	}
+	/* The pair's callbacks are deferred, and don't keep the loop
+	 * running by themselves. */
+	*keepalive = evtimer_new(base, timeout_cb, NULL);
+	evtimer_add(*keepalive, &tv);
+	return base;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event *reader_keepalive, *writer_keepalive = NULL;
+	struct timeval ts, te;
+	pthread_t thread;
+	int c, locked = 0;
+	double usec;
+
+	while ((c = getopt(argc, argv, "lm:s:w:")) != -1) {
+		switch (c) {
+		case 'l':
+			locked = 1;
+			break;
+		case 'm':
+			total_bytes = atol(optarg) * 1024 * 1024;
+			break;
+		case 's':
+			chunk_size = atoi(optarg);
+			break;
+		case 'w':
+			high_wm = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (total_bytes <= 0 || chunk_size == 0 || high_wm == 0) {
+		fprintf(stderr, "-m, -s and -w must be positive\n");
+		exit(1);
+	}
+
+	if (evthread_use_pthreads() < 0) {
+		fprintf(stderr, "evthread_use_pthreads failed\n");
+		exit(1);
+	}
+	if ((chunk = malloc(chunk_size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(chunk, 'x', chunk_size);
+
+	reader_base = new_base(&reader_keepalive);
+	if (locked) {
+		if (bufferevent_pair_new(reader_base, BEV_OPT_THREADSAFE,
+			pair) < 0) {
+			fprintf(stderr, "bufferevent_pair_new failed\n");
+			exit(1);
+		}
+		bufferevent_setcb(pair[0], NULL, locked_writecb, NULL, NULL);
+	} else {
+		writer_base = new_base(&writer_keepalive);
+		if (bufferevent_pair_new_cross_base(writer_base, reader_base,
+			0, pair) < 0) {
+			fprintf(stderr,
+			    "bufferevent_pair_new_cross_base failed\n");
+			exit(1);
+		}
+		bufferevent_setcb(pair[0], NULL, writer_writecb, NULL, NULL);
+	}
+	bufferevent_setwatermark(pair[0], EV_WRITE, high_wm, 0);
+	bufferevent_setcb(pair[1], reader_readcb, NULL, NULL, NULL);
+	bufferevent_setwatermark(pair[1], EV_READ, 0, high_wm);
+	bufferevent_enable(pair[1], EV_READ);
+
+	pthread_create(&thread, NULL, reader_run, NULL);
+
+	gettimeofday(&ts, NULL);
+	if (locked) {
+		locked_write_all();
+	} else {
+		writer_writecb(pair[0], NULL);
+		event_base_dispatch(writer_base);
+	}
+	pthread_join(thread, NULL);
+	gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%s: %ld bytes in chunks of %lu in %.0f usec: "
+	    "%.2f MB/sec\n",
+	    locked ? "locked same-base pair" : "cross-base pair",
+	    n_read, (unsigned long)chunk_size, usec,
+	    usec > 0 ? n_read / usec : 0.0);
+
+	bufferevent_free(pair[0]);
+	bufferevent_free(pair[1]);
+	event_free(reader_keepalive);
+	if (writer_keepalive)
+		event_free(writer_keepalive);
+	event_base_free(reader_base);
+	if (writer_base)
+		event_base_free(writer_base);
+	free(chunk);
+
+	return (n_read >= total_bytes ? 0 : 1);
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#endif
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures evbuffer_add_printf() on the kinds of lines that
+ * access loggers and header writers produce, against the way it used to
+ * work: reserve some space, format into it with evutil_vsnprintf(), and
+ * if the result didn't fit, reserve more and format it all over again.
+ */
+
+static long num_lines = 1000000;
+
+#ifndef va_copy
+#define	va_copy(dst, src)	memcpy(&(dst), &(src), sizeof(va_list))
+#endif
+
+/* The old evbuffer_add_vprintf(), rebuilt from the public API. */
+static int
+old_add_printf(struct evbuffer *buf, const char *fmt, ...)
+{
+	struct evbuffer_iovec v;
+	size_t want = 64;
+	va_list ap, aq;
+	int sz;
+
+	va_start(ap, fmt);
+	for (;;) {
+		if (evbuffer_reserve_space(buf, want, &v, 1) != 1) {
+			sz = -1;
+			break;
+		}
+		va_copy(aq, ap);
+		sz = evutil_vsnprintf(v.iov_base, v.iov_len, fmt, aq);
+		va_end(aq);
+		if (sz < 0)
+			break;
+		if ((size_t)sz < v.iov_len) {
+			v.iov_len = sz;
+			evbuffer_commit_space(buf, &v, 1);
+			break;
+		}
+		want = sz + 1;
+	}
+	va_end(ap);
+	return sz;
+}
+
+static const char *paths[] = {
+	"/", "/index.html", "/static/css/site.css",
+	"/api/v1/users/12345/preferences?include=notifications,privacy",
+};
+
+static double
+run(int old, int which)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct timeval ts, te;
+	size_t len;
+	long i;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_lines; ++i) {
+		const char *path = paths[i & 3];
+		len = (size_t)(i * 7919) & 0xfffff;
+		switch (which) {
+		case 0:
+			if (old)
+				old_add_printf(buf, "Content-Length: %zu\r\n",
+				    len);
+			else
+				evbuffer_add_printf(buf,
+				    "Content-Length: %zu\r\n", len);
+			break;
+		case 1:
+			if (old)
+				old_add_printf(buf, "%s - - \"%s %s HTTP/1.1\" "
+				    "%d %zu \"%s\"\n", "192.168.100.200",
+				    "GET", path, 200, len, "Mozilla/5.0");
+			else
+				evbuffer_add_printf(buf, "%s - - \"%s %s "
+				    "HTTP/1.1\" %d %zu \"%s\"\n",
+				    "192.168.100.200", "GET", path, 200, len,
+				    "Mozilla/5.0");
+			break;
+		case 2:
+			if (old)
+				old_add_printf(buf, "%s %s %d %.3f\n", "GET",
+				    path, 200, i / 1000.0);
+			else
+				evbuffer_add_printf(buf, "%s %s %d %.3f\n",
+				    "GET", path, 200, i / 1000.0);
+			break;
+		}
+		/* Act like a writer that flushes now and then. */
+		if (evbuffer_get_length(buf) > 65536)
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+	}
+	gettimeofday(&te, NULL);
+
+	evbuffer_free(buf);
+	evutil_timersub(&te, &ts, &te);
+	return te.tv_sec * 1000000.0 + te.tv_usec;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *names[] = {
+		"header line", "access log line", "line with %f"
+	};
+	double t_old, t_new;
+	int c, which;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_lines = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_lines <= 0) {
+		fprintf(stderr, "-n must be positive\n");
+		exit(1);
+	}
+
+	for (which = 0; which < 3; ++which) {
+		t_old = run(1, which);
+		t_new = run(0, which);
+		fprintf(stdout, "%-16s: vsnprintf %7.1f nsec/line, "
+		    "evbuffer_add_printf %7.1f nsec/line (%.2fx)\n",
+		    names[which], t_old * 1000.0 / num_lines,
+		    t_new * 1000.0 / num_lines,
+		    t_new > 0 ? t_old / t_new : 0.0);
+	}
+
+	return (0);
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include <openssl/ssl.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+/*
+ * This benchmark measures how much a storm of TLS handshakes slows down
+ * the other connections on the same event_base.  The main thread runs a
+ * TLS server, and a few plain connections that bounce timestamps back and
+ * forth as fast as they can.  Another thread opens connections to the
+ * server, a few at a time, until it has done all its handshakes.  We
+ * report the round-trip times the plain connections saw meanwhile.  With
+ * -w, the server does its handshakes on a pool of that many worker
+ * threads rather than on the event loop.
+ */
+
+static struct event_base *base;
+static struct bufferevent_openssl_handshake_pool *pool;
+static SSL_CTX *server_ctx;
+static int n_handshakes = 2000;
+static int n_concurrent = 32;
+static int n_pingers = 10;
+static int key_bits = 2048;
+
+/* Round-trip times seen by the plain connections, in usec. */
+static double *rtts;
+static int n_rtts, rtts_alloc;
+static volatile int storm_running = 1;
+
+/* Owned by the storm thread. */
+static struct event_base *client_base;
+static SSL_CTX *client_ctx;
+static struct sockaddr_in server_sin;
+static int n_started, n_done, n_failed;
+
+static void
+die(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	exit(1);
+}
+
+static void
+make_key_and_cert(EVP_PKEY **key_out, X509 **cert_out)
+{
+	EVP_PKEY *key = EVP_PKEY_new();
+	X509 *x509 = X509_new();
+	X509_NAME *name = X509_NAME_new();
+	RSA *rsa = RSA_generate_key(key_bits, RSA_F4, NULL, NULL);
+
+	if (!key || !x509 || !name || !rsa)
+		die("couldn't make a key");
+	EVP_PKEY_assign_RSA(key, rsa);
+	X509_set_version(x509, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (unsigned char *)"localhost", -1, -1, 0);
+	X509_set_subject_name(x509, name);
+	X509_set_issuer_name(x509, name);
+	X509_gmtime_adj(X509_get_notBefore(x509), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509), 3600);
+	X509_set_pubkey(x509, key);
+	if (!X509_sign(x509, key, EVP_sha256()))
+		die("couldn't sign our certificate");
+	X509_NAME_free(name);
+	*key_out = key;
+	*cert_out = x509;
+}
+
+/* ---- The plain connections ---- */
+
+static void
+pinger_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct timeval then, now;
+
+	while (evbuffer_get_length(input) >= sizeof(then)) {
+		evbuffer_remove(input, &then, sizeof(then));
+		evutil_gettimeofday(&now, NULL);
+		evutil_timersub(&now, &then, &now);
+		if (n_rtts == rtts_alloc) {
+			rtts_alloc = rtts_alloc ? rtts_alloc * 2 : 4096;
+			if (!(rtts = realloc(rtts, rtts_alloc * sizeof(double))))
+				die("out of memory");
+		}
+		rtts[n_rtts++] = now.tv_sec * 1000000.0 + now.tv_usec;
+		if (storm_running) {
+			evutil_gettimeofday(&now, NULL);
+			bufferevent_write(bev, &now, sizeof(now));
+		}
+	}
+}
+
+static void
+echo_readcb(struct bufferevent *bev, void *arg)
+{
+	bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+static void
+start_pinger(void)
+{
+	struct bufferevent *pinger, *echoer;
+	evutil_socket_t pair[2];
+	struct timeval now;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		die("socketpair failed");
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	pinger = bufferevent_socket_new(base, pair[0], BEV_OPT_CLOSE_ON_FREE);
+	echoer = bufferevent_socket_new(base, pair[1], BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(pinger, pinger_readcb, NULL, NULL, NULL);
+	bufferevent_setcb(echoer, echo_readcb, NULL, NULL, NULL);
+	bufferevent_enable(pinger, EV_READ|EV_WRITE);
+	bufferevent_enable(echoer, EV_READ|EV_WRITE);
+	evutil_gettimeofday(&now, NULL);
+	bufferevent_write(pinger, &now, sizeof(now));
+}
+
+/* ---- The TLS server ---- */
+
+static void
+server_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	/* Handshake done, or failed: either way, we're finished with it. */
+	bufferevent_free(bev);
+}
+
+static void
+acceptcb(struct evconnlistener *l, evutil_socket_t fd,
+    struct sockaddr *addr, int socklen, void *arg)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_openssl_socket_new(base, fd, SSL_new(server_ctx),
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev)
+		die("couldn't make a server bufferevent");
+	if (pool && bufferevent_openssl_set_handshake_pool(bev, pool) < 0)
+		die("couldn't use the handshake pool");
+	bufferevent_setcb(bev, NULL, NULL, server_eventcb, NULL);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+/* ---- The storm ---- */
+
+static void start_client(void);
+
+static void
+client_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (!(what & BEV_EVENT_CONNECTED))
+		++n_failed;
+	bufferevent_free(bev);
+	if (++n_done == n_handshakes) {
+		event_base_loopexit(client_base, NULL);
+		return;
+	}
+	if (n_started < n_handshakes)
+		start_client();
+}
+
+static void
+start_client(void)
+{
+	struct bufferevent *bev;
+
+	++n_started;
+	bev = bufferevent_openssl_socket_new(client_base, -1,
+	    SSL_new(client_ctx), BUFFEREVENT_SSL_CONNECTING,
+	    BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(bev, NULL, NULL, client_eventcb, NULL);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	if (bufferevent_socket_connect(bev, (struct sockaddr *)&server_sin,
+		sizeof(server_sin)) < 0)
+		die("couldn't connect");
+}
+
+static void *
+storm_thread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < n_concurrent && i < n_handshakes; ++i)
+		start_client();
+	event_base_dispatch(client_base);
+
+	storm_running = 0;
+	event_base_loopexit(base, NULL);
+	return NULL;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evconnlistener *listener;
+	struct timeval ts, te;
+	ev_socklen_t slen = sizeof(server_sin);
+	pthread_t storm;
+	EVP_PKEY *key;
+	X509 *cert;
+	double usec;
+	int c, i, n_workers = 0;
+
+	while ((c = getopt(argc, argv, "b:c:n:p:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			key_bits = atoi(optarg);
+			break;
+		case 'c':
+			n_concurrent = atoi(optarg);
+			break;
+		case 'n':
+			n_handshakes = atoi(optarg);
+			break;
+		case 'p':
+			n_pingers = atoi(optarg);
+			break;
+		case 'w':
+			n_workers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_handshakes <= 0 || n_concurrent <= 0 || n_pingers <= 0 ||
+	    n_workers < 0)
+		die("-n, -c and -p must be positive, and -w can't be negative");
+
+	/* Our peers hang up as soon as their handshakes are done. */
+	signal(SIGPIPE, SIG_IGN);
+	SSL_library_init();
+	SSL_load_error_strings();
+	if (evthread_use_pthreads() < 0)
+		die("couldn't turn on threading");
+
+	make_key_and_cert(&key, &cert);
+	server_ctx = SSL_CTX_new(SSLv23_server_method());
+	client_ctx = SSL_CTX_new(SSLv23_client_method());
+	if (!server_ctx || !client_ctx ||
+	    !SSL_CTX_use_certificate(server_ctx, cert) ||
+	    !SSL_CTX_use_PrivateKey(server_ctx, key))
+		die("couldn't set up OpenSSL");
+	/* Every connection should pay for a full handshake. */
+	SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+
+	base = event_base_new();
+	client_base = event_base_new();
+	if (n_workers &&
+	    !(pool = bufferevent_openssl_handshake_pool_new(n_workers)))
+		die("couldn't start the handshake pool");
+
+	memset(&server_sin, 0, sizeof(server_sin));
+	server_sin.sin_family = AF_INET;
+	server_sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	listener = evconnlistener_new_bind(base, acceptcb, NULL,
+	    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+	    (struct sockaddr *)&server_sin, sizeof(server_sin));
+	if (!listener ||
+	    getsockname(evconnlistener_get_fd(listener),
+		(struct sockaddr *)&server_sin, &slen) < 0)
+		die("couldn't listen");
+
+	for (i = 0; i < n_pingers; ++i)
+		start_pinger();
+
+	evutil_gettimeofday(&ts, NULL);
+	if (pthread_create(&storm, NULL, storm_thread, NULL))
+		die("couldn't start the storm thread");
+	event_base_dispatch(base);
+	evutil_gettimeofday(&te, NULL);
+	pthread_join(storm, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	qsort(rtts, n_rtts, sizeof(double), compare_doubles);
+	printf("%d handshakes (%d failed) with %d worker threads in %.0f "
+	    "usec: %.0f handshakes/sec\n", n_done, n_failed, n_workers, usec,
+	    usec > 0 ? n_done * 1000000.0 / usec : 0.0);
+	if (n_rtts)
+		printf("%d round trips on %d other connections: "
+		    "p50 %.0f usec, p99 %.0f usec, max %.0f usec\n",
+		    n_rtts, n_pingers, rtts[n_rtts / 2],
+		    rtts[(int)(n_rtts * 0.99)], rtts[n_rtts - 1]);
+
+	if (pool)
+		bufferevent_openssl_handshake_pool_free(pool);
+	free(rtts);
+
+	return n_failed ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_zlib.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures how quickly data can be compressed and
+ * decompressed through a pair of zlib bufferevents, over a bufferevent
+ * pair so that no time goes to the network.  Each connection sends -s
+ * bytes of text and finishes its stream.
+ *
+ * By default it uses bufferevent_zlib_new() with a shared stream pool.
+ * With -P, each connection sets up its own streams.  With -n, it uses a
+ * filter written the way most users write their own: it sets up its
+ * streams for each connection, pulls the input into one piece, and
+ * compresses into a fresh malloc()ed buffer on each call.
+ */
+
+static int num_conns = 1000;
+static size_t msg_size = 64*1024;
+static int level = Z_DEFAULT_COMPRESSION;
+static char *msg;
+
+static size_t n_read;
+
+/* The naive filter. */
+static enum bufferevent_filter_result
+naive_filter(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx,
+    int deflating)
+{
+	z_streamp z = ctx;
+	size_t len = evbuffer_get_length(src);
+	size_t out_len;
+	unsigned char *out;
+	int flush, r;
+
+	flush = mode == BEV_FINISHED ? Z_FINISH :
+	    mode == BEV_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+	z->next_in = evbuffer_pullup(src, -1);
+	z->avail_in = len;
+	do {
+		out_len = deflating ? deflateBound(z, len) : len * 4 + 4096;
+		if (!(out = malloc(out_len)))
+			return BEV_ERROR;
+		z->next_out = out;
+		z->avail_out = out_len;
+		r = deflating ? deflate(z, flush) : inflate(z, Z_SYNC_FLUSH);
+		evbuffer_add(dst, out, out_len - z->avail_out);
+		free(out);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+			return BEV_ERROR;
+	} while (z->avail_out == 0);
+	evbuffer_drain(src, len - z->avail_in);
+	return BEV_OK;
+}
+
+static enum bufferevent_filter_result
+naive_deflate(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx)
+{
+	return naive_filter(src, dst, lim, mode, ctx, 1);
+}
+
+static enum bufferevent_filter_result
+naive_inflate(struct evbuffer *src, struct evbuffer *dst,
+    ev_ssize_t lim, enum bufferevent_flush_mode mode, void *ctx)
+{
+	return naive_filter(src, dst, lim, mode, ctx, 0);
+}
+
+static void
+naive_deflate_free(void *ctx)
+{
+	deflateEnd(ctx);
+	free(ctx);
+}
+
+static void
+naive_inflate_free(void *ctx)
+{
+	inflateEnd(ctx);
+	free(ctx);
+}
+
+static struct bufferevent *
+naive_new(struct bufferevent *underlying, int deflating)
+{
+	z_streamp z = calloc(1, sizeof(z_stream));
+
+	if (!z)
+		return NULL;
+	if (deflating) {
+		deflateInit(z, level);
+		return bufferevent_filter_new(underlying, NULL, naive_deflate,
+		    BEV_OPT_CLOSE_ON_FREE, naive_deflate_free, z);
+	} else {
+		inflateInit(z);
+		return bufferevent_filter_new(underlying, naive_inflate, NULL,
+		    BEV_OPT_CLOSE_ON_FREE, naive_inflate_free, z);
+	}
+}
+
+static void
+readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	n_read += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	struct bufferevent_zlib_pool *pool = NULL;
+	struct bufferevent *pair[2], *writer, *reader;
+	struct timeval ts, te;
+	int c, i, j, naive = 0, use_pool = 1;
+	size_t off, expected;
+	double usec;
+
+	while ((c = getopt(argc, argv, "c:l:nPs:")) != -1) {
+		switch (c) {
+		case 'c':
+			num_conns = atoi(optarg);
+			break;
+		case 'l':
+			level = atoi(optarg);
+			break;
+		case 'n':
+			naive = 1;
+			break;
+		case 'P':
+			use_pool = 0;
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_conns <= 0 || msg_size == 0) {
+		fprintf(stderr, "-c and -s must be positive\n");
+		exit(1);
+	}
+
+	/* Lines of text, with enough variety to make zlib work. */
+	if ((msg = malloc(msg_size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (off = 0, i = 0; off < msg_size; off += j, ++i) {
+		char line[64];
+		j = evutil_snprintf(line, sizeof(line),
+		    "GET /item/%d?session=%x HTTP/1.1\r\n", i, i * 2654435761U);
+		if ((size_t)j > msg_size - off)
+			j = msg_size - off;
+		memcpy(msg + off, line, j);
+	}
+
+	base = event_base_new();
+	if (use_pool && !naive)
+		pool = bufferevent_zlib_pool_new(16);
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_conns; ++i) {
+		if (bufferevent_pair_new(base, 0, pair) < 0) {
+			fprintf(stderr, "bufferevent_pair_new failed\n");
+			exit(1);
+		}
+		if (naive) {
+			writer = naive_new(pair[0], 1);
+			reader = naive_new(pair[1], 0);
+		} else {
+			writer = bufferevent_zlib_new(pair[0], level, 0, pool,
+			    BEV_OPT_CLOSE_ON_FREE);
+			reader = bufferevent_zlib_new(pair[1], level, 0, pool,
+			    BEV_OPT_CLOSE_ON_FREE);
+		}
+		if (!writer || !reader) {
+			fprintf(stderr, "couldn't create the filters\n");
+			exit(1);
+		}
+		bufferevent_setcb(reader, readcb, NULL, NULL, NULL);
+		bufferevent_enable(reader, EV_READ);
+
+		expected = n_read + msg_size;
+		bufferevent_write(writer, msg, msg_size);
+		bufferevent_flush(writer, EV_WRITE, BEV_FINISHED);
+		for (j = 0; j < 100 && n_read < expected; ++j)
+			event_base_loop(base, EVLOOP_NONBLOCK);
+		if (n_read != expected) {
+			fprintf(stderr, "connection %d lost data\n", i);
+			exit(1);
+		}
+
+		bufferevent_free(writer);
+		bufferevent_free(reader);
+	}
+	gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%s: %d connections of %lu bytes in %.0f usec: "
+	    "%.2f MB/sec, %.0f connections/sec\n",
+	    naive ? "naive filter" :
+	    pool ? "bufferevent_zlib with pool" : "bufferevent_zlib",
+	    num_conns, (unsigned long)msg_size, usec,
+	    usec > 0 ? n_read / usec : 0.0,
+	    usec > 0 ? num_conns * 1000000.0 / usec : 0.0);
+
+	if (pool)
+		bufferevent_zlib_pool_free(pool);
+	event_base_free(base);
+	free(msg);
+
+	return 0;
+}
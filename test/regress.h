@@ -49,10 +49,15 @@ extern struct testcase_t minheap_testcases[];
 extern struct testcase_t iocp_testcases[];
 extern struct testcase_t ssl_testcases[];
 extern struct testcase_t listener_testcases[];
+extern struct testcase_t dgram_testcases[];
 extern struct testcase_t listener_iocp_testcases[];
 
 void regress_threads(void *);
+void regress_thread_handoff(void *);
+void regress_thread_handoff_wakeup(void *);
+void regress_thread_pair_cross_base(void *);
 void test_bufferevent_zlib(void *);
+void test_bufferevent_zlib_filter(void *);
 
 /* Helpers to wrap old testcases */
 extern int pair[2];
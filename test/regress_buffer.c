@@ -44,12 +44,15 @@
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdarg.h>
 
 #include "event2/event.h"
 #include "event2/buffer.h"
@@ -399,6 +402,117 @@ test_evbuffer_add_file(void *ptr)
 	EVUTIL_CLOSESOCKET(pair[1]);
 	evbuffer_free(src);
 }
+
+static void
+test_evbuffer_file_segment(void *ptr)
+{
+	/* Try each way of getting the file data out: sendfile (where we
+	 * have it), mmap, and plain reads. */
+	const unsigned modes[] = { 0, EVBUF_FS_DISABLE_SENDFILE,
+		EVBUF_FS_DISABLE_SENDFILE|EVBUF_FS_DISABLE_MMAP };
+	struct evbuffer *src = NULL, *expect = NULL, *got = NULL;
+	struct evbuffer_file_segment *whole = NULL, *tail = NULL;
+	char data[8000];
+	evutil_socket_t pair[2] = { -1, -1 };
+	int fd = -1, i, m;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = 'a' + (i * 7 + i / 26) % 26;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != -1);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	for (m = 0; m < (int)(sizeof(modes)/sizeof(modes[0])); ++m) {
+		size_t len;
+		TT_BLATHER(("Trying mode %u", modes[m]));
+
+		fd = regress_make_tmpfile(data, sizeof(data));
+		tt_assert(fd >= 0);
+		whole = evbuffer_file_segment_new(fd, 0, -1, modes[m]);
+		tt_assert(whole);
+		/* Not page-aligned, so mmap has to round down.  This one's
+		 * range is sent last, so it gets to close the fd. */
+		tail = evbuffer_file_segment_new(fd, 5000, -1,
+		    modes[m] | EVBUF_FS_CLOSE_ON_FREE);
+		tt_assert(tail);
+
+		src = evbuffer_new();
+		expect = evbuffer_new();
+		got = evbuffer_new();
+
+		/* A multi-range response: headers and file ranges, some of
+		 * them back to back. */
+		evbuffer_add_printf(src, "--part 1--\r\n");
+		tt_int_op(evbuffer_add_file_segment(src, whole, 100, 500),
+		    ==, 0);
+		evbuffer_add_printf(src, "\r\n--part 2--\r\n");
+		tt_int_op(evbuffer_add_file_segment(src, whole, 7000, -1),
+		    ==, 0);
+		tt_int_op(evbuffer_add_file_segment(src, tail, 0, 10), ==, 0);
+		tt_int_op(evbuffer_add_file_segment(src, whole, 0, 0), ==, 0);
+		evbuffer_add_printf(src, "\r\n--end--\r\n");
+		evbuffer_validate(src);
+
+		evbuffer_add_printf(expect, "--part 1--\r\n");
+		evbuffer_add(expect, data + 100, 500);
+		evbuffer_add_printf(expect, "\r\n--part 2--\r\n");
+		evbuffer_add(expect, data + 7000, 1000);
+		evbuffer_add(expect, data + 5000, 10);
+		evbuffer_add_printf(expect, "\r\n--end--\r\n");
+		len = evbuffer_get_length(expect);
+		tt_int_op(evbuffer_get_length(src), ==, len);
+
+		/* Ranges past the end of the segment are rejected. */
+		tt_int_op(evbuffer_add_file_segment(src, tail, 2999, 2), ==,
+		    -1);
+		tt_int_op(evbuffer_add_file_segment(src, tail, 3001, -1), ==,
+		    -1);
+
+		/* Our references are gone, but the ranges still need the
+		 * segments. */
+		evbuffer_file_segment_free(whole);
+		evbuffer_file_segment_free(tail);
+		whole = tail = NULL;
+
+		/* All of it goes out in one call, switching between writev
+		 * and sendfile as needed. */
+		tt_int_op(evbuffer_write(src, pair[0]), ==, (int)len);
+		tt_int_op(evbuffer_get_length(src), ==, 0);
+		evbuffer_validate(src);
+
+		while (evbuffer_get_length(got) < len)
+			tt_int_op(evbuffer_read(got, pair[1], -1), >, 0);
+		tt_int_op(evbuffer_get_length(got), ==, len);
+		tt_assert(!memcmp(evbuffer_pullup(got, -1),
+			evbuffer_pullup(expect, -1), len));
+
+		/* Freeing the last range closed the file. */
+		tt_int_op(fcntl(fd, F_GETFD), ==, -1);
+		fd = -1;
+
+		evbuffer_free(src);
+		evbuffer_free(expect);
+		evbuffer_free(got);
+		src = expect = got = NULL;
+	}
+
+ end:
+	if (whole)
+		evbuffer_file_segment_free(whole);
+	if (tail)
+		evbuffer_file_segment_free(tail);
+	if (src)
+		evbuffer_free(src);
+	if (expect)
+		evbuffer_free(expect);
+	if (got)
+		evbuffer_free(got);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
 #endif
 
 #ifndef _EVENT_DISABLE_MM_REPLACEMENT
@@ -910,6 +1024,90 @@ static void ref_done_cb(const void *data, size_t len, void *info)
 	ref_done_cb_called_with_len = len;
 }
 
+static void
+test_evbuffer_cb_batch(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf1 = evbuffer_new();
+	struct evbuffer *buf2 = evbuffer_new();
+	struct evbuffer *log1 = evbuffer_new();
+	struct evbuffer *log2 = evbuffer_new();
+	struct evbuffer_cb_batch *manual = NULL, *looped = NULL;
+	int i;
+
+	manual = evbuffer_cb_batch_new(NULL);
+	looped = evbuffer_cb_batch_new(data->base);
+	tt_assert(manual && looped);
+
+	evbuffer_add_cb(buf1, log_change_callback, log1);
+	evbuffer_add_cb(buf2, log_change_callback, log2);
+
+	/* Changes made before joining the batch don't count. */
+	evbuffer_add(buf1, "x", 1);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "0->1; ");
+	evbuffer_drain(log1, evbuffer_get_length(log1));
+	tt_int_op(evbuffer_set_cb_batch(buf1, manual), ==, 0);
+	tt_int_op(evbuffer_defer_callbacks(buf1, data->base), ==, -1);
+
+	/* Lots of little changes; no callbacks yet. */
+	for (i = 0; i < 100; ++i)
+		evbuffer_add(buf1, "abc", 3);
+	evbuffer_drain(buf1, 51);
+	tt_int_op(evbuffer_get_length(log1), ==, 0);
+
+	/* One callback with the totals. */
+	evbuffer_cb_batch_flush(manual);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "1->250; ");
+	evbuffer_cb_batch_flush(manual);
+	evbuffer_flush_callbacks(buf1);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "1->250; ");
+
+	/* Flushing a single buffer works too. */
+	evbuffer_drain(buf1, 50);
+	evbuffer_flush_callbacks(buf1);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "1->250; 250->200; ");
+	evbuffer_drain(log1, evbuffer_get_length(log1));
+
+	/* Leaving a batch runs what was pending. */
+	evbuffer_add(buf1, "y", 1);
+	tt_int_op(evbuffer_set_cb_batch(buf1, NULL), ==, 0);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "200->201; ");
+	evbuffer_drain(log1, evbuffer_get_length(log1));
+	evbuffer_add(buf1, "z", 1);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "201->202; ");
+	evbuffer_drain(log1, evbuffer_get_length(log1));
+
+	/* With a base, the batch is flushed from the loop. */
+	tt_int_op(evbuffer_set_cb_batch(buf1, looped), ==, 0);
+	tt_int_op(evbuffer_set_cb_batch(buf2, looped), ==, 0);
+	evbuffer_add(buf1, "hello", 5);
+	evbuffer_add(buf2, "hello", 5);
+	evbuffer_add(buf2, " world", 6);
+	tt_int_op(evbuffer_get_length(log1), ==, 0);
+	tt_int_op(evbuffer_get_length(log2), ==, 0);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_str_op(evbuffer_pullup(log1, -1), ==, "202->207; ");
+	tt_str_op(evbuffer_pullup(log2, -1), ==, "0->11; ");
+
+	/* A freed buffer leaves its batch. */
+	evbuffer_add(buf2, "!", 1);
+	evbuffer_free(buf2);
+	buf2 = NULL;
+	evbuffer_cb_batch_flush(looped);
+
+ end:
+	if (buf1)
+		evbuffer_free(buf1);
+	if (buf2)
+		evbuffer_free(buf2);
+	if (manual)
+		evbuffer_cb_batch_free(manual);
+	if (looped)
+		evbuffer_cb_batch_free(looped);
+	evbuffer_free(log1);
+	evbuffer_free(log2);
+}
+
 static void
 test_evbuffer_add_reference(void *ptr)
 {
@@ -984,6 +1182,317 @@ end:
 }
 
 /* Some cases that we didn't get in test_evbuffer() above, for more coverage. */
+static void
+test_evbuffer_multicast(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new();
+	struct evbuffer *dst[3] = { NULL, NULL, NULL };
+	evutil_socket_t pair[2] = { -1, -1 };
+	const char *data = "this is what we add as read-only memory.";
+	char expect[128], buf[128];
+	size_t len;
+	int i, n;
+
+	reference_cb_called = 0;
+	tt_assert(evbuffer_add_reference(src, data, strlen(data),
+		reference_cb, (void *)0xdeadaffe) != -1);
+	evbuffer_add_printf(src, " (%d)", 42);
+	len = evbuffer_get_length(src);
+	evutil_snprintf(expect, sizeof(expect), "<%s (42)", data);
+
+	for (i = 0; i < 3; ++i) {
+		dst[i] = evbuffer_new();
+		evbuffer_add(dst[i], "<", 1);
+		tt_int_op(evbuffer_add_buffer_reference(dst[i], src), ==, 0);
+		evbuffer_validate(dst[i]);
+		tt_int_op(evbuffer_get_length(dst[i]), ==, len + 1);
+	}
+	tt_int_op(evbuffer_get_length(src), ==, len);
+
+	/* Data we share from, or share to, can't be shared further. */
+	tt_int_op(evbuffer_add_buffer_reference(src, src), ==, -1);
+	tt_int_op(evbuffer_add_buffer_reference(dst[1], dst[0]), ==, -1);
+
+	/* The source can keep going without disturbing the copies. */
+	evbuffer_add(src, "!", 1);
+	evbuffer_prepend(src, "?", 1);
+	evbuffer_validate(src);
+	tt_assert(!memcmp(evbuffer_pullup(src, -1), "?", 1));
+	evbuffer_drain(src, len + 1);
+	tt_int_op(evbuffer_get_length(src), ==, 1);
+	evbuffer_free(src);
+	src = NULL;
+	tt_int_op(reference_cb_called, ==, 0);
+
+	n = evbuffer_remove(dst[0], buf, sizeof(buf));
+	tt_int_op(n, ==, len + 1);
+	tt_assert(!memcmp(buf, expect, n));
+	evbuffer_validate(dst[0]);
+
+	tt_assert(!memcmp(evbuffer_pullup(dst[1], -1), expect, len + 1));
+	evbuffer_validate(dst[1]);
+
+	/* Only the last reader releases the memory. */
+	tt_int_op(reference_cb_called, ==, 0);
+#ifndef WIN32
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	n = evbuffer_write(dst[2], pair[0]);
+	tt_int_op(n, ==, len + 1);
+	tt_int_op(evbuffer_get_length(dst[2]), ==, 0);
+	n = read(pair[1], buf, sizeof(buf));
+	tt_int_op(n, ==, len + 1);
+	tt_assert(!memcmp(buf, expect, n));
+#else
+	evbuffer_drain(dst[2], len + 1);
+#endif
+	tt_int_op(reference_cb_called, ==, 1);
+
+ end:
+	if (src)
+		evbuffer_free(src);
+	for (i = 0; i < 3; ++i) {
+		if (dst[i])
+			evbuffer_free(dst[i]);
+	}
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+
+static void
+test_evbuffer_slice(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new();
+	struct evbuffer *dst = evbuffer_new();
+	struct evbuffer *dst2 = evbuffer_new();
+	static char data[40000];
+	unsigned char *p;
+	struct evbuffer_iovec v[2];
+	ev_uint32_t tag = 0;
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = i * 7;
+
+	tt_int_op(evbuffer_mark_record_end(src, 1), ==, -1);
+	evbuffer_add(src, data, 30000);
+	tt_int_op(evbuffer_mark_record_end(src, 7), ==, 0);
+	evbuffer_add(src, data + 30000, 10000);
+	tt_int_op(evbuffer_mark_record_end(src, 8), ==, 0);
+	evbuffer_validate(src);
+	tt_int_op(evbuffer_get_record_length(src, &tag), ==, 30000);
+	tt_int_op(tag, ==, 7);
+	p = evbuffer_pullup(src, 1);
+	tt_assert(p);
+
+	/* Splitting a chain shares its memory instead of copying it. */
+	tt_int_op(evbuffer_remove_buffer_reference(src, dst, 10000), ==, 10000);
+	evbuffer_validate(src);
+	evbuffer_validate(dst);
+	tt_int_op(evbuffer_peek(dst, -1, NULL, v, 2), ==, 1);
+	tt_assert(v[0].iov_base == (void*)p);
+	tt_int_op(v[0].iov_len, ==, 10000);
+	tt_assert(evbuffer_pullup(src, 1) == p + 10000);
+	tt_int_op(evbuffer_get_record_length(dst, NULL), ==, -1);
+	tt_int_op(evbuffer_get_record_length(src, &tag), ==, 20000);
+	tt_int_op(tag, ==, 7);
+
+	/* Marks travel with whole chains; the partial chain is shared. */
+	tt_int_op(evbuffer_remove_buffer_reference(src, dst, 25000), ==, 25000);
+	evbuffer_validate(src);
+	evbuffer_validate(dst);
+	tt_int_op(evbuffer_get_length(dst), ==, 35000);
+	tt_int_op(evbuffer_get_record_length(dst, &tag), ==, 30000);
+	tt_int_op(tag, ==, 7);
+	tt_int_op(evbuffer_get_record_length(src, &tag), ==, 5000);
+	tt_int_op(tag, ==, 8);
+
+	/* Data that dst shares from src gets copied rather than shared
+	 * again, so that dst2 never refers to a third buffer. */
+	tt_int_op(evbuffer_remove_buffer_reference(dst, dst2, 34500), ==, 34500);
+	evbuffer_validate(dst);
+	evbuffer_validate(dst2);
+	tt_assert(!(dst2->last->flags & EVBUFFER_MULTICAST));
+	tt_int_op(evbuffer_get_record_length(dst2, &tag), ==, 30000);
+	tt_int_op(evbuffer_get_length(dst), ==, 500);
+
+	/* Small pieces get copied. */
+	tt_int_op(evbuffer_remove_buffer_reference(src, dst, 10), ==, 10);
+	evbuffer_validate(dst);
+	tt_int_op(evbuffer_get_length(src), ==, 4990);
+
+	/* The source can go away while others still hold its memory. */
+	evbuffer_free(src);
+	src = NULL;
+
+	/* A pullup that ends at a mark keeps it. */
+	p = evbuffer_pullup(dst2, 30000);
+	tt_assert(p);
+	tt_assert(!memcmp(p, data, 30000));
+	tt_int_op(evbuffer_get_record_length(dst2, &tag), ==, 30000);
+	tt_int_op(tag, ==, 7);
+	evbuffer_drain(dst2, 30000);
+	tt_int_op(evbuffer_get_record_length(dst2, NULL), ==, -1);
+	evbuffer_add_buffer(dst2, dst);
+	evbuffer_validate(dst2);
+	tt_int_op(evbuffer_get_length(dst2), ==, 5010);
+	tt_assert(!memcmp(evbuffer_pullup(dst2, -1), data + 30000, 5010));
+
+ end:
+	if (src)
+		evbuffer_free(src);
+	evbuffer_free(dst);
+	evbuffer_free(dst2);
+}
+
+static void
+test_evbuffer_coalesce(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer *plain = evbuffer_new();
+	char data[4096];
+	size_t n_coalesced, n_plain;
+	int i, j;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (char)i;
+
+	/* New chains are at least min_chain_size. */
+	tt_int_op(evbuffer_set_coalesce(buf, 8192, 1024), ==, 0);
+	evbuffer_add(buf, data, 10);
+	tt_assert(buf->first->buffer_len >= 8192);
+	evbuffer_drain(buf, 10);
+
+	/* Reuse free space at the front of the last chain by moving a
+	 * little data, where the default policy would add a chain. */
+	tt_int_op(evbuffer_set_coalesce(buf, 0, 1024), ==, 0);
+	evbuffer_add(buf, data, 3000);
+	evbuffer_drain(buf, 2500);
+	tt_int_op(evbuffer_get_n_bytes_moved(buf), ==, 0);
+	evbuffer_add(buf, data, 2600);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_n_chains(buf), ==, 1);
+	tt_int_op(evbuffer_get_n_bytes_moved(buf), ==, 500);
+	tt_assert(!memcmp(evbuffer_pullup(buf, 500), data + 2500, 500));
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+
+	/* Merge a short first chain into the space before the second. */
+	evbuffer_add(buf, data, 20);
+	evbuffer_add(tmp, data, 100);
+	evbuffer_drain(tmp, 50);
+	evbuffer_add_buffer(buf, tmp);
+	tt_int_op(evbuffer_get_n_chains(buf), ==, 2);
+	evbuffer_drain(buf, 5);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_n_chains(buf), ==, 1);
+	tt_int_op(evbuffer_get_length(buf), ==, 65);
+	tt_assert(!memcmp(evbuffer_pullup(buf, 15), data + 5, 15));
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1) + 15, data + 50, 50));
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+
+	/* Merge a short second chain into the end of the first. */
+	evbuffer_add(buf, data, 30);
+	evbuffer_add(tmp, data + 30, 20);
+	evbuffer_add_buffer(buf, tmp);
+	tt_int_op(evbuffer_get_n_chains(buf), ==, 2);
+	evbuffer_drain(buf, 10);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_n_chains(buf), ==, 1);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), data + 10, 40));
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+
+	/* A chatty workload: lots of small adds with occasional drains.
+	 * Coalescing should leave us with fewer chains than the default,
+	 * without changing the data. */
+	tt_int_op(evbuffer_set_coalesce(buf, 4096, 256), ==, 0);
+	n_coalesced = n_plain = 0;
+	for (i = 0; i < 2000; ++i) {
+		j = 10 + i % 41;
+		evbuffer_add(buf, data + i % 1000, j);
+		evbuffer_add(plain, data + i % 1000, j);
+		if (i % 7 == 6) {
+			evbuffer_drain(buf, 150);
+			evbuffer_drain(plain, 150);
+		}
+		n_coalesced += evbuffer_get_n_chains(buf);
+		n_plain += evbuffer_get_n_chains(plain);
+	}
+	evbuffer_validate(buf);
+	evbuffer_validate(plain);
+	TT_BLATHER(("%d chain-iterations coalesced; %d by default",
+		(int)n_coalesced, (int)n_plain));
+	tt_int_op(n_coalesced, <, n_plain);
+	tt_int_op(evbuffer_get_length(buf), ==, evbuffer_get_length(plain));
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), evbuffer_pullup(plain, -1),
+		evbuffer_get_length(buf)));
+
+ end:
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+	evbuffer_free(plain);
+}
+
+#ifndef WIN32
+static void
+test_evbuffer_adaptive_read(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	evutil_socket_t pair[2] = { -1, -1 };
+	char data[32768];
+
+	memset(data, 'x', sizeof(data));
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	evutil_make_socket_nonblocking(pair[1]);
+
+	tt_int_op(evbuffer_set_adaptive_read(buf, 16384), ==, 0);
+	tt_int_op(buf->read_size, ==, 4096);
+	tt_int_op(write(pair[0], data, sizeof(data)), ==, sizeof(data));
+
+	/* Reads that fill the space we offer make the next one bigger, up
+	 * to the maximum. */
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 4096);
+	tt_int_op(buf->read_size, ==, 8192);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 8192);
+	tt_int_op(buf->read_size, ==, 16384);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 16384);
+	tt_int_op(buf->read_size, ==, 16384);
+
+	/* A read that comes up short makes the next one smaller. */
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 4096);
+	tt_int_op(buf->read_size, ==, 8192);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data));
+	evbuffer_validate(buf);
+
+	/* A read that the caller limited tells us nothing. */
+	tt_int_op(write(pair[0], data, 100), ==, 100);
+	tt_int_op(evbuffer_read(buf, pair[1], 50), ==, 50);
+	tt_int_op(buf->read_size, ==, 8192);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 50);
+	tt_int_op(buf->read_size, ==, 4096);
+
+	/* We never go below the default read size. */
+	tt_int_op(write(pair[0], data, 10), ==, 10);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 10);
+	tt_int_op(buf->read_size, ==, 4096);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data) + 110);
+	evbuffer_validate(buf);
+
+	tt_int_op(evbuffer_set_adaptive_read(buf, 0), ==, 0);
+	tt_int_op(buf->max_read, ==, 0);
+
+ end:
+	evbuffer_free(buf);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+#endif
+
 static void
 test_evbuffer_prepend(void *ptr)
 {
@@ -1139,6 +1648,307 @@ end:
 		evbuffer_free(tmp_buf);
 }
 
+/* Add fmt to buf with evbuffer_add_vprintf(), and fail the test unless
+ * that added exactly what evutil_vsnprintf() produces. */
+static void
+printf_matches(struct evbuffer *buf, const char *fmt, ...)
+{
+	char expect[2048];
+	size_t old_len = evbuffer_get_length(buf);
+	unsigned char *cp;
+	int r, n;
+	va_list ap;
+
+	va_start(ap, fmt);
+	n = evutil_vsnprintf(expect, sizeof(expect), fmt, ap);
+	va_end(ap);
+	va_start(ap, fmt);
+	r = evbuffer_add_vprintf(buf, fmt, ap);
+	va_end(ap);
+
+	evbuffer_validate(buf);
+	if (n < 0 || r != n || (size_t)n >= sizeof(expect) ||
+	    evbuffer_get_length(buf) != old_len + n) {
+		TT_DIE(("\"%s\": got %d bytes, expected %d", fmt, r, n));
+	}
+	cp = evbuffer_pullup(buf, -1);
+	if (n > 0 && memcmp(cp + old_len, expect, n)) {
+		TT_DIE(("\"%s\": got \"%.*s\", expected \"%s\"", fmt, n,
+			cp + old_len, expect));
+	}
+end:
+	;
+}
+
+static void
+test_evbuffer_printf(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char big[600], huge[5001];
+	unsigned char *cp;
+	size_t i, n;
+
+	memset(big, 'b', sizeof(big)-1);
+	big[sizeof(big)-1] = '\0';
+
+	/* Run everything twice: once into an empty buffer, and once with
+	 * nearly-full chains so that most conversions get split. */
+	for (i = 0; i < 2; ++i) {
+		printf_matches(buf, "");
+		printf_matches(buf, "plain text, 100%% literal");
+		printf_matches(buf, "%d %i %d %d", 0, -1, INT_MAX, INT_MIN);
+		printf_matches(buf, "%u %x %X %lx", 0u, 0xdeadbeefu,
+			0xabcdefu, 0x12345678ul);
+		printf_matches(buf, "%ld %lu %hd %hu %hhd %hhu",
+			LONG_MIN, ULONG_MAX, -1234, 65000, -7, 255);
+#ifdef _EVENT_SIZEOF_LONG_LONG
+		printf_matches(buf, "%lld %llu %llx", -0x7fffffffffffffffLL - 1,
+			~0ULL, ~0ULL);
+#endif
+		printf_matches(buf, "[%zu] [%zd] [%zx]",
+			(size_t)123456789, (ev_ssize_t)-42, (size_t)255);
+		printf_matches(buf, "[%5d|%-5d|%05d|%-05d|%03d]",
+			42, 42, -42, -42, -12345);
+		printf_matches(buf, "[%*d|%-*u|%*d]", 6, 7, 6, 7u, -6, 7);
+		printf_matches(buf, "[%c%c%3c%-3c]", 'a', 'b', 'c', 'd');
+		printf_matches(buf, "[%s|%10s|%-10s|%.3s|%5.2s|%.*s]",
+			"abc", "abc", "abc", "abcdef", "abcdef", 2, "xyz");
+		printf_matches(buf, "%s and %s", big, big+100);
+		printf_matches(buf, "%300d|%-300s|", 1, "x");
+
+		/* These finish in the general case. */
+		printf_matches(buf, "%s took %.3f sec", "GET", 1.5);
+		printf_matches(buf, "%-*s|%*.*f|%s", 8, "ab", 9, 2, 3.14159,
+			"end");
+		printf_matches(buf, "%2$s %1$s", "world", "hello");
+		printf_matches(buf, "%d %+d % d %#x %.4d %o", 1, 2, 3, 4, 5,
+			6);
+		printf_matches(buf, "%d %p %s", 99, (void*)buf, big);
+
+		/* Leave the last chain with just a few bytes free. */
+		n = evbuffer_get_length(buf);
+		evbuffer_drain(buf, n);
+		tt_int_op(evbuffer_expand(buf, 1024), ==, 0);
+		n = buf->last->buffer_len - buf->last->misalign -
+		    buf->last->off - 3;
+		while (n) {
+			size_t len = n < sizeof(big)-1 ? n : sizeof(big)-1;
+			evbuffer_add(buf, big, len);
+			n -= len;
+		}
+	}
+
+	/* The general case has to grow a buffer whose only chain is empty
+	 * and too small. */
+	evbuffer_free(buf);
+	buf = evbuffer_new();
+	memset(huge, 'h', sizeof(huge)-1);
+	huge[sizeof(huge)-1] = '\0';
+	tt_int_op(evbuffer_expand(buf, 10), ==, 0);
+	tt_int_op(evbuffer_add_printf(buf, "%f%s", 1.5, huge), ==, 5008);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, 5008);
+	cp = evbuffer_pullup(buf, -1);
+	tt_assert(!memcmp(cp, "1.500000", 8));
+	tt_assert(!memcmp(cp + 8, huge, 5000));
+
+end:
+	evbuffer_free(buf);
+}
+
+/* Check that the contents of buf are the len bytes of pattern starting
+ * at position pos, and that they are one extent. */
+static int
+ring_check(struct evbuffer *buf, const char *pattern, size_t pos, size_t len)
+{
+	struct evbuffer_iovec v[2];
+
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, len);
+	if (!len)
+		return 1;
+	tt_int_op(evbuffer_peek(buf, -1, NULL, v, 2), ==, 1);
+	tt_int_op(v[0].iov_len, ==, len);
+	tt_assert(!memcmp(v[0].iov_base, pattern + pos, len));
+	return 1;
+end:
+	return 0;
+}
+
+static void
+test_evbuffer_ring(void *ptr)
+{
+	const unsigned flags = !strcmp(ptr, "mirror") ? EVBUFFER_RING_MIRROR : 0;
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *other = evbuffer_new();
+	struct evbuffer_iovec v[2];
+	evutil_socket_t pair[2] = { -1, -1 };
+	char *pattern = NULL, tmp[1024];
+	size_t i, pos, len;
+	int mirrored, fd;
+
+	tt_assert(buf && other);
+	pattern = malloc(65536);
+	tt_assert(pattern);
+	for (i = 0; i < 65536; ++i)
+		pattern[i] = (char)(i * 7 + i / 251);
+
+	/* Only empty, ordinary evbuffers can become rings. */
+	evbuffer_add(buf, "x", 1);
+	tt_int_op(evbuffer_set_ring(buf, 4096, flags), ==, -1);
+	evbuffer_drain(buf, 1);
+	tt_int_op(evbuffer_set_ring(buf, 0, flags), ==, -1);
+	tt_int_op(evbuffer_set_ring(buf, 4096, flags), ==, 0);
+	tt_int_op(evbuffer_set_ring(buf, 4096, flags), ==, -1);
+	mirrored = (EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_ring,
+		buf->first))->mirrored;
+	TT_BLATHER(("ring is %smirrored", mirrored ? "" : "not "));
+#if defined(_EVENT_HAVE_MMAP) && !defined(WIN32)
+	if (flags)
+		tt_assert(mirrored);
+#endif
+
+	/* Go around the ring a few times. */
+	tt_int_op(evbuffer_add(buf, pattern, 3000), ==, 0);
+	for (pos = 0; pos < 20000; pos += 700) {
+		tt_int_op(evbuffer_add(buf, pattern + pos + 3000, 700), ==, 0);
+		tt_int_op(evbuffer_remove(buf, tmp, 700), ==, 700);
+		tt_assert(!memcmp(tmp, pattern + pos, 700));
+		if (!ring_check(buf, pattern, pos + 700, 3000))
+			goto end;
+	}
+	if (mirrored)
+		tt_int_op(evbuffer_get_n_bytes_moved(buf), ==, 0);
+	tt_int_op(evbuffer_get_n_chains(buf), ==, 1);
+
+	/* It never grows. */
+	tt_int_op(evbuffer_add(buf, pattern, 1097), ==, -1);
+	tt_int_op(evbuffer_prepend(buf, pattern, 1097), ==, -1);
+	tt_int_op(evbuffer_expand(buf, 1097), ==, -1);
+	tt_int_op(evbuffer_reserve_space(buf, 1097, v, 2), ==, -1);
+	tt_int_op(evbuffer_add(buf, pattern + pos + 3000, 1096), ==, 0);
+	tt_int_op(evbuffer_add_printf(buf, "%d", 1), ==, -1);
+	if (!ring_check(buf, pattern, pos, 4096))
+		goto end;
+	tt_int_op(evbuffer_drain(buf, 4000), ==, 0);
+	pos += 4000;
+	if (!ring_check(buf, pattern, pos, 96))
+		goto end;
+
+	/* Reserve and commit across the end of the ring. */
+	tt_int_op(evbuffer_reserve_space(buf, 2000, v, 2), ==, 1);
+	tt_int_op(v[0].iov_len, >=, 2000);
+	memcpy(v[0].iov_base, pattern + pos + 96, 2000);
+	v[0].iov_len = 2000;
+	tt_int_op(evbuffer_commit_space(buf, v, 1), ==, 0);
+	if (!ring_check(buf, pattern, pos, 2096))
+		goto end;
+
+	/* Prepend in front of the data, wrapping if we're mirrored. */
+	tt_int_op(evbuffer_drain(buf, 2000), ==, 0);
+	pos += 2000;
+	tt_int_op(evbuffer_prepend(buf, pattern + pos - 3000, 3000), ==, 0);
+	pos -= 3000;
+	if (!ring_check(buf, pattern, pos, 3096))
+		goto end;
+
+	/* Moving data in and out of the ring copies it. */
+	evbuffer_add(other, pattern + pos + 3096, 500);
+	evbuffer_add_reference(other, pattern + pos + 3596, 300, NULL, NULL);
+	tt_int_op(evbuffer_add_buffer(buf, other), ==, 0);
+	tt_int_op(evbuffer_get_length(other), ==, 0);
+	if (!ring_check(buf, pattern, pos, 3896))
+		goto end;
+	evbuffer_add(other, pattern, 201);
+	tt_int_op(evbuffer_add_buffer(buf, other), ==, -1);
+	tt_int_op(evbuffer_get_length(other), ==, 201);
+	tt_int_op(evbuffer_remove_buffer(other, buf, 1000), ==, 200);
+	tt_int_op(evbuffer_get_length(other), ==, 1);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1) + 3896, pattern, 200));
+	evbuffer_drain(other, 1);
+	tt_int_op(evbuffer_remove_buffer(buf, other, 96), ==, 96);
+	pos += 96;
+	tt_int_op(evbuffer_add_buffer(other, buf), ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(evbuffer_get_length(other), ==, 4096);
+	tt_assert(!memcmp(evbuffer_pullup(other, -1), pattern + pos - 96, 96));
+	tt_assert(!memcmp(evbuffer_pullup(other, -1) + 96, pattern + pos,
+		3800));
+	evbuffer_drain(other, 4096);
+
+	/* References can't go into a ring. */
+	tt_int_op(evbuffer_add_reference(buf, "abc", 3, NULL, NULL), ==, -1);
+	evbuffer_add(other, "abc", 3);
+	tt_int_op(evbuffer_add_buffer_reference(buf, other), ==, -1);
+	tt_int_op(evbuffer_add_buffer_reference(other, buf), ==, -1);
+	evbuffer_drain(other, 3);
+
+#ifndef WIN32
+	/* Neither can file data that isn't in memory; what comes before it
+	 * can. */
+	fd = regress_make_tmpfile("0123456789", 10);
+	tt_assert(fd >= 0);
+	evbuffer_add(other, "abc", 3);
+	tt_int_op(evbuffer_add_file(other, fd, 0, 10), ==, 0);
+	if (other->first->next->flags & EVBUFFER_SENDFILE) {
+		tt_int_op(evbuffer_add_buffer(buf, other), ==, -1);
+		tt_int_op(evbuffer_get_length(other), ==, 13);
+		tt_int_op(evbuffer_remove_buffer(other, buf, 13), ==, 3);
+		tt_int_op(evbuffer_remove_buffer(other, buf, 10), ==, -1);
+		tt_int_op(evbuffer_get_length(other), ==, 10);
+		tt_int_op(evbuffer_get_length(buf), ==, 3);
+		evbuffer_drain(buf, 3);
+	}
+	evbuffer_drain(other, evbuffer_get_length(other));
+#endif
+
+	/* printf formats in place. */
+	tt_int_op(evbuffer_add(buf, pattern, 4000), ==, 0);
+	tt_int_op(evbuffer_drain(buf, 3990), ==, 0);
+	tt_int_op(evbuffer_add_printf(buf, "%d-%s-%x", 42, "hello", 255), ==,
+	    11);
+	tt_int_op(evbuffer_get_length(buf), ==, 21);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1) + 10, "42-hello-ff", 11));
+	evbuffer_drain(buf, 21);
+
+	/* Reading and writing a socket. */
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != -1);
+	evutil_make_socket_nonblocking(pair[1]);
+	tt_int_op(evbuffer_add(buf, pattern, 3000), ==, 0);
+	tt_int_op(evbuffer_drain(buf, 2000), ==, 0);
+	tt_int_op(send(pair[0], pattern + 3000, 5000, 0), ==, 5000);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 3096);
+	if (!ring_check(buf, pattern, 2000, 4096))
+		goto end;
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, -1);
+	tt_int_op(EVUTIL_SOCKET_ERROR(), ==, ENOBUFS);
+	tt_int_op(evbuffer_drain(buf, 2500), ==, 0);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 1904);
+	if (!ring_check(buf, pattern, 4500, 3500))
+		goto end;
+	tt_int_op(evbuffer_write(buf, pair[1]), ==, 3500);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	len = 0;
+	while (len < 3500) {
+		ev_ssize_t n = recv(pair[0], tmp, sizeof(tmp), 0);
+		tt_int_op(n, >, 0);
+		tt_assert(!memcmp(tmp, pattern + 4500 + len, n));
+		len += n;
+	}
+
+end:
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+	if (buf)
+		evbuffer_free(buf);
+	if (other)
+		evbuffer_free(other);
+	if (pattern)
+		free(pattern);
+}
+
 /* Check whether evbuffer freezing works right.  This is called twice,
    once with the argument "start" and once with the argument "end".
    When we test "start", we freeze the start of an evbuffer and make sure
@@ -1257,14 +2067,24 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "ptr_set", test_evbuffer_ptr_set, 0, NULL, NULL },
 	{ "search", test_evbuffer_search, 0, NULL, NULL },
 	{ "callbacks", test_evbuffer_callbacks, 0, NULL, NULL },
+	{ "cb_batch", test_evbuffer_cb_batch, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  NULL },
 	{ "add_reference", test_evbuffer_add_reference, 0, NULL, NULL },
+	{ "multicast", test_evbuffer_multicast, 0, NULL, NULL },
+	{ "slice", test_evbuffer_slice, 0, NULL, NULL },
+	{ "coalesce", test_evbuffer_coalesce, 0, NULL, NULL },
 	{ "prepend", test_evbuffer_prepend, 0, NULL, NULL },
+	{ "printf", test_evbuffer_printf, 0, NULL, NULL },
 	{ "peek", test_evbuffer_peek, 0, NULL, NULL },
+	{ "ring", test_evbuffer_ring, 0, &nil_setup, (void*)"plain" },
+	{ "ring_mirror", test_evbuffer_ring, 0, &nil_setup, (void*)"mirror" },
 	{ "freeze_start", test_evbuffer_freeze, 0, &nil_setup, (void*)"start" },
 	{ "freeze_end", test_evbuffer_freeze, 0, &nil_setup, (void*)"end" },
 #ifndef WIN32
 	/* TODO: need a temp file implementation for Windows */
 	{ "add_file", test_evbuffer_add_file, 0, NULL, NULL },
+	{ "file_segment", test_evbuffer_file_segment, 0, NULL, NULL },
+	{ "adaptive_read", test_evbuffer_adaptive_read, 0, NULL, NULL },
 #endif
 
 	END_OF_TESTCASES
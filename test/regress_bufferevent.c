@@ -57,6 +57,9 @@
 #ifdef _EVENT_HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifdef _EVENT_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 
 #include "event-config.h"
 #include "event2/event.h"
@@ -64,6 +67,7 @@
 #include "event2/event_compat.h"
 #include "event2/tag.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/bufferevent_struct.h"
@@ -71,6 +75,7 @@
 #include "event2/util.h"
 
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
 #ifdef WIN32
 #include "iocp-internal.h"
 #endif
@@ -613,6 +618,900 @@ end:
 		event_del(&close_listener_event);
 }
 
+#define ZC_TOTAL (1024*1024)
+#define ZC_CHUNK 65536
+
+static size_t zc_n_read = 0;
+static int zc_bad = 0;
+
+static void
+zc_readcb(struct bufferevent *bev, void *arg)
+{
+	struct event_base *base = arg;
+	unsigned char buf[4096];
+	size_t i, n;
+
+	while ((n = bufferevent_read(bev, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; ++i) {
+			if (buf[i] != (unsigned char)((zc_n_read + i) % 251))
+				++zc_bad;
+		}
+		zc_n_read += n;
+	}
+	if (zc_n_read == ZC_TOTAL)
+		event_base_loopexit(base, NULL);
+}
+
+/* Connect a pair of TCP sockets over the loopback interface. */
+static int
+zc_tcp_pair(evutil_socket_t pair[2])
+{
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t listener;
+	int r = -1;
+
+	pair[0] = pair[1] = -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001L);
+
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0 ||
+	    listen(listener, 1) < 0 ||
+	    getsockname(listener, (struct sockaddr*)&sin, &slen) < 0)
+		goto done;
+	if ((pair[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		goto done;
+	if (connect(pair[0], (struct sockaddr*)&sin, sizeof(sin)) < 0)
+		goto done;
+	if ((pair[1] = accept(listener, NULL, NULL)) < 0)
+		goto done;
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	r = 0;
+done:
+	EVUTIL_CLOSESOCKET(listener);
+	return r;
+}
+
+static void
+test_bufferevent_zerocopy(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *sender = NULL, *receiver = NULL;
+	evutil_socket_t pair[2] = { -1, -1 };
+	unsigned char *chunk = NULL;
+	size_t i;
+
+	tt_assert(zc_tcp_pair(pair) == 0);
+	sender = bufferevent_socket_new(data->base, pair[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	receiver = bufferevent_socket_new(data->base, pair[1],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(sender);
+	tt_assert(receiver);
+	pair[0] = pair[1] = -1;
+
+	if (bufferevent_socket_set_zerocopy(sender, 16384) < 0) {
+		tt_skip();
+	}
+	tt_int_op(_evbuffer_get_zerocopy(bufferevent_get_output(sender)),
+	    ==, 16384);
+
+	chunk = malloc(ZC_CHUNK);
+	tt_assert(chunk);
+	for (i = 0; i < ZC_TOTAL; ++i) {
+		chunk[i % ZC_CHUNK] = (unsigned char)(i % 251);
+		if (i % ZC_CHUNK == ZC_CHUNK - 1)
+			tt_assert(!bufferevent_write(sender, chunk, ZC_CHUNK));
+	}
+
+	bufferevent_setcb(receiver, zc_readcb, NULL, NULL, data->base);
+	bufferevent_enable(receiver, EV_READ);
+	/* The sender reads too, so that completions get collected. */
+	bufferevent_enable(sender, EV_READ|EV_WRITE);
+
+	event_base_dispatch(data->base);
+	tt_int_op(zc_n_read, ==, ZC_TOTAL);
+	tt_int_op(zc_bad, ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(sender)), ==, 0);
+
+	/* Give the kernel a moment to report that it's done with our
+	 * memory, then make sure nothing is still pinned. */
+	tt_int_op(_evbuffer_zerocopy_linger(bufferevent_get_output(sender),
+		bufferevent_getfd(sender), 1000), ==, 0);
+	tt_assert(TAILQ_EMPTY(
+		    &bufferevent_get_output(sender)->zerocopy->pins));
+	/* ...because the kernel told us it was done, not because we gave
+	 * up on it. */
+	tt_assert(bufferevent_get_output(sender)->zerocopy->n_completed > 0);
+
+	tt_int_op(bufferevent_socket_set_zerocopy(sender, 0), ==, 0);
+	tt_int_op(_evbuffer_get_zerocopy(bufferevent_get_output(sender)),
+	    ==, 0);
+end:
+	if (chunk)
+		free(chunk);
+	if (sender)
+		bufferevent_free(sender);
+	if (receiver)
+		bufferevent_free(receiver);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+
+static int edge_n_readcb = 0;
+static int edge_got_eof = 0;
+
+static void
+edge_readcb(struct bufferevent *bev, void *arg)
+{
+	++edge_n_readcb;
+}
+
+static void
+edge_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & BEV_EVENT_EOF)
+		edge_got_eof = 1;
+}
+
+static void
+test_bufferevent_edge(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL, *plain = NULL;
+	struct evbuffer *input;
+	evutil_socket_t pair[2] = { -1, -1 };
+	char buf[8192];
+	size_t n_read;
+	int i;
+
+	if (!(event_base_get_features(data->base) & EV_FEATURE_ET))
+		tt_skip();
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	memset(buf, 'x', sizeof(buf));
+
+	/* Only edge-triggered socket bufferevents have a budget. */
+	plain = bufferevent_socket_new(data->base, pair[1], 0);
+	tt_assert(plain);
+	tt_int_op(bufferevent_socket_set_edge_budget(plain, 1000), ==, -1);
+
+	bev = bufferevent_socket_new(data->base, pair[0],
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_EDGE_TRIGGERED);
+	tt_assert(bev);
+	pair[0] = -1;
+	input = bufferevent_get_input(bev);
+	tt_int_op(bufferevent_socket_set_edge_budget(bev, 1000), ==, 0);
+	bufferevent_setcb(bev, edge_readcb, NULL, edge_eventcb, NULL);
+	bufferevent_enable(bev, EV_READ);
+
+	/* We read one budget per turn, and come back for the rest without
+	 * another edge. */
+	tt_int_op(send(pair[1], buf, 5000, 0), ==, 5000);
+	for (i = 1; i <= 5; ++i) {
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+		tt_int_op(evbuffer_get_length(input), ==, i * 1000);
+		tt_int_op(edge_n_readcb, ==, i);
+	}
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 5000);
+	tt_int_op(edge_n_readcb, ==, 5);
+	evbuffer_drain(input, 5000);
+
+	/* Without a budget, we read everything in one turn... */
+	tt_int_op(bufferevent_socket_set_edge_budget(bev, 0), ==, 0);
+	tt_int_op(send(pair[1], buf, 8000, 0), ==, 8000);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 8000);
+	tt_int_op(edge_n_readcb, ==, 6);
+	evbuffer_drain(input, 8000);
+
+	/* ...unless the high watermark stops us; then we pick up where we
+	 * left off once the input is drained. */
+	bufferevent_setwatermark(bev, EV_READ, 0, 3000);
+	tt_int_op(send(pair[1], buf, 7000, 0), ==, 7000);
+	for (n_read = 0, i = 0; i < 10 && n_read < 7000; ++i) {
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+		tt_int_op(evbuffer_get_length(input), >, 0);
+		tt_int_op(evbuffer_get_length(input), <=, 3000);
+		n_read += evbuffer_get_length(input);
+		evbuffer_drain(input, evbuffer_get_length(input));
+	}
+	tt_int_op(n_read, ==, 7000);
+	bufferevent_setwatermark(bev, EV_READ, 0, 0);
+
+	/* Writing keeps going while the peer keeps draining. */
+	tt_int_op(bufferevent_socket_set_edge_budget(bev, 10000), ==, 0);
+	for (i = 0; i < 50; ++i)
+		bufferevent_write(bev, buf, sizeof(buf));
+	bufferevent_enable(bev, EV_WRITE);
+	n_read = 0;
+	for (i = 0; i < 1000 && n_read < 50 * sizeof(buf); ++i) {
+		int r;
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+		while ((r = recv(pair[1], buf, sizeof(buf), 0)) > 0)
+			n_read += r;
+	}
+	tt_int_op(n_read, ==, 50 * sizeof(buf));
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+
+	/* Data that arrives with the EOF is delivered before it. */
+	edge_n_readcb = 0;
+	tt_int_op(send(pair[1], buf, 10, 0), ==, 10);
+	bufferevent_free(plain);
+	plain = NULL;
+	EVUTIL_CLOSESOCKET(pair[1]);
+	pair[1] = -1;
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(edge_n_readcb, ==, 1);
+	tt_int_op(evbuffer_get_length(input), ==, 10);
+	tt_assert(edge_got_eof);
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (plain)
+		bufferevent_free(plain);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+
+static void
+cork_write_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent *bev = arg;
+	char buf[10000];
+	int i;
+
+	memset(buf, 'c', sizeof(buf));
+	for (i = 0; i < 3; ++i)
+		bufferevent_write(bev, buf, sizeof(buf));
+}
+
+/* Return how many bytes are waiting on fd, reading them all. */
+static int
+cork_drain(evutil_socket_t fd)
+{
+	char buf[4096];
+	int r, n = 0;
+
+	while ((r = recv(fd, buf, sizeof(buf), 0)) > 0)
+		n += r;
+	return n;
+}
+
+static void
+test_bufferevent_cork(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL, *tcp_bev = NULL;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	evutil_socket_t fds[2] = { -1, -1 }, tcp_fds[2] = { -1, -1 };
+	struct event *ev = NULL;
+	int i, n;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+	bev = bufferevent_socket_new(data->base, fds[0],
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_CORK);
+	tt_assert(bev);
+	fds[0] = -1;
+
+	/* Everything written in one iteration goes out at the end of that
+	 * iteration, without waiting for the write event, and in one call
+	 * even though it's more than one write event would send. */
+	ev = evtimer_new(data->base, cork_write_cb, bev);
+	tt_assert(ev);
+	event_active(ev, EV_TIMEOUT, 1);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_int_op(cork_drain(fds[1]), ==, 30000);
+	tt_assert(!event_pending(&bev->ev_write, EV_WRITE, NULL));
+
+	/* An explicit cork holds everything back until the last uncork. */
+	tt_int_op(bufferevent_socket_uncork(bev), ==, -1);
+	tt_int_op(bufferevent_socket_cork(bev), ==, 0);
+	tt_int_op(bufferevent_socket_cork(bev), ==, 0);
+	bufferevent_write(bev, "hello", 5);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(cork_drain(fds[1]), ==, 0);
+	tt_int_op(bufferevent_socket_uncork(bev), ==, 0);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(cork_drain(fds[1]), ==, 0);
+	tt_int_op(bufferevent_socket_uncork(bev), ==, 0);
+	tt_int_op(cork_drain(fds[1]), ==, 5);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+
+	/* Only socket bufferevents can be corked. */
+	tt_assert(bufferevent_pair_new(data->base, 0, pair) == 0);
+	tt_int_op(bufferevent_socket_cork(pair[0]), ==, -1);
+
+	/* On a TCP socket we may be able to let the kernel hold data back
+	 * for us instead; either way, it all arrives after the uncork. */
+	tt_assert(zc_tcp_pair(tcp_fds) == 0);
+	tcp_bev = bufferevent_socket_new(data->base, tcp_fds[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(tcp_bev);
+	tcp_fds[0] = -1;
+	tt_int_op(bufferevent_socket_cork(tcp_bev), ==, 0);
+#ifdef TCP_CORK
+	tt_assert(BEV_UPCAST(tcp_bev)->tcp_corked);
+#endif
+	bufferevent_write(tcp_bev, "hello", 5);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(bufferevent_socket_uncork(tcp_bev), ==, 0);
+	for (i = n = 0; i < 100 && n < 5; ++i) {
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+		n += cork_drain(tcp_fds[1]);
+		if (n < 5) {
+			struct timeval tv = { 0, 10*1000 };
+			evutil_socket_t fd = tcp_fds[1];
+			fd_set rfds;
+			FD_ZERO(&rfds);
+			FD_SET(fd, &rfds);
+			select(fd + 1, &rfds, NULL, NULL, &tv);
+		}
+	}
+	tt_int_op(n, ==, 5);
+end:
+	if (ev)
+		event_free(ev);
+	if (bev)
+		bufferevent_free(bev);
+	if (tcp_bev)
+		bufferevent_free(tcp_bev);
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (pair[1])
+		bufferevent_free(pair[1]);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+	if (tcp_fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(tcp_fds[0]);
+	if (tcp_fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(tcp_fds[1]);
+}
+
+static void
+lazy_readcb(struct bufferevent *bev, void *arg)
+{
+	int *n_read = arg;
+	char buf[64];
+
+	*n_read += bufferevent_read(bev, buf, sizeof(buf));
+}
+
+static void
+lazy_noop_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+    void *arg)
+{
+}
+
+static void
+test_bufferevent_lazy(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	evutil_socket_t fds[2] = { -1, -1 };
+	struct ev_token_bucket_cfg *cfg = NULL;
+	char buf[8];
+	int n_read = 0;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+	bev = bufferevent_socket_new(data->base, fds[0],
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_LAZY_BUFFERS);
+	tt_assert(bev);
+	fds[0] = -1;
+	bufferevent_setcb(bev, lazy_readcb, NULL, NULL, &n_read);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	/* No buffers until we need them... */
+	tt_assert(bev->input == NULL);
+	tt_assert(bev->output == NULL);
+
+	/* ...and none once they're empty again. */
+	tt_int_op(bufferevent_write(bev, "hello", 5), ==, 0);
+	tt_assert(bev->output != NULL);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(cork_drain(fds[1]), ==, 5);
+	tt_assert(bev->output == NULL);
+
+	tt_int_op(send(fds[1], "world", 5, 0), ==, 5);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n_read, ==, 5);
+	tt_assert(bev->input == NULL);
+
+	/* Data nobody has read yet stays put, and a watermark set before the
+	 * input buffer exists still applies. */
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_setwatermark(bev, EV_READ, 0, 3);
+	tt_int_op(send(fds[1], "abcde", 5, 0), ==, 5);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_assert(bev->input != NULL);
+	tt_int_op(evbuffer_get_length(bev->input), ==, 3);
+	tt_int_op(bufferevent_read(bev, buf, sizeof(buf)), ==, 3);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(bufferevent_read(bev, buf, sizeof(buf)), ==, 2);
+	tt_assert(!memcmp(buf, "de", 2));
+
+	/* A buffer with something set up on it is never freed. */
+	tt_assert(evbuffer_add_cb(bufferevent_get_output(bev), lazy_noop_cb,
+		NULL));
+	tt_int_op(bufferevent_write(bev, "x", 1), ==, 0);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(cork_drain(fds[1]), ==, 1);
+	tt_assert(bev->output != NULL);
+
+	/* Rate-limiting state goes away along with the rate limit. */
+	cfg = ev_token_bucket_cfg_new(1024, 1024, 1024, 1024, NULL);
+	tt_assert(cfg);
+	tt_int_op(bufferevent_set_rate_limit(bev, cfg), ==, 0);
+	tt_assert(BEV_UPCAST(bev)->rate_limiting != NULL);
+	tt_int_op(bufferevent_set_rate_limit(bev, NULL), ==, 0);
+	tt_assert(BEV_UPCAST(bev)->rate_limiting == NULL);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+}
+
+static void
+stats_wait(struct event_base *base, long usec)
+{
+	struct timeval tv = { 0, usec };
+
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+}
+
+static void
+test_bufferevent_stats(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL, *plain = NULL, *client = NULL;
+	struct bufferevent_stats st, total;
+	evutil_socket_t fds[2] = { -1, -1 }, listener = -1, server = -1;
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	char buf[16];
+	int i;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+	bev = bufferevent_socket_new(data->base, fds[0],
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_STATS);
+	tt_assert(bev);
+	fds[0] = -1;
+	plain = bufferevent_socket_new(data->base, -1, 0);
+	tt_assert(plain);
+	tt_int_op(bufferevent_get_stats(plain, &st), ==, -1);
+
+	/* Bytes and calls. */
+	bufferevent_write(bev, "hello", 5);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(bufferevent_get_stats(bev, &st), ==, 0);
+	tt_int_op(st.bytes_written, ==, 5);
+	tt_int_op(st.write_calls, ==, 1);
+	tt_int_op(st.bytes_read, ==, 0);
+	tt_int_op(recv(fds[1], buf, sizeof(buf), 0), ==, 5);
+
+	/* Time blocked on the high watermark. */
+	bufferevent_setwatermark(bev, EV_READ, 0, 4);
+	bufferevent_enable(bev, EV_READ);
+	tt_int_op(send(fds[1], "0123456789", 10, 0), ==, 10);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	stats_wait(data->base, 50*1000);
+	tt_int_op(bufferevent_get_stats(bev, &st), ==, 0);
+	tt_int_op(st.bytes_read, ==, 4);
+	tt_int_op(st.read_calls, ==, 1);
+	tt_assert(st.read_blocked_wm.tv_sec > 0 ||
+	    st.read_blocked_wm.tv_usec >= 40*1000);
+	tt_assert(!evutil_timerisset(&st.read_blocked_rlim));
+	tt_int_op(bufferevent_read(bev, buf, sizeof(buf)), ==, 4);
+	for (i = 0; i < 3; ++i) {
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+		bufferevent_read(bev, buf, sizeof(buf));
+	}
+	tt_int_op(bufferevent_get_stats(bev, &st), ==, 0);
+	tt_int_op(st.bytes_read, ==, 10);
+	tt_int_op(st.n_first_bytes, ==, 0);
+
+	/* Time from connect to the first byte. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001L);
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(listener >= 0);
+	tt_assert(bind(listener, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	tt_assert(listen(listener, 1) == 0);
+	tt_assert(getsockname(listener, (struct sockaddr*)&sin, &slen) == 0);
+	client = bufferevent_socket_new(data->base, -1,
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_STATS);
+	tt_assert(client);
+	tt_int_op(bufferevent_socket_connect(client, (struct sockaddr*)&sin,
+		sizeof(sin)), ==, 0);
+	bufferevent_enable(client, EV_READ);
+	server = accept(listener, NULL, NULL);
+	tt_assert(server >= 0);
+	stats_wait(data->base, 20*1000);
+	tt_int_op(send(server, "x", 1, 0), ==, 1);
+	stats_wait(data->base, 20*1000);
+	tt_int_op(bufferevent_get_stats(client, &st), ==, 0);
+	tt_int_op(st.bytes_read, ==, 1);
+	tt_int_op(st.n_first_bytes, ==, 1);
+	tt_assert(st.connect_to_first_byte.tv_sec > 0 ||
+	    st.connect_to_first_byte.tv_usec >= 10*1000);
+
+	/* The base's totals cover freed bufferevents too, and not the ones
+	 * without counters. */
+	bufferevent_free(bev);
+	bev = NULL;
+	tt_int_op(event_base_get_bufferevent_stats(data->base, &total), ==, 0);
+	tt_int_op(total.bytes_read, ==, 11);
+	tt_int_op(total.bytes_written, ==, 5);
+	tt_int_op(total.n_first_bytes, ==, 1);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (plain)
+		bufferevent_free(plain);
+	if (client)
+		bufferevent_free(client);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+	if (listener >= 0)
+		EVUTIL_CLOSESOCKET(listener);
+	if (server >= 0)
+		EVUTIL_CLOSESOCKET(server);
+}
+
+static void
+test_bufferevent_nested_groups(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	evutil_socket_t fds[2] = { -1, -1 };
+	struct ev_token_bucket_cfg *big_cfg = NULL, *small_cfg = NULL;
+	struct bufferevent_rate_limit_group *top, *mid, *leaf;
+	struct timeval tick = { 100, 0 };
+	char buf[1024];
+	size_t len;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+
+	/* Only the top group is tight; it won't refill during the test. */
+	big_cfg = ev_token_bucket_cfg_new(100000, 100000, 100000, 100000,
+	    &tick);
+	small_cfg = ev_token_bucket_cfg_new(100, 100, 100, 100, &tick);
+	tt_assert(big_cfg);
+	tt_assert(small_cfg);
+	top = bufferevent_rate_limit_group_new(data->base, small_cfg);
+	mid = bufferevent_rate_limit_group_new(data->base, big_cfg);
+	leaf = bufferevent_rate_limit_group_new(data->base, big_cfg);
+	tt_assert(top && mid && leaf);
+
+	tt_int_op(bufferevent_rate_limit_group_set_parent(mid, top), ==, 0);
+	tt_int_op(bufferevent_rate_limit_group_set_parent(leaf, mid), ==, 0);
+	/* No cycles. */
+	tt_int_op(bufferevent_rate_limit_group_set_parent(top, leaf), ==, -1);
+	tt_int_op(bufferevent_rate_limit_group_set_parent(mid, mid), ==, -1);
+
+	bev = bufferevent_socket_new(data->base, fds[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	fds[0] = -1;
+	tt_int_op(bufferevent_add_to_rate_limit_group(bev, leaf), ==, 0);
+	tt_int_op(top->n_members_total, ==, 1);
+	tt_int_op(top->n_busy_children, ==, 1);
+	/* A group with bufferevents below it stays put. */
+	tt_int_op(bufferevent_rate_limit_group_set_parent(mid, NULL), ==, -1);
+
+	/* The top group's limit applies to a member two levels down. */
+	memset(buf, 'x', sizeof(buf));
+	tt_int_op(send(fds[1], buf, sizeof(buf), 0), ==, sizeof(buf));
+	bufferevent_enable(bev, EV_READ);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	len = evbuffer_get_length(bufferevent_get_input(bev));
+	tt_assert(len > 0);
+	tt_assert(len <= 100);
+	tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_BW_GROUP);
+
+	tt_int_op(bufferevent_remove_from_rate_limit_group(bev), ==, 0);
+	tt_int_op(top->n_members_total, ==, 0);
+	tt_int_op(top->n_busy_children, ==, 0);
+	tt_int_op(bufferevent_rate_limit_group_set_parent(mid, NULL), ==, 0);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (big_cfg)
+		ev_token_bucket_cfg_free(big_cfg);
+	if (small_cfg)
+		ev_token_bucket_cfg_free(small_cfg);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+}
+
+static void
+tickless_readcb(struct bufferevent *bev, void *arg)
+{
+	if (evbuffer_get_length(bufferevent_get_input(bev)) >= 3000)
+		event_base_loopexit(arg, NULL);
+}
+
+static void
+test_bufferevent_tickless(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	evutil_socket_t fds[2] = { -1, -1 };
+	struct ev_token_bucket_cfg *cfg = NULL, *fine_cfg = NULL;
+	struct timeval no_tick = { 0, 0 }, fine_tick = { 0, 500 };
+	struct timeval start, end, timeout = { 5, 0 };
+	char buf[3000];
+	long msec;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+
+	/* Ticks shorter than a millisecond work. */
+	fine_cfg = ev_token_bucket_cfg_new(10, 100, 10, 100, &fine_tick);
+	tt_assert(fine_cfg);
+	tt_int_op(fine_cfg->usec_per_tick, ==, 500);
+
+	/* A tick-less bucket needs room for at least one byte. */
+	tt_assert(!ev_token_bucket_cfg_new(10000, 0, 10000, 0, &no_tick));
+	/* 10000 bytes a second, 1000 at a time. */
+	cfg = ev_token_bucket_cfg_new(10000, 1000, 10000, 1000, &no_tick);
+	tt_assert(cfg);
+	tt_assert(EV_TOKEN_BUCKET_TICKLESS(cfg));
+
+	bev = bufferevent_socket_new(data->base, fds[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	fds[0] = -1;
+	tt_int_op(bufferevent_set_rate_limit(bev, cfg), ==, 0);
+	bufferevent_setcb(bev, tickless_readcb, NULL, NULL, data->base);
+
+	/* The first 1000 bytes are in the bucket already; the other 2000
+	 * should trickle in over about 200 msec. */
+	memset(buf, 'x', sizeof(buf));
+	tt_int_op(send(fds[1], buf, sizeof(buf), 0), ==, sizeof(buf));
+	evutil_gettimeofday(&start, NULL);
+	bufferevent_enable(bev, EV_READ);
+	event_base_loopexit(data->base, &timeout);
+	event_base_dispatch(data->base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &end);
+	msec = end.tv_sec * 1000 + end.tv_usec / 1000;
+
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev)), ==, 3000);
+	tt_int_op(msec, >=, 150);
+	tt_int_op(msec, <, 2000);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+	if (fine_cfg)
+		ev_token_bucket_cfg_free(fine_cfg);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+}
+
+/* A filter that doubles every byte, taking no more than its limit lets it,
+ * rounded up. */
+static enum bufferevent_filter_result
+doubling_filter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t lim,
+    enum bufferevent_flush_mode state, void *ctx)
+{
+	char in[64], out[128];
+	size_t want = sizeof(in);
+	int i, n;
+
+	if (lim >= 0 && (size_t)(lim + 1) / 2 < want)
+		want = (lim + 1) / 2;
+	if (!want || (n = evbuffer_remove(src, in, want)) <= 0)
+		return BEV_NEED_MORE;
+	for (i = 0; i < n; ++i)
+		out[2*i] = out[2*i+1] = in[i];
+	evbuffer_add(dst, out, 2*n);
+	return BEV_OK;
+}
+
+static void
+test_bufferevent_filter_ratelim(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	evutil_socket_t fds[2] = { -1, -1 };
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct timeval tick = { 100, 0 };
+	int underlying = !strcmp((char*)data->setup_data, "underlying");
+	char buf[1000];
+	size_t n_read, n_sent = 0;
+	int i, r;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+
+	bev = bufferevent_socket_new(data->base, fds[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	fds[0] = -1;
+	bev = bufferevent_filter_new(bev, doubling_filter, doubling_filter,
+	    BEV_OPT_CLOSE_ON_FREE |
+	    (underlying ? BEV_OPT_RATELIM_UNDERLYING : 0), NULL, NULL);
+	tt_assert(bev);
+	/* 100 bytes each way; no refill during the test. */
+	cfg = ev_token_bucket_cfg_new(100, 100, 100, 100, &tick);
+	tt_assert(cfg);
+	tt_int_op(bufferevent_set_rate_limit(bev, cfg), ==, 0);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	memset(buf, 'x', sizeof(buf));
+	tt_int_op(send(fds[1], buf, sizeof(buf), 0), ==, sizeof(buf));
+	bufferevent_write(bev, buf, sizeof(buf));
+	for (i = 0; i < 3; ++i)
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+
+	/* Every byte on the wire is two bytes for the user.  We get charged
+	 * for one or the other. */
+	n_read = evbuffer_get_length(bufferevent_get_input(bev));
+	while ((r = recv(fds[1], buf, sizeof(buf), 0)) > 0)
+		n_sent += r;
+	TT_BLATHER(("read %d, sent %d", (int)n_read, (int)n_sent));
+	if (underlying) {
+		tt_assert(n_read > 100);
+		tt_assert(n_read <= 202);
+		tt_assert(n_sent > 50);
+		tt_assert(n_sent <= 102);
+	} else {
+		tt_assert(n_read > 50);
+		tt_assert(n_read <= 102);
+		tt_assert(n_sent > 100);
+		tt_assert(n_sent <= 202);
+	}
+	tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_BW);
+	tt_assert(BEV_UPCAST(bev)->write_suspended & BEV_SUSPEND_BW);
+
+	/* Without the limit, what was held back goes through. */
+	tt_int_op(bufferevent_set_rate_limit(bev, NULL), ==, 0);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev)), ==, 2000);
+	while ((r = recv(fds[1], buf, sizeof(buf), 0)) > 0)
+		n_sent += r;
+	tt_int_op(n_sent, ==, 2000);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+}
+
+static size_t cross_n_read = 0;
+static size_t cross_max_input = 0;
+static int cross_got_eof = 0;
+
+static void
+cross_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t len = evbuffer_get_length(input);
+
+	if (len > cross_max_input)
+		cross_max_input = len;
+	cross_n_read += len;
+	evbuffer_drain(input, len);
+}
+
+static void
+cross_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & BEV_EVENT_EOF)
+		cross_got_eof = 1;
+}
+
+static void
+test_bufferevent_pair_cross_base(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base2 = NULL;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	char buf[1024];
+	int i;
+
+	base2 = event_base_new();
+	tt_assert(base2);
+	tt_int_op(bufferevent_pair_new_cross_base(data->base, base2, 0, pair),
+	    ==, 0);
+	bufferevent_setcb(pair[1], cross_readcb, NULL, cross_eventcb, NULL);
+	bufferevent_setwatermark(pair[1], EV_READ, 0, 4096);
+	bufferevent_enable(pair[1], EV_READ);
+	bufferevent_enable(pair[0], EV_READ);
+
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < 64; ++i)
+		bufferevent_write(pair[0], buf, sizeof(buf));
+	/* Only pair[1]'s high-water mark worth is handed over; the rest
+	 * waits in pair[0]. */
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(pair[0])), ==,
+	    60*1024);
+	tt_int_op(cross_n_read, ==, 0);
+
+	bufferevent_write(pair[1], "ok", 2);
+	for (i = 0; i < 100 && cross_n_read < 64*1024; ++i) {
+		event_base_loop(base2, EVLOOP_NONBLOCK);
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	}
+	tt_int_op(cross_n_read, ==, 64*1024);
+	tt_int_op(cross_max_input, <=, 4096);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(pair[0])), ==, 2);
+	tt_assert(!cross_got_eof);
+
+	/* Freeing one end hands over everything it was still holding
+	 * back, and then is an EOF for the other. */
+	for (i = 0; i < 64; ++i)
+		bufferevent_write(pair[0], buf, sizeof(buf));
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(pair[0])), ==,
+	    60*1024);
+	bufferevent_free(pair[0]);
+	pair[0] = NULL;
+	for (i = 0; i < 100 && !cross_got_eof; ++i)
+		event_base_loop(base2, EVLOOP_NONBLOCK);
+	tt_int_op(cross_n_read, ==, 128*1024);
+	tt_assert(cross_got_eof);
+
+end:
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (pair[1])
+		bufferevent_free(pair[1]);
+	if (base2)
+		event_base_free(base2);
+}
+
 struct testcase_t bufferevent_testcases[] = {
 
         LEGACY(bufferevent, TT_ISOLATED),
@@ -621,6 +1520,8 @@ struct testcase_t bufferevent_testcases[] = {
         LEGACY(bufferevent_pair_watermarks, TT_ISOLATED),
         LEGACY(bufferevent_filters, TT_ISOLATED),
         LEGACY(bufferevent_pair_filters, TT_ISOLATED),
+	{ "bufferevent_pair_cross_base", test_bufferevent_pair_cross_base,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_THREADS, &basic_setup, NULL },
 	{ "bufferevent_connect", test_bufferevent_connect, TT_FORK|TT_NEED_BASE,
 	  &basic_setup, (void*)"" },
 	{ "bufferevent_connect_defer", test_bufferevent_connect,
@@ -632,10 +1533,32 @@ struct testcase_t bufferevent_testcases[] = {
 	  (void*)"defer lock" },
 	{ "bufferevent_connect_fail", test_bufferevent_connect_fail,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_zerocopy", test_bufferevent_zerocopy,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_edge", test_bufferevent_edge,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_cork", test_bufferevent_cork,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_lazy", test_bufferevent_lazy,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_stats", test_bufferevent_stats,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_nested_groups", test_bufferevent_nested_groups,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_tickless", test_bufferevent_tickless,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_filter_ratelim", test_bufferevent_filter_ratelim,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, (void*)"" },
+	{ "bufferevent_filter_ratelim_underlying",
+	  test_bufferevent_filter_ratelim, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  (void*)"underlying" },
 #ifdef _EVENT_HAVE_LIBZ
         LEGACY(bufferevent_zlib, TT_ISOLATED),
+	{ "bufferevent_zlib_filter", test_bufferevent_zlib_filter,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 #else
         { "bufferevent_zlib", NULL, TT_SKIP, NULL, NULL },
+	{ "bufferevent_zlib_filter", NULL, TT_SKIP, NULL, NULL },
 #endif
 
         END_OF_TESTCASES,
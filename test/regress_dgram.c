@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2010 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+#include <sys/types.h>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include <event2/dgram.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "regress.h"
+#include "tinytest.h"
+#include "tinytest_macros.h"
+#include "util-internal.h"
+
+/* Helper: make a nonblocking UDP socket bound to a free port on localhost,
+ * and tell us its address. */
+static evutil_socket_t
+udp_socket(struct sockaddr_in *sin)
+{
+	ev_socklen_t slen = sizeof(*sin);
+	evutil_socket_t fd;
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	sin->sin_port = 0; /* "You pick!" */
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)sin, &slen) < 0 ||
+	    evutil_make_socket_nonblocking(fd) < 0) {
+		EVUTIL_CLOSESOCKET(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct dgram_test {
+	struct event_base *base;
+	struct sockaddr_in peer;
+	/* Datagrams we've seen. */
+	int n_seen;
+	/* Read callbacks we've had. */
+	int n_calls;
+	/* The most datagrams we've had in one callback. */
+	int max_batch;
+	/* When n_seen reaches this, exit the loop. */
+	int n_expected;
+	/* If true, echo each datagram back where it came from. */
+	int echo;
+	/* If true, free the evdgram from its read callback. */
+	int free_in_cb;
+	int failed;
+};
+
+static void
+dgram_readcb(struct evdgram *dg, const struct evdgram_msg *msgs, int n_msgs,
+    void *arg)
+{
+	struct dgram_test *t = arg;
+	int i;
+
+	++t->n_calls;
+	if (n_msgs > t->max_batch)
+		t->max_batch = n_msgs;
+	for (i = 0; i < n_msgs; ++i) {
+		const struct evdgram_msg *msg = &msgs[i];
+		const struct sockaddr_in *sin =
+		    (const struct sockaddr_in *)msg->addr;
+		const unsigned char *p = msg->data;
+		size_t j;
+		/* Datagram number n is n+1 bytes long, all set to n. */
+		if (msg->len != (size_t)t->n_seen + 1 || msg->truncated ||
+		    msg->addrlen != sizeof(struct sockaddr_in) ||
+		    sin->sin_port != t->peer.sin_port) {
+			TT_BLATHER(("Bad datagram %d", t->n_seen));
+			t->failed = 1;
+		}
+		for (j = 0; j < msg->len; ++j)
+			if (p[j] != (unsigned char)t->n_seen)
+				t->failed = 1;
+		if (t->echo && evdgram_send(dg, msg->data, msg->len,
+			msg->addr, msg->addrlen) < 0)
+			t->failed = 1;
+		if (++t->n_seen == t->n_expected)
+			event_base_loopexit(t->base, NULL);
+	}
+	if (t->free_in_cb)
+		evdgram_free(dg);
+}
+
+static void
+test_dgram_batch(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *client = NULL, *server = NULL;
+	struct sockaddr_in client_sin, server_sin;
+	struct dgram_test client_t, server_t;
+	evutil_socket_t fd1, fd2;
+	unsigned char buf[64];
+	int i;
+
+	fd1 = udp_socket(&client_sin);
+	fd2 = udp_socket(&server_sin);
+	tt_assert(fd1 >= 0);
+	tt_assert(fd2 >= 0);
+
+	client = evdgram_new(data->base, fd1, EVDGRAM_OPT_CLOSE_ON_FREE, 0, 0);
+	server = evdgram_new(data->base, fd2, EVDGRAM_OPT_CLOSE_ON_FREE, 8,
+	    512);
+	tt_assert(client);
+	tt_assert(server);
+	tt_int_op(evdgram_get_fd(server), ==, fd2);
+	tt_ptr_op(evdgram_get_base(server), ==, data->base);
+
+	memset(&client_t, 0, sizeof(client_t));
+	memset(&server_t, 0, sizeof(server_t));
+	client_t.base = server_t.base = data->base;
+	client_t.peer = server_sin;
+	server_t.peer = client_sin;
+	/* The client stops the loop when it has all the echoes. */
+	client_t.n_expected = 20;
+	server_t.n_expected = -1;
+	server_t.echo = 1;
+	evdgram_setcb(client, dgram_readcb, NULL, &client_t);
+	evdgram_setcb(server, dgram_readcb, NULL, &server_t);
+	tt_int_op(evdgram_enable(client), ==, 0);
+	tt_int_op(evdgram_enable(server), ==, 0);
+
+	/* Nothing goes out until the loop runs. */
+	for (i = 0; i < 20; ++i) {
+		memset(buf, i, i + 1);
+		tt_int_op(evdgram_send(client, buf, i + 1,
+			(struct sockaddr *)&server_sin, sizeof(server_sin)), ==,
+		    0);
+	}
+	tt_int_op(evdgram_get_queued(client), ==, 20);
+
+	event_base_dispatch(data->base);
+
+	tt_assert(!server_t.failed);
+	tt_assert(!client_t.failed);
+	tt_int_op(server_t.n_seen, ==, 20);
+	tt_int_op(client_t.n_seen, ==, 20);
+	tt_int_op(evdgram_get_queued(client), ==, 0);
+	tt_int_op(evdgram_get_queued(server), ==, 0);
+	/* They all arrived together, so the server read them in full
+	 * batches. */
+	tt_int_op(server_t.max_batch, ==, 8);
+	tt_int_op(server_t.n_calls, ==, 3);
+	tt_int_op(client_t.n_calls, <, 20);
+
+end:
+	if (client)
+		evdgram_free(client);
+	if (server)
+		evdgram_free(server);
+}
+
+static void
+truncate_readcb(struct evdgram *dg, const struct evdgram_msg *msgs,
+    int n_msgs, void *arg)
+{
+	struct evdgram_msg *msg = arg;
+
+	*msg = msgs[0];
+	msg->data = NULL;
+	event_base_loopexit(evdgram_get_base(dg), NULL);
+}
+
+static void
+test_dgram_truncate(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *client = NULL, *server = NULL;
+	struct sockaddr_in client_sin, server_sin;
+	evutil_socket_t fd1, fd2;
+	struct evdgram_msg msg;
+	unsigned char buf[64];
+
+	fd1 = udp_socket(&client_sin);
+	fd2 = udp_socket(&server_sin);
+	tt_assert(fd1 >= 0);
+	tt_assert(fd2 >= 0);
+	/* Connect the client, so it doesn't need to give an address. */
+	tt_assert(connect(fd1, (struct sockaddr *)&server_sin,
+		sizeof(server_sin)) == 0);
+
+	client = evdgram_new(data->base, fd1, EVDGRAM_OPT_CLOSE_ON_FREE, 4,
+	    sizeof(buf));
+	server = evdgram_new(data->base, fd2, EVDGRAM_OPT_CLOSE_ON_FREE, 4,
+	    16);
+	tt_assert(client);
+	tt_assert(server);
+
+	memset(&msg, 0, sizeof(msg));
+	evdgram_setcb(server, truncate_readcb, NULL, &msg);
+	evdgram_enable(server);
+
+	memset(buf, 0, sizeof(buf));
+	tt_int_op(evdgram_send(client, buf, sizeof(buf) + 1, NULL, 0), ==, -1);
+	tt_int_op(evdgram_send(client, buf, sizeof(buf), NULL, 0), ==, 0);
+	tt_int_op(evdgram_flush(client), ==, 1);
+	tt_int_op(evdgram_flush(client), ==, 0);
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(msg.len, ==, 16);
+	tt_int_op(msg.truncated, ==, 1);
+	tt_int_op(msg.addrlen, ==, sizeof(client_sin));
+
+end:
+	if (client)
+		evdgram_free(client);
+	if (server)
+		evdgram_free(server);
+}
+
+static void
+test_dgram_free_in_cb(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *client = NULL, *server = NULL;
+	struct sockaddr_in client_sin, server_sin;
+	evutil_socket_t fd1, fd2;
+	struct dgram_test t;
+	struct timeval tv = { 0, 100000 };
+	unsigned char buf[8];
+	int i;
+
+	fd1 = udp_socket(&client_sin);
+	fd2 = udp_socket(&server_sin);
+	tt_assert(fd1 >= 0);
+	tt_assert(fd2 >= 0);
+
+	client = evdgram_new(data->base, fd1, EVDGRAM_OPT_CLOSE_ON_FREE, 0, 0);
+	server = evdgram_new(data->base, fd2, EVDGRAM_OPT_CLOSE_ON_FREE, 16,
+	    0);
+	tt_assert(client);
+	tt_assert(server);
+
+	/* The server queues echoes, then frees itself, all in the same
+	 * callback: it shouldn't send them or call us again. */
+	memset(&t, 0, sizeof(t));
+	t.base = data->base;
+	t.peer = client_sin;
+	t.n_expected = -1;
+	t.echo = 1;
+	t.free_in_cb = 1;
+	evdgram_setcb(server, dgram_readcb, NULL, &t);
+	evdgram_enable(server);
+
+	for (i = 0; i < 8; ++i) {
+		memset(buf, i, i + 1);
+		evdgram_send(client, buf, i + 1, (struct sockaddr *)&server_sin,
+		    sizeof(server_sin));
+	}
+	tt_int_op(evdgram_flush(client), ==, 8);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	server = NULL;
+
+	tt_assert(!t.failed);
+	tt_int_op(t.n_calls, ==, 1);
+	tt_int_op(t.n_seen, ==, 8);
+	/* Nothing came back. */
+	tt_int_op(recv(fd1, (char *)buf, sizeof(buf), 0), ==, -1);
+
+end:
+	if (client)
+		evdgram_free(client);
+	if (server)
+		evdgram_free(server);
+}
+
+struct testcase_t dgram_testcases[] = {
+	{ "batch", test_dgram_batch, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  NULL },
+	{ "truncate", test_dgram_truncate, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  NULL },
+	{ "free_in_cb", test_dgram_free_in_cb, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+
+	END_OF_TESTCASES,
+};
@@ -297,8 +297,15 @@ const struct testcase_setup_t legacy_setup = {
 struct testcase_t thread_testcases[] = {
 #if defined(_EVENT_HAVE_PTHREADS) && !defined(_EVENT_DISABLE_THREAD_SUPPORT)
 	{ "pthreads", regress_threads, TT_FORK, NULL, NULL, },
+	{ "handoff", regress_thread_handoff, TT_FORK, NULL, NULL, },
+	{ "handoff_wakeup", regress_thread_handoff_wakeup, TT_FORK, NULL, NULL, },
+	{ "pair_cross_base", regress_thread_pair_cross_base, TT_FORK, NULL,
+	  NULL, },
 #else
 	{ "pthreads", NULL, TT_SKIP, NULL, NULL },
+	{ "handoff", NULL, TT_SKIP, NULL, NULL },
+	{ "handoff_wakeup", NULL, TT_SKIP, NULL, NULL },
+	{ "pair_cross_base", NULL, TT_SKIP, NULL, NULL },
 #endif
 	END_OF_TESTCASES
 };
@@ -317,6 +324,7 @@ struct testgroup_t testgroups[] = {
 	{ "rpc/", rpc_testcases },
 	{ "thread/", thread_testcases },
 	{ "listener/", listener_testcases },
+	{ "dgram/", dgram_testcases },
 #ifdef WIN32
 	{ "iocp/", iocp_testcases },
 	{ "iocp/bufferevent/", bufferevent_iocp_testcases },
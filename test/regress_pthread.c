@@ -29,14 +29,18 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 
 #include "event2/util.h"
 #include "event2/event.h"
 #include "event2/event_struct.h"
 #include "event2/thread.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
 #include "regress.h"
 #include "tinytest_macros.h"
 
@@ -146,3 +150,406 @@ regress_threads(void *arg)
 end:
         ;
 }
+
+#define HANDOFF_MESSAGES 100000
+
+struct handoff_test {
+	struct event_base *base;
+	ev_uint32_t next_seq;
+	int failed;
+};
+
+static void *
+handoff_producer(void *arg)
+{
+	struct evbuffer_handoff *h = arg;
+	struct evbuffer *buf = evbuffer_new();
+	ev_uint32_t i;
+
+	assert(buf);
+	for (i = 0; i < HANDOFF_MESSAGES; ++i) {
+		assert(evbuffer_add(buf, &i, sizeof(i)) == 0);
+		/* Push batches of different sizes. */
+		if (i % 7 == 0 || i % 11 == 0)
+			assert(evbuffer_handoff_push(h, buf) == 0);
+	}
+	assert(evbuffer_handoff_push(h, buf) == 0);
+	assert(evbuffer_get_length(buf) == 0);
+	evbuffer_free(buf);
+
+	return (NULL);
+}
+
+static void
+handoff_consumer_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct handoff_test *t = arg;
+	ev_uint32_t seq;
+
+	/* Ignore the calls caused by our own evbuffer_remove(). */
+	if (!info->n_added)
+		return;
+	while (evbuffer_get_length(buf) >= sizeof(seq)) {
+		evbuffer_remove(buf, &seq, sizeof(seq));
+		if (seq != t->next_seq)
+			t->failed = 1;
+		++t->next_seq;
+	}
+	if (t->next_seq == HANDOFF_MESSAGES)
+		event_base_loopexit(t->base, NULL);
+}
+
+static void
+handoff_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct handoff_test *t = arg;
+	t->failed = 1;
+	event_base_loopexit(t->base, NULL);
+}
+
+void
+regress_thread_handoff(void *arg)
+{
+	struct event_base *base = NULL;
+	struct evbuffer_handoff *h = NULL;
+	struct evbuffer *buf = NULL, *dst = NULL;
+	struct handoff_test t;
+	struct event ev;
+	struct timeval tv = { 30, 0 };
+	pthread_t producer;
+	(void) arg;
+
+	if (evthread_use_pthreads()<0)
+		tt_abort_msg("Couldn't initialize pthreads!");
+	base = event_base_new();
+	tt_assert(base);
+	if (evthread_make_base_notifiable(base)<0)
+		tt_abort_msg("Couldn't make base notifiable!");
+
+	/* First, by hand from one thread. */
+	h = evbuffer_handoff_new();
+	buf = evbuffer_new();
+	dst = evbuffer_new();
+	tt_assert(h && buf && dst);
+	tt_int_op(evbuffer_handoff_pull(h, dst), ==, 0);
+	evbuffer_add(buf, "hello ", 6);
+	tt_int_op(evbuffer_handoff_push(h, buf), ==, 0);
+	evbuffer_add(buf, "world", 5);
+	tt_int_op(evbuffer_handoff_push(h, buf), ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(evbuffer_handoff_get_length(h), ==, 11);
+	tt_int_op(evbuffer_handoff_pull(h, dst), ==, 11);
+	tt_int_op(evbuffer_handoff_get_length(h), ==, 0);
+	tt_assert(!memcmp(evbuffer_pullup(dst, -1), "hello world", 11));
+	/* Batches are reused once the consumer is past them. */
+	evbuffer_add(buf, "again", 5);
+	tt_int_op(evbuffer_handoff_push(h, buf), ==, 0);
+	/* Data nobody pulled is freed along with the queue. */
+	evbuffer_add(buf, "leftover", 8);
+	tt_int_op(evbuffer_handoff_push(h, buf), ==, 0);
+	evbuffer_handoff_free(h);
+	evbuffer_free(dst);
+
+	/* Now from another thread, with wakeups. */
+	memset(&t, 0, sizeof(t));
+	t.base = base;
+	h = evbuffer_handoff_new();
+	dst = evbuffer_new();
+	tt_assert(h && dst);
+	evbuffer_add_cb(dst, handoff_consumer_cb, &t);
+	tt_int_op(evbuffer_handoff_set_consumer(h, base, dst), ==, 0);
+
+	/* Keep the loop alive while we wait, but not forever. */
+	evtimer_assign(&ev, base, handoff_timeout_cb, &t);
+	evtimer_add(&ev, &tv);
+
+	pthread_create(&producer, NULL, handoff_producer, h);
+	event_base_dispatch(base);
+	pthread_join(producer, NULL);
+	evtimer_del(&ev);
+
+	tt_int_op(t.next_seq, ==, HANDOFF_MESSAGES);
+	tt_assert(!t.failed);
+	tt_int_op(evbuffer_handoff_get_length(h), ==, 0);
+
+end:
+	if (h)
+		evbuffer_handoff_free(h);
+	if (buf)
+		evbuffer_free(buf);
+	if (dst)
+		evbuffer_free(dst);
+	if (base)
+		event_base_free(base);
+}
+
+#define WAKEUP_ROUNDS 20000
+
+struct wakeup_test {
+	struct evbuffer_handoff *volatile h;
+	volatile int round;
+	volatile int pushed;
+	int received;
+};
+
+static void *
+wakeup_producer(void *arg)
+{
+	struct wakeup_test *t = arg;
+	struct evbuffer *buf = evbuffer_new();
+	volatile int spin;
+	int i, j;
+
+	assert(buf);
+	for (i = 1; i <= WAKEUP_ROUNDS; ++i) {
+		/* Wait for the consumer to start round i. */
+		while (t->round < i)
+			sched_yield();
+		if (t->round > WAKEUP_ROUNDS)
+			break;
+		/* A new consumer's first run pulls from an empty queue and
+		 * then goes to sleep.  Push at a slightly different time
+		 * each round, so that (given a second CPU) some pushes land
+		 * between the two. */
+		for (j = 0, spin = 0; j < i % 2000; ++j)
+			++spin;
+		evbuffer_add(buf, "x", 1);
+		assert(evbuffer_handoff_push(t->h, buf) == 0);
+		t->pushed = i;
+	}
+	evbuffer_free(buf);
+
+	return (NULL);
+}
+
+static void
+wakeup_consumer_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct event *done = arg;
+
+	if (!info->n_added)
+		return;
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	event_active(done, EV_TIMEOUT, 1);
+}
+
+static void
+wakeup_done_cb(evutil_socket_t fd, short what, void *arg)
+{
+	event_base_loopbreak(arg);
+}
+
+void
+regress_thread_handoff_wakeup(void *arg)
+{
+	struct event_base *base = NULL;
+	struct evbuffer *dst = NULL;
+	struct wakeup_test t;
+	struct event ev;
+	struct timeval tv = { 5, 0 };
+	pthread_t producer;
+	int i, started = 0;
+	(void) arg;
+
+	memset(&t, 0, sizeof(t));
+	if (evthread_use_pthreads()<0)
+		tt_abort_msg("Couldn't initialize pthreads!");
+	base = event_base_new();
+	tt_assert(base);
+	if (evthread_make_base_notifiable(base)<0)
+		tt_abort_msg("Couldn't make base notifiable!");
+	dst = evbuffer_new();
+	tt_assert(dst);
+	/* The consumer activates this when the data arrives; if a wakeup
+	 * is lost, it times out instead. */
+	evtimer_assign(&ev, base, wakeup_done_cb, base);
+	evbuffer_add_cb(dst, wakeup_consumer_cb, &ev);
+
+	pthread_create(&producer, NULL, wakeup_producer, &t);
+	started = 1;
+	for (i = 1; i <= WAKEUP_ROUNDS; ++i) {
+		t.h = evbuffer_handoff_new();
+		tt_assert(t.h);
+		t.round = i;
+		tt_int_op(evbuffer_handoff_set_consumer(t.h, base, dst), ==,
+		    0);
+		evtimer_add(&ev, &tv);
+		event_base_dispatch(base);
+		evtimer_del(&ev);
+		/* Make sure the producer is done with the queue. */
+		while (t.pushed != i)
+			sched_yield();
+		if (evbuffer_handoff_get_length(t.h) != 0)
+			break;
+		++t.received;
+		evbuffer_handoff_free(t.h);
+		t.h = NULL;
+	}
+	tt_int_op(t.received, ==, WAKEUP_ROUNDS);
+
+end:
+	/* Let the producer give up if we stopped early. */
+	t.round = WAKEUP_ROUNDS + 1;
+	if (started)
+		pthread_join(producer, NULL);
+	if (t.h)
+		evbuffer_handoff_free(t.h);
+	if (dst)
+		evbuffer_free(dst);
+	if (base)
+		event_base_free(base);
+}
+
+#define CROSS_TOTAL (4*1024*1024)
+#define CROSS_CHUNK 4096
+
+/* One end of a cross-base pair: it writes CROSS_TOTAL bytes of a known
+ * pattern to its peer, and checks that it reads the same back. */
+struct cross_end {
+	struct event_base *base;
+	struct event done;
+	size_t sent;
+	size_t received;
+	int finished;
+	int eof;
+	int bad;
+};
+
+static void
+cross_end_check_done(struct cross_end *e)
+{
+	if (e->finished && e->eof)
+		event_active(&e->done, EV_TIMEOUT, 1);
+}
+
+static void
+cross_end_writecb(struct bufferevent *bev, void *arg)
+{
+	struct cross_end *e = arg;
+	struct evbuffer *output = bufferevent_get_output(bev);
+	unsigned char buf[CROSS_CHUNK];
+	size_t i;
+
+	while (e->sent < CROSS_TOTAL &&
+	    evbuffer_get_length(output) < 16*CROSS_CHUNK) {
+		for (i = 0; i < CROSS_CHUNK; ++i)
+			buf[i] = (e->sent + i) % 251;
+		bufferevent_write(bev, buf, CROSS_CHUNK);
+		e->sent += CROSS_CHUNK;
+	}
+	if (e->sent == CROSS_TOTAL && !e->finished) {
+		bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
+		e->finished = 1;
+		cross_end_check_done(e);
+	}
+}
+
+static void
+cross_end_readcb(struct bufferevent *bev, void *arg)
+{
+	struct cross_end *e = arg;
+	unsigned char buf[CROSS_CHUNK];
+	int i, n;
+
+	while ((n = bufferevent_read(bev, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; ++i) {
+			if (buf[i] != (e->received + i) % 251)
+				e->bad = 1;
+		}
+		e->received += n;
+	}
+}
+
+static void
+cross_end_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct cross_end *e = arg;
+
+	if (what & BEV_EVENT_EOF) {
+		e->eof = 1;
+		cross_end_check_done(e);
+	}
+}
+
+static void
+cross_end_done_cb(evutil_socket_t fd, short what, void *arg)
+{
+	event_base_loopbreak(arg);
+}
+
+static void
+cross_end_setup(struct cross_end *e, struct bufferevent *bev)
+{
+	struct timeval tv = { 60, 0 };
+
+	/* The ends don't keep the loop running; this does, until both
+	 * directions are done, or we give up. */
+	evtimer_assign(&e->done, e->base, cross_end_done_cb, e->base);
+	evtimer_add(&e->done, &tv);
+	bufferevent_setcb(bev, cross_end_readcb, cross_end_writecb,
+	    cross_end_eventcb, e);
+	bufferevent_setwatermark(bev, EV_READ, 0, 8*CROSS_CHUNK);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	cross_end_writecb(bev, e);
+}
+
+static void *
+cross_end_thread(void *arg)
+{
+	event_base_dispatch(arg);
+	return (NULL);
+}
+
+void
+regress_thread_pair_cross_base(void *arg)
+{
+	struct cross_end ends[2];
+	struct bufferevent *pair[2] = { NULL, NULL };
+	pthread_t thread;
+	int i, started = 0;
+	(void) arg;
+
+	memset(ends, 0, sizeof(ends));
+	if (evthread_use_pthreads()<0)
+		tt_abort_msg("Couldn't initialize pthreads!");
+	for (i = 0; i < 2; ++i) {
+		ends[i].base = event_base_new();
+		tt_assert(ends[i].base);
+		if (evthread_make_base_notifiable(ends[i].base)<0)
+			tt_abort_msg("Couldn't make base notifiable!");
+	}
+	tt_int_op(bufferevent_pair_new_cross_base(ends[0].base, ends[1].base,
+		0, pair), ==, 0);
+
+	/* Set both ends up before the second base starts running. */
+	cross_end_setup(&ends[1], pair[1]);
+	cross_end_setup(&ends[0], pair[0]);
+	pthread_create(&thread, NULL, cross_end_thread, ends[1].base);
+	started = 1;
+	event_base_dispatch(ends[0].base);
+	pthread_join(thread, NULL);
+	started = 0;
+
+	for (i = 0; i < 2; ++i) {
+		tt_int_op(ends[i].sent, ==, CROSS_TOTAL);
+		tt_int_op(ends[i].received, ==, CROSS_TOTAL);
+		tt_assert(ends[i].finished);
+		tt_assert(ends[i].eof);
+		tt_assert(!ends[i].bad);
+	}
+
+end:
+	if (started)
+		pthread_join(thread, NULL);
+	for (i = 0; i < 2; ++i) {
+		if (pair[i])
+			bufferevent_free(pair[i]);
+		if (ends[i].base) {
+			if (event_initialized(&ends[i].done))
+				event_del(&ends[i].done);
+			event_base_free(ends[i].base);
+		}
+	}
+}
@@ -32,6 +32,7 @@
 #ifndef WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <unistd.h>
 #endif
 
 #include <event2/util.h>
@@ -51,6 +52,10 @@
 
 #include <string.h>
 
+#ifdef _EVENT_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 /* A short pre-generated key, to save the cost of doing an RSA key generation
  * step during the unit tests.  It's only 512 bits long, and it is published
  * in this file, so you would have to be very foolish to consider using it in
@@ -221,6 +226,7 @@ regress_bufferevent_openssl(void *arg)
 	SSL *ssl1, *ssl2;
 	X509 *cert = getcert();
 	EVP_PKEY *key = getkey();
+	struct bufferevent_openssl_handshake_pool *pool = NULL;
 	tt_assert(cert);
 	tt_assert(key);
 
@@ -250,6 +256,15 @@ regress_bufferevent_openssl(void *arg)
 			BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS);
 
 		tt_int_op(bufferevent_getfd(bev1), ==, data->pair[0]);
+
+		if (strstr((char*)data->setup_data, "pool")) {
+			pool = bufferevent_openssl_handshake_pool_new(2);
+			tt_assert(pool);
+			tt_int_op(bufferevent_openssl_set_handshake_pool(bev1,
+				pool), ==, 0);
+			tt_int_op(bufferevent_openssl_set_handshake_pool(bev2,
+				pool), ==, 0);
+		}
 	} else if (strstr((char*)data->setup_data, "filter")) {
 		struct bufferevent *bev_ll1, *bev_ll2;
 		bev_ll1 = bufferevent_socket_new(data->base, data->pair[0],
@@ -295,6 +310,8 @@ regress_bufferevent_openssl(void *arg)
 	   tt_int_op(got_error, ==, 0);
 	*/
 end:
+	if (pool)
+		bufferevent_openssl_handshake_pool_free(pool);
 	return;
 }
 
@@ -379,6 +396,322 @@ end:
 	;
 }
 
+/* ====================
+   Here we queue a hundred tiny chains on a connected SSL bufferevent, and
+   make sure that they go out as one TLS record rather than a hundred.
+*/
+
+static unsigned long coalesce_wire_start = 0;
+static int coalesce_bytes_read = 0;
+
+static void
+coalesce_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	coalesce_bytes_read += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	if (coalesce_bytes_read == 1000)
+		event_base_loopexit(ctx, NULL);
+}
+
+static void
+coalesce_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	static const char chunk[10] = "123456789";
+	struct evbuffer *output = bufferevent_get_output(bev);
+	SSL *ssl = bufferevent_openssl_get_ssl(bev);
+	int i;
+
+	if (!(what & BEV_EVENT_CONNECTED))
+		return;
+	coalesce_wire_start = BIO_number_written(SSL_get_wbio(ssl));
+	/* Each reference gets a chain of its own. */
+	for (i = 0; i < 100; ++i)
+		evbuffer_add_reference(output, chunk, sizeof(chunk), NULL, NULL);
+}
+
+static void
+regress_bufferevent_openssl_coalesce(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	SSL *ssl1, *ssl2;
+	unsigned long wire_bytes;
+
+	init_ssl();
+
+	ssl1 = SSL_new(get_ssl_ctx());
+	ssl2 = SSL_new(get_ssl_ctx());
+	SSL_use_certificate(ssl2, getcert());
+	SSL_use_PrivateKey(ssl2, getkey());
+
+	bev1 = bufferevent_openssl_socket_new(data->base, data->pair[0], ssl1,
+	    BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	bev2 = bufferevent_openssl_socket_new(data->base, data->pair[1], ssl2,
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev1);
+	tt_assert(bev2);
+
+	bufferevent_setcb(bev1, NULL, NULL, coalesce_eventcb, NULL);
+	bufferevent_setcb(bev2, coalesce_readcb, NULL, NULL, data->base);
+	bufferevent_enable(bev1, EV_READ|EV_WRITE);
+	bufferevent_enable(bev2, EV_READ|EV_WRITE);
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(coalesce_bytes_read, ==, 1000);
+	wire_bytes = BIO_number_written(SSL_get_wbio(ssl1)) -
+	    coalesce_wire_start;
+	TT_BLATHER(("1000 bytes took %lu bytes on the wire", wire_bytes));
+	/* One record costs well under 100 bytes of framing; a hundred
+	 * records would cost thousands. */
+	tt_int_op(wire_bytes, <, 1100);
+end:
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+}
+
+/* ====================
+   Here we connect to a couple of servers, one after another, through a
+   session cache with room for a single session, and make sure that we
+   resume the sessions we should and only those.
+*/
+
+static int session_n_connected = 0;
+
+static void
+session_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if ((what & BEV_EVENT_CONNECTED) && ++session_n_connected == 2)
+		event_base_loopexit(ctx, NULL);
+}
+
+static void
+session_connect(struct basic_test_data *data,
+    struct bufferevent_openssl_session_cache *cache, const char *host)
+{
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	evutil_socket_t pair[2];
+	SSL *ssl2;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	ssl2 = SSL_new(get_ssl_ctx());
+	SSL_use_certificate(ssl2, getcert());
+	SSL_use_PrivateKey(ssl2, getkey());
+
+	if (strstr((char*)data->setup_data, "filter")) {
+		bev1 = bufferevent_openssl_filter_new(data->base,
+		    bufferevent_socket_new(data->base, pair[0],
+			BEV_OPT_CLOSE_ON_FREE),
+		    SSL_new(get_ssl_ctx()), BUFFEREVENT_SSL_CONNECTING,
+		    BEV_OPT_CLOSE_ON_FREE);
+		bev2 = bufferevent_openssl_filter_new(data->base,
+		    bufferevent_socket_new(data->base, pair[1],
+			BEV_OPT_CLOSE_ON_FREE),
+		    ssl2, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	} else {
+		bev1 = bufferevent_openssl_socket_new(data->base, pair[0],
+		    SSL_new(get_ssl_ctx()), BUFFEREVENT_SSL_CONNECTING,
+		    BEV_OPT_CLOSE_ON_FREE);
+		bev2 = bufferevent_openssl_socket_new(data->base, pair[1],
+		    ssl2, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	}
+	tt_assert(bev1);
+	tt_assert(bev2);
+	tt_int_op(bufferevent_openssl_set_session_cache(bev1, cache, host,
+		443), ==, 0);
+	/* Only a connecting bufferevent can use the cache. */
+	tt_int_op(bufferevent_openssl_set_session_cache(bev2, cache, host,
+		443), ==, -1);
+
+	bufferevent_setcb(bev1, NULL, NULL, session_eventcb, data->base);
+	bufferevent_setcb(bev2, NULL, NULL, session_eventcb, data->base);
+	bufferevent_enable(bev1, EV_READ|EV_WRITE);
+	bufferevent_enable(bev2, EV_READ|EV_WRITE);
+
+	session_n_connected = 0;
+	event_base_dispatch(data->base);
+	tt_int_op(session_n_connected, ==, 2);
+
+	/* Once the handshake has started, it's too late. */
+	tt_int_op(bufferevent_openssl_set_session_cache(bev1, cache, host,
+		443), ==, -1);
+end:
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+}
+
+static void
+regress_bufferevent_openssl_session_cache(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent_openssl_session_cache *cache;
+	ev_uint64_t n_resumed, n_full;
+
+	init_ssl();
+
+	cache = bufferevent_openssl_session_cache_new(1, 3600);
+	tt_assert(cache);
+
+	/* A full handshake, and then a resumed one. */
+	session_connect(data, cache, "a.example.com");
+	session_connect(data, cache, "a.example.com");
+	bufferevent_openssl_session_cache_get_counts(cache, &n_resumed,
+	    &n_full);
+	tt_int_op(n_resumed, ==, 1);
+	tt_int_op(n_full, ==, 1);
+
+	/* A new server pushes the first one out of the cache. */
+	session_connect(data, cache, "b.example.com");
+	session_connect(data, cache, "a.example.com");
+	bufferevent_openssl_session_cache_get_counts(cache, &n_resumed,
+	    &n_full);
+	tt_int_op(n_resumed, ==, 1);
+	tt_int_op(n_full, ==, 3);
+
+	bufferevent_openssl_session_cache_free(cache);
+end:
+	;
+}
+
+#ifdef _EVENT_HAVE_PTHREADS
+/* ====================
+   Handshakes on a worker pool: we check that the pool really does the
+   handshake, and that freeing a bufferevent while a worker has its SSL
+   is safe.
+*/
+
+static pthread_t pool_main_thread;
+static pthread_mutex_t pool_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool_n_worker_handshakes = 0;
+static int pool_n_connected = 0;
+static int pool_n_events = 0;
+static int pool_got_line = 0;
+
+static void
+pool_info_cb(const SSL *ssl, int where, int ret)
+{
+	if ((where & SSL_CB_HANDSHAKE_DONE) &&
+	    !pthread_equal(pthread_self(), pool_main_thread)) {
+		pthread_mutex_lock(&pool_count_lock);
+		++pool_n_worker_handshakes;
+		pthread_mutex_unlock(&pool_count_lock);
+	}
+}
+
+static void
+pool_readcb(struct bufferevent *bev, void *ctx)
+{
+	char *line;
+
+	line = evbuffer_readln(bufferevent_get_input(bev), NULL,
+	    EVBUFFER_EOL_LF);
+	if (line && !strcmp(line, "hello")) {
+		pool_got_line = 1;
+		event_base_loopexit(ctx, NULL);
+	}
+	free(line);
+}
+
+static void
+pool_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	++pool_n_events;
+	if (what & BEV_EVENT_CONNECTED)
+		++pool_n_connected;
+}
+
+static void
+regress_bufferevent_openssl_handshake_pool(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent_openssl_handshake_pool *pool = NULL;
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	evutil_socket_t pair[2] = { -1, -1 };
+	SSL *ssl1, *ssl2;
+
+	init_ssl();
+	pool_main_thread = pthread_self();
+	pool = bufferevent_openssl_handshake_pool_new(2);
+	tt_assert(pool);
+
+	/* First, a whole handshake through the pool. */
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	ssl1 = SSL_new(get_ssl_ctx());
+	ssl2 = SSL_new(get_ssl_ctx());
+	SSL_use_certificate(ssl2, getcert());
+	SSL_use_PrivateKey(ssl2, getkey());
+	SSL_set_info_callback(ssl1, pool_info_cb);
+	SSL_set_info_callback(ssl2, pool_info_cb);
+	bev1 = bufferevent_openssl_socket_new(data->base, pair[0], ssl1,
+	    BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	bev2 = bufferevent_openssl_socket_new(data->base, pair[1], ssl2,
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev1);
+	tt_assert(bev2);
+	pair[0] = pair[1] = -1;
+	tt_int_op(bufferevent_openssl_set_handshake_pool(bev1, pool), ==, 0);
+	tt_int_op(bufferevent_openssl_set_handshake_pool(bev2, pool), ==, 0);
+	bufferevent_setcb(bev1, NULL, NULL, pool_eventcb, NULL);
+	bufferevent_setcb(bev2, pool_readcb, NULL, pool_eventcb, data->base);
+	bufferevent_enable(bev1, EV_READ|EV_WRITE);
+	bufferevent_enable(bev2, EV_READ|EV_WRITE);
+	evbuffer_add_printf(bufferevent_get_output(bev1), "hello\n");
+
+	event_base_dispatch(data->base);
+	tt_int_op(pool_n_connected, ==, 2);
+	tt_int_op(pool_n_worker_handshakes, >=, 2);
+	tt_assert(pool_got_line);
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+	bev1 = bev2 = NULL;
+
+	/* Now free a bufferevent while a worker is in the middle of its
+	 * handshake.  Our socket blocks, and nobody answers on the other
+	 * end, so the worker waits for a reply until we close that. */
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	bev1 = bufferevent_openssl_socket_new(data->base, pair[0],
+	    SSL_new(get_ssl_ctx()), BUFFEREVENT_SSL_CONNECTING,
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev1);
+	tt_int_op(bufferevent_openssl_set_handshake_pool(bev1, pool), ==, 0);
+	pool_n_events = 0;
+	bufferevent_setcb(bev1, NULL, NULL, pool_eventcb, NULL);
+	bufferevent_enable(bev1, EV_READ|EV_WRITE);
+	/* The first step of the handshake goes to a worker... */
+	event_base_loop(data->base, EVLOOP_ONCE);
+	/* ...which owns our SSL, and its socket, till it's done. */
+	tt_int_op(bufferevent_setfd(bev1, pair[0]), ==, -1);
+	bufferevent_free(bev1);
+	bev1 = NULL;
+	EVUTIL_CLOSESOCKET(pair[1]);
+	pair[0] = pair[1] = -1;
+	/* The loop runs till the worker is done, and we hear nothing. */
+	event_base_dispatch(data->base);
+	tt_int_op(pool_n_events, ==, 0);
+
+end:
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+	if (pool)
+		bufferevent_openssl_handshake_pool_free(pool);
+}
+#endif
+
 struct testcase_t ssl_testcases[] = {
 
 	{ "bufferevent_socketpair", regress_bufferevent_openssl, TT_ISOLATED,
@@ -392,9 +725,25 @@ struct testcase_t ssl_testcases[] = {
 	{ "bufferevent_renegotiate_filter", regress_bufferevent_openssl,
 	  TT_ISOLATED,
 	  &basic_setup, (void*)"filter renegotiate" },
+#ifdef _EVENT_HAVE_PTHREADS
+	{ "bufferevent_handshake_pool", regress_bufferevent_openssl,
+	  TT_ISOLATED|TT_NEED_THREADS,
+	  &basic_setup, (void*)"socketpair pool" },
+	{ "bufferevent_handshake_pool_worker",
+	  regress_bufferevent_openssl_handshake_pool,
+	  TT_ISOLATED|TT_NEED_THREADS, &basic_setup, NULL },
+#endif
 
 	{ "bufferevent_connect", regress_bufferevent_openssl_connect,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_coalesce", regress_bufferevent_openssl_coalesce,
+	  TT_ISOLATED, &basic_setup, (void*)"socketpair" },
+	{ "bufferevent_session_cache_socketpair",
+	  regress_bufferevent_openssl_session_cache,
+	  TT_ISOLATED, &basic_setup, (void*)"socketpair" },
+	{ "bufferevent_session_cache_filter",
+	  regress_bufferevent_openssl_session_cache,
+	  TT_ISOLATED, &basic_setup, (void*)"filter" },
 
         END_OF_TESTCASES,
 };
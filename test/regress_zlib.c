@@ -52,6 +52,7 @@
 #include "event2/event_compat.h"
 #include "event2/buffer.h"
 #include "event2/bufferevent.h"
+#include "event2/bufferevent_zlib.h"
 
 #include "regress.h"
 
@@ -317,3 +318,124 @@ end:
 	if (pair[1] >= 0)
 		EVUTIL_CLOSESOCKET(pair[1]);
 }
+
+/*
+ * The built-in zlib bufferevents
+ */
+
+static void
+zlib_count_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+    void *arg)
+{
+	size_t *n = arg;
+	*n += info->n_added;
+}
+
+static void
+zlib_collect_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *collected = arg;
+	evbuffer_add_buffer(collected, bufferevent_get_input(bev));
+}
+
+/* Connect a compressing writer to a decompressing reader over a
+ * socketpair, counting the bytes on the wire in *n_wire. */
+static int
+zlib_connect(struct event_base *base, struct bufferevent_zlib_pool *pool,
+    int flags, struct evbuffer *collected, size_t *n_wire,
+    struct bufferevent **writer_out, struct bufferevent **reader_out)
+{
+	evutil_socket_t fds[2];
+	struct bufferevent *under_w, *under_r;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		return -1;
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+	under_w = bufferevent_socket_new(base, fds[0], BEV_OPT_CLOSE_ON_FREE);
+	under_r = bufferevent_socket_new(base, fds[1], BEV_OPT_CLOSE_ON_FREE);
+	evbuffer_add_cb(bufferevent_get_input(under_r), zlib_count_cb, n_wire);
+
+	*writer_out = bufferevent_zlib_new(under_w, 9, flags, pool,
+	    BEV_OPT_CLOSE_ON_FREE);
+	*reader_out = bufferevent_zlib_new(under_r, 9, flags, pool,
+	    BEV_OPT_CLOSE_ON_FREE);
+	if (!*writer_out || !*reader_out)
+		return -1;
+	bufferevent_setcb(*reader_out, zlib_collect_readcb, NULL, NULL,
+	    collected);
+	bufferevent_enable(*writer_out, EV_WRITE);
+	bufferevent_enable(*reader_out, EV_READ);
+	return 0;
+}
+
+void
+test_bufferevent_zlib_filter(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent_zlib_pool *pool = NULL;
+	struct bufferevent *writer = NULL, *reader = NULL;
+	struct evbuffer *expected = NULL, *collected = NULL;
+	ev_uint64_t n_created, n_reused;
+	size_t n_wire = 0, len;
+	int i;
+
+	pool = bufferevent_zlib_pool_new(4);
+	expected = evbuffer_new();
+	collected = evbuffer_new();
+	tt_assert(pool && expected && collected);
+	tt_int_op(zlib_connect(data->base, pool, 0, collected, &n_wire,
+		&writer, &reader), ==, 0);
+
+	for (i = 0; evbuffer_get_length(expected) < 65536; ++i)
+		evbuffer_add_printf(expected, "line %d of the test data\n", i);
+	len = evbuffer_get_length(expected);
+	tt_int_op(bufferevent_write(writer, evbuffer_pullup(expected, -1),
+		len), ==, 0);
+	/* Without a flush, the compressor holds on to the tail. */
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(collected), <, len);
+
+	bufferevent_flush(writer, EV_WRITE, BEV_FLUSH);
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(collected), ==, len);
+	tt_assert(!memcmp(evbuffer_pullup(collected, -1),
+		evbuffer_pullup(expected, -1), len));
+	TT_BLATHER(("%d bytes took %d on the wire", (int)len, (int)n_wire));
+	tt_int_op(n_wire, <, len / 4);
+
+	bufferevent_free(writer);
+	bufferevent_free(reader);
+	writer = reader = NULL;
+	bufferevent_zlib_pool_get_counts(pool, &n_created, &n_reused);
+	tt_int_op(n_created, ==, 2);
+	tt_int_op(n_reused, ==, 0);
+
+	/* The next connection reuses both streams, and flushes every write
+	 * when asked to. */
+	evbuffer_drain(collected, evbuffer_get_length(collected));
+	tt_int_op(zlib_connect(data->base, pool, BEV_ZLIB_FLUSH_WRITES,
+		collected, &n_wire, &writer, &reader), ==, 0);
+	bufferevent_write(writer, "hello", 5);
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(collected), ==, 5);
+	tt_assert(!memcmp(evbuffer_pullup(collected, -1), "hello", 5));
+	bufferevent_zlib_pool_get_counts(pool, &n_created, &n_reused);
+	tt_int_op(n_created, ==, 2);
+	tt_int_op(n_reused, ==, 2);
+
+end:
+	if (writer)
+		bufferevent_free(writer);
+	if (reader)
+		bufferevent_free(reader);
+	if (pool)
+		bufferevent_zlib_pool_free(pool);
+	if (expected)
+		evbuffer_free(expected);
+	if (collected)
+		evbuffer_free(collected);
+}
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -50,18 +51,54 @@ static int cfg_duration = 5;
 static int cfg_connlimit = 0;
 static int cfg_grouplimit = 0;
 static int cfg_tick_msec = 1000;
+static int cfg_n_idle = 0;
+static int cfg_n_tenants = 0;
+static int cfg_tenantlimit = 0;
 
 static struct timeval cfg_tick = { 0, 500*1000 };
 
 static struct ev_token_bucket_cfg *conn_bucket_cfg = NULL;
 static struct ev_token_bucket_cfg *group_bucket_cfg = NULL;
 struct bufferevent_rate_limit_group *ratelim_group = NULL;
+static struct ev_token_bucket_cfg *tenant_bucket_cfg = NULL;
+static struct bufferevent_rate_limit_group **tenant_groups = NULL;
+
+/* With -T, the local port of each client connection, and the tenant it
+ * belongs to. */
+static ev_uint16_t *client_ports = NULL;
+static int *client_tenants = NULL;
 
 struct client_state {
 	size_t queued;
 	ev_uint64_t received;
 };
 
+/* How many bytes all the clients got in each 10 msec of the test, to see
+ * how smoothly the traffic flowed. */
+#define SAMPLE_MSEC 10
+
+/* Let a bucket hold four ticks' worth of data, or 100 msec worth if it's
+ * tick-less. */
+#define BURST(limit) \
+	(cfg_tick_msec ? (limit) * 4 : ((limit) >= 10 ? (limit) / 10 : 1))
+static ev_uint64_t *samples = NULL;
+static int n_samples = 0, max_samples = 0;
+static ev_uint64_t last_sample_total = 0;
+
+static void
+sample_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct client_state *states = arg;
+	ev_uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < cfg_n_connections; ++i)
+		total += states[i].received;
+	if (n_samples < max_samples)
+		samples[n_samples++] = total - last_sample_total;
+	last_sample_total = total;
+}
+
 static void
 loud_writecb(struct bufferevent *bev, void *ctx)
 {
@@ -127,7 +164,20 @@ echo_listenercb(struct evconnlistener *listener, evutil_socket_t newsock,
 	bufferevent_setcb(bev, echo_readcb, NULL, NULL, NULL);
 	if (conn_bucket_cfg)
 		bufferevent_set_rate_limit(bev, conn_bucket_cfg);
-	if (ratelim_group)
+	if (tenant_groups) {
+		/* Find which client this is, to put it in the right tenant's
+		 * group. */
+		ev_uint16_t port =
+		    ((struct sockaddr_in *)sourceaddr)->sin_port;
+		int i;
+		for (i = 0; i < cfg_n_connections; ++i) {
+			if (client_ports[i] == port) {
+				bufferevent_add_to_rate_limit_group(bev,
+				    tenant_groups[client_tenants[i]]);
+				break;
+			}
+		}
+	} else if (ratelim_group)
 		bufferevent_add_to_rate_limit_group(bev, ratelim_group);
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 }
@@ -143,7 +193,10 @@ test_ratelimiting(void)
 	ev_socklen_t slen;
 
 	struct bufferevent **bevs;
+	struct bufferevent **idle_bevs = NULL;
 	struct client_state *states;
+	struct event *sample_ev;
+	struct timeval sample_tv = { 0, SAMPLE_MSEC*1000 };
 
 	int i;
 
@@ -152,6 +205,8 @@ test_ratelimiting(void)
 	ev_uint64_t total_received;
 	double total_sq_persec, total_persec;
 	double variance;
+	double min_persec = 0.0, max_persec = 0.0;
+	clock_t cpu_start, cpu_used;
 
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
@@ -172,21 +227,67 @@ test_ratelimiting(void)
 
 	if (cfg_connlimit > 0) {
 		conn_bucket_cfg = ev_token_bucket_cfg_new(
-			cfg_connlimit, cfg_connlimit * 4,
-			cfg_connlimit, cfg_connlimit * 4,
+			cfg_connlimit, BURST(cfg_connlimit),
+			cfg_connlimit, BURST(cfg_connlimit),
 			&cfg_tick);
 		assert(conn_bucket_cfg);
 	}
 
 	if (cfg_grouplimit > 0) {
 		group_bucket_cfg = ev_token_bucket_cfg_new(
-			cfg_grouplimit, cfg_grouplimit * 4,
-			cfg_grouplimit, cfg_grouplimit * 4,
+			cfg_grouplimit, BURST(cfg_grouplimit),
+			cfg_grouplimit, BURST(cfg_grouplimit),
 			&cfg_tick);
 		ratelim_group = bufferevent_rate_limit_group_new(
 			base, group_bucket_cfg);
 	};
 
+	if (cfg_n_tenants > 0) {
+		int limit = cfg_tenantlimit ? cfg_tenantlimit : cfg_grouplimit;
+		assert(ratelim_group);
+		tenant_bucket_cfg = ev_token_bucket_cfg_new(
+			limit, BURST(limit), limit, BURST(limit), &cfg_tick);
+		tenant_groups = calloc(cfg_n_tenants,
+		    sizeof(struct bufferevent_rate_limit_group *));
+		client_ports = calloc(cfg_n_connections, sizeof(ev_uint16_t));
+		client_tenants = calloc(cfg_n_connections, sizeof(int));
+		assert(tenant_bucket_cfg && tenant_groups && client_ports &&
+		    client_tenants);
+		for (i = 0; i < cfg_n_tenants; ++i) {
+			tenant_groups[i] = bufferevent_rate_limit_group_new(
+				base, tenant_bucket_cfg);
+			assert(tenant_groups[i]);
+			if (bufferevent_rate_limit_group_set_parent(
+				    tenant_groups[i], ratelim_group) < 0) {
+				fprintf(stderr, "Couldn't nest tenant group\n");
+				exit(1);
+			}
+		}
+		/* Give the first tenant half of the connections, and split
+		 * the rest among the others, so that a flat group would
+		 * let the first tenant hog the bandwidth. */
+		for (i = 0; i < cfg_n_connections; ++i) {
+			if (cfg_n_tenants == 1 || i < cfg_n_connections / 2)
+				client_tenants[i] = 0;
+			else
+				client_tenants[i] = 1 + i % (cfg_n_tenants - 1);
+		}
+	}
+
+	if (cfg_n_idle > 0 && ratelim_group) {
+		/* Members that never do anything: they should cost the
+		 * group nothing per tick. */
+		idle_bevs = calloc(cfg_n_idle, sizeof(struct bufferevent *));
+		assert(idle_bevs);
+		for (i = 0; i < cfg_n_idle; ++i) {
+			idle_bevs[i] = bufferevent_socket_new(base, -1,
+			    BEV_OPT_LAZY_BUFFERS);
+			assert(idle_bevs[i]);
+			bufferevent_add_to_rate_limit_group(idle_bevs[i],
+			    ratelim_group);
+		}
+	}
+
 	bevs = calloc(cfg_n_connections, sizeof(struct bufferevent *));
 	states = calloc(cfg_n_connections, sizeof(struct client_state));
 
@@ -200,14 +301,32 @@ test_ratelimiting(void)
 		bufferevent_enable(bevs[i], EV_READ|EV_WRITE);
 		bufferevent_socket_connect(bevs[i], (struct sockaddr *)&ss,
 		    slen);
+		if (client_ports) {
+			struct sockaddr_in local;
+			ev_socklen_t locallen = sizeof(local);
+			if (getsockname(bufferevent_getfd(bevs[i]),
+				(struct sockaddr *)&local, &locallen) < 0) {
+				perror("getsockname");
+				return;
+			}
+			client_ports[i] = local.sin_port;
+		}
 	}
 
+	max_samples = cfg_duration * 1000 / SAMPLE_MSEC;
+	samples = calloc(max_samples, sizeof(ev_uint64_t));
+	assert(samples);
+	sample_ev = event_new(base, -1, EV_PERSIST, sample_cb, states);
+	event_add(sample_ev, &sample_tv);
+
 	tv.tv_sec = cfg_duration;
 	tv.tv_usec = 0;
 
 	event_base_loopexit(base, &tv);
 
+	cpu_start = clock();
 	event_base_dispatch(base);
+	cpu_used = clock() - cpu_start;
 
 	total_received = 0;
 	total_persec = 0.0;
@@ -218,6 +337,10 @@ test_ratelimiting(void)
 		total_received += states[i].received;
 		total_persec += persec;
 		total_sq_persec += persec*persec;
+		if (i == 0 || persec < min_persec)
+			min_persec = persec;
+		if (i == 0 || persec > max_persec)
+			max_persec = persec;
 		printf("%d: %lf per second\n", i, persec);
 	}
 	printf("   total: %lf per second\n",
@@ -228,6 +351,62 @@ test_ratelimiting(void)
 	variance = total_sq_persec/cfg_n_connections - total_persec*total_persec/(cfg_n_connections*cfg_n_connections);
 
 	printf("  stddev: %lf per second\n", sqrt(variance));
+	printf(" min/max: %lf/%lf per second\n", min_persec, max_persec);
+	/* Jain's fairness index: 1.0 when every connection gets the same
+	 * share, 1/n when one connection gets everything. */
+	printf("fairness: %lf\n", total_sq_persec > 0 ?
+	    total_persec*total_persec/(cfg_n_connections*total_sq_persec) :
+	    1.0);
+	if (cfg_n_tenants > 0) {
+		double t_sum = 0.0, t_sq = 0.0;
+		int t;
+		for (t = 0; t < cfg_n_tenants; ++t) {
+			double persec = 0.0;
+			for (i = 0; i < cfg_n_connections; ++i) {
+				if (client_tenants[i] == t)
+					persec += states[i].received;
+			}
+			persec /= cfg_duration;
+			t_sum += persec;
+			t_sq += persec*persec;
+			printf("tenant %d: %lf per second\n", t, persec);
+		}
+		printf("tenant fairness: %lf\n", t_sq > 0 ?
+		    t_sum*t_sum/(cfg_n_tenants*t_sq) : 1.0);
+	}
+	{
+		/* Skip the first second, while the buckets drain from their
+		 * initial fill. */
+		double s_sum = 0.0, s_sq = 0.0, mean;
+		int first = 1000 / SAMPLE_MSEC, n = n_samples - first;
+		for (i = first; i < n_samples; ++i) {
+			s_sum += samples[i];
+			s_sq += (double)samples[i]*samples[i];
+		}
+		if (n > 0 && s_sum > 0) {
+			mean = s_sum / n;
+			printf("burstiness: %lf (stddev/mean of bytes per %d "
+			    "msec)\n", sqrt(s_sq/n - mean*mean) / mean,
+			    SAMPLE_MSEC);
+		}
+	}
+	if (cfg_tick_msec)
+		printf("cpu/tick: %lf usec over %d ticks\n",
+		    ((double)cpu_used)/CLOCKS_PER_SEC*1000000.0/
+		    (cfg_duration*1000/cfg_tick_msec),
+		    cfg_duration*1000/cfg_tick_msec);
+	else
+		printf("cpu/sec: %lf usec over %d seconds\n",
+		    ((double)cpu_used)/CLOCKS_PER_SEC*1000000.0/cfg_duration,
+		    cfg_duration);
+	event_free(sample_ev);
+	free(samples);
+
+	if (idle_bevs) {
+		for (i = 0; i < cfg_n_idle; ++i)
+			bufferevent_free(idle_bevs[i]);
+		free(idle_bevs);
+	}
 }
 
 static struct option {
@@ -239,7 +418,10 @@ static struct option {
 	{ "-d", &cfg_duration, 1, 0 },
 	{ "-c", &cfg_connlimit, 0, 0 },
 	{ "-g", &cfg_grouplimit, 0, 0 },
-	{ "-t", &cfg_tick_msec, 10, 0 },
+	{ "-t", &cfg_tick_msec, 0, 0 },
+	{ "-i", &cfg_n_idle, 0, 0 },
+	{ "-T", &cfg_n_tenants, 0, 0 },
+	{ "-G", &cfg_tenantlimit, 0, 0 },
 	{ NULL, NULL, -1, 0 },
 };
 
@@ -276,7 +458,8 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-"test-ratelim [-v] [-n INT] [-d INT] [-c INT] [-g INT] [-t INT]\n\n"
+"test-ratelim [-v] [-n INT] [-d INT] [-c INT] [-g INT] [-t INT] [-i INT]\n"
+"             [-T INT] [-G INT]\n\n"
 "Pushes bytes through a number of possibly rate-limited connections, and\n"
 "displays average throughput.\n\n"
 "  -n INT: Number of connections to open (default: 30)\n"
@@ -285,7 +468,14 @@ usage(void)
 "          (default: None.)\n"
 "  -g INT: Group-rate limit applied to sum of all usage in bytes per second\n"
 "          (default: None.)\n"
-"  -t INT: Granularity of timing, in milliseconds (default: 1000 msec)\n");
+"  -t INT: Granularity of timing, in milliseconds, or 0 for tick-less\n"
+"          buckets (default: 1000 msec)\n"
+"  -i INT: Number of idle connections to add to the rate-limit group, to\n"
+"          show what a big group costs per tick (default: 0)\n"
+"  -T INT: Number of tenant groups to nest inside the -g group.  The first\n"
+"          tenant gets half the connections (default: 0)\n"
+"  -G INT: Rate limit for each tenant group in bytes per second\n"
+"          (default: same as -g)\n");
 }
 
 int
@@ -325,10 +515,17 @@ main(int argc, char **argv)
 	cfg_tick.tv_sec = cfg_tick_msec / 1000;
 	cfg_tick.tv_usec = (cfg_tick_msec % 1000)*1000;
 
-	ratio = cfg_tick_msec / 1000.0;
+	/* A tick-less bucket's rates are already per second. */
+	ratio = cfg_tick_msec ? cfg_tick_msec / 1000.0 : 1.0;
 
 	cfg_connlimit *= ratio;
 	cfg_grouplimit *= ratio;
+	cfg_tenantlimit *= ratio;
+
+	if (cfg_n_tenants > 0 && cfg_grouplimit <= 0) {
+		fprintf(stderr, "-T needs a group limit (-g)\n");
+		return 1;
+	}
 
 	{
 		struct timeval tv;
@@ -200,6 +200,12 @@ long _evutil_weakrand(void);
 #define EV_UINT32_MAX ((ev_uint32_t)-1)
 #endif
 
+#ifdef INT32_MAX
+#define EV_INT32_MAX INT32_MAX
+#else
+#define EV_INT32_MAX ((ev_int32_t)(EV_UINT32_MAX >> 1))
+#endif
+
 #if _EVENT_SIZEOF_SIZE_T == 8
 #define EV_SIZE_MAX EV_UINT64_MAX
 #elif  _EVENT_SIZEOF_SIZE_T == 4